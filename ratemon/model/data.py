@@ -80,13 +80,19 @@ def get_bulk_data(args, net):
 
 
 def get_split(data_dir, name, sample_frac, net):
-    """Constructs a split from many subsplits on disk."""
-    # Load the split's subsplits.
-    subsplits = utils.load_subsplits(data_dir, name)
-    # Optionally select a fraction of each subsplit.
-    if sample_frac < 1:
-        new_subsplits = []
-        for fil, subsplit in subsplits:
+    """Constructs a split from many subsplits on disk.
+
+    Only the features that the model uses are loaded, and only the sampled prefix
+    of each subsplit is read from disk.
+    """
+    fets = list(
+        dict.fromkeys(list(net.in_spc) + list(net.out_spc) + features.EXTRA_FETS)
+    )
+    subsplits = []
+    for fil in utils.list_subsplits(data_dir, name):
+        num_pkts = None
+        # Optionally select a fraction of each subsplit.
+        if sample_frac < 1:
             # HACK: Select more from subsplits that are tagged "high-fair-rate".
             multiplier = 1.25 if "high-fair-rate" in fil else 1
             actual_sample_frac = min(1, sample_frac * multiplier)
@@ -100,12 +106,11 @@ def get_split(data_dir, name, sample_frac, net):
                     fil,
                     actual_sample_frac,
                 )
-            new_subsplits.append(
-                subsplit[: math.ceil(subsplit.shape[0] * actual_sample_frac)]
+            num_pkts = math.ceil(
+                utils.load_split_metadata(data_dir, fil)[0] * actual_sample_frac
             )
-        subsplits = new_subsplits
-    else:
-        subsplits = [subsplit for fil, subsplit in subsplits]
+        subsplits.append(utils.load_split(data_dir, fil, fets, num_pkts))
+    assert subsplits, f'No subsplits found with prefix "{name}" in: {data_dir}'
     # Merge the subsplits into a split.
     split = np.concatenate(subsplits)
     # If there is more than one subsplit, then we need to shuffle the merged split.
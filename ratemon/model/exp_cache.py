@@ -0,0 +1,224 @@
+"""Content-addressed cache for parsed experiments and generated features.
+
+Entries are keyed by the hash of an experiment's tarball contents, the version of
+the code that produced them, and the parsing parameters, so a renamed experiment
+still hits and a changed one misses. The cache has two layers:
+
+    pkts/<exp key>/       The experiment's params file and the parsed receiver
+                          packets of each flow, so that reparsing does not need to
+                          untar the experiment or parse its pcaps.
+    cols/<column key>.npy One file per generated feature column, in the same format
+                          as a feature store column (see feature_store).
+    fets/<manifest>.json  Per-flow row offsets of an experiment's generated
+                          features, and the counts of erroneous throughputs of the
+                          groups of features that count them.
+
+Because feature columns are cached individually, changing the feature set does not
+invalidate the columns that remain, and a feature store for any subset of cached
+columns can be assembled by linking files. gen_features generates features in small
+groups (e.g., one EWMA or the windowed metrics of one window), so adding a feature
+generates only the groups that contain it and loads the rest from the cache.
+
+The cache is safe to share between processes: entries are written to a temporary
+path and renamed into place, and concurrent writers produce identical entries.
+"""
+
+import hashlib
+import json
+import os
+import shutil
+from os import path
+
+import numpy as np
+
+from ratemon.model import feature_store
+
+# Bump when the output of utils.parse_packets() changes.
+PKTS_VERSION = 1
+# Bump when the computation or definition of any existing feature in gen_features
+# changes. Adding a new feature does not require a bump.
+#
+# 2: Loss event rates are computed for every window (not just 8), and columns are
+#    generated per group.
+FETS_VERSION = 2
+# Size of the blocks in which to hash tarballs.
+HASH_BLOCK_B = 1 << 20
+
+
+def _hash(*parts):
+    return hashlib.sha256(json.dumps(parts).encode("utf-8")).hexdigest()
+
+
+def _write_text(flp, text):
+    tmp_flp = f"{flp}.{os.getpid()}.tmp"
+    with open(tmp_flp, "w", encoding="utf-8") as fil:
+        fil.write(text)
+    os.replace(tmp_flp, flp)
+
+
+class ExpCache:
+    """A content-addressed cache rooted at a directory."""
+
+    def __init__(self, cache_dir):
+        self.cache_dir = cache_dir
+        for sub in ["digests", "pkts", "fets", "cols"]:
+            os.makedirs(path.join(cache_dir, sub), exist_ok=True)
+
+    def get_digest(self, exp_flp):
+        """Return the SHA-256 digest of an experiment tarball.
+
+        Digests are memoized by filename, size, and modification time, so each
+        tarball is only read once.
+        """
+        stat = os.stat(exp_flp)
+        memo_flp = path.join(
+            self.cache_dir,
+            "digests",
+            f"{path.basename(exp_flp)}-{stat.st_size}-{stat.st_mtime_ns}",
+        )
+        if path.exists(memo_flp):
+            with open(memo_flp, "r", encoding="utf-8") as fil:
+                return fil.read().strip()
+        hasher = hashlib.sha256()
+        with open(exp_flp, "rb") as fil:
+            for block in iter(lambda: fil.read(HASH_BLOCK_B), b""):
+                hasher.update(block)
+        digest = hasher.hexdigest()
+        _write_text(memo_flp, digest)
+        return digest
+
+    def get_exp_key(self, exp_flp, select_tail_percent):
+        """Return the key of an experiment's parsed packets."""
+        return _hash(self.get_digest(exp_flp), PKTS_VERSION, select_tail_percent)
+
+    def _get_pkts_dir(self, exp_key):
+        return path.join(self.cache_dir, "pkts", exp_key)
+
+    def has_pkts(self, exp_key):
+        """Return whether an experiment's parsed packets are cached."""
+        return path.exists(path.join(self._get_pkts_dir(exp_key), "flows.json"))
+
+    def load_pkts(self, exp_key):
+        """Load an experiment's params and parsed receiver packets.
+
+        Returns a tuple of the form (params, flw_to_pkts), where flw_to_pkts is in
+        the format produced by utils.parse_packets(), or None if the entry does not
+        exist.
+        """
+        if not self.has_pkts(exp_key):
+            return None
+        pkts_dir = self._get_pkts_dir(exp_key)
+        with open(path.join(pkts_dir, "params.json"), "r", encoding="utf-8") as fil:
+            params = json.load(fil)
+        with open(path.join(pkts_dir, "flows.json"), "r", encoding="utf-8") as fil:
+            flws = json.load(fil)
+        flw_to_pkts = {}
+        for flw_idx, flw in enumerate(flws):
+            with np.load(path.join(pkts_dir, f"{flw_idx}.npz")) as dat:
+                flw_to_pkts[tuple(flw)] = (dat["data"], dat["ack"])
+        return params, flw_to_pkts
+
+    def save_pkts(self, exp_key, params, flw_to_pkts):
+        """Save an experiment's params and parsed receiver packets."""
+        pkts_dir = self._get_pkts_dir(exp_key)
+        if self.has_pkts(exp_key):
+            return
+        tmp_dir = f"{pkts_dir}.{os.getpid()}.tmp"
+        if path.exists(tmp_dir):
+            shutil.rmtree(tmp_dir)
+        os.makedirs(tmp_dir)
+        with open(path.join(tmp_dir, "params.json"), "w", encoding="utf-8") as fil:
+            json.dump(params, fil)
+        flws = list(flw_to_pkts.keys())
+        for flw_idx, flw in enumerate(flws):
+            data_pkts, ack_pkts = flw_to_pkts[flw]
+            np.savez(path.join(tmp_dir, f"{flw_idx}.npz"), data=data_pkts, ack=ack_pkts)
+        with open(path.join(tmp_dir, "flows.json"), "w", encoding="utf-8") as fil:
+            json.dump([list(flw) for flw in flws], fil)
+        try:
+            os.rename(tmp_dir, pkts_dir)
+        except OSError:
+            # Another process saved this entry first.
+            shutil.rmtree(tmp_dir)
+
+    def _get_col_flp(self, exp_key, fet, typ):
+        return path.join(
+            self.cache_dir,
+            "cols",
+            f"{_hash(exp_key, FETS_VERSION, fet, np.dtype(typ).str)}.npy",
+        )
+
+    def _get_manifest_flp(self, exp_key):
+        return path.join(self.cache_dir, "fets", f"{_hash(exp_key, FETS_VERSION)}.json")
+
+    def load_manifest(self, exp_key):
+        """Load the manifest of an experiment's generated features.
+
+        Returns a dictionary of the form:
+            {
+                "flw_offsets": [ row offsets, as in a feature store index ],
+                "errors": { group kind: { window size: erroneous throughputs } },
+            }
+        or None if no features of the experiment are cached.
+        """
+        manifest_flp = self._get_manifest_flp(exp_key)
+        if not path.exists(manifest_flp):
+            return None
+        with open(manifest_flp, "r", encoding="utf-8") as fil:
+            return json.load(fil)
+
+    def get_cached_fets(self, exp_key, dtype):
+        """Return the set of names of the features in dtype that are cached."""
+        return {
+            fet
+            for fet, typ in dtype
+            if path.exists(self._get_col_flp(exp_key, fet, typ))
+        }
+
+    def load_cols(self, exp_key, dtype):
+        """Load the cached columns in dtype.
+
+        Returns a dictionary mapping feature name to an array that holds the rows of
+        all flows back to back (see load_manifest() for the offsets).
+        """
+        return {
+            fet: np.load(self._get_col_flp(exp_key, fet, typ)) for fet, typ in dtype
+        }
+
+    def link_fets(self, exp_key, dtype, out_flp):
+        """Assemble a feature store at out_flp from cached columns. All of the
+        columns in dtype must be cached."""
+        feature_store.link(
+            out_flp,
+            dtype,
+            self.load_manifest(exp_key)["flw_offsets"],
+            [self._get_col_flp(exp_key, fet, typ) for fet, typ in dtype],
+        )
+
+    def save_fets(self, exp_key, store_dir, errors):
+        """Add the columns of a feature store to the cache.
+
+        Only columns that are not already cached are stored. errors contains the
+        counts of erroneous throughputs of the groups that were generated, in the
+        format of the manifest (see load_manifest()), and is merged into the
+        manifest.
+        """
+        idx = feature_store.load_index(store_dir)
+        for name, typ, fln in idx["columns"]:
+            col_flp = self._get_col_flp(exp_key, name, typ)
+            if path.exists(col_flp):
+                continue
+            tmp_flp = f"{col_flp}.{os.getpid()}.tmp"
+            try:
+                os.link(path.join(store_dir, fln), tmp_flp)
+            except OSError:
+                shutil.copyfile(path.join(store_dir, fln), tmp_flp)
+            os.replace(tmp_flp, col_flp)
+        manifest = self.load_manifest(exp_key) or {"errors": {}}
+        assert (
+            manifest.get("flw_offsets", idx["flw_offsets"]) == idx["flw_offsets"]
+        ), f"Cached features have different row offsets than: {store_dir}"
+        manifest["flw_offsets"] = idx["flw_offsets"]
+        for kind, win_to_errors in errors.items():
+            manifest["errors"].setdefault(kind, {}).update(win_to_errors)
+        _write_text(self._get_manifest_flp(exp_key), json.dumps(manifest))
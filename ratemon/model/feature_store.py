@@ -0,0 +1,217 @@
+"""Memory-mapped columnar storage for features.
+
+A store is a directory (ending in STORE_EXT) that contains one .npy file per
+feature column and an index file. Each column holds the rows of all flows back to
+back, and the index records the row range of each flow. Because every column is a
+plain, uncompressed .npy file, np.load(mmap_mode="r") maps it directly, so readers
+touch only the columns and row ranges that they ask for.
+
+Index format (JSON):
+    {
+        "version": VERSION,
+        "columns": [ [feature name, dtype string, column filename], ... ],
+        "flw_offsets": [ 0, rows in flow 0, rows in flows 0-1, ..., total rows ],
+    }
+"""
+
+import json
+import logging
+import os
+import shutil
+from os import path
+
+import numpy as np
+
+# Directory suffix that marks a feature store.
+STORE_EXT = ".fets"
+# Name of the index file inside a store.
+INDEX_FLN = "index.json"
+# Version of the on-disk format.
+VERSION = 1
+
+
+def is_store(flp):
+    """Return whether flp is a feature store."""
+    return path.isdir(flp) and path.exists(path.join(flp, INDEX_FLN))
+
+
+def get_column_fln(col_idx):
+    """Return the filename of a column.
+
+    Feature names may contain characters that are not allowed in filenames (e.g.,
+    "/"), so columns are named by their index instead.
+    """
+    return f"c{col_idx:04d}.npy"
+
+
+def _open_column(flp, typ, num_rows):
+    """Create a column file and return it as a writable array."""
+    if num_rows == 0:
+        # Cannot memory-map an empty file.
+        col = np.empty((0,), dtype=typ)
+        np.save(flp, col)
+        return col
+    return np.lib.format.open_memmap(flp, mode="w+", dtype=typ, shape=(num_rows,))
+
+
+def _write_index(store_dir, dtype, flw_offsets):
+    with open(path.join(store_dir, INDEX_FLN), "w", encoding="utf-8") as fil:
+        json.dump(
+            {
+                "version": VERSION,
+                "columns": [
+                    [name, np.dtype(typ).str, get_column_fln(idx)]
+                    for idx, (name, typ) in enumerate(dtype)
+                ],
+                "flw_offsets": [int(off) for off in flw_offsets],
+            },
+            fil,
+            indent=4,
+        )
+
+
+def save(store_dir, flws_dat):
+    """Save a list of per-flow structured arrays (which share a dtype).
+
+    The store is written to a temporary directory and then renamed into place, so
+    a partially-written store is never visible to readers.
+    """
+    assert flws_dat, "No flows to save!"
+    dtype = flws_dat[0].dtype.descr
+    for dat in flws_dat:
+        assert dat.dtype.descr == dtype, "All flows must have the same dtype!"
+    flw_offsets = np.concatenate(([0], np.cumsum([len(dat) for dat in flws_dat])))
+
+    tmp_dir = f"{store_dir}.{os.getpid()}.tmp"
+    if path.exists(tmp_dir):
+        shutil.rmtree(tmp_dir)
+    os.makedirs(tmp_dir)
+    for idx, (name, typ) in enumerate(dtype):
+        col = _open_column(
+            path.join(tmp_dir, get_column_fln(idx)), typ, int(flw_offsets[-1])
+        )
+        for flw_idx, dat in enumerate(flws_dat):
+            col[flw_offsets[flw_idx] : flw_offsets[flw_idx + 1]] = dat[name]
+        if isinstance(col, np.memmap):
+            col.flush()
+        del col
+    _write_index(tmp_dir, dtype, flw_offsets)
+    os.rename(tmp_dir, store_dir)
+
+
+def link(store_dir, dtype, flw_offsets, col_flps):
+    """Assemble a store from existing column files (one .npy per entry in dtype).
+
+    The columns are hard-linked into the store when possible, and copied otherwise.
+    Like save(), the store is renamed into place once it is complete.
+    """
+    assert len(dtype) == len(col_flps), "Must provide one file per column!"
+    tmp_dir = f"{store_dir}.{os.getpid()}.tmp"
+    if path.exists(tmp_dir):
+        shutil.rmtree(tmp_dir)
+    os.makedirs(tmp_dir)
+    for idx, col_flp in enumerate(col_flps):
+        dst_flp = path.join(tmp_dir, get_column_fln(idx))
+        try:
+            os.link(col_flp, dst_flp)
+        except OSError:
+            shutil.copyfile(col_flp, dst_flp)
+    _write_index(tmp_dir, dtype, flw_offsets)
+    os.rename(tmp_dir, store_dir)
+
+
+def create(store_dir, dtype, num_rows):
+    """Create a single-flow store of the given size for incremental writing.
+
+    Returns a dictionary mapping feature name to a writable memory-mapped column.
+    """
+    os.makedirs(store_dir)
+    _write_index(store_dir, dtype, [0, num_rows])
+    return {
+        name: _open_column(path.join(store_dir, get_column_fln(idx)), typ, num_rows)
+        for idx, (name, typ) in enumerate(dtype)
+    }
+
+
+def load_index(store_dir):
+    """Load a store's index."""
+    with open(path.join(store_dir, INDEX_FLN), "r", encoding="utf-8") as fil:
+        idx = json.load(fil)
+    assert (
+        idx["version"] == VERSION
+    ), f"Unsupported feature store version {idx['version']}: {store_dir}"
+    return idx
+
+
+def get_dtype(store_dir):
+    """Return the full dtype of a store as a list of (name, type) tuples."""
+    return [(name, typ) for name, typ, _ in load_index(store_dir)["columns"]]
+
+
+def get_headers(store_dir):
+    """Parse a store's index.
+
+    Returns a list of tuples of the form (name, shape, np.dtype), with one entry per
+    flow, which matches the format of utils.get_npz_headers(). Returns an empty list
+    if the index cannot be read.
+    """
+    try:
+        idx = load_index(store_dir)
+    except (OSError, ValueError, KeyError, AssertionError):
+        logging.info("Warning: Not a valid feature store: %s", store_dir)
+        return []
+    dtype = np.dtype([(name, typ) for name, typ, _ in idx["columns"]])
+    offs = idx["flw_offsets"]
+    return [
+        (str(flw + 1), (offs[flw + 1] - offs[flw],), dtype)
+        for flw in range(len(offs) - 1)
+    ]
+
+
+def open_columns(store_dir, fets=None, mode="r"):
+    """Memory-map the requested columns (default: all).
+
+    Returns a dictionary mapping feature name to a memory-mapped column.
+    """
+    idx = load_index(store_dir)
+    cols = {name: fln for name, _, fln in idx["columns"]}
+    fets = list(cols.keys()) if fets is None else fets
+    missing = [fet for fet in fets if fet not in cols]
+    assert not missing, f"Features not in store {store_dir}: {missing}"
+    if idx["flw_offsets"][-1] == 0:
+        # Cannot memory-map an empty file.
+        typs = dict((name, typ) for name, typ, _ in idx["columns"])
+        return {fet: np.empty((0,), dtype=typs[fet]) for fet in fets}
+    return {
+        fet: np.load(path.join(store_dir, cols[fet]), mmap_mode=mode) for fet in fets
+    }
+
+
+def load(store_dir, fets=None, flw_slices=None):
+    """Load a store as a list of per-flow structured arrays.
+
+    Only the columns in fets (default: all) are read. flw_slices is an optional list
+    with one slice per flow that selects the rows to read from that flow. Only the
+    selected rows of the selected columns are read from disk.
+    """
+    idx = load_index(store_dir)
+    offs = idx["flw_offsets"]
+    num_flws = len(offs) - 1
+    if flw_slices is None:
+        flw_slices = [slice(None)] * num_flws
+    assert (
+        len(flw_slices) == num_flws
+    ), f"Expected {num_flws} slices, but got {len(flw_slices)}: {store_dir}"
+    cols = open_columns(store_dir, fets)
+    dtype = [(fet, col.dtype) for fet, col in cols.items()]
+
+    flws_dat = []
+    for flw in range(num_flws):
+        start, end, step = flw_slices[flw].indices(offs[flw + 1] - offs[flw])
+        assert step > 0, f"Only forward slices are supported: {flw_slices[flw]}"
+        rows = slice(offs[flw] + start, offs[flw] + max(start, end), step)
+        dat = np.empty((len(range(rows.start, rows.stop, rows.step)),), dtype=dtype)
+        for fet, col in cols.items():
+            dat[fet] = col[rows]
+        flws_dat.append(dat)
+    return flws_dat
@@ -19,7 +19,44 @@ from os import path
 
 import numpy as np
 
-from ratemon.model import cl_args, defaults, features, loss_event_rate, utils
+from ratemon.model import (
+    cl_args,
+    defaults,
+    exp_cache,
+    feature_store,
+    features,
+    loss_event_rate,
+    utils,
+    windows,
+)
+
+# The groups in which features are generated (see get_fet_groups()).
+#
+# Per-packet metrics (features.REGULAR_FETS).
+REGULAR_GROUP = "regular"
+# One EWMA metric.
+EWMA_GROUP = "ewma"
+# The windowed metrics of one window that depend only on a single flow.
+WINDOWED_GROUP = "windowed"
+# The loss event rate--related metrics of one window.
+LOSS_EVENT_RATE_GROUP = "loss event rate"
+# The windowed metrics of one window that depend on the combined throughput of all
+# flows.
+TOTAL_TPUT_GROUP = "total throughput"
+LOSS_EVENT_RATE_METRICS = {
+    features.LOSS_EVENT_RATE_FET,
+    features.SQRT_LOSS_EVENT_RATE_FET,
+    features.MATHIS_TPUT_LOSS_EVENT_RATE_FET,
+}
+TOTAL_TPUT_METRICS = {
+    features.TOTAL_TPUT_FET,
+    features.TPUT_FAIR_SHARE_BPS_FET,
+    features.TPUT_SHARE_FRAC_FET,
+    features.TPUT_TO_FAIR_SHARE_RATIO_FET,
+}
+# The groups that count erroneous throughputs, in the order of the counts in
+# win_to_errors (see parse_opened_exp()).
+ERROR_GROUP_KINDS = [WINDOWED_GROUP, TOTAL_TPUT_GROUP]
 
 
 def get_time_bounds(pkts, direction="data"):
@@ -40,11 +77,12 @@ def get_time_bounds(pkts, direction="data"):
 
 
 @contextmanager
-def open_exp(exp, exp_flp, untar_dir, out_dir, out_flp, always_reparse):
+def open_exp(exp, exp_flp, untar_dir, out_dir, out_flp, always_reparse, untar=True):
     """Untar an experiment.
 
     Lock the experiment to prevent two processes from opening it at once.
-    Cleans up the lock and untarred files automatically.
+    Cleans up the lock and untarred files automatically. If untar is False, then
+    only lock the experiment and yield None instead of the untarred directory.
     """
     lock_flp = path.join(out_dir, f"{exp.name}.lock")
     exp_dir = path.join(untar_dir, exp.name)
@@ -64,6 +102,9 @@ def open_exp(exp, exp_flp, untar_dir, out_dir, out_flp, always_reparse):
             locked = True
             with open(lock_flp, "w", encoding="utf-8"):
                 pass
+            if not untar:
+                yield True, None
+                return
 
             # Create a temporary folder to untar experiments.
             if not path.exists(untar_dir):
@@ -79,13 +120,566 @@ def open_exp(exp, exp_flp, untar_dir, out_dir, out_flp, always_reparse):
         # Remove an entity only if we created it.
         #
         # Remove untarred folder
-        if locked and path.exists(exp_dir):
+        if untarred and path.exists(exp_dir):
             shutil.rmtree(exp_dir)
         # Remove lock file.
-        if untarred and path.exists(lock_flp):
+        if locked and path.exists(lock_flp):
             os.remove(lock_flp)
 
 
+def get_dtype(skip_smoothed):
+    """Return the dtype of an experiment's features.
+
+    The (super-complicated) dtype combines each metric at multiple granularities.
+    """
+    return features.REGULAR_FETS + (
+        [] if skip_smoothed else features.make_smoothed_features()
+    )
+
+
+def get_fet_groups(dtype):
+    """Split the features in dtype into the groups in which they are generated.
+
+    Each group can be generated on its own, given the groups that it depends on (see
+    parse_opened_exp()). A group is a tuple whose first entry is one of the *_GROUP
+    constants. EWMA groups also contain their metric and alpha, and windowed groups
+    contain their window size.
+
+    Returns a dictionary mapping group to a list of feature names.
+    """
+    groups = {}
+    for fet, _ in dtype:
+        if "-ewma-" in fet:
+            group = (EWMA_GROUP, *features.parse_ewma_metric(fet))
+        elif "-windowed-" in fet:
+            metric, win = features.parse_win_metric(fet)
+            if metric in LOSS_EVENT_RATE_METRICS:
+                group = (LOSS_EVENT_RATE_GROUP, win)
+            elif metric in TOTAL_TPUT_METRICS:
+                group = (TOTAL_TPUT_GROUP, win)
+            else:
+                group = (WINDOWED_GROUP, win)
+        else:
+            group = (REGULAR_GROUP,)
+        groups.setdefault(group, []).append(fet)
+    return groups
+
+
+def get_stale_wins(groups, kind):
+    """Return the window sizes of the windowed groups of a kind in groups."""
+    return [group[1] for group in groups if group[0] == kind]
+
+
+def get_stale_groups(cache, exp_key, dtype):
+    """Find the feature groups of an experiment that must be generated.
+
+    A group is stale if any of its features are not cached, or if it counts
+    erroneous throughputs and its counts are not cached.
+
+    Returns a tuple of the form (manifest, stale groups), where manifest is the
+    experiment's cache manifest (or None) and stale groups is in the format returned
+    by get_fet_groups().
+    """
+    groups = get_fet_groups(dtype)
+    manifest = None if cache is None else cache.load_manifest(exp_key)
+    if manifest is None:
+        return None, groups
+    cached = cache.get_cached_fets(exp_key, dtype)
+    errors = manifest["errors"]
+    return manifest, {
+        group: fets
+        for group, fets in groups.items()
+        if not cached.issuperset(fets)
+        or (group[0] in ERROR_GROUP_KINDS and str(group[1]) not in errors[group[0]])
+    }
+
+
+def get_cached_errors(manifest, stale, dtype, win_to_errors):
+    """Fill win_to_errors (see parse_opened_exp()) with the cached counts of
+    erroneous throughputs of the groups that are not stale."""
+    for group in get_fet_groups(dtype):
+        if group not in stale and group[0] in ERROR_GROUP_KINDS:
+            kind, win = group
+            errors = manifest["errors"][kind][str(win)]
+            win_to_errors[win][ERROR_GROUP_KINDS.index(kind)] = errors
+
+
+def get_errors_to_cache(stale, win_to_errors):
+    """Return the counts of erroneous throughputs of the stale groups, in the format
+    of ExpCache.save_fets()."""
+    return {
+        kind: {str(win): win_to_errors[win][idx] for win in get_stale_wins(stale, kind)}
+        for idx, kind in enumerate(ERROR_GROUP_KINDS)
+    }
+
+
+def get_smallest_safe_win(win_to_errors, exp_flp):
+    """Return the smallest window size without erroneous throughputs, or 0 if there
+    is none. win_to_errors is in the format used by parse_opened_exp()."""
+    for win in sorted(features.WINDOWS):
+        if sum(win_to_errors[win]) == 0:
+            print(f"\tSmallest safe window size is {win} in: {exp_flp}")
+            return win
+    print(f"Warning: No safe window sizes in: {exp_flp}")
+    return 0
+
+
+def link_cached_fets(cache, exp_key, skip_smoothed, exp_flp, out_flp):
+    """If all of an experiment's features are cached, then assemble a feature store
+    at out_flp from the cache and return the smallest safe window size. Otherwise,
+    return None."""
+    dtype = get_dtype(skip_smoothed)
+    manifest, stale = get_stale_groups(cache, exp_key, dtype)
+    if manifest is None or stale:
+        return None
+    cache.link_fets(exp_key, dtype, out_flp)
+    win_to_errors = {win: [0, 0] for win in features.WINDOWS}
+    get_cached_errors(manifest, stale, dtype, win_to_errors)
+    return get_smallest_safe_win(win_to_errors, exp_flp)
+
+
+def fill_windowed_fets(output, first_data_time_us, max_tput_bps=None, wins=None):
+    """Fill in the windowed metrics for all packets in a flow.
+
+    output must already contain the per-packet features. Windowed metrics are
+    calculated only for packets for which the min RTT is known, an entire window has
+    elapsed since first_data_time_us, and the window contains at least two packets.
+    Metrics that depend on other flows or on the loss event rate are not filled in.
+    If max_tput_bps is not None, then throughputs that exceed it are discarded. wins
+    selects the windows to fill in (default: all).
+
+    Returns a dictionary mapping window size to the number of discarded throughputs.
+    """
+    num_pkts = output.shape[0]
+    idxs = np.arange(num_pkts)
+    arr_times_us = output[features.ARRIVAL_TIME_FET]
+    min_rtts_us = output[features.MIN_RTT_FET]
+    # If we cannot estimate the min RTT, then we cannot compute any windowed
+    # metrics.
+    valid = min_rtts_us != -1
+    win_to_sizes_us = windows.win_sizes_us(min_rtts_us)
+    # Move the window start indices later in time. The min RTT estimate will
+    # never increase, so the start of a window never moves earlier in time.
+    win_to_start_idxs = windows.start_idxs(
+        arr_times_us, arr_times_us - win_to_sizes_us, max_idxs=idxs, valid=valid
+    )
+    wirelens = windows.PrefixSums(output[features.WIRELEN_FET])
+    rtts_us = windows.PrefixSums(output[features.RTT_FET])
+    rtt_ratios = windows.PrefixSums(output[features.RTT_RATIO_FET])
+    pkts_lost = windows.PrefixSums(output[features.PACKETS_LOST_FET])
+    # The Mathis model throughput uses the per-packet loss rate, so it is the same
+    # for all windows.
+    mathis_tputs_bps = windows.safe_mathis_tput_bps(
+        output[features.PAYLOAD_FET],
+        output[features.RTT_FET],
+        output[features.LOSS_RATE_FET],
+    )
+
+    win_to_errors = {}
+    for win, sizes_us, start_idxs in zip(
+        features.WINDOWS, win_to_sizes_us, win_to_start_idxs
+    ):
+        if wins is not None and win not in wins:
+            continue
+        # Calculate windowed metrics only if an entire window has elapsed since
+        # the start of the flow. A window requires at least two packets. Note
+        # that this means the the first packet will always be skipped.
+        mask = (
+            valid
+            & (arr_times_us - first_data_time_us >= sizes_us)
+            & (start_idxs != idxs)
+        )
+        end_idxs = idxs[mask]
+        start_idxs = start_idxs[mask]
+
+        interarr_times_us = windows.safe_div(
+            windows.safe_sub(arr_times_us[end_idxs], arr_times_us[start_idxs]),
+            end_idxs - start_idxs,
+        )
+        output[features.make_win_metric(features.INTERARR_TIME_FET, win)][
+            mask
+        ] = interarr_times_us
+        output[features.make_win_metric(features.INV_INTERARR_TIME_FET, win)][
+            mask
+        ] = windows.safe_mul(
+            8 * 1e6 * output[features.WIRELEN_FET][end_idxs],
+            windows.safe_div(1, interarr_times_us),
+        )
+
+        tputs_bps = windows.safe_tput_bps(
+            arr_times_us, wirelens, start_idxs, end_idxs
+        )
+        # If the throughput exceeds the bandwidth, then do not record it.
+        errors = np.zeros(tputs_bps.shape, dtype=bool)
+        if max_tput_bps is not None:
+            errors = (tputs_bps != -1) & (tputs_bps > max_tput_bps)
+        win_to_errors[win] = int(errors.sum())
+        output[features.make_win_metric(features.TPUT_FET, win)][
+            end_idxs[~errors]
+        ] = tputs_bps[~errors]
+
+        output[features.make_win_metric(features.RTT_FET, win)][mask] = rtts_us.mean(
+            start_idxs, end_idxs
+        )
+        output[features.make_win_metric(features.RTT_RATIO_FET, win)][
+            mask
+        ] = rtt_ratios.mean(start_idxs, end_idxs)
+        win_losses = pkts_lost.sum(start_idxs + 1, end_idxs)
+        loss_rates = windows.safe_div(win_losses, win_losses + (end_idxs - start_idxs))
+        output[features.make_win_metric(features.LOSS_RATE_FET, win)][
+            mask
+        ] = loss_rates
+        output[features.make_win_metric(features.SQRT_LOSS_RATE_FET, win)][
+            mask
+        ] = windows.safe_div(1, windows.safe_sqrt(loss_rates))
+        output[features.make_win_metric(features.MATHIS_TPUT_LOSS_RATE_FET, win)][
+            mask
+        ] = mathis_tputs_bps[end_idxs]
+    return win_to_errors
+
+
+def fill_regular_fets(
+    output,
+    recv_data_pkts,
+    recv_ack_pkts,
+    cca,
+    flws_time_bounds,
+    exp,
+    exp_flp,
+    flw_idx,
+    flw,
+):
+    """Fill in the per-packet metrics (features.REGULAR_FETS) for all packets in a
+    flow.
+
+    flws_time_bounds contains the (first, last) data packet arrival times of every
+    flow in the experiment.
+    """
+    # Copa and PCC Vivace use packet-based sequence numbers as opposed to TCP's
+    # byte-based sequence numbers.
+    packet_seq = cca in {"copa", "vivace"}
+
+    # Total number of packet losses up to the current received
+    # packet.
+    pkt_loss_total_estimate = 0
+    # Loss rate estimation.
+    prev_seq = None
+    prev_payload_bytes = None
+    highest_seq = None
+    # NOTE: Disabled because not used.
+    #
+    # # Use for Copa RTT estimation.
+    # snd_ack_idx = 0
+    # snd_data_idx = 0
+    # Use for TCP and PCC Vivace RTT estimation.
+    recv_ack_idx = 0
+
+    # Track which packets are definitely retransmissions. Ignore these
+    # packets when estimating the RTT. Note that because we are doing
+    # receiver-side retransmission tracking, it is possible that there are
+    # other retransmissions that we cannot detect.
+    #
+    # All sequence numbers that have been received.
+    unique_pkts = set()
+    # Sequence numbers that have been received multiple times.
+    retrans_pkts = set()
+
+    for j, recv_pkt in enumerate(recv_data_pkts):
+        if j % 1000 == 0:
+            print(
+                f"\tFlow {flw_idx + 1}/{exp.tot_flws}: "
+                f"{j}/{len(recv_data_pkts)} packets"
+            )
+        # Whether this is the first packet.
+        first = j == 0
+        # Note that Copa and Vivace use packet-level sequence numbers
+        # instead of TCP's byte-level sequence numbers.
+        recv_seq = recv_pkt[features.SEQ_FET]
+        output[j][features.SEQ_FET] = recv_seq
+        retrans = recv_seq in unique_pkts or (
+            prev_seq is not None
+            and prev_payload_bytes is not None
+            and (prev_seq + (1 if packet_seq else prev_payload_bytes)) > recv_seq
+        )
+        if retrans:
+            # If this packet is a multiple retransmission, then this line
+            # has no effect.
+            retrans_pkts.add(recv_seq)
+        # If this packet has already been seen, then this line has no
+        # effect.
+        unique_pkts.add(recv_seq)
+
+        recv_time_cur_us = recv_pkt[features.ARRIVAL_TIME_FET]
+        output[j][features.ARRIVAL_TIME_FET] = recv_time_cur_us
+
+        payload_bytes = recv_pkt[features.PAYLOAD_FET]
+        wirelen_bytes = recv_pkt[features.WIRELEN_FET]
+        output[j][features.PAYLOAD_FET] = payload_bytes
+        output[j][features.WIRELEN_FET] = wirelen_bytes
+        output[j][features.TOTAL_SO_FAR_FET] = (
+            0 if first else output[j - 1][features.TOTAL_SO_FAR_FET]
+        ) + wirelen_bytes
+        output[j][features.PAYLOAD_SO_FAR_FET] = (
+            0 if first else output[j - 1][features.PAYLOAD_SO_FAR_FET]
+        ) + payload_bytes
+
+        # Count how many flows were active when this packet was captured.
+        active_flws = sum(
+            1
+            for first_time_us, last_time_us in flws_time_bounds
+            if first_time_us <= recv_time_cur_us <= last_time_us
+        )
+        assert active_flws > 0, (
+            f"Error: No active flows detected for packet {j} of "
+            f"flow {flw_idx} in: {exp_flp}"
+        )
+
+        output[j][features.ACTIVE_FLOWS_FET] = active_flws
+        output[j][features.BW_FAIR_SHARE_FRAC_FET] = utils.safe_div(1, active_flws)
+        output[j][features.BW_FAIR_SHARE_BPS_FET] = (
+            utils.safe_div(exp.bw_bps, active_flws) if exp.use_bess else -1
+        )
+
+        # Calculate RTT-related metrics.
+        rtt_us = -1
+        if not first and recv_seq != -1 and not retrans:
+            if cca == "copa":
+                raise UnsupportedOperation("Support for Copa has been removed!")
+
+                # NOTE: Disabled because not used.
+                #
+                # # In a Copa ACK, the sender timestamp is the time at which
+                # # the corresponding data packet was sent. The receiver
+                # # timestamp is the time that the data packet was received
+                # # and the ACK was sent. This enables sender-side RTT
+                # # estimation. However, because the sender does not echo a
+                # # value back to the receiver, this cannot be used for
+                # # receiver-size RTT estimation.
+                # #
+                # # For now, we will just do sender-side RTT estimation. When
+                # # selecting which packets to use for the RTT estimate, we
+                # # will select the packet/ACK pair whose ACK arrived soonest
+                # # before packet j was sent. This means that the sender would
+                # # have been able to calculate this RTT estimate before
+                # # sending packet j, and could very well have included the
+                # # RTT estimate in packet j's header.
+                # #
+                # # First, find the index of the ACK that was received soonest
+                # # before packet j was sent.
+                # snd_ack_idx = utils.find_bound(
+                #     snd_ack_pkts[features.SEQ_FET],
+                #     recv_seq,
+                #     snd_ack_idx,
+                #     snd_ack_pkts.shape[0] - 1,
+                #     which="before",
+                # )
+                # snd_ack_seq = snd_ack_pkts[snd_ack_idx][features.SEQ_FET]
+                # # Then, find this ACK's data packet.
+                # snd_data_seq = snd_data_pkts[snd_data_idx][features.SEQ_FET]
+                # while snd_data_idx < snd_data_pkts.shape[0]:
+                #     snd_data_seq = snd_data_pkts[snd_data_idx][features.SEQ_FET]
+                #     if snd_data_seq == snd_ack_seq:
+                #         # Third, the RTT is the difference between the
+                #         # sending time of the data packet and the arrival
+                #         # time of its ACK.
+                #         rtt_us = (
+                #             snd_ack_pkts[snd_ack_idx][features.ARRIVAL_TIME_FET]
+                #             - snd_data_pkts[snd_data_idx][features.ARRIVAL_TIME_FET]
+                #         )
+                #         assert rtt_us >= 0, (
+                #             f"Error: Calculated negative RTT ({rtt_us} "
+                #             f"us) for packet {j} of flow {flw} in: "
+                #             f"{exp_flp}"
+                #         )
+                #         break
+                #     snd_data_idx += 1
+            elif cca == "vivace":
+                # UDT ACKs may contain the RTT. Find the last ACK to be sent
+                # by the receiver before packet j was received.
+                recv_ack_idx = utils.find_bound(
+                    recv_ack_pkts[features.ARRIVAL_TIME_FET],
+                    recv_time_cur_us,
+                    recv_ack_idx,
+                    recv_ack_pkts.shape[0] - 1,
+                    which="before",
+                )
+                udt_rtt_us = recv_ack_pkts[recv_ack_idx][features.TS_1_FET]
+                if udt_rtt_us > 0:
+                    # The RTT is an optional field in UDT ACK packets. I
+                    # assume that this means that if the RTT is not
+                    # included, then the field will be 0.
+                    rtt_us = udt_rtt_us
+            else:
+                # This is a TCP flow. Do receiver-side RTT estimation using
+                # the TCP timestamp option. Attempt to find a new RTT
+                # estimate. Move recv_ack_idx to the first occurance of the
+                # timestamp option TSval corresponding to the current
+                # packet's TSecr.
+                recv_ack_idx_old = recv_ack_idx
+                tsval = recv_ack_pkts[recv_ack_idx][features.TS_1_FET]
+                tsecr = recv_pkt[features.TS_2_FET]
+                while recv_ack_idx < recv_ack_pkts.shape[0]:
+                    tsval = recv_ack_pkts[recv_ack_idx][features.TS_1_FET]
+                    if tsval == tsecr:
+                        # If we found a timestamp option match, then update
+                        # the RTT estimate.
+                        rtt_us = (
+                            recv_time_cur_us
+                            - recv_ack_pkts[recv_ack_idx][features.ARRIVAL_TIME_FET]
+                        )
+                        break
+                    recv_ack_idx += 1
+                else:
+                    # If we never found a matching tsval, then use the
+                    # previous RTT estimate and reset recv_ack_idx to search
+                    # again on the next packet.
+                    rtt_us = output[j - 1][features.RTT_FET]
+                    recv_ack_idx = recv_ack_idx_old
+
+        recv_time_prev_us = -1 if first else output[j - 1][features.ARRIVAL_TIME_FET]
+        interarr_time_us = utils.safe_sub(recv_time_cur_us, recv_time_prev_us)
+        output[j][features.INTERARR_TIME_FET] = interarr_time_us
+        output[j][features.INV_INTERARR_TIME_FET] = utils.safe_mul(
+            8 * 1e6 * wirelen_bytes, utils.safe_div(1, interarr_time_us)
+        )
+
+        output[j][features.RTT_FET] = rtt_us
+        min_rtt_us = utils.safe_min(
+            sys.maxsize if first else output[j - 1][features.MIN_RTT_FET], rtt_us
+        )
+        output[j][features.MIN_RTT_FET] = min_rtt_us
+        rtt_estimate_ratio = utils.safe_div(rtt_us, min_rtt_us)
+        output[j][features.RTT_RATIO_FET] = rtt_estimate_ratio
+
+        # Receiver-side loss rate estimation. Estimate the number of lost
+        # packets since the last packet. Do not try anything complex or
+        # prone to edge cases. Consider only the simple case where the last
+        # packet and current packet are in order and not retransmissions.
+        pkt_loss_cur_estimate = (
+            -1
+            if (
+                recv_seq == -1
+                or prev_seq is None
+                or prev_seq == -1
+                or prev_payload_bytes is None
+                or prev_payload_bytes <= 0
+                or payload_bytes <= 0
+                or highest_seq is None
+                or
+                # The last packet was a retransmission.
+                highest_seq != prev_seq
+                or
+                # The current packet is a retransmission.
+                retrans
+            )
+            else round(
+                (recv_seq - (1 if packet_seq else prev_payload_bytes) - prev_seq)
+                / (1 if packet_seq else payload_bytes)
+            )
+        )
+
+        if pkt_loss_cur_estimate != -1:
+            pkt_loss_total_estimate += pkt_loss_cur_estimate
+        loss_rate_cur = utils.safe_div(
+            pkt_loss_cur_estimate, utils.safe_add(pkt_loss_cur_estimate, 1)
+        )
+
+        output[j][features.PACKETS_LOST_FET] = pkt_loss_cur_estimate
+        prev_packets_lost_total = (
+            0 if first else output[j - 1][features.PACKETS_LOST_TOTAL_FET]
+        )
+        # This feature is different, because we want to skip the current value if
+        # it's -1.
+        output[j][features.PACKETS_LOST_TOTAL_FET] = (
+            prev_packets_lost_total
+            if pkt_loss_cur_estimate == -1
+            else utils.safe_add(prev_packets_lost_total, pkt_loss_cur_estimate)
+        )
+        output[j][features.LOSS_RATE_FET] = loss_rate_cur
+        sqrt_loss_rate_cur = utils.safe_div(1, utils.safe_sqrt(loss_rate_cur))
+        output[j][features.SQRT_LOSS_RATE_FET] = sqrt_loss_rate_cur
+        mathis_tput_raw = utils.safe_mathis_tput_bps(
+            output[j][features.PAYLOAD_FET],
+            output[j][features.RTT_FET],
+            output[j][features.LOSS_RATE_FET],
+        )
+        output[j][features.MATHIS_TPUT_LOSS_RATE_FET] = mathis_tput_raw
+
+        prev_seq = recv_seq
+        prev_payload_bytes = payload_bytes
+        highest_seq = prev_seq if highest_seq is None else max(highest_seq, prev_seq)
+        # In the event of sequence number wraparound, reset the sequence
+        # number tracking.
+        #
+        # TODO: Test sequence number wraparound logic.
+        if recv_seq != -1 and recv_seq + (1 if packet_seq else payload_bytes) > 2**32:
+            print(
+                "Warning: Sequence number wraparound detected for packet "
+                f"{j} of flow {flw} in: {exp_flp}"
+            )
+            highest_seq = None
+            prev_seq = None
+
+
+def fill_ewma_fet(output, metric, alpha):
+    """Fill in one EWMA metric for all packets in a flow.
+
+    output must already contain the per-packet features, which are the values that
+    the EWMA averages.
+    """
+    news = output[metric].tolist()
+    if metric == features.SQRT_LOSS_RATE_FET:
+        news = [1 if new in utils.UNSAFE else new for new in news]
+    ewmas = output[features.make_ewma_metric(metric, alpha)]
+    # Update the EWMA. If this is the first value, then use -1 as the old value.
+    ewma = -1
+    for j, new in enumerate(news):
+        ewma = utils.safe_update_ewma(ewma, new, alpha)
+        ewmas[j] = ewma
+
+
+def fill_loss_event_rate_fets(output, wins):
+    """Fill in the loss event rate--related metrics (LOSS_EVENT_RATE_FET,
+    SQRT_LOSS_EVENT_RATE, and MATHIS_TPUT_LOSS_EVENT_RATE_FET) for the given windows
+    for all packets in a flow.
+
+    output must already contain the per-packet features.
+    """
+    for win, loss_event_rates in loss_event_rate.loss_event_rates(output, wins)[
+        1
+    ].items():
+        # Fill in loss event rate.
+        output[features.make_win_metric(features.LOSS_EVENT_RATE_FET, win)] = (
+            loss_event_rates
+        )
+        # Fill in the sqrt of the loss event rate and the mathis tput based on loss
+        # event rate.
+        output[features.make_win_metric(features.SQRT_LOSS_EVENT_RATE_FET, win)] = (
+            windows.safe_div(1, windows.safe_sqrt(loss_event_rates))
+        )
+        output[
+            features.make_win_metric(features.MATHIS_TPUT_LOSS_EVENT_RATE_FET, win)
+        ] = windows.safe_mathis_tput_bps(
+            output[features.PAYLOAD_FET],
+            output[features.RTT_FET],
+            loss_event_rates,
+        )
+
+
+def get_flw_to_cca(params):
+    """Return a dictionary mapping a flow to its flow's CCA.
+
+    Each flow is a tuple of the form: (sender port, receiver port)
+
+    { (sender port, receiver port): CCA }
+    """
+    return {
+        (sender_port, flw[6]): flw[2]
+        for flw in params["flowsets"]
+        for sender_port in flw[5]
+    }
+
+
 def parse_opened_exp(
     exp,
     exp_flp,
@@ -94,8 +688,15 @@ def parse_opened_exp(
     skip_smoothed,
     select_tail_percent=None,
     servicepolicy=False,
+    cache=None,
 ):
-    """Parse an experiment. Return the smallest safe window size."""
+    """Parse an experiment. Return the smallest safe window size.
+
+    If cache (an exp_cache.ExpCache) is not None, then the parsed packets are loaded
+    from or saved to it. Features that are cached are loaded from it, and the
+    others are generated and saved to it. If the parsed packets are cached, then
+    exp_dir may be None.
+    """
     print(f"Parsing: {exp_flp}")
     if exp.name.startswith("FAILED"):
         print(f"Error: Experimant failed: {exp_flp}")
@@ -104,49 +705,53 @@ def parse_opened_exp(
         print(f"Error: No flows to analyze in: {exp_flp}")
         return -1
 
-    # Determine flow src and dst ports.
-    params_flp = path.join(exp_dir, f"{exp.name}.json")
-    if not path.exists(params_flp):
-        print(f"Error: Cannot find params file ({params_flp}) in: {exp_flp}")
-        return -1
-    with open(params_flp, "r", encoding="utf-8") as fil:
-        params = json.load(fil)
-
-    # Dictionary mapping a flow to its flow's CCA. Each flow is a tuple of the
-    # form: (sender port, receiver port)
-    #
-    # { (sender port, receiver port): CCA }
-    flw_to_cca = {
-        (sender_port, flw[6]): flw[2]
-        for flw in params["flowsets"]
-        for sender_port in flw[5]
-    }
-    flws = list(flw_to_cca.keys())
-
-    # NOTE: We no longer use the sender pcap.
-    #
-    # sender_pcap = path.join(exp_dir, f"sender-tcpdump-{exp.name}.pcap")
-    # Look up the name of the receiver host.
-    # print("params", params)
-    # In a FlowSet, the second entry is the receiver Host, where the first entry is the
-    # name and the 8th entry is the LAN IP.
-    receiver_name_to_ip = {flw[1][0]: flw[1][7] for flw in params["flowsets"]}
-    assert (
-        len(receiver_name_to_ip) == 1
-    ), f"For training, must use a single receiver: {receiver_name_to_ip}"
-    receiver_name, receiver_ip = list(receiver_name_to_ip.items())[0]
-    receiver_pcap = path.join(exp_dir, f"{receiver_name}-tcpdump-{exp.name}.pcap")
-
-    # if not (path.exists(sender_pcap) and path.exists(receiver_pcap)):
-    if not path.exists(receiver_pcap):
-        print(f"Warning: Missing pcap file in: {exp_flp} --- {receiver_pcap}")
-        return -1
-    # NOTE: Disabled because not used.
-    #
-    # flw_to_pkts_sender = utils.parse_packets(sender_pcap, flw_to_cca)
-    flw_to_pkts_receiver = utils.parse_packets(
-        receiver_pcap, flw_to_cca, receiver_ip, select_tail_percent
+    # If possible, load the params and parsed packets from the cache instead of from
+    # the untarred experiment.
+    exp_key = (
+        None if cache is None else cache.get_exp_key(exp_flp, select_tail_percent)
     )
+    cached = None if cache is None else cache.load_pkts(exp_key)
+    if cached is None:
+        # Determine flow src and dst ports.
+        params_flp = path.join(exp_dir, f"{exp.name}.json")
+        if not path.exists(params_flp):
+            print(f"Error: Cannot find params file ({params_flp}) in: {exp_flp}")
+            return -1
+        with open(params_flp, "r", encoding="utf-8") as fil:
+            params = json.load(fil)
+        flw_to_cca = get_flw_to_cca(params)
+
+        # NOTE: We no longer use the sender pcap.
+        #
+        # sender_pcap = path.join(exp_dir, f"sender-tcpdump-{exp.name}.pcap")
+        # Look up the name of the receiver host.
+        # print("params", params)
+        # In a FlowSet, the second entry is the receiver Host, where the first entry
+        # is the name and the 8th entry is the LAN IP.
+        receiver_name_to_ip = {flw[1][0]: flw[1][7] for flw in params["flowsets"]}
+        assert (
+            len(receiver_name_to_ip) == 1
+        ), f"For training, must use a single receiver: {receiver_name_to_ip}"
+        receiver_name, receiver_ip = list(receiver_name_to_ip.items())[0]
+        receiver_pcap = path.join(exp_dir, f"{receiver_name}-tcpdump-{exp.name}.pcap")
+
+        # if not (path.exists(sender_pcap) and path.exists(receiver_pcap)):
+        if not path.exists(receiver_pcap):
+            print(f"Warning: Missing pcap file in: {exp_flp} --- {receiver_pcap}")
+            return -1
+        # NOTE: Disabled because not used.
+        #
+        # flw_to_pkts_sender = utils.parse_packets(sender_pcap, flw_to_cca)
+        flw_to_pkts_receiver = utils.parse_packets(
+            receiver_pcap, flw_to_cca, receiver_ip, select_tail_percent
+        )
+        if cache is not None:
+            cache.save_pkts(exp_key, params, flw_to_pkts_receiver)
+    else:
+        print(f"\tUsing cached packets for: {exp_flp}")
+        params, flw_to_pkts_receiver = cached
+        flw_to_cca = get_flw_to_cca(params)
+    flws = list(flw_to_cca.keys())
 
     # Log and drop flows with no data packets.
     flws_to_remove = []
@@ -237,17 +842,22 @@ def parse_opened_exp(
     # combined throughput of all flows.
     win_to_errors = {win: [0, 0] for win in features.WINDOWS}
 
-    # Create the (super-complicated) dtype. The dtype combines each metric at
-    # multiple granularities.
-    dtype = features.REGULAR_FETS + (
-        [] if skip_smoothed else features.make_smoothed_features()
-    )
+    dtype = get_dtype(skip_smoothed)
+    # Only generate the groups of features that are not cached, and load the rest.
+    manifest, stale = get_stale_groups(cache, exp_key, dtype)
+    cached_cols = {}
+    if manifest is not None:
+        stale_fets = {fet for fets in stale.values() for fet in fets}
+        cached_cols = cache.load_cols(
+            exp_key, [(fet, typ) for fet, typ in dtype if fet not in stale_fets]
+        )
+        get_cached_errors(manifest, stale, dtype, win_to_errors)
+        print(
+            f"\tUsing {len(cached_cols)} cached features and generating "
+            f"{len(stale_fets)} for: {exp_flp}"
+        )
 
     for flw_idx, flw in enumerate(flws):
-        cca = flw_to_cca[flw]
-        # Copa and PCC Vivace use packet-based sequence numbers as opposed to
-        # TCP's byte-based sequence numbers.
-        packet_seq = cca in {"copa", "vivace"}
         # NOTE: Disabled because not used.
         #
         # snd_data_pkts, snd_ack_pkts = flw_to_pkts_sender[flw]
@@ -279,465 +889,48 @@ def parse_opened_exp(
             flw_results[flw] = output
             continue
 
-        # State that the windowed metrics need to track across packets.
-        win_to_start_idx = {win: 0 for win in features.WINDOWS}
-        # Total number of packet losses up to the current received
-        # packet.
-        pkt_loss_total_estimate = 0
-        # Loss rate estimation.
-        prev_seq = None
-        prev_payload_bytes = None
-        highest_seq = None
-        # NOTE: Disabled because not used.
-        #
-        # # Use for Copa RTT estimation.
-        # snd_ack_idx = 0
-        # snd_data_idx = 0
-        # Use for TCP and PCC Vivace RTT estimation.
-        recv_ack_idx = 0
-
-        # Track which packets are definitely retransmissions. Ignore these
-        # packets when estimating the RTT. Note that because we are doing
-        # receiver-side retransmission tracking, it is possible that there are
-        # other retransmissions that we cannot detect.
-        #
-        # All sequence numbers that have been received.
-        unique_pkts = set()
-        # Sequence numbers that have been received multiple times.
-        retrans_pkts = set()
-
-        for j, recv_pkt in enumerate(recv_data_pkts):
-            if j % 1000 == 0:
-                print(
-                    f"\tFlow {flw_idx + 1}/{exp.tot_flws}: "
-                    f"{j}/{len(recv_data_pkts)} packets"
-                )
-            # Whether this is the first packet.
-            first = j == 0
-            # Note that Copa and Vivace use packet-level sequence numbers
-            # instead of TCP's byte-level sequence numbers.
-            recv_seq = recv_pkt[features.SEQ_FET]
-            output[j][features.SEQ_FET] = recv_seq
-            retrans = recv_seq in unique_pkts or (
-                prev_seq is not None
-                and prev_payload_bytes is not None
-                and (prev_seq + (1 if packet_seq else prev_payload_bytes)) > recv_seq
+        # Fill in the columns that are cached, and then generate the stale ones.
+        if cached_cols:
+            start, end = manifest["flw_offsets"][flw_idx : flw_idx + 2]
+            assert end - start == len(output), (
+                f"Error: Cached features have {end - start} rows, but there are "
+                f"{len(output)} packets for flow {flw_idx} in: {exp_flp}"
             )
-            if retrans:
-                # If this packet is a multiple retransmission, then this line
-                # has no effect.
-                retrans_pkts.add(recv_seq)
-            # If this packet has already been seen, then this line has no
-            # effect.
-            unique_pkts.add(recv_seq)
-
-            recv_time_cur_us = recv_pkt[features.ARRIVAL_TIME_FET]
-            output[j][features.ARRIVAL_TIME_FET] = recv_time_cur_us
-
-            payload_bytes = recv_pkt[features.PAYLOAD_FET]
-            wirelen_bytes = recv_pkt[features.WIRELEN_FET]
-            output[j][features.PAYLOAD_FET] = payload_bytes
-            output[j][features.WIRELEN_FET] = wirelen_bytes
-            output[j][features.TOTAL_SO_FAR_FET] = (
-                0 if first else output[j - 1][features.TOTAL_SO_FAR_FET]
-            ) + wirelen_bytes
-            output[j][features.PAYLOAD_SO_FAR_FET] = (
-                0 if first else output[j - 1][features.PAYLOAD_SO_FAR_FET]
-            ) + payload_bytes
-
-            # Count how many flows were active when this packet was captured.
-            active_flws = sum(
-                1
-                for first_time_us, last_time_us in flws_time_bounds
-                if first_time_us <= recv_time_cur_us <= last_time_us
-            )
-            assert active_flws > 0, (
-                f"Error: No active flows detected for packet {j} of "
-                f"flow {flw_idx} in: {exp_flp}"
+            for fet, col in cached_cols.items():
+                output[fet] = col[start:end]
+        if (REGULAR_GROUP,) in stale:
+            fill_regular_fets(
+                output,
+                recv_data_pkts,
+                recv_ack_pkts,
+                flw_to_cca[flw],
+                flws_time_bounds,
+                exp,
+                exp_flp,
+                flw_idx,
+                flw,
             )
 
-            output[j][features.ACTIVE_FLOWS_FET] = active_flws
-            output[j][features.BW_FAIR_SHARE_FRAC_FET] = utils.safe_div(1, active_flws)
-            output[j][features.BW_FAIR_SHARE_BPS_FET] = (
-                utils.safe_div(exp.bw_bps, active_flws) if exp.use_bess else -1
-            )
-
-            # Calculate RTT-related metrics.
-            rtt_us = -1
-            if not first and recv_seq != -1 and not retrans:
-                if cca == "copa":
-                    raise UnsupportedOperation("Support for Copa has been removed!")
-
-                    # NOTE: Disabled because not used.
-                    #
-                    # # In a Copa ACK, the sender timestamp is the time at which
-                    # # the corresponding data packet was sent. The receiver
-                    # # timestamp is the time that the data packet was received
-                    # # and the ACK was sent. This enables sender-side RTT
-                    # # estimation. However, because the sender does not echo a
-                    # # value back to the receiver, this cannot be used for
-                    # # receiver-size RTT estimation.
-                    # #
-                    # # For now, we will just do sender-side RTT estimation. When
-                    # # selecting which packets to use for the RTT estimate, we
-                    # # will select the packet/ACK pair whose ACK arrived soonest
-                    # # before packet j was sent. This means that the sender would
-                    # # have been able to calculate this RTT estimate before
-                    # # sending packet j, and could very well have included the
-                    # # RTT estimate in packet j's header.
-                    # #
-                    # # First, find the index of the ACK that was received soonest
-                    # # before packet j was sent.
-                    # snd_ack_idx = utils.find_bound(
-                    #     snd_ack_pkts[features.SEQ_FET],
-                    #     recv_seq,
-                    #     snd_ack_idx,
-                    #     snd_ack_pkts.shape[0] - 1,
-                    #     which="before",
-                    # )
-                    # snd_ack_seq = snd_ack_pkts[snd_ack_idx][features.SEQ_FET]
-                    # # Then, find this ACK's data packet.
-                    # snd_data_seq = snd_data_pkts[snd_data_idx][features.SEQ_FET]
-                    # while snd_data_idx < snd_data_pkts.shape[0]:
-                    #     snd_data_seq = snd_data_pkts[snd_data_idx][features.SEQ_FET]
-                    #     if snd_data_seq == snd_ack_seq:
-                    #         # Third, the RTT is the difference between the
-                    #         # sending time of the data packet and the arrival
-                    #         # time of its ACK.
-                    #         rtt_us = (
-                    #             snd_ack_pkts[snd_ack_idx][features.ARRIVAL_TIME_FET]
-                    #             - snd_data_pkts[snd_data_idx][features.ARRIVAL_TIME_FET]
-                    #         )
-                    #         assert rtt_us >= 0, (
-                    #             f"Error: Calculated negative RTT ({rtt_us} "
-                    #             f"us) for packet {j} of flow {flw} in: "
-                    #             f"{exp_flp}"
-                    #         )
-                    #         break
-                    #     snd_data_idx += 1
-                elif cca == "vivace":
-                    # UDT ACKs may contain the RTT. Find the last ACK to be sent
-                    # by the receiver before packet j was received.
-                    recv_ack_idx = utils.find_bound(
-                        recv_ack_pkts[features.ARRIVAL_TIME_FET],
-                        recv_time_cur_us,
-                        recv_ack_idx,
-                        recv_ack_pkts.shape[0] - 1,
-                        which="before",
-                    )
-                    udt_rtt_us = recv_ack_pkts[recv_ack_idx][features.TS_1_FET]
-                    if udt_rtt_us > 0:
-                        # The RTT is an optional field in UDT ACK packets. I
-                        # assume that this means that if the RTT is not
-                        # included, then the field will be 0.
-                        rtt_us = udt_rtt_us
-                else:
-                    # This is a TCP flow. Do receiver-side RTT estimation using
-                    # the TCP timestamp option. Attempt to find a new RTT
-                    # estimate. Move recv_ack_idx to the first occurance of the
-                    # timestamp option TSval corresponding to the current
-                    # packet's TSecr.
-                    recv_ack_idx_old = recv_ack_idx
-                    tsval = recv_ack_pkts[recv_ack_idx][features.TS_1_FET]
-                    tsecr = recv_pkt[features.TS_2_FET]
-                    while recv_ack_idx < recv_ack_pkts.shape[0]:
-                        tsval = recv_ack_pkts[recv_ack_idx][features.TS_1_FET]
-                        if tsval == tsecr:
-                            # If we found a timestamp option match, then update
-                            # the RTT estimate.
-                            rtt_us = (
-                                recv_time_cur_us
-                                - recv_ack_pkts[recv_ack_idx][features.ARRIVAL_TIME_FET]
-                            )
-                            break
-                        recv_ack_idx += 1
-                    else:
-                        # If we never found a matching tsval, then use the
-                        # previous RTT estimate and reset recv_ack_idx to search
-                        # again on the next packet.
-                        rtt_us = output[j - 1][features.RTT_FET]
-                        recv_ack_idx = recv_ack_idx_old
-
-            recv_time_prev_us = (
-                -1 if first else output[j - 1][features.ARRIVAL_TIME_FET]
-            )
-            interarr_time_us = utils.safe_sub(recv_time_cur_us, recv_time_prev_us)
-            output[j][features.INTERARR_TIME_FET] = interarr_time_us
-            output[j][features.INV_INTERARR_TIME_FET] = utils.safe_mul(
-                8 * 1e6 * wirelen_bytes, utils.safe_div(1, interarr_time_us)
-            )
-
-            output[j][features.RTT_FET] = rtt_us
-            min_rtt_us = utils.safe_min(
-                sys.maxsize if first else output[j - 1][features.MIN_RTT_FET], rtt_us
-            )
-            output[j][features.MIN_RTT_FET] = min_rtt_us
-            rtt_estimate_ratio = utils.safe_div(rtt_us, min_rtt_us)
-            output[j][features.RTT_RATIO_FET] = rtt_estimate_ratio
-
-            # Receiver-side loss rate estimation. Estimate the number of lost
-            # packets since the last packet. Do not try anything complex or
-            # prone to edge cases. Consider only the simple case where the last
-            # packet and current packet are in order and not retransmissions.
-            pkt_loss_cur_estimate = (
-                -1
-                if (
-                    recv_seq == -1
-                    or prev_seq is None
-                    or prev_seq == -1
-                    or prev_payload_bytes is None
-                    or prev_payload_bytes <= 0
-                    or payload_bytes <= 0
-                    or highest_seq is None
-                    or
-                    # The last packet was a retransmission.
-                    highest_seq != prev_seq
-                    or
-                    # The current packet is a retransmission.
-                    retrans
-                )
-                else round(
-                    (recv_seq - (1 if packet_seq else prev_payload_bytes) - prev_seq)
-                    / (1 if packet_seq else payload_bytes)
-                )
-            )
-
-            if pkt_loss_cur_estimate != -1:
-                pkt_loss_total_estimate += pkt_loss_cur_estimate
-            loss_rate_cur = utils.safe_div(
-                pkt_loss_cur_estimate, utils.safe_add(pkt_loss_cur_estimate, 1)
-            )
-
-            output[j][features.PACKETS_LOST_FET] = pkt_loss_cur_estimate
-            prev_packets_lost_total = (
-                0 if first else output[j - 1][features.PACKETS_LOST_TOTAL_FET]
-            )
-            # This feature is different, because we want to skip the current value if
-            # it's -1.
-            output[j][features.PACKETS_LOST_TOTAL_FET] = (
-                prev_packets_lost_total
-                if pkt_loss_cur_estimate == -1
-                else utils.safe_add(prev_packets_lost_total, pkt_loss_cur_estimate)
-            )
-            output[j][features.LOSS_RATE_FET] = loss_rate_cur
-            sqrt_loss_rate_cur = utils.safe_div(1, utils.safe_sqrt(loss_rate_cur))
-            output[j][features.SQRT_LOSS_RATE_FET] = sqrt_loss_rate_cur
-            mathis_tput_raw = utils.safe_mathis_tput_bps(
-                output[j][features.PAYLOAD_FET],
-                output[j][features.RTT_FET],
-                output[j][features.LOSS_RATE_FET],
-            )
-            output[j][features.MATHIS_TPUT_LOSS_RATE_FET] = mathis_tput_raw
-
-            # EWMA metrics.
-            for (metric, _), alpha in itertools.product(
-                features.EWMA_FETS, features.ALPHAS
-            ):
-                if skip_smoothed:
-                    continue
-
-                metric = features.make_ewma_metric(metric, alpha)
-                if metric.startswith(features.INTERARR_TIME_FET):
-                    new = interarr_time_us
-                elif metric.startswith(features.INV_INTERARR_TIME_FET):
-                    # Do not use the interarrival time EWMA to calculate the
-                    # inverse interarrival time. Instead, use the true inverse
-                    # interarrival time so that the value used to update the
-                    # inverse interarrival time EWMA is not "EWMA-ified" twice.
-                    new = output[j][features.INV_INTERARR_TIME_FET]
-                elif metric.startswith(features.RTT_FET):
-                    new = rtt_us
-                elif metric.startswith(features.RTT_RATIO_FET):
-                    new = rtt_estimate_ratio
-                elif metric.startswith(features.LOSS_RATE_FET):
-                    new = loss_rate_cur
-                elif metric.startswith(features.SQRT_LOSS_RATE_FET):
-                    new = (
-                        1 if sqrt_loss_rate_cur in utils.UNSAFE else sqrt_loss_rate_cur
-                    )
-                elif metric.startswith(features.MATHIS_TPUT_LOSS_RATE_FET):
-                    new = mathis_tput_raw
-                else:
-                    raise RuntimeError(f"Unknown EWMA metric: {metric}")
-                # Update the EWMA. If this is the first value, then use 0 are
-                # the old value.
-                output[j][metric] = utils.safe_update_ewma(
-                    -1 if first else output[j - 1][metric], new, alpha
-                )
-
-            # If we cannot estimate the min RTT, then we cannot compute any
-            # windowed metrics.
-            if min_rtt_us != -1:
-                # Move the window start indices later in time. The min RTT
-                # estimate will never increase, so we do not need to investigate
-                # whether the start of the window moved earlier in time.
-                for win in features.WINDOWS:
-                    win_to_start_idx[win] = utils.find_bound(
-                        output[features.ARRIVAL_TIME_FET],
-                        target=recv_time_cur_us - (win * min_rtt_us),
-                        min_idx=win_to_start_idx[win],
-                        max_idx=j,
-                        which="after",
-                    )
-
-            # Windowed metrics.
-            for (metric, _), win in itertools.product(
-                features.WINDOWED_FETS, features.WINDOWS
-            ):
-                # If we cannot estimate the min RTT, then we cannot compute any
-                # windowed metrics.
-                if skip_smoothed or min_rtt_us == -1:
-                    continue
-
-                # Calculate windowed metrics only if an entire window has
-                # elapsed since the start of the flow.
-                win_size_us = win * min_rtt_us
-                if recv_time_cur_us - first_data_time_us < win_size_us:
-                    continue
-
-                # A window requires at least two packets. Note that this means
-                # the the first packet will always be skipped.
-                win_start_idx = win_to_start_idx[win]
-                if win_start_idx == j:
-                    continue
-
-                metric = features.make_win_metric(metric, win)
-                if metric.startswith(features.INTERARR_TIME_FET):
-                    new = utils.safe_div(
-                        utils.safe_sub(
-                            recv_time_cur_us,
-                            output[win_start_idx][features.ARRIVAL_TIME_FET],
-                        ),
-                        j - win_start_idx,
-                    )
-                elif metric.startswith(features.INV_INTERARR_TIME_FET):
-                    new = utils.safe_mul(
-                        8 * 1e6 * wirelen_bytes,
-                        utils.safe_div(
-                            1,
-                            output[j][
-                                features.make_win_metric(
-                                    features.INTERARR_TIME_FET, win
-                                )
-                            ],
-                        ),
-                    )
-                elif metric.startswith(features.TPUT_FET):
-                    tput_bps = utils.safe_tput_bps(output, win_start_idx, j)
-                    # If the throughput exceeds the bandwidth, then print a
-                    # warning and do not record this throughput.
-                    if tput_bps != -1 and exp.use_bess and tput_bps > exp.bw_bps:
-                        win_to_errors[win][0] += 1
-                        continue
-                    new = tput_bps
-                elif metric.startswith(features.TPUT_SHARE_FRAC_FET):
-                    # This is calculated at the end.
-                    continue
-                elif metric.startswith(features.TOTAL_TPUT_FET):
-                    # This is calcualted at the end.
-                    continue
-                elif metric.startswith(features.TPUT_FAIR_SHARE_BPS_FET):
-                    # This is calculated at the end.
-                    continue
-                elif metric.startswith(features.TPUT_TO_FAIR_SHARE_RATIO_FET):
-                    # This is calculated at the end.
-                    continue
-                elif metric.startswith(features.RTT_FET):
-                    new = utils.safe_mean(output[features.RTT_FET], win_start_idx, j)
-                elif metric.startswith(features.RTT_RATIO_FET):
-                    new = utils.safe_mean(
-                        output[features.RTT_RATIO_FET], win_start_idx, j
-                    )
-                elif metric.startswith(features.LOSS_RATE_FET):
-                    win_losses = utils.safe_sum(
-                        output[features.PACKETS_LOST_FET], win_start_idx + 1, j
-                    )
-                    new = utils.safe_div(win_losses, win_losses + (j - win_start_idx))
-                elif metric.startswith(features.SQRT_LOSS_RATE_FET):
-                    new = utils.safe_div(
-                        1,
-                        utils.safe_sqrt(
-                            output[j][
-                                features.make_win_metric(features.LOSS_RATE_FET, win)
-                            ]
-                        ),
-                    )
-                elif metric.startswith(features.LOSS_EVENT_RATE_FET):
-                    # Populated below.
-                    continue
-                elif metric.startswith(features.SQRT_LOSS_EVENT_RATE_FET):
-                    # Populated below.
-                    continue
-                elif metric.startswith(features.MATHIS_TPUT_LOSS_RATE_FET):
-                    new = utils.safe_mathis_tput_bps(
-                        output[j][features.PAYLOAD_FET],
-                        output[j][features.RTT_FET],
-                        output[j][features.LOSS_RATE_FET],
-                    )
-                elif metric.startswith(features.MATHIS_TPUT_LOSS_EVENT_RATE_FET):
-                    # Populated below.
-                    continue
-                else:
-                    raise RuntimeError(f"Unknown windowed metric: {metric}")
-                output[j][metric] = new
-
-            prev_seq = recv_seq
-            prev_payload_bytes = payload_bytes
-            highest_seq = (
-                prev_seq if highest_seq is None else max(highest_seq, prev_seq)
-            )
-            # In the event of sequence number wraparound, reset the sequence
-            # number tracking.
-            #
-            # TODO: Test sequence number wraparound logic.
-            if (
-                recv_seq != -1
-                and recv_seq + (1 if packet_seq else payload_bytes) > 2**32
-            ):
-                print(
-                    "Warning: Sequence number wraparound detected for packet "
-                    f"{j} of flow {flw} in: {exp_flp}"
-                )
-                highest_seq = None
-                prev_seq = None
-
-        # Fill in loss event rate--related metrics: LOSS_EVENT_RATE_FET,
-        # SQRT_LOSS_EVENT_RATE, and MATHIS_TPUT_LOSS_EVENT_RATE_FET.
-        for win, loss_event_rates in (
-            loss_event_rate.LossTracker(features.WINDOWS)
-            .loss_event_rate(output, all_pkts=True)[1]
-            .items()
-        ):
-            if len(loss_event_rates) != len(output):
-                print(
-                    f"Error: Number of loss event rates ({len(loss_event_rates)}) "
-                    f"does not equal number of packets ({len(output)}) "
-                    f"for window size {win} in flow {flw} in: {exp_flp}"
-                )
-                continue
-            # Fill in loss event rate.
-            output[features.make_win_metric(features.LOSS_EVENT_RATE_FET, win)] = (
-                loss_event_rates
-            )
-
-            # Fill in the sqrt of the loss event rate and the mathis tput based on loss
-            # event rate.
-            sqrt_loss_event_rate_metric = features.make_win_metric(
-                features.SQRT_LOSS_EVENT_RATE_FET, win
-            )
-            mathis_tput_loss_event_rate_metric = features.make_win_metric(
-                features.MATHIS_TPUT_LOSS_EVENT_RATE_FET, win
-            )
-            for ler, out in zip(loss_event_rates, output):
-                # Use the loss event rate to compute 1 / sqrt(loss event rate).
-                out[sqrt_loss_event_rate_metric] = utils.safe_div(
-                    1, utils.safe_sqrt(ler)
-                )
-                out[mathis_tput_loss_event_rate_metric] = utils.safe_mathis_tput_bps(
-                    out[features.PAYLOAD_FET],
-                    out[features.RTT_FET],
-                    ler,
-                )
+        # EWMA metrics.
+        for group in stale:
+            if group[0] == EWMA_GROUP:
+                fill_ewma_fet(output, group[1], group[2])
+
+        # Windowed metrics. These depend only on per-packet features of the
+        # current and earlier packets, so compute them for all packets at once.
+        wins = get_stale_wins(stale, WINDOWED_GROUP)
+        if wins:
+            for win, errors in fill_windowed_fets(
+                output,
+                first_data_time_us,
+                max_tput_bps=exp.bw_bps if exp.use_bess else None,
+                wins=wins,
+            ).items():
+                win_to_errors[win][0] += errors
+
+        wins = get_stale_wins(stale, LOSS_EVENT_RATE_GROUP)
+        if wins:
+            fill_loss_event_rate_fets(output, wins)
 
         # NOTE: Disabled because not used.
         #
@@ -860,10 +1053,9 @@ def parse_opened_exp(
     del recv_data_pkts
     del recv_ack_pkts
 
-    if not skip_smoothed:
-        # Maps window the index of the packet at the start of that window.
-        win_to_start_idx = {win: 0 for win in features.WINDOWS}
-
+    # Metrics that depend on the combined throughput of all flows.
+    wins = get_stale_wins(stale, TOTAL_TPUT_GROUP)
+    if wins:
         # Merge the flow data into a unified timeline.
         combined = []
         for flw in flws:
@@ -873,97 +1065,89 @@ def parse_opened_exp(
                 dtype=[
                     (features.WIRELEN_FET, "float64"),
                     (features.MIN_RTT_FET, "float64"),
-                    ("sender port", "float64"),
-                    ("receiver port", "float64"),
-                    ("index", "float64"),
+                    ("flow", "int64"),
+                    ("index", "int64"),
                 ],
             )
             merged[features.WIRELEN_FET] = flw_results[flw][features.WIRELEN_FET]
             merged[features.MIN_RTT_FET] = flw_results[flw][features.MIN_RTT_FET]
-            merged["sender port"].fill(flw[0])
-            merged["receiver port"].fill(flw[1])
+            merged["flow"].fill(flws.index(flw))
             merged["index"] = np.arange(num_pkts)
             combined.append(merged)
         zipped_arr_times, zipped_dat = utils.zip_timeseries(
             [flw_results[flw][features.ARRIVAL_TIME_FET] for flw in flws], combined
         )
 
-        for j in range(zipped_arr_times.shape[0]):
-            min_rtt_us = zipped_dat[j][features.MIN_RTT_FET]
-            if min_rtt_us == -1:
-                continue
+        zipped_idxs = np.arange(zipped_arr_times.shape[0])
+        valid = zipped_dat[features.MIN_RTT_FET] != -1
+        # The bounds should never go backwards.
+        win_to_start_idxs = windows.start_idxs(
+            zipped_arr_times,
+            zipped_arr_times
+            - windows.win_sizes_us(zipped_dat[features.MIN_RTT_FET]),
+            max_idxs=zipped_idxs,
+            valid=valid,
+        )
+        wirelens = windows.PrefixSums(zipped_dat[features.WIRELEN_FET])
 
-            for win in features.WINDOWS:
-                # The bounds should never go backwards, so start the
-                # search at the current bound.
-                win_to_start_idx[win] = utils.find_bound(
-                    zipped_arr_times,
-                    target=(
-                        zipped_arr_times[j]
-                        - (win * zipped_dat[j][features.MIN_RTT_FET])
-                    ),
-                    min_idx=win_to_start_idx[win],
-                    max_idx=j,
-                    which="after",
-                )
-                # If the window's trailing edge caught up with its
-                # leading edge, then skip this flow.
-                if win_to_start_idx[win] >= j:
-                    continue
-
-                total_tput_bps = utils.safe_div(
-                    utils.safe_mul(
-                        # Accumulate the bytes received by this flow during this
-                        # window. When calculating the average throughput, we
-                        # must exclude the first packet in the window.
-                        utils.safe_sum(
-                            zipped_dat[features.WIRELEN_FET],
-                            start_idx=win_to_start_idx[win] + 1,
-                            end_idx=j,
-                        ),
-                        8 * 1e6,
-                    ),
-                    utils.safe_sub(
-                        zipped_arr_times[j], zipped_arr_times[win_to_start_idx[win]]
-                    ),
+        for win, start_idxs in zip(features.WINDOWS, win_to_start_idxs):
+            if win not in wins:
+                continue
+            # If the window's trailing edge caught up with its leading edge, then
+            # skip this packet.
+            mask = valid & (start_idxs < zipped_idxs)
+            end_idxs = zipped_idxs[mask]
+            start_idxs = start_idxs[mask]
+            total_tput_bps = windows.safe_div(
+                windows.safe_mul(
+                    # Accumulate the bytes received by all flows during this
+                    # window. When calculating the average throughput, we must
+                    # exclude the first packet in the window.
+                    wirelens.sum(start_idxs + 1, end_idxs),
+                    8 * 1e6,
+                ),
+                windows.safe_sub(
+                    zipped_arr_times[end_idxs], zipped_arr_times[start_idxs]
+                ),
+            )
+            # Check if the total throughput is erroneous, and if so, then do not
+            # fill in features related to the total throughput.
+            if exp.use_bess:
+                errors = total_tput_bps > exp.bw_bps
+                win_to_errors[win][1] += int(errors.sum())
+                end_idxs = end_idxs[~errors]
+                total_tput_bps = total_tput_bps[~errors]
+
+            # Scatter the results back to the flow to which each packet belongs,
+            # using the packet's index in its flow.
+            for flw_idx, flw in enumerate(flws):
+                in_flw = zipped_dat["flow"][end_idxs] == flw_idx
+                idxs = zipped_dat["index"][end_idxs][in_flw]
+                total_tput_bps_flw = total_tput_bps[in_flw]
+                res = flw_results[flw]
+                res[features.make_win_metric(features.TOTAL_TPUT_FET, win)][idxs] = (
+                    total_tput_bps_flw
                 )
-                # Check if the total throughput is erroneous, and if so, then do not
-                # fill in features related to the total throughput.
-                if exp.use_bess and total_tput_bps > exp.bw_bps:
-                    win_to_errors[win][1] += 1
-                    continue
-
-                # Extract the flow to which this packet belongs, as well as
-                # its index in its flow.
-                flw = tuple(zipped_dat[j][["sender port", "receiver port"]].tolist())
-                index = int(zipped_dat[j]["index"])
-                flw_results[flw][index][
-                    features.make_win_metric(features.TOTAL_TPUT_FET, win)
-                ] = total_tput_bps
                 # Use the total throughput and the number of active flows to
                 # calculate the throughput fair share.
-                flw_results[flw][index][
-                    features.make_win_metric(features.TPUT_FAIR_SHARE_BPS_FET, win)
-                ] = utils.safe_div(
-                    total_tput_bps,
-                    flw_results[flw][index][features.ACTIVE_FLOWS_FET],
+                res[features.make_win_metric(features.TPUT_FAIR_SHARE_BPS_FET, win)][
+                    idxs
+                ] = windows.safe_div(
+                    total_tput_bps_flw, res[features.ACTIVE_FLOWS_FET][idxs]
                 )
                 # Divide the flow's throughput by the total throughput.
-                tput_share = utils.safe_div(
-                    flw_results[flw][index][
-                        features.make_win_metric(features.TPUT_FET, win)
-                    ],
-                    total_tput_bps,
+                tput_share = windows.safe_div(
+                    res[features.make_win_metric(features.TPUT_FET, win)][idxs],
+                    total_tput_bps_flw,
                 )
-                flw_results[flw][index][
-                    features.make_win_metric(features.TPUT_SHARE_FRAC_FET, win)
+                res[features.make_win_metric(features.TPUT_SHARE_FRAC_FET, win)][
+                    idxs
                 ] = tput_share
                 # Calculate the ratio of tput share to bandwidth fair share.
-                flw_results[flw][index][
+                res[
                     features.make_win_metric(features.TPUT_TO_FAIR_SHARE_RATIO_FET, win)
-                ] = utils.safe_div(
-                    tput_share,
-                    flw_results[flw][index][features.BW_FAIR_SHARE_FRAC_FET],
+                ][idxs] = windows.safe_div(
+                    tput_share, res[features.BW_FAIR_SHARE_FRAC_FET][idxs]
                 )
 
     print(f"\tFinal window durations in: {exp_flp}:")
@@ -986,14 +1170,7 @@ def parse_opened_exp(
             f"\t\t{win}: per-flow: {win_to_errors[win][0]}, "
             f"overall: {win_to_errors[win][1]}"
         )
-    smallest_safe_win = 0
-    for win in sorted(features.WINDOWS):
-        if sum(win_to_errors[win]) == 0:
-            print(f"\tSmallest safe window size is {win} in: {exp_flp}")
-            smallest_safe_win = win
-            break
-    else:
-        print(f"Warning: No safe window sizes in: {exp_flp}")
+    smallest_safe_win = get_smallest_safe_win(win_to_errors, exp_flp)
 
     # Determine if there are any NaNs or Infs in the results. For the results
     # for each flow, look through all features (columns) and make a note of the
@@ -1016,10 +1193,20 @@ def parse_opened_exp(
         print(f"\tOutput already exists: {out_flp}")
     else:
         print(f"\tSaving: {out_flp}")
-        np.savez_compressed(
-            out_flp,
-            **{str(k + 1): v for k, v in enumerate(flw_results[flw] for flw in flws)},
-        )
+        if out_flp.endswith(feature_store.STORE_EXT):
+            feature_store.save(out_flp, [flw_results[flw] for flw in flws])
+            if cache is not None:
+                cache.save_fets(
+                    exp_key, out_flp, get_errors_to_cache(stale, win_to_errors)
+                )
+        else:
+            np.savez_compressed(
+                out_flp,
+                **{
+                    str(k + 1): v
+                    for k, v in enumerate(flw_results[flw] for flw in flws)
+                },
+            )
 
     return smallest_safe_win
 
@@ -1168,118 +1355,114 @@ def parse_received_packets(
         else:
             raise RuntimeError(f"Unknown EWMA metric: {metric}")
 
-    # The index at which this window starts. Uninitialized for now.
-    win_to_start_idx = {win: 0 for win in features.WINDOWS}
-
-    # Windowed metrics.
-    for j in range(win_metrics_start_idx, num_pkts):
-        # Find the start indices for all windowed such that they end on the current
-        # packet.
-        win_to_start_idx = {
-            win: utils.find_bound(
-                fets[features.ARRIVAL_TIME_FET],
-                target=fets[j][features.ARRIVAL_TIME_FET] - (win * min_rtt_us),
-                min_idx=old_start_idx,
-                max_idx=j - 1,
-                which="after",
-            )
-            for win, old_start_idx in win_to_start_idx.items()
-        }
+    # Windowed metrics. Find the start indices for all windows such that they end
+    # on each packet.
+    end_idxs = np.arange(win_metrics_start_idx, num_pkts)
+    arr_times_us = fets[features.ARRIVAL_TIME_FET]
+    win_to_start_idxs = windows.start_idxs(
+        arr_times_us,
+        arr_times_us[end_idxs]
+        - np.array(features.WINDOWS, dtype="float64")[:, np.newaxis] * min_rtt_us,
+        max_idxs=end_idxs - 1,
+    )
+    available_time_us = arr_times_us[end_idxs] - arr_times_us[0]
+    prefix_sums = {}
 
-        available_time_us = (
-            fets[j][features.ARRIVAL_TIME_FET] - fets[0][features.ARRIVAL_TIME_FET]
-        )
+    def get_prefix_sums(fet):
+        if fet not in prefix_sums:
+            prefix_sums[fet] = windows.PrefixSums(fets[fet])
+        return prefix_sums[fet]
 
-        for (metric, _), win in itertools.product(
-            features.WINDOWED_FETS, features.WINDOWS
-        ):
-            metric = features.make_win_metric(metric, win)
-            # If this is not a desired feature, then skip it.
-            if metric not in fets.dtype.names:
-                continue
+    for (metric, _), (win, start_idxs) in itertools.product(
+        features.WINDOWED_FETS, zip(features.WINDOWS, win_to_start_idxs)
+    ):
+        metric = features.make_win_metric(metric, win)
+        # If this is not a desired feature, then skip it.
+        if metric not in fets.dtype.names:
+            continue
 
-            # Calculate windowed metrics only if an entire window has
-            # elapsed since the start of the flow. Recall that the timestamps
-            # have been adjusted to be relative to the start of the flow.
-            win_size_us = win * min_rtt_us
-            if available_time_us < win_size_us:
-                logging.warning(
-                    (
-                        "Warning: Skipping windowed metric %s for packet %d"
-                        "because we lack a full window (%d < %d)"
-                    ),
-                    metric,
-                    j,
-                    available_time_us,
-                    win_size_us,
-                )
-                continue
+        # Calculate windowed metrics only if an entire window has elapsed since
+        # the start of the flow. Recall that the timestamps have been adjusted to
+        # be relative to the start of the flow.
+        win_size_us = win * min_rtt_us
+        full = available_time_us >= win_size_us
+        if not full.all():
+            logging.warning(
+                (
+                    "Warning: Skipping windowed metric %s for %d packets "
+                    "because we lack a full window (%d < %d)"
+                ),
+                metric,
+                (~full).sum(),
+                available_time_us[~full].max(),
+                win_size_us,
+            )
+        ends = end_idxs[full]
+        starts = start_idxs[full]
 
-            # A window requires at least two packets. Note that this means
-            # that the first packet will always be skipped.
-            win_start_idx = win_to_start_idx[win]
-            assert win_start_idx < j, "Window does not contain at least two packtes."
-
-            if metric.startswith(features.INTERARR_TIME_FET):
-                new = (
-                    fets[j][features.ARRIVAL_TIME_FET]
-                    - fets[win_start_idx][features.ARRIVAL_TIME_FET]
-                ) / (j - win_start_idx)
-            elif metric.startswith(features.INV_INTERARR_TIME_FET):
-                new = (
-                    8
-                    * 1e6
-                    * fets[j][features.WIRELEN_FET]
-                    / fets[j][features.make_win_metric(features.INTERARR_TIME_FET, win)]
-                )
-            elif metric.startswith(features.TPUT_FET):
-                new = utils.safe_tput_bps(fets, win_start_idx, j)
-            elif metric.startswith(features.RTT_FET):
-                new = utils.safe_mean(fets[features.RTT_FET], win_start_idx, j)
-            elif metric.startswith(features.RTT_RATIO_FET):
-                new = utils.safe_mean(fets[features.RTT_RATIO_FET], win_start_idx, j)
-            elif metric.startswith(features.LOSS_EVENT_RATE_FET):
-                # Filled in already.
-                continue
-            elif metric.startswith(features.SQRT_LOSS_EVENT_RATE_FET):
-                # 1 / sqrt(loss event rate).
-                new = utils.safe_div(
-                    1,
-                    utils.safe_sqrt(
-                        fets[j][
-                            features.make_win_metric(features.LOSS_EVENT_RATE_FET, win)
-                        ]
-                    ),
-                )
-            elif metric.startswith(features.LOSS_RATE_FET):
-                win_losses = utils.safe_sum(
-                    fets[features.PACKETS_LOST_FET], win_start_idx + 1, j
-                )
-                new = utils.safe_div(win_losses, win_losses + (j - win_start_idx))
-            elif metric.startswith(features.SQRT_LOSS_RATE_FET):
-                new = utils.safe_div(
-                    1,
-                    utils.safe_sqrt(
-                        fets[j][features.make_win_metric(features.LOSS_RATE_FET, win)]
-                    ),
-                )
-            elif metric.startswith(features.MATHIS_TPUT_LOSS_RATE_FET):
-                new = utils.safe_mathis_tput_bps(
-                    fets[j][features.PAYLOAD_FET],
-                    fets[j][features.RTT_FET],
-                    fets[j][features.make_win_metric(features.LOSS_RATE_FET, win)],
-                )
-            elif metric.startswith(features.MATHIS_TPUT_LOSS_EVENT_RATE_FET):
-                new = utils.safe_mathis_tput_bps(
-                    fets[j][features.PAYLOAD_FET],
-                    fets[j][features.RTT_FET],
-                    fets[j][
-                        features.make_win_metric(features.LOSS_EVENT_RATE_FET, win)
-                    ],
-                )
-            else:
-                raise RuntimeError(f"Unknown windowed metric: {metric}")
-            fets[j][metric] = new
+        # A window requires at least two packets. Note that this means
+        # that the first packet will always be skipped.
+        assert (starts < ends).all(), "Window does not contain at least two packtes."
+
+        if metric.startswith(features.INTERARR_TIME_FET):
+            new = (arr_times_us[ends] - arr_times_us[starts]) / (ends - starts)
+        elif metric.startswith(features.INV_INTERARR_TIME_FET):
+            new = (
+                8
+                * 1e6
+                * fets[features.WIRELEN_FET][ends]
+                / fets[features.make_win_metric(features.INTERARR_TIME_FET, win)][ends]
+            )
+        elif metric.startswith(features.TPUT_FET):
+            new = windows.safe_tput_bps(
+                arr_times_us, get_prefix_sums(features.WIRELEN_FET), starts, ends
+            )
+        elif metric.startswith(features.RTT_FET):
+            new = get_prefix_sums(features.RTT_FET).mean(starts, ends)
+        elif metric.startswith(features.RTT_RATIO_FET):
+            new = get_prefix_sums(features.RTT_RATIO_FET).mean(starts, ends)
+        elif metric.startswith(features.LOSS_EVENT_RATE_FET):
+            # Filled in already.
+            continue
+        elif metric.startswith(features.SQRT_LOSS_EVENT_RATE_FET):
+            # 1 / sqrt(loss event rate).
+            new = windows.safe_div(
+                1,
+                windows.safe_sqrt(
+                    fets[features.make_win_metric(features.LOSS_EVENT_RATE_FET, win)][
+                        ends
+                    ]
+                ),
+            )
+        elif metric.startswith(features.LOSS_RATE_FET):
+            win_losses = get_prefix_sums(features.PACKETS_LOST_FET).sum(
+                starts + 1, ends
+            )
+            new = windows.safe_div(win_losses, win_losses + (ends - starts))
+        elif metric.startswith(features.SQRT_LOSS_RATE_FET):
+            new = windows.safe_div(
+                1,
+                windows.safe_sqrt(
+                    fets[features.make_win_metric(features.LOSS_RATE_FET, win)][ends]
+                ),
+            )
+        elif metric.startswith(features.MATHIS_TPUT_LOSS_RATE_FET):
+            new = windows.safe_mathis_tput_bps(
+                fets[features.PAYLOAD_FET][ends],
+                fets[features.RTT_FET][ends],
+                fets[features.make_win_metric(features.LOSS_RATE_FET, win)][ends],
+            )
+        elif metric.startswith(features.MATHIS_TPUT_LOSS_EVENT_RATE_FET):
+            new = windows.safe_mathis_tput_bps(
+                fets[features.PAYLOAD_FET][ends],
+                fets[features.RTT_FET][ends],
+                fets[features.make_win_metric(features.LOSS_EVENT_RATE_FET, win)][
+                    ends
+                ],
+            )
+        else:
+            raise RuntimeError(f"Unknown windowed metric: {metric}")
+        fets[metric][ends] = new
 
     # Make sure that all fets rows were used.
     used_rows = np.sum(fets[features.ARRIVAL_TIME_FET] != -1)
@@ -1318,17 +1501,62 @@ def parse_exp(
     servicepolicy=False,
     always_reparse=False,
     parse_func=parse_opened_exp,
+    out_ext=feature_store.STORE_EXT,
+    cache_dir=None,
 ):
-    """Lock, untar, and parse an experiment."""
+    """Lock, untar, and parse an experiment.
+
+    By default, the results are written to a columnar feature store. Pass
+    out_ext=".npz" to write a compressed .npz file instead.
+
+    If cache_dir is not None, then use a content-addressed cache (see exp_cache) of
+    parsed packets and generated features in that directory. If all of the
+    requested features are cached, then the output is assembled from the cache
+    without opening the experiment. Otherwise, only the groups of features that are
+    not cached are generated (see get_fet_groups()). If the parsed packets are
+    cached, then the experiment is not untarred. always_reparse bypasses the cache.
+    """
     exp = utils.Exp(exp_flp)
     # Create output directory if it does not already exist.
     os.makedirs(out_dir, exist_ok=True)
-    out_flp = path.join(out_dir, f"{exp.name}.npz")
-    with open_exp(exp, exp_flp, untar_dir, out_dir, out_flp, always_reparse) as (
+    out_flp = path.join(out_dir, f"{exp.name}{out_ext}")
+
+    cache = None
+    exp_key = None
+    kwargs = {}
+    if cache_dir is not None and not always_reparse:
+        assert (
+            parse_func is parse_opened_exp
+        ), "The cache only supports parse_opened_exp()."
+        assert (
+            out_ext == feature_store.STORE_EXT
+        ), f"The cache only supports {feature_store.STORE_EXT} output."
+        cache = exp_cache.ExpCache(cache_dir)
+        exp_key = cache.get_exp_key(exp_flp, select_tail_percent)
+        kwargs["cache"] = cache
+
+    with open_exp(
+        exp,
+        exp_flp,
+        untar_dir,
+        out_dir,
+        out_flp,
+        always_reparse,
+        untar=cache is None or not cache.has_pkts(exp_key),
+    ) as (
         locked,
         exp_dir,
     ):
-        if locked and exp_dir is not None:
+        if locked:
+            # Assemble the output from the cache while holding the lock, so that
+            # two processes do not write it at once.
+            if cache is not None:
+                smallest_safe_win = link_cached_fets(
+                    cache, exp_key, skip_smoothed, exp_flp, out_flp
+                )
+                if smallest_safe_win is not None:
+                    print(f"Using cached features for: {exp_flp}")
+                    return smallest_safe_win
             try:
                 return parse_func(
                     exp,
@@ -1338,6 +1566,7 @@ def parse_exp(
                     skip_smoothed,
                     select_tail_percent,
                     servicepolicy,
+                    **kwargs,
                 )
             except AssertionError:
                 traceback.print_exc()
@@ -1394,6 +1623,24 @@ def _main():
         required=False,
         type=float,
     )
+    psr.add_argument(
+        "--cache-dir",
+        help=(
+            "A directory in which to cache parsed packets and generated features, "
+            "keyed by the contents of each experiment. Features that are already "
+            "cached are not regenerated."
+        ),
+        required=False,
+        type=str,
+    )
+    psr.add_argument(
+        "--always-reparse",
+        action="store_true",
+        help=(
+            "Parse experiments even if their output already exists. Bypasses the "
+            "cache."
+        ),
+    )
     psr, psr_verify = cl_args.add_out(psr)
     args = psr_verify(psr.parse_args())
     exp_dir = args.exp_dir
@@ -1410,6 +1657,11 @@ def _main():
             out_dir,
             skip_smoothed,
             args.select_tail_percent,
+            False,  # servicepolicy
+            args.always_reparse,
+            parse_opened_exp,
+            feature_store.STORE_EXT,
+            args.cache_dir,
         )
         for exp in sorted(os.listdir(exp_dir))
         if exp.endswith(".tar.gz")
@@ -3,6 +3,8 @@
 import collections
 import logging
 
+import numpy as np
+
 from ratemon.model import features
 
 
@@ -205,3 +207,150 @@ class LossTracker:
             max_loss_events: self.calculate_loss_event_rate(weights)
             for max_loss_events, weights in self.weights.items()
         }
+
+
+def _first_greater(vals, thresholds, start_idxs):
+    """For each query, find the first index k >= start_idx where vals[k] > threshold.
+
+    Returns len(vals) for queries with no such index. Answers all queries at once by
+    descending a table of block maximums, from the largest block size to the
+    smallest, so each query takes O(log n) vectorized steps.
+    """
+    num_vals = len(vals)
+    if num_vals == 0:
+        return np.zeros_like(start_idxs)
+    levels = [vals]
+    span = 1
+    while 2 * span <= num_vals:
+        levels.append(np.maximum(levels[-1][:-span], levels[-1][span:]))
+        span *= 2
+    idxs = start_idxs.copy()
+    for lvl in reversed(range(len(levels))):
+        size = 1 << lvl
+        fits = idxs + size <= num_vals
+        block_maxs = levels[lvl][np.where(fits, idxs, 0)]
+        idxs[fits & (block_maxs <= thresholds)] += size
+    return idxs
+
+
+def loss_event_rates(pkts, window_sizes):
+    """Batch version of LossTracker.loss_event_rate(pkts, all_pkts=True).
+
+    Computes the same per-packet loss estimates and loss event rates for a whole
+    flow at once, for all window sizes, as a fresh LossTracker would. pkts is a
+    structured numpy array that contains the features in
+    features.PARSE_PACKETS_FETS. Intended for offline feature generation, where the
+    entire flow is available up front.
+
+    Returns a tuple of the form:
+        (packets lost per packet, { window size: loss event rate per packet })
+    """
+    num_pkts = len(pkts)
+    if num_pkts < 2:
+        return np.zeros((num_pkts,), dtype="int64"), {
+            win: np.zeros((num_pkts,), dtype="float64") for win in window_sizes
+        }
+    seqs = pkts[features.SEQ_FET].astype("int64")
+    rtts_us = pkts[features.RTT_FET].astype("float64")
+    payloads = pkts[features.PAYLOAD_FET].astype("int64")
+    times_us = pkts[features.ARRIVAL_TIME_FET].astype("float64")
+    # Each step i (from 1 to num_pkts - 1) processes packet i with packet i - 1 as
+    # the previous packet. All of the following arrays are indexed by step.
+    prev_seqs = seqs[:-1]
+    cur_seqs = seqs[1:]
+    prev_payloads = payloads[:-1]
+    cur_payloads = payloads[1:]
+
+    # Steps in which either packet has no payload assume no loss. Steps in which
+    # the sequence number wraps around assume no loss and reset the highest
+    # sequence number. Only the remaining steps track sequence numbers.
+    nonempty = (cur_payloads != 0) & (prev_payloads != 0)
+    expected_seqs = prev_seqs + prev_payloads
+    wraps = nonempty & (expected_seqs > 2**32)
+    checked = nonempty & ~wraps
+
+    # The highest sequence number is the running max of the previous sequence
+    # numbers (and 0), restarting after every wraparound. Offset each segment so
+    # that a single running max does not cross segment boundaries.
+    segments = np.concatenate(([0], np.cumsum(wraps)[:-1]))
+    offset = 2**40
+    highest_seqs = (
+        np.maximum.accumulate(np.maximum(prev_seqs, 0) + segments * offset)
+        - segments * offset
+    )
+
+    # A packet is a retransmission if its sequence number is behind the expected
+    # one or was already received in an earlier checked step.
+    checked_idxs = np.flatnonzero(checked)
+    _, first_idxs = np.unique(cur_seqs[checked_idxs], return_index=True)
+    seen = np.ones(checked_idxs.shape, dtype=bool)
+    seen[first_idxs] = False
+    retrans = np.zeros(checked.shape, dtype=bool)
+    retrans[checked_idxs] = seen
+    retrans |= expected_seqs > cur_seqs
+
+    estimate = checked & ~retrans & (highest_seqs == prev_seqs)
+    lost = np.zeros(checked.shape, dtype="int64")
+    lost[estimate] = np.round(
+        (cur_seqs[estimate] - prev_payloads[estimate] - prev_seqs[estimate])
+        / cur_payloads[estimate]
+    ).astype("int64")
+    assert (lost >= 0).all()
+
+    # Spread each step's losses evenly between the previous and current arrival
+    # times. Each loss uses the current packet's RTT.
+    loss_steps = np.repeat(np.arange(len(lost)), lost)
+    num_losses = len(loss_steps)
+    cum_lost = np.cumsum(lost)
+    loss_nums = np.arange(num_losses) - (cum_lost - lost)[loss_steps] + 1
+    loss_times_us = (
+        times_us[loss_steps]
+        + loss_nums
+        * ((times_us[loss_steps + 1] - times_us[loss_steps]) / lost[loss_steps])
+    )
+    loss_rtts_us = rtts_us[loss_steps + 1]
+
+    # A loss starts a new loss event if it is more than one RTT after the start of
+    # the current loss event. The first loss event starts at time 0. For each loss,
+    # find the first later loss that would start a new event if this loss started
+    # one, then follow that chain from the first event.
+    keys = loss_times_us - loss_rtts_us
+    next_starts = _first_greater(keys, loss_times_us, np.arange(num_losses) + 1)
+    event_starts = []
+    start = _first_greater(keys, np.zeros(1), np.zeros(1, dtype="int64"))[0]
+    while start < num_losses:
+        event_starts.append(start)
+        start = next_starts[start]
+    event_starts = np.array(event_starts, dtype="int64")
+    num_events = len(event_starts) + 1
+
+    # The first loss and first step of each event. Event 0 is the initial event.
+    event_first_losses = np.concatenate(([0], event_starts))
+    event_first_steps = np.concatenate(([0], loss_steps[event_starts]))
+    # The event that is current at the end of each step, and the number of packets
+    # (lost or received) that it has accumulated so far.
+    step_events = np.searchsorted(event_starts, cum_lost - 1, side="right")
+    step_events[cum_lost == 0] = 0
+    cur_totals = (cum_lost - event_first_losses[step_events]) + (
+        np.arange(len(lost)) - event_first_steps[step_events] + 1
+    )
+    # The total packets in each finished event.
+    totals = np.zeros((num_events,), dtype="float64")
+    totals[:-1] = np.diff(event_first_losses) + np.diff(event_first_steps)
+
+    per_packet_loss_event_rate = {}
+    for win in window_sizes:
+        weights = np.array(LossTracker.make_interval_weights(win))
+        # For each event, the weighted totals of the previous events, using
+        # weights[1:] (when including the current event) or weights[:-1] (when
+        # excluding it).
+        prev_0 = np.convolve(totals, np.concatenate(([0], weights[1:])))[:num_events]
+        prev_1 = np.convolve(totals, np.concatenate(([0], weights)))[:num_events]
+        weights_totals = np.cumsum(weights)[np.minimum(np.arange(num_events), win - 1)]
+        interval_totals = np.maximum(
+            cur_totals * weights[0] + prev_0[step_events], prev_1[step_events]
+        )
+        per_packet_loss_event_rate[win] = np.concatenate(
+            ([0], 1 / (interval_totals / weights_totals[step_events]))
+        )
+    return np.concatenate(([0], lost)), per_packet_loss_event_rate
@@ -0,0 +1,715 @@
+"""Streaming PCAP/PCAPNG parser backed by a memory map.
+
+This is a faster alternative to parsing a PCAP file packet-by-packet with scapy.
+The file is memory-mapped and read in chunks of packet records. Records are found
+by checking a window of the file for plausible record headers at every offset at
+once and then following the chain of record lengths. Header fields are extracted
+from each chunk using vectorized numpy operations, and the chunks are decoded in
+parallel by a pool of worker threads. The output format is identical to
+that of utils.parse_packets().
+
+Only IPv4 is supported. UDP packets are decoded only if the caller provides each
+flow's CCA, which determines the format of the UDP payload (e.g., Copa and PCC
+Vivace).
+"""
+
+import concurrent.futures
+import logging
+import mmap
+import os
+import socket
+import struct
+
+import numpy as np
+
+from ratemon.model import defaults, features
+
+# Global header magic numbers, as read in little endian.
+PCAP_MAGIC_US = 0xA1B2C3D4
+PCAP_MAGIC_NS = 0xA1B23C4D
+PCAP_MAGIC_US_SWAPPED = 0xD4C3B2A1
+PCAP_MAGIC_NS_SWAPPED = 0x4D3CB2A1
+# PCAPNG block types.
+PCAPNG_SHB = 0x0A0D0D0A
+PCAPNG_IDB = 0x00000001
+PCAPNG_EPB = 0x00000006
+PCAPNG_BYTE_ORDER_MAGIC = 0x1A2B3C4D
+# PCAPNG interface option that specifies the timestamp resolution.
+PCAPNG_OPT_IF_TSRESOL = 9
+# Link types.
+LINKTYPE_ETHERNET = 1
+LINKTYPE_RAW = 101
+LINKTYPE_LINUX_SLL = 113
+LINKTYPE_IPV4 = 228
+# Ethertypes.
+ETH_P_IP = 0x0800
+ETH_P_8021Q = 0x8100
+# TCP option kinds.
+TCPOPT_EOL = 0
+TCPOPT_NOP = 1
+TCPOPT_TIMESTAMP = 8
+# The maximum length of the TCP options, in bytes.
+TCP_MAX_OPTS_B = 40
+# How to decode the UDP payload of a flow's packets, by CCA (see
+# utils.parse_packets()).
+UDP_OTHER = 0
+UDP_COPA = 1
+UDP_VIVACE = 2
+CCA_TO_UDP = {"copa": UDP_COPA, "vivace": UDP_VIVACE}
+UDP_HEADER_B = 8
+# The Copa header is padded like a C struct (see defaults.COPA_HEADER_FMT), so its
+# timestamps start at the next multiple of 8 bytes after the three ints.
+COPA_SENDER_TS_OFF = struct.calcsize(defaults.COPA_HEADER_FMT[:3] + "0d")
+COPA_RECEIVER_TS_OFF = COPA_SENDER_TS_OFF + 8
+# PCC Vivace uses UDT. See https://tools.ietf.org/pdf/draft-gg-udt-03.pdf
+UDT_HEADER_B = 16
+UDT_ACK_B = 24
+UDT_TYPE_ACK = 2
+# The number of packet records to decode at once.
+CHUNK_PKTS = 1 << 18
+# The number of bytes of the file in which to look for records at once.
+SCAN_WINDOW_B = 1 << 24
+# Bounds on the fields of a plausible classic PCAP record header. Timestamps may
+# be a little earlier than the first record's, and much later.
+PCAP_MAX_CAPLEN = 1 << 18
+PCAP_SEC_SLACK = 24 * 60 * 60
+PCAP_SEC_SPAN = 10 * 366 * 24 * 60 * 60
+# The default number of worker threads.
+DEFAULT_THREADS = min(4, os.cpu_count() or 1)
+
+
+def _be16(buf, idx):
+    """Gather big-endian 16-bit values from buf at the offsets in idx."""
+    return (buf[idx].astype(np.uint32) << 8) | buf[idx + 1]
+
+
+def _be32(buf, idx):
+    """Gather big-endian 32-bit values from buf at the offsets in idx."""
+    return (
+        (buf[idx].astype(np.uint32) << 24)
+        | (buf[idx + 1].astype(np.uint32) << 16)
+        | (buf[idx + 2].astype(np.uint32) << 8)
+        | buf[idx + 3]
+    )
+
+
+def _u32(buf, idx, endian):
+    """Gather 32-bit values with the given byte order from buf at the offsets in
+    idx."""
+    if endian == ">":
+        return _be32(buf, idx)
+    return (
+        buf[idx].astype(np.uint32)
+        | (buf[idx + 1].astype(np.uint32) << 8)
+        | (buf[idx + 2].astype(np.uint32) << 16)
+        | (buf[idx + 3].astype(np.uint32) << 24)
+    )
+
+
+def _le64_float(buf, idx):
+    """Gather little-endian doubles from buf at the offsets in idx."""
+    return (
+        (_u32(buf, idx + 4, "<").astype(np.uint64) << np.uint64(32))
+        | _u32(buf, idx, "<").astype(np.uint64)
+    ).view(np.float64)
+
+
+def _convert_ts_us(ts, tsresol):
+    """Convert an array of PCAPNG timestamps (uint64) with the given if_tsresol to
+    microseconds."""
+    if tsresol & 0x80:
+        # Negative power of two. Split off the whole seconds so that multiplying
+        # by 1000000 does not overflow.
+        bits = tsresol & 0x7F
+        frac = ((ts & ((1 << bits) - 1)) * 1000000) >> bits
+        return ((ts >> bits) * 1000000 + frac).astype(np.int64)
+    # Negative power of ten.
+    if tsresol >= 6:
+        return (ts // (10 ** (tsresol - 6))).astype(np.int64)
+    return (ts * (10 ** (6 - tsresol))).astype(np.int64)
+
+
+def _follow_chain(starts, nxts):
+    """Find the records that are chained to the first one.
+
+    starts is a sorted array of candidate record offsets, some of which may be
+    false positives (e.g., inside packet payloads), and nxts is where the record
+    after each candidate would start. Returns the indices of the candidates that
+    are reached by following nxts from starts[0], in order. Uses pointer jumping,
+    so it takes O(log n) vectorized passes instead of one step per record.
+    """
+    num = len(starts)
+    idx = np.minimum(np.searchsorted(starts, nxts), num - 1)
+    # Candidates whose successor is not a candidate jump to a sentinel.
+    jump = np.append(np.where(starts[idx] == nxts, idx, num), num)
+    reach = np.zeros(num + 1, dtype=bool)
+    reach[0] = True
+    # After k passes, reach holds the first 2^k records of the chain.
+    for _ in range(num.bit_length()):
+        reach[jump[reach]] = True
+        jump = jump[jump]
+    return np.flatnonzero(reach[:num])
+
+
+def _scan_pcap_window(buf, start, end, endian, frac_limit, sec_lo):
+    """Find the records of a classic PCAP file that start in [start, end), given
+    that one starts at start.
+
+    Every byte offset in the window is checked for a plausible record header at
+    once, and then the real records are found with _follow_chain(). Returns a
+    tuple of (header offsets, seconds, fractions, captured lengths, wire lengths),
+    or None if the header at start is not plausible.
+    """
+    size = len(buf)
+    dtype = np.dtype(f"{endian}u4")
+    found = []
+    # Reading 32-bit words at every offset that is congruent to k mod 4 is a
+    # zero-copy view, and the four header fields are shifted slices of it.
+    for k in range(4):
+        base = start + k
+        num = (end - base + 3) // 4
+        if num <= 0:
+            continue
+        words = buf[base : base + 4 * (num + 3)].view(dtype)
+        # The timestamp check rejects most offsets, so only check the other
+        # fields of the offsets that pass it.
+        idx = np.flatnonzero((words[:num] - sec_lo) <= PCAP_SEC_SPAN)
+        hdrs = [words[idx + i].astype(np.int64) for i in range(4)]
+        plausible = (
+            (hdrs[1] < frac_limit)
+            & (hdrs[2] <= hdrs[3])
+            & (hdrs[2] <= PCAP_MAX_CAPLEN)
+            & (base + 4 * idx + 16 + hdrs[2] <= size)
+        )
+        found.append([base + 4 * idx[plausible]] + [hdr[plausible] for hdr in hdrs])
+    cols = [np.concatenate(col) for col in zip(*found)]
+    order = np.argsort(cols[0], kind="stable")
+    starts, secs, fracs, caplens, wirelens = (col[order] for col in cols)
+    if not len(starts) or starts[0] != start:
+        return None
+    sel = _follow_chain(starts, starts + 16 + caplens)
+    return starts[sel], secs[sel], fracs[sel], caplens[sel], wirelens[sel]
+
+
+def _scan_pcapng_window(buf, start, end, endian):
+    """Find the PCAPNG blocks that start in [start, end), given that one starts
+    at start.
+
+    Blocks are 4-byte aligned and repeat their length at their end, so the
+    candidates are the aligned offsets whose trailing length matches, and the
+    real blocks are found with _follow_chain(). Returns a tuple of (block offsets,
+    block lengths), or None if the block at start is not a candidate.
+    """
+    size = len(buf)
+    num = (end - start + 3) // 4
+    lens = buf[start : start + 4 * (num + 1)].view(f"{endian}u4")[1:].astype(np.int64)
+    starts = start + 4 * np.arange(num, dtype=np.int64)
+    ok = (lens >= 12) & (lens % 4 == 0) & (starts + lens <= size)
+    starts, lens = starts[ok], lens[ok]
+    ok = _u32(buf, starts + lens - 4, endian) == lens
+    starts, lens = starts[ok], lens[ok]
+    if not len(starts) or starts[0] != start:
+        return None
+    sel = _follow_chain(starts, starts + lens)
+    return starts[sel], lens[sel]
+
+
+def _rechunk(windows, chunk_pkts):
+    """Regroup windows of records, in the format yielded by _iter_pcap_records(),
+    into chunks of chunk_pkts records. The last chunk may be smaller."""
+    pending = []
+    count = 0
+    linktype = None
+    for window in windows:
+        linktype = window[0]
+        pending.append(window[1:])
+        count += len(window[1])
+        while count >= chunk_pkts:
+            cols = [np.concatenate(col) for col in zip(*pending)]
+            yield (linktype,) + tuple(col[:chunk_pkts] for col in cols)
+            pending = [tuple(col[chunk_pkts:] for col in cols)]
+            count -= chunk_pkts
+    if count:
+        yield (linktype,) + tuple(np.concatenate(col) for col in zip(*pending))
+
+
+def _iter_pcap_records(buf, chunk_pkts):
+    """Walk the records of a classic PCAP file.
+
+    Yields tuples of the form:
+        ( linktype, record offsets, captured lengths, wire lengths, times (us) )
+    """
+    (magic,) = struct.unpack_from("<I", buf, 0)
+    if magic in {PCAP_MAGIC_US, PCAP_MAGIC_NS}:
+        endian = "<"
+    elif magic in {PCAP_MAGIC_US_SWAPPED, PCAP_MAGIC_NS_SWAPPED}:
+        endian = ">"
+    else:
+        raise RuntimeError(f"Unknown PCAP magic number: {magic:#x}")
+    nanos = magic in {PCAP_MAGIC_NS, PCAP_MAGIC_NS_SWAPPED}
+    (linktype,) = struct.unpack_from(f"{endian}I", buf, 20)
+    # Ignore the upper bits, which may contain FCS information.
+    linktype &= 0xFFFF
+    hdr = struct.Struct(f"{endian}IIII")
+    size = len(buf)
+    off = 24
+    sec_lo = None
+
+    def windows():
+        nonlocal off, sec_lo
+        while off + hdr.size <= size:
+            sec, frac, caplen, wirelen = hdr.unpack_from(buf, off)
+            if off + hdr.size + caplen > size:
+                logging.warning("\tTruncated PCAP record at offset %d", off + hdr.size)
+                return
+            if sec_lo is None:
+                sec_lo = np.uint32(max(sec - PCAP_SEC_SLACK, 0))
+            found = _scan_pcap_window(
+                buf,
+                off,
+                min(off + SCAN_WINDOW_B, size - hdr.size + 1),
+                endian,
+                1000000000 if nanos else 1000000,
+                sec_lo,
+            )
+            if found is None:
+                # This record does not look like the others (e.g., its timestamp
+                # is far from the first record's), so take it on its own.
+                found = tuple(
+                    np.asarray([val], dtype=np.int64)
+                    for val in (off, sec, frac, caplen, wirelen)
+                )
+            starts, secs, fracs, caplens, wirelens = found
+            off = int(starts[-1] + hdr.size + caplens[-1])
+            # Use 1000000 instead of 1e6 to avoid converting floats.
+            yield (
+                linktype,
+                starts + hdr.size,
+                caplens,
+                wirelens,
+                secs * 1000000 + (fracs // 1000 if nanos else fracs),
+            )
+
+    return _rechunk(windows(), chunk_pkts)
+
+
+def _iter_pcapng_records(buf, chunk_pkts):
+    """Walk the Enhanced Packet Blocks of a PCAPNG file.
+
+    All interfaces in a section must share a linktype. Yields tuples in the same
+    format as _iter_pcap_records().
+    """
+    size = len(buf)
+
+    def windows():
+        off = 0
+        endian = "<"
+        # Per-interface (linktype, if_tsresol) for the current section.
+        ifaces = []
+        linktype = None
+        while off + 12 <= size:
+            (blk_type,) = struct.unpack_from("<I", buf, off)
+            if blk_type == PCAPNG_SHB:
+                (bom,) = struct.unpack_from("<I", buf, off + 8)
+                endian = "<" if bom == PCAPNG_BYTE_ORDER_MAGIC else ">"
+                ifaces = []
+            (blk_type, blk_len) = struct.unpack_from(f"{endian}II", buf, off)
+            if blk_len < 12 or off + blk_len > size:
+                logging.warning("\tTruncated PCAPNG block at offset %d", off)
+                return
+            if blk_type == PCAPNG_IDB:
+                (if_linktype,) = struct.unpack_from(f"{endian}H", buf, off + 8)
+                tsresol = 6
+                # Walk the options, looking for if_tsresol.
+                opt_off = off + 16
+                while opt_off + 4 <= off + blk_len - 4:
+                    code, opt_len = struct.unpack_from(f"{endian}HH", buf, opt_off)
+                    if code == 0:
+                        break
+                    if code == PCAPNG_OPT_IF_TSRESOL:
+                        tsresol = int(buf[opt_off + 4])
+                    opt_off += 4 + ((opt_len + 3) & ~3)
+                ifaces.append((if_linktype, tsresol))
+            if blk_type != PCAPNG_EPB:
+                off += blk_len
+                continue
+
+            # Find the run of EPBs that starts here all at once. Other blocks,
+            # which are rare, are handled one at a time above.
+            found = _scan_pcapng_window(
+                buf, off, min(off + SCAN_WINDOW_B, size - 11), endian
+            )
+            starts, lens = (
+                found
+                if found is not None
+                else (np.asarray([off]), np.asarray([blk_len]))
+            )
+            is_epb = _u32(buf, starts, endian) == PCAPNG_EPB
+            run = int(np.argmin(is_epb)) if not is_epb.all() else len(starts)
+            starts = starts[:run]
+            off = int(starts[-1] + lens[run - 1])
+
+            iface, ts_hi, ts_lo, caplens, wirelens = (
+                _u32(buf, starts + 8 + 4 * i, endian).astype(np.int64) for i in range(5)
+            )
+            if int(iface.max()) >= len(ifaces):
+                bad = int(np.argmax(iface >= len(ifaces)))
+                raise RuntimeError(
+                    f"PCAPNG packet block at offset {int(starts[bad])} refers to "
+                    f"interface {int(iface[bad])}, but only {len(ifaces)} "
+                    "interfaces have been described so far"
+                )
+            times_us = np.empty(len(starts), dtype=np.int64)
+            ts = (ts_hi.astype(np.uint64) << np.uint64(32)) | ts_lo.astype(np.uint64)
+            for if_idx in np.unique(iface).tolist():
+                if_linktype, tsresol = ifaces[if_idx]
+                if linktype is not None and if_linktype != linktype:
+                    raise RuntimeError(
+                        "Mixed linktypes are not supported: "
+                        f"{linktype}, {if_linktype}"
+                    )
+                linktype = if_linktype
+                sel = iface == if_idx
+                times_us[sel] = _convert_ts_us(ts[sel], tsresol)
+            yield linktype, starts + 28, caplens, wirelens, times_us
+
+    return _rechunk(windows(), chunk_pkts)
+
+
+def _decode_udp(buf, idx, kinds, dir_idx, pl_off, seq, tsval, tsecr):
+    """Decode the CCA-specific headers at the start of UDP payloads, like
+    utils.parse_packets().
+
+    kinds is the UDP_* kind of each packet's flow and pl_off is where each packet's
+    UDP payload starts. Updates seq, tsval, and tsecr in place. Returns a tuple of
+    the form (which packets to keep, the length of each packet's headers after
+    the IP header).
+    """
+    keep = np.ones(kinds.shape, dtype=bool)
+    hdr_b = np.full(kinds.shape, UDP_HEADER_B, dtype=np.int64)
+
+    # Copa. The header is written in the sender's (little-endian) byte order.
+    copa = np.flatnonzero(kinds == UDP_COPA)
+    copa_off = pl_off[copa]
+    copa_seq = _u32(buf, idx(copa_off), "<").astype(np.int32)
+    # A sequence number of -1 marks a connection-establishment packet.
+    keep[copa] = copa_seq != -1
+    seq[copa] = copa_seq
+    # Convert the timestamps from milliseconds to microseconds.
+    tsval[copa] = np.round(_le64_float(buf, idx(copa_off + COPA_SENDER_TS_OFF)) * 1000)
+    tsecr[copa] = np.round(
+        _le64_float(buf, idx(copa_off + COPA_RECEIVER_TS_OFF)) * 1000
+    )
+    hdr_b[copa] += defaults.COPA_HEADER_SIZE_B
+
+    # PCC Vivace. The first bit of a UDT header is 1 for control packets. Keep only
+    # data packets and the ACKs sent by the receiver, which contain the RTT.
+    vivace = kinds == UDP_VIVACE
+    first = _be32(buf, idx(pl_off))
+    control = (first >> 31) == 1
+    ack = control & (((first & 0x7FFF0000) >> 16) == UDT_TYPE_ACK)
+    keep &= ~vivace | ~control | (ack & (dir_idx == 1))
+    data = vivace & ~control
+    seq[data] = (first & 0x7FFFFFFF)[data]
+    ack &= vivace
+    seq[ack] = _be32(buf, idx(pl_off + UDT_HEADER_B))[ack]
+    tsval[ack] = _be32(buf, idx(pl_off + UDT_HEADER_B + 4))[ack]
+    hdr_b[vivace] += UDT_HEADER_B
+    hdr_b[ack] += UDT_ACK_B
+    return keep, hdr_b
+
+
+def _decode_chunk(buf, local_ip, flw_keys, flw_udp, chunk):
+    """Extract the header fields for a chunk of packet records.
+
+    flw_keys is a sorted array of flows encoded as (sender port << 16) | receiver
+    port. If flw_udp is None, then only TCP packets are decoded. Otherwise, it holds
+    the UDP_* kind of each flow in flw_keys, and UDP packets are decoded as well.
+    Returns a tuple of:
+        ( flow index, direction index, PARSE_PCAP_FETS structured array )
+    for the packets in this chunk that belong to one of the flows.
+    """
+    linktype, offsets, caplens, wirelens, times_us = chunk
+    # Clamp gather indices to the buffer so that malformed packets cannot cause
+    # out-of-bounds reads. Such packets are filtered out by the "valid" mask.
+    last = len(buf) - 1
+
+    def idx(arr):
+        return np.minimum(arr, last - 3)
+
+    # Find the start of the network header.
+    if linktype == LINKTYPE_ETHERNET:
+        ethertype = _be16(buf, idx(offsets + 12))
+        vlan = ethertype == ETH_P_8021Q
+        ethertype = np.where(vlan, _be16(buf, idx(offsets + 16)), ethertype)
+        l3_off = offsets + np.where(vlan, 18, 14)
+        valid = ethertype == ETH_P_IP
+    elif linktype == LINKTYPE_LINUX_SLL:
+        l3_off = offsets + 16
+        valid = _be16(buf, idx(offsets + 14)) == ETH_P_IP
+    elif linktype in {LINKTYPE_RAW, LINKTYPE_IPV4}:
+        l3_off = offsets
+        valid = np.ones(offsets.shape, dtype=bool)
+    else:
+        raise RuntimeError(f"Unsupported PCAP linktype: {linktype}")
+    l3_len = caplens - (l3_off - offsets)
+
+    # IPv4 header.
+    ver_ihl = buf[idx(l3_off)]
+    ihl_b = (ver_ihl & 0x0F).astype(np.int64) << 2
+    valid &= ((ver_ihl >> 4) == 4) & (ihl_b >= 20) & (l3_len >= 20)
+    proto = buf[idx(l3_off + 9)]
+    is_udp = (proto == socket.IPPROTO_UDP) & (flw_udp is not None)
+    valid &= (proto == socket.IPPROTO_TCP) | is_udp
+    ip_len = _be16(buf, idx(l3_off + 2)).astype(np.int64)
+    saddr = _be32(buf, idx(l3_off + 12))
+
+    # TCP or UDP header. Both start with the ports.
+    l4_off = l3_off + ihl_b
+    valid &= l3_len >= ihl_b + np.where(is_udp, UDP_HEADER_B, 20)
+    sport = _be16(buf, idx(l4_off))
+    dport = _be16(buf, idx(l4_off + 2))
+    seq = _be32(buf, idx(l4_off + 4))
+    thl_b = np.where(
+        is_udp, UDP_HEADER_B, (buf[idx(l4_off + 12)] >> 4).astype(np.int64) << 2
+    )
+    valid &= is_udp | (thl_b >= 20)
+
+    # Determine each packet's direction. Incoming packets are given dir_idx of 0
+    # and outgoing packets are given dir_idx of 1. The flow is a tuple of (sender
+    # port, receiver port).
+    dir_idx = (saddr == local_ip).astype(np.int64)
+    flw_key = np.where(
+        dir_idx == 1, (dport << 16) | sport, (sport << 16) | dport
+    ).astype(np.int64)
+    flw_idx = np.searchsorted(flw_keys, flw_key)
+    flw_idx = np.minimum(flw_idx, len(flw_keys) - 1)
+    valid &= flw_keys[flw_idx] == flw_key
+
+    # Drop everything that we do not care about before walking the TCP options.
+    sel = np.flatnonzero(valid)
+    l4_off, thl_b, l4_end = l4_off[sel], thl_b[sel], (l3_off + l3_len)[sel]
+    is_udp = is_udp[sel]
+    seq = np.where(is_udp, -1, seq[sel].astype(np.int64))
+    tsval = np.full(sel.shape, -1, dtype=np.int64)
+    tsecr = np.full(sel.shape, -1, dtype=np.int64)
+    # Walk the TCP options of all packets in lockstep. Each iteration advances
+    # every packet's cursor by at least one byte, so TCP_MAX_OPTS_B iterations are
+    # enough to visit every option.
+    cur = l4_off + 20
+    opts_end = np.minimum(l4_off + thl_b, l4_end)
+    active = ~is_udp & (cur < opts_end)
+    for _ in range(TCP_MAX_OPTS_B):
+        if not active.any():
+            break
+        kind = np.where(active, buf[idx(cur)], TCPOPT_EOL)
+        active &= kind != TCPOPT_EOL
+        opt_len = np.where(kind == TCPOPT_NOP, 1, buf[idx(cur + 1)].astype(np.int64))
+        found = active & (kind == TCPOPT_TIMESTAMP) & (cur + 10 <= opts_end)
+        tsval = np.where(found, _be32(buf, idx(cur + 2)), tsval)
+        tsecr = np.where(found, _be32(buf, idx(cur + 6)), tsecr)
+        # A zero-length option is malformed. Stop walking this packet's options.
+        active &= ~found & (opt_len > 0)
+        cur = cur + opt_len
+        active &= cur < opts_end
+
+    if is_udp.any():
+        udp = np.flatnonzero(is_udp)
+        udp_seq, udp_tsval, udp_tsecr = seq[udp], tsval[udp], tsecr[udp]
+        keep, thl_b[udp] = _decode_udp(
+            buf,
+            idx,
+            flw_udp[flw_idx[sel[udp]]],
+            dir_idx[sel[udp]],
+            l4_off[udp] + UDP_HEADER_B,
+            udp_seq,
+            udp_tsval,
+            udp_tsecr,
+        )
+        seq[udp], tsval[udp], tsecr[udp] = udp_seq, udp_tsval, udp_tsecr
+        keep_all = np.ones(sel.shape, dtype=bool)
+        keep_all[udp] = keep
+        sel, seq, tsval, tsecr, thl_b = (
+            arr[keep_all] for arr in (sel, seq, tsval, tsecr, thl_b)
+        )
+
+    pkts = np.empty(sel.shape, dtype=features.PARSE_PCAP_FETS)
+    pkts[features.SEQ_FET] = seq
+    pkts[features.ARRIVAL_TIME_FET] = times_us[sel]
+    pkts[features.TS_1_FET] = tsval
+    pkts[features.TS_2_FET] = tsecr
+    # Transport payload. Length of the IP packet minus the length of the IP
+    # header minus the length of the transport header.
+    pkts[features.PAYLOAD_FET] = ip_len[sel] - ihl_b[sel] - thl_b
+    pkts[features.WIRELEN_FET] = wirelens[sel]
+    return flw_idx[sel], dir_idx[sel], pkts
+
+
+def iter_packets(
+    flp, flws, local_ip, select_tail_percent=None, threads=None, ccas=None
+):
+    """Parse a PCAP or PCAPNG file containing TCP or UDP flows, one chunk at a time.
+
+    flws is a list of flows of the form (sender port, receiver port). local_ip is a
+    string IPv4 address of the interface on which the PCAP trace was collected.
+    ccas is an optional list of the CCA of each flow in flws. If it is None, then
+    only TCP packets are parsed.
+
+    Yields tuples of the form:
+        ( number of packet records, flow index, direction index, packets )
+    in file order, where flow index indexes flws, direction index is 0 for incoming
+    packets and 1 for outgoing packets, and packets is a PARSE_PCAP_FETS structured
+    array. At most a bounded number of chunks are in memory at once.
+    """
+    assert flws, "No flows provided!"
+    flw_keys = np.asarray([(snd << 16) | rcv for snd, rcv in flws], dtype=np.int64)
+    order = np.argsort(flw_keys)
+    flw_keys = flw_keys[order]
+    flw_udp = (
+        None
+        if ccas is None
+        else np.asarray([CCA_TO_UDP.get(cca, UDP_OTHER) for cca in ccas])[order]
+    )
+    local_ip = struct.unpack("!I", socket.inet_aton(local_ip))[0]
+    threads = DEFAULT_THREADS if threads is None else threads
+
+    with open(flp, "rb") as fil:
+        if os.fstat(fil.fileno()).st_size == 0:
+            return
+        mem = mmap.mmap(fil.fileno(), 0, access=mmap.ACCESS_READ)
+        buf = np.frombuffer(mem, dtype=np.uint8)
+        try:
+            (magic,) = struct.unpack_from("<I", buf, 0)
+            records = (
+                _iter_pcapng_records(buf, CHUNK_PKTS)
+                if magic == PCAPNG_SHB
+                else _iter_pcap_records(buf, CHUNK_PKTS)
+            )
+
+            # Optionally select a percentage of the tail of the PCAP file. This
+            # requires knowing the last timestamp, so materialize the record
+            # index (but not the packets) first.
+            if select_tail_percent is not None and select_tail_percent != 100:
+                assert 0 < select_tail_percent <= 100, (
+                    '"select_tail_percent" must be in the range (0, 100], '
+                    f"but is: {select_tail_percent}"
+                )
+                print(f"\tSelecting last {select_tail_percent}% of pcap file by time")
+                records = list(records)
+                assert records, "No packets."
+                first_us = records[0][4][0]
+                last_us = records[-1][4][-1]
+                new_start_time_us = last_us - (
+                    (last_us - first_us) * select_tail_percent / 100
+                )
+                times_us = np.concatenate([chunk[4] for chunk in records])
+                after = times_us > new_start_time_us
+                start_idx = int(np.argmax(after)) if after.any() else len(times_us) - 1
+                trimmed = []
+                for chunk in records:
+                    cnt = len(chunk[1])
+                    if start_idx < cnt:
+                        trimmed.append(
+                            (chunk[0],) + tuple(arr[start_idx:] for arr in chunk[1:])
+                        )
+                    start_idx = max(0, start_idx - cnt)
+                records = trimmed
+
+            def decode(chunk):
+                flw_idx, dir_idx, pkts = _decode_chunk(
+                    buf, local_ip, flw_keys, flw_udp, chunk
+                )
+                return len(chunk[1]), order[flw_idx], dir_idx, pkts
+
+            with concurrent.futures.ThreadPoolExecutor(max_workers=threads) as pool:
+                # Keep a bounded number of chunks in flight so that memory use does
+                # not grow with the size of the PCAP file.
+                pending = []
+                for chunk in records:
+                    pending.append(pool.submit(decode, chunk))
+                    if len(pending) >= 2 * threads:
+                        yield pending.pop(0).result()
+                for fut in pending:
+                    yield fut.result()
+        finally:
+            # The map cannot be closed while views into it exist. Drop ours (and
+            # the record walker, which holds more) first.
+            buf = records = None
+            try:
+                mem.close()
+            except BufferError:
+                # The traceback of an exception that is propagating still holds
+                # a view. Let the map be unmapped when that is released instead
+                # of masking the exception.
+                pass
+
+
+def parse_packets(
+    flp, flws, local_ip, select_tail_percent=None, threads=None, ccas=None
+):
+    """Parse a PCAP or PCAPNG file containing TCP or UDP flows.
+
+    flws is an iterable of flows of the form (sender port, receiver port). local_ip
+    is a string IPv4 address of the interface on which the PCAP trace was collected.
+    See iter_packets() for ccas and utils.parse_packets() for the output format.
+    """
+    logging.info("\tParsing PCAP (fast path): %s", flp)
+    flws = list(flws)
+    assert ccas is None or len(ccas) == len(flws)
+    threads = DEFAULT_THREADS if threads is None else threads
+
+    # Per-flow, per-direction lists of packet arrays, in file order.
+    pieces = [([], []) for _ in flws]
+    num_pkts = 0
+    for result in iter_packets(flp, flws, local_ip, select_tail_percent, threads, ccas):
+        num_pkts += _collect(result, pieces)
+
+    # Assemble each flow's arrays. Flows are independent, so split them across
+    # worker threads.
+    def assemble(flw_pieces):
+        return tuple(
+            (
+                np.concatenate(dir_pieces)
+                if dir_pieces
+                else np.empty((0,), dtype=features.PARSE_PCAP_FETS)
+            )
+            for dir_pieces in flw_pieces
+        )
+
+    with concurrent.futures.ThreadPoolExecutor(max_workers=threads) as pool:
+        flw_to_pkts = dict(zip(flws, pool.map(assemble, pieces)))
+
+    tot_pkts = sum(dat.shape[0] + ack.shape[0] for dat, ack in flw_to_pkts.values())
+    assert (
+        tot_pkts <= num_pkts
+    ), f"Found more packets than exist ({tot_pkts} > {num_pkts}): {flp}"
+    discarded_pkts = num_pkts - tot_pkts
+    if num_pkts == 0:
+        logging.info("No packets found in: %s", flp)
+    else:
+        logging.info(
+            "\tDiscarded packets: %s (%.2f%%)",
+            discarded_pkts,
+            discarded_pkts / num_pkts * 100,
+        )
+    return flw_to_pkts
+
+
+def _collect(result, pieces):
+    """Distribute a decoded chunk into per-flow pieces.
+
+    Returns the number of packet records in the chunk.
+    """
+    num_records, flw_idx, dir_idx, pkts = result
+    if len(pkts):
+        # Sorting is stable, so packets stay in file order within each flow.
+        grp = flw_idx * 2 + dir_idx
+        srt = np.argsort(grp, kind="stable")
+        grp, pkts = grp[srt], pkts[srt]
+        bounds = np.flatnonzero(np.diff(grp)) + 1
+        for start, end in zip(
+            np.concatenate(([0], bounds)), np.concatenate((bounds, [len(grp)]))
+        ):
+            key = int(grp[start])
+            pieces[key // 2][key % 2].append(pkts[start:end])
+    return num_records
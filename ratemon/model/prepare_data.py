@@ -17,73 +17,94 @@ from os import path
 
 import numpy as np
 
-from ratemon.model import cl_args, defaults, features, models, utils
+from ratemon.model import cl_args, defaults, feature_store, features, models, utils
 
 SPLIT_NAMES = ["train", "val", "test"]
 
 
 class Split:
-    """Represents either the training, validation, or test split."""
+    """Represents either the training, validation, or test split.
+
+    A Split is written to disk incrementally, one experiment at a time. To shuffle
+    a Split without holding it in memory, its rows are divided into chunks of at
+    most chunk_pkts rows. Each new packet is sent to a random chunk, weighted by
+    the free space in that chunk, and then each chunk is shuffled on its own in
+    finish(). The result is a uniformly random permutation, and at most one
+    chunk of one feature is ever in memory. If chunk_pkts is None, then the whole
+    Split is one chunk.
+    """
 
     def __init__(
-        self, name, split_frac, sample_frac, out_dir, dtype, num_pkts_tot, shuffle
+        self,
+        name,
+        split_frac,
+        sample_frac,
+        out_dir,
+        dtype,
+        num_pkts_tot,
+        shuffle,
+        chunk_pkts=None,
     ):
         self.name = name
         self.frac = split_frac * sample_frac
         self.shuffle = shuffle
         self.fets = [name for name, typ in dtype]
+        self.rng = np.random.default_rng()
 
         flp = utils.get_split_data_flp(out_dir, name)
         if split_exists(out_dir, name):
             raise RuntimeError(f"Split already exists: {flp}")
+
+        num_pkts = math.ceil(num_pkts_tot * self.frac)
+        # Without shuffling, packets are written in order, so there is no need for
+        # more than one chunk.
+        num_chunks = (
+            1
+            if chunk_pkts is None or not self.shuffle
+            else max(1, math.ceil(num_pkts / chunk_pkts))
+        )
+        # The bounds of each chunk. Chunk i spans [bounds[i], bounds[i + 1]).
+        self.chunk_bounds = np.linspace(0, num_pkts, num_chunks + 1).astype("int64")
+        # The next available index in each chunk.
+        self.chunk_idxs = self.chunk_bounds[:-1].copy()
         logging.info(
             '\tInitializing split "%s" (%f%%, sampling %f%%%s) at: %s',
             self.name,
             split_frac * 100,
             sample_frac * 100,
-            ", shuffled" if self.shuffle else "",
+            (
+                f", shuffled in {num_chunks} chunk{'s' if num_chunks > 1 else ''}"
+                if self.shuffle
+                else ""
+            ),
             flp,
         )
 
-        num_pkts = math.ceil(num_pkts_tot * self.frac)
-        # The next available index in self.dat.
-        self.idx = 0
-        # # List of all available indices in this split. This set is
-        # # reduced as the split is populated.
-        # self.dat_available_idxs = set(range(num_pkts))
-
         # Save this Split's metadata so that its data file can be read later.
         utils.save_split_metadata(out_dir, self.name, dat=(num_pkts, dtype))
 
+        # Create an empty feature store for each split, with one memory-mapped
+        # file per feature. Features values that cannot be computed are replaced
+        # with -1. When reading the splits later, we can detect incomplete
+        # feature values by looking for -1s.
+        self.dat = feature_store.create(flp, dtype, num_pkts)
+        self.num_pkts = num_pkts
         # Track where this Split has been finalized, in which case it cannot have
         # methods called on it.
         if num_pkts == 0:
             logging.info("Skipping split %s because it will select no packets.", name)
             self.finished = True
-
-            # Create an empty file and save it. We need to handle the empty case
-            # separately because we cannot memmap an empty file.
-            self.dat = np.empty((0,), dtype=dtype)
-            np.save(flp, self.dat)
         else:
             self.finished = False
 
-            # Create an empty file for each split. Features values that cannot
-            # be computed are replaced with -1. When reading the splits later,
-            # we can detect incomplete feature values by looking for -1s.
-            self.dat = np.memmap(flp, dtype=dtype, mode="w+", shape=(num_pkts,))
-
     def take(self, exp_dat, exp_available_idxs):
         """Bring additional samples into this Split.
 
-        Takes this Split's specified fraction of data from exp_dat,
-        choosing from exp_available_idxs. Removes the chosen indices from
-        exp_available_idxs and returns the modified version.
+        Takes this Split's specified fraction of data from exp_dat, choosing from
+        exp_available_idxs, which must be in random order. Returns the indices
+        that were not chosen.
         """
         assert not self.finished, "Trying to call a method on a finished Split."
-        if self.dat is None:
-            # This split is not supposed to select any packets.
-            return exp_available_idxs
 
         num_exp_pkts = exp_dat.shape[0]
         num_new = math.floor(num_exp_pkts * self.frac)
@@ -95,23 +116,40 @@ class Split:
         assert num_new > 0 or self.frac == 0, (
             f"Selecting 0 of {num_exp_pkts} packets, but fraction is: " f"{self.frac}"
         )
-        # Randomly select the packets to pull into this split. This must be
-        # random to capture a diverse set of situations.
-        exp_new_idxs = random.sample(exp_available_idxs, num_new)
-        exp_available_idxs -= set(exp_new_idxs)
-
-        # Identify the indices in the merged array.
-        start_idx = self.idx
-        self.idx += num_new
-        assert self.idx <= self.dat.shape[0], (
-            f'Index {self.idx} into "{self.name}" split does not fit '
-            f"within shape {self.dat.shape}"
+        # Select the packets to pull into this split. This must be random to
+        # capture a diverse set of situations. Since exp_available_idxs is in
+        # random order, its prefix is a random sample.
+        exp_new_idxs = exp_available_idxs[:num_new]
+
+        # Divide the new packets between the chunks. Drawing without replacement
+        # from the free space in the chunks means that every free slot is equally
+        # likely to receive each packet.
+        chunk_free = self.chunk_bounds[1:] - self.chunk_idxs
+        assert num_new <= chunk_free.sum(), (
+            f'Taking {num_new} packets into "{self.name}" split does not fit '
+            f"within shape {(self.num_pkts,)}"
         )
-        # dat_new_idxs = list(range(start_idx, self.idx))
-
-        self.dat[start_idx : self.idx] = exp_dat[exp_new_idxs]
-        # self.dat_available_idxs -= set(dat_new_idxs)
-        return exp_available_idxs
+        chunk_nums = (
+            self.rng.multivariate_hypergeometric(chunk_free, num_new)
+            if len(chunk_free) > 1
+            else np.array([num_new])
+        )
+        # Because exp_new_idxs is in random order, consecutive runs of it are
+        # random too.
+        exp_offsets = np.concatenate(([0], np.cumsum(chunk_nums)))
+        for chunk, chunk_num in enumerate(chunk_nums):
+            if chunk_num == 0:
+                continue
+            start_idx = self.chunk_idxs[chunk]
+            self.chunk_idxs[chunk] += chunk_num
+            chunk_exp_idxs = np.sort(
+                exp_new_idxs[exp_offsets[chunk] : exp_offsets[chunk + 1]]
+            )
+            for fet in self.fets:
+                self.dat[fet][start_idx : start_idx + chunk_num] = exp_dat[fet][
+                    chunk_exp_idxs
+                ]
+        return exp_available_idxs[num_new:]
 
     def finish(self):
         """Finalize this split, and maybe shuffle it.
@@ -120,29 +158,34 @@ class Split:
         """
         if self.finished:
             return
-
         self.finished = True
-        if self.dat is None:
-            # This split does not contain any packets.
-            return
 
         # Mark any unused indices as invalid by filling their values with -1.
-        # self.dat[list(self.dat_available_idxs)].fill(-1)
-        self.dat[self.idx :].fill(-1)
+        for col in self.dat.values():
+            for chunk_idx, chunk_end in zip(self.chunk_idxs, self.chunk_bounds[1:]):
+                col[chunk_idx:chunk_end].fill(-1)
 
         # Shuffle in-place at the end. This is only okay because I plan to
-        # always store the output in a tmpfs.
+        # always store the output in a tmpfs. All columns must be shuffled using
+        # the same permutation. Shuffle one chunk of one column at a time so that
+        # only that piece needs to be in memory at once.
         if self.shuffle:
             logging.info('Shuffling split "%s"...', self.name)
             tim_srt_s = time.time()
-            np.random.default_rng().shuffle(self.dat)
+            for chunk_start, chunk_end in zip(
+                self.chunk_bounds[:-1], self.chunk_bounds[1:]
+            ):
+                perm = self.rng.permutation(chunk_end - chunk_start)
+                for col in self.dat.values():
+                    col[chunk_start:chunk_end] = col[chunk_start:chunk_end][perm]
             logging.info(
                 'Done shuffling split "%s" (took %0.2f seconds)',
                 self.name,
                 time.time() - tim_srt_s,
             )
 
-        self.dat.flush()
+        for col in self.dat.values():
+            col.flush()
 
 
 def survey(exp_flps, warmup_frac):
@@ -167,7 +210,7 @@ def survey(exp_flps, warmup_frac):
     #         )
     #     ]
     num_exps_original = len(exp_flps)
-    exp_headers = [(exp_flp, utils.get_npz_headers(exp_flp)) for exp_flp in exp_flps]
+    exp_headers = [(exp_flp, utils.get_exp_headers(exp_flp)) for exp_flp in exp_flps]
     # Remove experiments whose headers could not be read.
     exp_headers = [(exp_flp, headers) for exp_flp, headers in exp_headers if headers]
     # Extract the filepaths of the experiments whose headers could be read. This
@@ -208,12 +251,24 @@ def survey(exp_flps, warmup_frac):
     return exp_flps, num_pkts, dtype
 
 
-def merge(exp_flps, out_dir, num_pkts, dtype, split_fracs, warmup_frac, sample_frac):
+def merge(
+    exp_flps,
+    out_dir,
+    num_pkts,
+    dtype,
+    split_fracs,
+    warmup_frac,
+    sample_frac,
+    chunk_pkts=None,
+):
     """Merge the provided experiments into training, validation, and test splits.
 
     Uses the defined by the percents in split_fracs. Stores the resulting files
     in out_dir. The experiments contain a total of num_pkts packets and have the
-    provided dtype.
+    provided dtype. Experiments are loaded one at a time, and each split takes its
+    fraction of every experiment (i.e., sampling is stratified by experiment). If
+    chunk_pkts is not None, then splits are shuffled in chunks of at most that many
+    packets, which bounds memory usage (see Split).
     """
     logging.info("Preparing split files...")
     splits = {
@@ -227,6 +282,7 @@ def merge(exp_flps, out_dir, num_pkts, dtype, split_fracs, warmup_frac, sample_f
             # Shuffle all splits so that later attempts to select a range of packets
             # from the beginning are random.
             shuffle=True,
+            chunk_pkts=chunk_pkts,
         )
         for name, split_frac in split_fracs.items()
     }
@@ -236,34 +292,26 @@ def merge(exp_flps, out_dir, num_pkts, dtype, split_fracs, warmup_frac, sample_f
     num_exps = len(exp_flps)
     dtype_names = [name for name, typ in dtype]
     for idx, exp_flp in enumerate(exp_flps):
+        # Select only the features that the model requires, and remove a
+        # percentage of packets from the beginning of each flow. For feature
+        # stores, the remaining features and packets are never read.
         exp, dat = utils.load_exp(
-            exp_flp, msg=f"{idx + 1:{f'0{len(str(num_exps))}'}}/{num_exps}"
+            exp_flp,
+            msg=f"{idx + 1:{f'0{len(str(num_exps))}'}}/{num_exps}",
+            fets=dtype_names,
+            warmup_frac=warmup_frac,
         )
         if dat is None:
             logging.info("\tError loading %s", exp_flp)
             continue
 
         # Combine flows.
-        dat_combined = None
-        for flw in range(exp.tot_flws):
-            dat_flw = dat[flw]
-            if warmup_frac != 0:
-                # Remove a percentage of packets from the beginning of the
-                # experiment.
-                dat_flw = dat_flw[math.floor(dat_flw.shape[0] * warmup_frac) :]
-            if dat_combined is None:
-                dat_combined = dat_flw
-            else:
-                dat_combined = np.concatenate((dat_combined, dat_flw))
-        assert dat_combined is not None
-        dat = dat_combined
-
-        # Select only the features that the model requires.
-        dat = dat[dtype_names]
-
-        # Start with the list of all indices. Each split selects some
-        # indices for itself, then removes them from this set.
-        all_idxs = set(range(dat.shape[0]))
+        assert len(dat) == exp.tot_flws
+        dat = np.concatenate(dat)
+
+        # Start with all indices, in random order. Each split selects some
+        # indices for itself, then removes them.
+        all_idxs = np.random.default_rng().permutation(dat.shape[0])
         # For each split, take a fraction of the experiment packets.
         for split in splits.values():
             if not split.finished:
@@ -300,9 +348,10 @@ def splits_exist(out_dir):
 
 def split_exists(out_dir, split_name):
     """Check if a particular split exists in out_dir."""
-    return path.exists(utils.get_split_data_flp(out_dir, split_name)) and path.exists(
-        utils.get_split_metadata_flp(out_dir, split_name)
-    )
+    return (
+        path.exists(utils.get_split_data_flp(out_dir, split_name))
+        or path.exists(utils.get_split_legacy_data_flp(out_dir, split_name))
+    ) and path.exists(utils.get_split_metadata_flp(out_dir, split_name))
 
 
 def parse_args():
@@ -359,10 +408,24 @@ def parse_args():
             "not signify an error or need to be regenerated."
         ),
     )
+    psr.add_argument(
+        "--chunk-pkts",
+        help=(
+            "Out-of-core mode. If set, shuffle each split in chunks of at most this "
+            "many packets instead of all at once, so that memory usage is bounded "
+            "by the chunk size instead of the split size. The result is still a "
+            "uniform shuffle."
+        ),
+        required=False,
+        type=int,
+    )
     psr, psr_verify = cl_args.add_sample_percent(
         *cl_args.add_out(*cl_args.add_warmup(*cl_args.add_num_exps(psr)))
     )
     args = psr_verify(psr.parse_args())
+    assert (
+        args.chunk_pkts is None or args.chunk_pkts > 0
+    ), f'"chunk-pkts" must be positive, but is: {args.chunk_pkts}'
 
     split_fracs = {
         "train": args.train_split / 100,
@@ -396,7 +459,8 @@ def _main():
     exp_flps = [
         path.join(exps_dir, fln)
         for fln in os.listdir(exps_dir)
-        if not fln.startswith(defaults.DATA_PREFIX) and fln.endswith(".npz")
+        if not fln.startswith(defaults.DATA_PREFIX)
+        and (fln.endswith(".npz") or fln.endswith(feature_store.STORE_EXT))
     ]
 
     random.shuffle(exp_flps)
@@ -524,7 +588,14 @@ def do_prepare(args, split_fracs, exp_flps, dtype_guess=None):
 
     # Create the merged training, validation, and test files.
     merge(
-        exp_flps, args.out_dir, num_pkts, dtype, split_fracs, warmup_frac, sample_frac
+        exp_flps,
+        args.out_dir,
+        num_pkts,
+        dtype,
+        split_fracs,
+        warmup_frac,
+        sample_frac,
+        args.chunk_pkts,
     )
 
     return dtype
@@ -62,7 +62,7 @@ class TestGeneral(unittest.TestCase):
         ]
 
         # Check if output files are in parsed_experiments
-        assert os.path.exists(PARSED_EXPERIMENTS + f"{exp_name}.npz")
+        assert os.path.exists(PARSED_EXPERIMENTS + f"{exp_name}.fets")
         # Remove files
         shutil.rmtree(PARSED_EXPERIMENTS)
 
@@ -26,7 +26,7 @@ from matplotlib import pyplot as plt
 from scipy import cluster, stats
 from sklearn import ensemble, feature_selection, inspection
 
-from ratemon.model import defaults, features
+from ratemon.model import defaults, feature_store, features, pcap_parser
 
 # Values considered unsafe for division and min().
 UNSAFE = {-1, 0, float("inf"), float("NaN")}
@@ -257,6 +257,11 @@ class Exp:
             toks[-1] = toks[-1][:-4]
             # Update sim.name.
             self.name = self.name[:-4]
+        elif sim.endswith(feature_store.STORE_EXT):
+            # Remove the feature store suffix from the last token.
+            toks[-1] = toks[-1][: -len(feature_store.STORE_EXT)]
+            # Update sim.name.
+            self.name = self.name[: -len(feature_store.STORE_EXT)]
 
         # unfair-pcc-cubic-8bw-30rtt-64q-1pcc-1cubic-0bitrate-0bitrate-35.60ping-unfairTrue-bessTrue-100s-20201118T114242
 
@@ -515,7 +520,7 @@ def make_empty(num_pkts, dtype):
     return np.full((num_pkts,), -1, dtype=dtype)
 
 
-def parse_packets(flp, flw_to_cca, local_ip, select_tail_percent=None):
+def parse_packets(flp, flw_to_cca, local_ip, select_tail_percent=None, fast=True):
     """Parse a PCAP file.
 
     local_ip is a string IPv4 address of the interface on which the PCAP trace
@@ -533,7 +538,19 @@ def parse_packets(flp, flw_to_cca, local_ip, select_tail_percent=None):
          (sequence number, timestamp (us),
           TCP timestamp option TSval, TCP timestamp option TSecr,
           TCP payload size (B), total packet size (B))
+
+    If fast is True, then the PCAP is parsed by pcap_parser.parse_packets(), which
+    is equivalent but much faster.
     """
+    if fast:
+        return pcap_parser.parse_packets(
+            flp,
+            flw_to_cca.keys(),
+            local_ip,
+            select_tail_percent,
+            ccas=list(flw_to_cca.values()),
+        )
+
     logging.info("\tParsing PCAP: %s", flp)
 
     # Use list() to read the pcap file all at once (minimize seeks).
@@ -815,10 +832,36 @@ def scale_all(dat, scl_prms, min_out, max_out, standardize):
     return new
 
 
-def load_exp(flp, msg=None):
-    """Load one experiment results file (as generated by gen_features.py)."""
+def load_exp(flp, msg=None, fets=None, warmup_frac=0):
+    """Load one experiment results file (as generated by gen_features.py).
+
+    The file may be either a feature store or an .npz file. Optionally select only
+    the features in fets and drop the first warmup_frac of each flow's packets. For
+    feature stores, only the selected features and packets are read from disk.
+    """
     logging.info("%sParsing: %s", "" if msg is None else f"{msg} - ", flp)
     exp = Exp(flp)
+    if feature_store.is_store(flp):
+        headers = feature_store.get_headers(flp)
+        if not headers:
+            return exp, None
+        if len(headers) != exp.tot_flws:
+            logging.info(
+                "\tThe number of flows in the store (%s) does not match the number "
+                "of flows (%s): %s",
+                len(headers),
+                exp.tot_flws,
+                flp,
+            )
+            return exp, None
+        return exp, feature_store.load(
+            flp,
+            fets,
+            [
+                slice(math.floor(shape[0] * warmup_frac), None)
+                for _, shape, _ in headers
+            ],
+        )
     try:
         with np.load(flp, allow_pickle=True) as fil:
             num_files = len(fil.files)
@@ -837,6 +880,13 @@ def load_exp(flp, msg=None):
     except zipfile.BadZipFile:
         logging.info("Bad simulation file: %s", flp)
         dat = None
+    if dat is not None:
+        dat = [
+            flw_dat[math.floor(flw_dat.shape[0] * warmup_frac) :]
+            for flw_dat in dat
+        ]
+        if fets is not None:
+            dat = [flw_dat[fets] for flw_dat in dat]
     return exp, dat
 
 
@@ -1266,6 +1316,17 @@ def get_npz_headers(flp):
         return []
 
 
+def get_exp_headers(flp):
+    """Parse the headers of an experiment file.
+
+    The file may be either a feature store or an .npz file. See get_npz_headers()
+    for the return format.
+    """
+    if feature_store.is_store(flp):
+        return feature_store.get_headers(flp)
+    return get_npz_headers(flp)
+
+
 def set_rand_seed(seed=defaults.SEED):
     """Set the Python, numpy, and Torch random seeds to seed."""
     random.seed(seed)
@@ -1299,8 +1360,14 @@ def get_split_data_flp(split_dir, name):
     """Return the path to the data for a Split.
 
     The Split has the provided name and stores its data in the provided
-    directory.
+    directory. Splits are stored as feature stores. Older splits may instead be
+    stored as a single row-major .npy file (see get_split_legacy_data_flp()).
     """
+    return path.join(split_dir, f"{name}{feature_store.STORE_EXT}")
+
+
+def get_split_legacy_data_flp(split_dir, name):
+    """Return the path to the row-major data for a Split."""
     return path.join(split_dir, f"{name}.npy")
 
 
@@ -1352,27 +1419,51 @@ def load_scl_prms(out_dir):
         return json.load(fil)
 
 
-def load_split(split_dir, name):
-    """Load a training, validation, and test Split's raw data from disk."""
+def load_split(split_dir, name, fets=None, num_pkts=None):
+    """Load a training, validation, and test Split's raw data from disk.
+
+    Optionally select only the features in fets and the first num_pkts packets. For
+    Splits stored as feature stores, only the selected data is read from disk.
+    """
     logging.info("Loading split data: %s", name)
-    num_pkts, dtype = load_split_metadata(split_dir, name)
+    num_pkts_tot, dtype = load_split_metadata(split_dir, name)
+    num_pkts = num_pkts_tot if num_pkts is None else min(num_pkts, num_pkts_tot)
+    if fets is not None:
+        dtype = [field for field in dtype if field[0] in fets]
     if num_pkts == 0:
         # If the number of packets in this split is 0, then we will not find the
         # split on disk (because it is impossible to create a memory-mapped
         # numpy ndarray of size 0). Therefore, just return a new empty numpy
         # ndarray.
         return np.zeros((num_pkts,), dtype=dtype)
-    return np.memmap(
-        get_split_data_flp(split_dir, name), dtype=dtype, mode="r", shape=(num_pkts,)
-    )
+    store_dir = get_split_data_flp(split_dir, name)
+    if feature_store.is_store(store_dir):
+        return feature_store.load(
+            store_dir, [name for name, _ in dtype], [slice(num_pkts)]
+        )[0]
+    dat = np.memmap(
+        get_split_legacy_data_flp(split_dir, name),
+        dtype=load_split_metadata(split_dir, name)[1],
+        mode="r",
+        shape=(num_pkts_tot,),
+    )[:num_pkts]
+    return dat if fets is None else dat[[name for name, _ in dtype]]
+
+
+def list_subsplits(split_dir, prefix):
+    """Return the names of the Splits that begin with prefix."""
+    return [
+        fil.split("_metadata.")[0]
+        for fil in os.listdir(split_dir)
+        if fil.startswith(prefix) and fil.endswith(".pickle")
+    ]
 
 
-def load_subsplits(split_dir, prefix):
+def load_subsplits(split_dir, prefix, fets=None):
     """Load and return Splits that begin with prefix."""
     subsplits = [
-        (fil, load_split(split_dir, fil.split("_metadata.")[0]))
-        for fil in os.listdir(split_dir)
-        if fil.startswith(prefix) and fil.endswith(".pickle")
+        (name, load_split(split_dir, name, fets))
+        for name in list_subsplits(split_dir, prefix)
     ]
     assert subsplits, f'No subsplits found with prefix "{prefix}" in: {split_dir}'
     return subsplits
@@ -1635,6 +1726,12 @@ def zip_timeseries(xs, ys):
     for idx in range(len(xs)):
         assert xs[idx].shape[0] == ys[idx].shape[0]
 
+    if all((np.diff(xs_) >= 0).all() for xs_ in xs):
+        # Merging sorted timeseries is the same as a stable sort of their
+        # concatenation. Ties go to the earlier timeseries.
+        order = np.argsort(np.concatenate(xs), kind="stable")
+        return np.concatenate(xs)[order], np.concatenate(ys)[order]
+
     idxs = [0] * len(xs)
     tot = sum(xs_.shape[0] for xs_ in xs)
     xs_o = np.full((tot,), -1, dtype=xs[0].dtype)
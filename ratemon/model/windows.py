@@ -0,0 +1,194 @@
+"""Vectorized kernels for windowed features.
+
+Windowed features (see features.WINDOWED_FETS) are aggregates over a window that ends
+at a packet and extends backwards in time by a multiple of the minimum RTT. Rather
+than walking each window's start forward one packet at a time with
+utils.find_bound() and re-reducing the window for every packet, these kernels find
+the window start of every packet, for all window sizes, in one pass, and then
+evaluate window aggregates using prefix sums. All window aggregates treat -1 as
+unknown, in the same way as the scalar utils.safe_*() functions.
+"""
+
+import numpy as np
+
+from ratemon.model import defaults, features, utils
+
+
+def start_idxs(vals, targets, max_idxs, valid=None):
+    """Find the window start index of every packet.
+
+    Equivalent to iterating over the packets in order and calling:
+        bound = utils.find_bound(vals, target, bound, max_idx, which="after")
+    where bound starts at 0 and is only updated for packets where valid is True.
+
+    targets has shape (number of windows, number of packets), or (number of
+    packets,) for a single window. max_idxs has one entry per packet and must be
+    monotonically increasing. vals must be monotonically increasing. If vals is not
+    sorted or contains unknown values (-1), then this falls back to calling
+    utils.find_bound() for each packet.
+
+    Returns an array of the same shape as targets.
+    """
+    targets = np.asarray(targets, dtype="float64")
+    single = targets.ndim == 1
+    targets = np.atleast_2d(targets)
+    max_idxs = np.asarray(max_idxs, dtype="int64")
+    if valid is None:
+        valid = np.ones(targets.shape[1], dtype=bool)
+
+    if (vals == -1).any() or (np.diff(vals) < 0).any():
+        bounds = np.zeros(targets.shape, dtype="int64")
+        for win_targets, win_bounds in zip(targets, bounds):
+            bound = 0
+            for j, target in enumerate(win_targets):
+                if valid[j]:
+                    bound = utils.find_bound(
+                        vals, target, min_idx=bound, max_idx=max_idxs[j], which="after"
+                    )
+                win_bounds[j] = bound
+        return bounds[0] if single else bounds
+
+    # Because vals is sorted, the first value that is not before each target is a
+    # binary search away. find_bound() stops one short of max_idx and never moves the
+    # bound backwards, so the result is the running max of the clipped search
+    # results. Packets that are not valid do not move the bound.
+    bounds = np.searchsorted(vals, targets, side="left")
+    np.minimum(bounds, max_idxs - 1, out=bounds)
+    bounds[:, ~valid] = 0
+    np.maximum.accumulate(bounds, axis=1, out=bounds)
+    np.maximum(bounds, 0, out=bounds)
+    return bounds[0] if single else bounds
+
+
+class PrefixSums:
+    """Prefix sums over the known (not -1) values of a column.
+
+    Each query takes arrays of inclusive start and end indices and evaluates all of
+    the windows at once.
+    """
+
+    def __init__(self, dat):
+        known = dat != -1
+        self.sums = np.zeros((len(dat) + 1,), dtype="float64")
+        np.cumsum(np.where(known, dat, 0), dtype="float64", out=self.sums[1:])
+        self.counts = np.zeros((len(dat) + 1,), dtype="int64")
+        np.cumsum(known, out=self.counts[1:])
+
+    def _window(self, start_idxs, end_idxs):
+        # Empty windows (start after end) have no known values.
+        end_idxs = np.maximum(end_idxs, start_idxs - 1) + 1
+        return (
+            self.sums[end_idxs] - self.sums[start_idxs],
+            self.counts[end_idxs] - self.counts[start_idxs],
+        )
+
+    def sum(self, start_idxs, end_idxs):
+        """Vectorized utils.safe_sum()."""
+        sums, counts = self._window(start_idxs, end_idxs)
+        return np.where(counts == 0, -1, sums)
+
+    def mean(self, start_idxs, end_idxs):
+        """Vectorized utils.safe_mean()."""
+        sums, counts = self._window(start_idxs, end_idxs)
+        with np.errstate(divide="ignore", invalid="ignore"):
+            return np.where(counts == 0, -1, sums / counts)
+
+
+class SparseTable:
+    """Sparse table for window min and max queries over the known values of a column.
+
+    Building takes O(n log n) time and space. Each query is O(1) per window.
+    """
+
+    def __init__(self, dat):
+        known = dat != -1
+        self.mins = [np.where(known, dat, np.inf).astype("float64")]
+        self.maxs = [np.where(known, dat, -np.inf).astype("float64")]
+        span = 1
+        while 2 * span <= len(dat):
+            self.mins.append(np.minimum(self.mins[-1][:-span], self.mins[-1][span:]))
+            self.maxs.append(np.maximum(self.maxs[-1][:-span], self.maxs[-1][span:]))
+            span *= 2
+
+    def _query(self, levels, reduce, start_idxs, end_idxs):
+        lens = np.maximum(end_idxs - start_idxs + 1, 1)
+        lvls = np.floor(np.log2(lens)).astype("int64")
+        out = np.full(lens.shape, -1, dtype="float64")
+        for lvl in np.unique(lvls):
+            sel = lvls == lvl
+            out[sel] = reduce(
+                levels[lvl][start_idxs[sel]],
+                levels[lvl][end_idxs[sel] - (1 << lvl) + 1],
+            )
+        # Windows that are empty or contain no known values are unknown.
+        out[(end_idxs < start_idxs) | ~np.isfinite(out)] = -1
+        return out
+
+    def min(self, start_idxs, end_idxs):
+        """Vectorized utils.safe_min_win()."""
+        return self._query(self.mins, np.minimum, start_idxs, end_idxs)
+
+    def max(self, start_idxs, end_idxs):
+        """Vectorized utils.safe_max_win()."""
+        return self._query(self.maxs, np.maximum, start_idxs, end_idxs)
+
+
+def _unsafe(vals):
+    """Return a mask of the values that are in utils.UNSAFE."""
+    return (vals == -1) | (vals == 0) | ~np.isfinite(vals)
+
+
+def safe_sub(vals1, vals2):
+    """Vectorized utils.safe_sub()."""
+    return np.where((vals1 == -1) | (vals2 == -1), -1, vals1 - vals2)
+
+
+def safe_mul(vals1, vals2):
+    """Vectorized utils.safe_mul()."""
+    return np.where((vals1 == -1) | (vals2 == -1), -1, vals1 * vals2)
+
+
+def safe_div(nums, dens):
+    """Vectorized utils.safe_div()."""
+    nums, dens = np.broadcast_arrays(nums, dens)
+    bad = (nums == -1) | _unsafe(dens)
+    out = np.full(nums.shape, -1, dtype="float64")
+    np.divide(nums, dens, out=out, where=~bad)
+    return out
+
+
+def safe_sqrt(vals):
+    """Vectorized utils.safe_sqrt().
+
+    Negative values (other than -1) are unknown instead of raising an error.
+    """
+    out = np.full(np.shape(vals), -1, dtype="float64")
+    np.sqrt(vals, out=out, where=vals >= 0)
+    return out
+
+
+def safe_tput_bps(arr_times_us, wirelens, start_idxs, end_idxs):
+    """Vectorized utils.safe_tput_bps().
+
+    wirelens is a PrefixSums over the packets' wire lengths.
+    """
+    return safe_div(
+        safe_mul(wirelens.sum(start_idxs + 1, end_idxs), 8),
+        safe_div(safe_sub(arr_times_us[end_idxs], arr_times_us[start_idxs]), 1e6),
+    )
+
+
+def safe_mathis_tput_bps(mss_bytes, rtt_us, loss_rate):
+    """Vectorized utils.safe_mathis_tput_bps()."""
+    return safe_mul(
+        safe_div(safe_mul(8, mss_bytes), safe_div(rtt_us, 1e6)),
+        safe_div(defaults.MATHIS_C, safe_sqrt(loss_rate)),
+    )
+
+
+def win_sizes_us(min_rtts_us):
+    """Return the size of every window (rows) for every packet (columns)."""
+    return np.outer(
+        np.array(features.WINDOWS, dtype="float64"),
+        np.asarray(min_rtts_us, dtype="float64"),
+    )
@@ -0,0 +1,26 @@
+#pragma once
+
+#ifndef __RATEMON_BENCH_COMMON_H
+#define __RATEMON_BENCH_COMMON_H
+
+#include <stdint.h>
+#include <time.h>
+
+// Wire protocol shared by bench_sender and bench_receiver. Each transfer is a
+// header containing the payload length as a 64-bit big-endian integer, followed
+// by the payload. After reading the whole payload, the receiver replies with a
+// single byte, which lets the sender measure the transfer's completion time.
+#define RM_BENCH_HDR_B 8
+#define RM_BENCH_ACK_B 1
+// Size of the buffers used to send and receive payloads.
+#define RM_BENCH_BUF_B (1 << 16)
+// Default port on which bench_receiver listens.
+#define RM_BENCH_PORT 9000
+
+static inline uint64_t rm_bench_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+#endif /* __RATEMON_BENCH_COMMON_H */
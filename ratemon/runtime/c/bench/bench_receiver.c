@@ -0,0 +1,215 @@
+// Receiver for the netns benchmark (see netns_bench.py).
+//
+// Accepts connections from bench_sender with accept(), so that when it is run
+// with LD_PRELOAD=libratemon_interp.so every connection is registered for
+// scheduled RWND tuning, and drains transfers using one epoll loop. Runs until
+// SIGINT or SIGTERM.
+//
+// Writes one CSV line per connection to --out when the connection closes (or
+// when the receiver exits):
+//     remote port, bytes received, first data time (ns), last data time (ns)
+// Times are CLOCK_MONOTONIC.
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "bench_common.h"
+
+// Max number of connections.
+#define MAX_CONNS 65536
+#define MAX_EVENTS 256
+
+struct conn {
+  bool open;
+  unsigned short remote_port;
+  // Bytes of the current transfer's header that have been read.
+  unsigned int hdr_read;
+  unsigned char hdr[RM_BENCH_HDR_B];
+  // Bytes of the current transfer's payload that are left to read.
+  uint64_t left;
+  uint64_t bytes;
+  uint64_t first_ns;
+  uint64_t last_ns;
+};
+
+static volatile sig_atomic_t run = 1;
+static struct conn conns[MAX_CONNS];
+static FILE *out;
+
+static void stop_handler(int signum) {
+  (void)signum;
+  run = 0;
+}
+
+static void close_conn(int epfd, int fd) {
+  struct conn *c = &conns[fd];
+  fprintf(out, "%u,%lu,%lu,%lu\n", c->remote_port, c->bytes, c->first_ns,
+          c->last_ns);
+  fflush(out);
+  epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+  close(fd);
+  c->open = false;
+}
+
+// Consume received bytes, replying to each completed transfer.
+static bool consume(int fd, struct conn *c, const unsigned char *buf,
+                    size_t len) {
+  while (len > 0) {
+    if (c->hdr_read < RM_BENCH_HDR_B) {
+      size_t n = RM_BENCH_HDR_B - c->hdr_read;
+      n = n < len ? n : len;
+      memcpy(c->hdr + c->hdr_read, buf, n);
+      c->hdr_read += n;
+      buf += n;
+      len -= n;
+      if (c->hdr_read < RM_BENCH_HDR_B)
+        break;
+      c->left = 0;
+      for (int i = 0; i < RM_BENCH_HDR_B; ++i)
+        c->left = (c->left << 8) | c->hdr[i];
+    }
+    size_t n = c->left < len ? (size_t)c->left : len;
+    c->left -= n;
+    buf += n;
+    len -= n;
+    if (c->left == 0) {
+      // Transfer complete. Acknowledge it and start reading the next header.
+      c->hdr_read = 0;
+      char ack = 0;
+      if (send(fd, &ack, RM_BENCH_ACK_B, MSG_NOSIGNAL) != RM_BENCH_ACK_B)
+        return false;
+    }
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  unsigned short port = RM_BENCH_PORT;
+  const char *out_flp = NULL;
+  static const struct option opts[] = {{"port", required_argument, NULL, 'p'},
+                                       {"out", required_argument, NULL, 'w'},
+                                       {NULL, 0, NULL, 0}};
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+    switch (opt) {
+    case 'p':
+      port = (unsigned short)atoi(optarg);
+      break;
+    case 'w':
+      out_flp = optarg;
+      break;
+    default:
+      printf("Usage: %s [--port P] [--out FILE]\n", argv[0]);
+      return 1;
+    }
+  }
+  out = out_flp == NULL ? stdout : fopen(out_flp, "w");
+  if (out == NULL) {
+    printf("ERROR: failed to open output file: %s\n", out_flp);
+    return 1;
+  }
+
+  // Do not use SA_RESTART, so that epoll_wait() returns when signalled.
+  struct sigaction action = {.sa_handler = stop_handler};
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+
+  int lfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (lfd == -1) {
+    printf("ERROR: failed to create socket\n");
+    return 1;
+  }
+  setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int));
+  struct sockaddr_in addr = {.sin_family = AF_INET,
+                             .sin_port = htons(port),
+                             .sin_addr.s_addr = INADDR_ANY};
+  if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(lfd, 4096) == -1) {
+    printf("ERROR: failed to listen on port %u: %s\n", port, strerror(errno));
+    return 1;
+  }
+  int epfd = epoll_create1(0);
+  struct epoll_event ev = {.events = EPOLLIN, .data.fd = lfd};
+  epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev);
+  printf("INFO: listening on port %u\n", port);
+  fflush(stdout);
+
+  static unsigned char buf[RM_BENCH_BUF_B];
+  struct epoll_event events[MAX_EVENTS];
+  while (run) {
+    int num = epoll_wait(epfd, events, MAX_EVENTS, 100);
+    for (int i = 0; i < num; ++i) {
+      int fd = events[i].data.fd;
+      if (fd == lfd) {
+        // Use accept() rather than accept4() because that is the function
+        // that libratemon_interp interposes on.
+        struct sockaddr_in remote;
+        socklen_t remote_len = sizeof(remote);
+        int cfd;
+        while ((cfd = accept(lfd, (struct sockaddr *)&remote, &remote_len)) !=
+               -1) {
+          if (cfd >= MAX_CONNS) {
+            printf("ERROR: too many connections\n");
+            close(cfd);
+            continue;
+          }
+          fcntl(cfd, F_SETFL, fcntl(cfd, F_GETFL) | O_NONBLOCK);
+          conns[cfd] = (struct conn){.open = true,
+                                     .remote_port = ntohs(remote.sin_port)};
+          struct epoll_event cev = {.events = EPOLLIN | EPOLLRDHUP,
+                                    .data.fd = cfd};
+          epoll_ctl(epfd, EPOLL_CTL_ADD, cfd, &cev);
+          remote_len = sizeof(remote);
+        }
+        continue;
+      }
+      struct conn *c = &conns[fd];
+      bool keep = true;
+      for (;;) {
+        ssize_t ret = recv(fd, buf, sizeof(buf), 0);
+        if (ret > 0) {
+          uint64_t now_ns = rm_bench_now_ns();
+          if (!c->first_ns)
+            c->first_ns = now_ns;
+          c->last_ns = now_ns;
+          c->bytes += (uint64_t)ret;
+          if (!consume(fd, c, buf, (size_t)ret)) {
+            keep = false;
+            break;
+          }
+          continue;
+        }
+        if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+          break;
+        if (ret == -1 && errno == EINTR)
+          continue;
+        // EOF or error.
+        keep = false;
+        break;
+      }
+      if (!keep)
+        close_conn(epfd, fd);
+    }
+  }
+
+  for (int fd = 0; fd < MAX_CONNS; ++fd)
+    if (conns[fd].open)
+      close_conn(epfd, fd);
+  close(lfd);
+  close(epfd);
+  if (out != stdout)
+    fclose(out);
+  return 0;
+}
@@ -0,0 +1,277 @@
+// Traffic generator for the netns benchmark (see netns_bench.py).
+//
+// Opens one connection per flow to bench_receiver, each from a fixed local port
+// so that the receiver's RM_MONITOR_PORT_START/END range can select them, and
+// repeatedly sends transfers of --size-b bytes separated by --off-ms of idle
+// time until --duration-s elapses. Different traffic patterns are different
+// combinations of these parameters:
+//     bulk:  large transfers, no off time
+//     rpc:   small transfers, no (or a short) off time
+//     onoff: medium transfers, long off time
+//
+// Writes one CSV line per completed transfer to --out:
+//     flow, local port, start time (ns), end time (ns), bytes
+// Times are CLOCK_MONOTONIC, so they are comparable with bench_receiver's.
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "bench_common.h"
+
+struct sender_args {
+  struct in_addr addr;
+  unsigned short port;
+  unsigned short local_port_start;
+  unsigned int flows;
+  uint64_t size_b;
+  unsigned int off_ms;
+  unsigned int duration_s;
+  const char *out;
+};
+
+struct flow_ctx {
+  const struct sender_args *args;
+  unsigned int idx;
+  uint64_t deadline_ns;
+  // Completed transfers, as rows of (start ns, end ns).
+  uint64_t (*rows)[2];
+  size_t num_rows;
+  size_t cap_rows;
+  bool failed;
+};
+
+// Send the whole buffer. Returns false on error or if the deadline passes.
+static bool send_all(int fd, const char *buf, size_t len,
+                     uint64_t deadline_ns) {
+  while (len > 0) {
+    ssize_t ret = send(fd, buf, len, MSG_NOSIGNAL);
+    if (ret == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        // Send timeout. Give up if the run is over.
+        if (rm_bench_now_ns() >= deadline_ns)
+          return false;
+        continue;
+      }
+      return false;
+    }
+    buf += ret;
+    len -= (size_t)ret;
+  }
+  return true;
+}
+
+static bool record(struct flow_ctx *ctx, uint64_t start_ns, uint64_t end_ns) {
+  if (ctx->num_rows == ctx->cap_rows) {
+    size_t cap = ctx->cap_rows ? ctx->cap_rows * 2 : 1024;
+    void *rows = realloc(ctx->rows, cap * sizeof(*ctx->rows));
+    if (rows == NULL)
+      return false;
+    ctx->rows = rows;
+    ctx->cap_rows = cap;
+  }
+  ctx->rows[ctx->num_rows][0] = start_ns;
+  ctx->rows[ctx->num_rows][1] = end_ns;
+  ++ctx->num_rows;
+  return true;
+}
+
+static int connect_flow(const struct sender_args *args, unsigned int idx) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd == -1) {
+    printf("ERROR: flow %u: failed to create socket\n", idx);
+    return -1;
+  }
+  // Allow reusing the local port across back-to-back runs.
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) == -1) {
+    printf("ERROR: flow %u: failed to set SO_REUSEADDR\n", idx);
+    close(fd);
+    return -1;
+  }
+  // Wake up periodically while blocked in send() so that flows that the
+  // receiver has paused still notice the end of the run.
+  struct timeval tv = {.tv_sec = 0, .tv_usec = 100000};
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  if (args->local_port_start) {
+    struct sockaddr_in local = {.sin_family = AF_INET,
+                                .sin_port =
+                                    htons(args->local_port_start + idx),
+                                .sin_addr.s_addr = INADDR_ANY};
+    if (bind(fd, (struct sockaddr *)&local, sizeof(local)) == -1) {
+      printf("ERROR: flow %u: failed to bind to local port %u: %s\n", idx,
+             args->local_port_start + idx, strerror(errno));
+      close(fd);
+      return -1;
+    }
+  }
+  struct sockaddr_in remote = {.sin_family = AF_INET,
+                               .sin_port = htons(args->port),
+                               .sin_addr = args->addr};
+  if (connect(fd, (struct sockaddr *)&remote, sizeof(remote)) == -1) {
+    printf("ERROR: flow %u: failed to connect: %s\n", idx, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void *flow_func(void *arg) {
+  struct flow_ctx *ctx = arg;
+  const struct sender_args *args = ctx->args;
+  static const char payload[RM_BENCH_BUF_B];
+
+  int fd = connect_flow(args, ctx->idx);
+  if (fd == -1) {
+    ctx->failed = true;
+    return NULL;
+  }
+
+  unsigned char hdr[RM_BENCH_HDR_B];
+  for (int i = 0; i < RM_BENCH_HDR_B; ++i)
+    hdr[i] = (unsigned char)(args->size_b >> (8 * (RM_BENCH_HDR_B - 1 - i)));
+
+  while (rm_bench_now_ns() < ctx->deadline_ns) {
+    uint64_t start_ns = rm_bench_now_ns();
+    if (!send_all(fd, (const char *)hdr, sizeof(hdr), ctx->deadline_ns))
+      break;
+    uint64_t left = args->size_b;
+    bool ok = true;
+    while (left > 0 && ok) {
+      size_t len = left < sizeof(payload) ? (size_t)left : sizeof(payload);
+      ok = send_all(fd, payload, len, ctx->deadline_ns);
+      left -= len;
+    }
+    if (!ok)
+      break;
+    // Wait for the receiver to acknowledge the whole transfer.
+    char ack;
+    ssize_t ret;
+    do {
+      ret = recv(fd, &ack, sizeof(ack), 0);
+    } while (ret == -1 && (errno == EINTR || errno == EAGAIN) &&
+             rm_bench_now_ns() < ctx->deadline_ns);
+    if (ret != sizeof(ack))
+      break;
+    if (!record(ctx, start_ns, rm_bench_now_ns())) {
+      ctx->failed = true;
+      break;
+    }
+    if (args->off_ms)
+      usleep(args->off_ms * 1000);
+  }
+  close(fd);
+  return NULL;
+}
+
+static void usage(const char *prog) {
+  printf("Usage: %s --addr A [--port P] [--local-port-start L] [--flows M]\n"
+         "          [--size-b B] [--off-ms O] [--duration-s D] [--out FILE]\n",
+         prog);
+}
+
+int main(int argc, char **argv) {
+  struct sender_args args = {.port = RM_BENCH_PORT,
+                             .flows = 1,
+                             .size_b = 1 << 20,
+                             .duration_s = 10};
+  bool have_addr = false;
+  static const struct option opts[] = {
+      {"addr", required_argument, NULL, 'a'},
+      {"port", required_argument, NULL, 'p'},
+      {"local-port-start", required_argument, NULL, 'l'},
+      {"flows", required_argument, NULL, 'f'},
+      {"size-b", required_argument, NULL, 's'},
+      {"off-ms", required_argument, NULL, 'o'},
+      {"duration-s", required_argument, NULL, 'd'},
+      {"out", required_argument, NULL, 'w'},
+      {NULL, 0, NULL, 0}};
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+    switch (opt) {
+    case 'a':
+      have_addr = inet_pton(AF_INET, optarg, &args.addr) == 1;
+      break;
+    case 'p':
+      args.port = (unsigned short)atoi(optarg);
+      break;
+    case 'l':
+      args.local_port_start = (unsigned short)atoi(optarg);
+      break;
+    case 'f':
+      args.flows = (unsigned int)atoi(optarg);
+      break;
+    case 's':
+      args.size_b = strtoull(optarg, NULL, 10);
+      break;
+    case 'o':
+      args.off_ms = (unsigned int)atoi(optarg);
+      break;
+    case 'd':
+      args.duration_s = (unsigned int)atoi(optarg);
+      break;
+    case 'w':
+      args.out = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (!have_addr || !args.flows || !args.size_b) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  FILE *out = args.out == NULL ? stdout : fopen(args.out, "w");
+  if (out == NULL) {
+    printf("ERROR: failed to open output file: %s\n", args.out);
+    return 1;
+  }
+
+  struct flow_ctx *ctxs = calloc(args.flows, sizeof(*ctxs));
+  pthread_t *threads = calloc(args.flows, sizeof(*threads));
+  if (ctxs == NULL || threads == NULL) {
+    printf("ERROR: failed to allocate %u flows\n", args.flows);
+    return 1;
+  }
+  uint64_t deadline_ns =
+      rm_bench_now_ns() + (uint64_t)args.duration_s * 1000000000ull;
+  for (unsigned int i = 0; i < args.flows; ++i) {
+    ctxs[i] = (struct flow_ctx){
+        .args = &args, .idx = i, .deadline_ns = deadline_ns};
+    if (pthread_create(&threads[i], NULL, flow_func, &ctxs[i])) {
+      printf("ERROR: failed to create thread for flow %u\n", i);
+      return 1;
+    }
+  }
+
+  int ret = 0;
+  for (unsigned int i = 0; i < args.flows; ++i) {
+    pthread_join(threads[i], NULL);
+    if (ctxs[i].failed)
+      ret = 1;
+    for (size_t j = 0; j < ctxs[i].num_rows; ++j)
+      fprintf(out, "%u,%u,%lu,%lu,%lu\n", i,
+              args.local_port_start ? args.local_port_start + i : 0,
+              ctxs[i].rows[j][0], ctxs[i].rows[j][1], args.size_b);
+    free(ctxs[i].rows);
+  }
+  if (out != stdout)
+    fclose(out);
+  free(ctxs);
+  free(threads);
+  return ret;
+}
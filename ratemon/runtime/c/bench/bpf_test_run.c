@@ -0,0 +1,546 @@
+// Microbenchmarks and output checks for RateMon's BPF programs.
+//
+// Loads each BPF object that the runtime deploys and reports the verifier's
+// view of every program (instructions processed, translated and JITed sizes),
+// so that changes which push a program toward the verifier's limits show up
+// before deployment. Maps are never pinned, so this does not interfere with a
+// running instance of RateMon.
+//
+// The tc/egress program is additionally driven with BPF_PROG_TEST_RUN using
+// synthetic packets. For each case, the harness first runs the program once and
+// compares the output packet against the expected packet, including the
+// advertised window and a freshly computed TCP checksum, then runs it --repeat
+// times per batch and reports the median ns/packet over --batches batches.
+// The kernel reuses the same packet across repetitions, so timed runs of the
+// cases that rewrite the window measure the steady state in which the window
+// already holds the target value.
+//
+// The kernel does not implement BPF_PROG_TEST_RUN for kprobe, sockops, or
+// struct_ops programs, so those are load-only.
+//
+// If --out is given, writes one CSV line per case to it, for tracking the
+// per-packet cost of enforcement across commits:
+//     case, ns/packet, verified (0 or 1)
+// Exits with a non-zero status if any program fails to load or any case fails
+// verification. Requires root.
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <errno.h>
+#include <getopt.h>
+#include <net/ethernet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/tcp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../ratemon.h"
+
+// Large enough for every synthetic packet below.
+#define PKT_MAX_B 256
+// Bytes of TCP payload in each synthetic packet.
+#define PKT_PAYLOAD_B 32
+// Size of an 802.1Q tag.
+#define VLAN_HDR_B 4
+
+// The flow used in all cases, from the receiver's point of view. At egress,
+// the local host is the source.
+#define LOCAL_ADDR "10.0.0.1"
+#define REMOTE_ADDR "10.0.0.2"
+#define LOCAL_PORT 9000
+#define REMOTE_PORT 50000
+// ACK number of every synthetic packet.
+#define PKT_ACK_SEQ 2000
+
+enum pkt_kind { PKT_IPV4, PKT_IPV4_VLAN, PKT_IPV6 };
+
+struct tc_case {
+  const char *name;
+  enum pkt_kind kind;
+  // Advertised window in the packet, before scaling.
+  uint16_t window_in;
+  // Whether the flow has an entry in flow_to_rwnd, and its value.
+  bool has_rwnd;
+  unsigned int rwnd;
+  // Whether the flow has an entry in flow_to_win_scale, and its value.
+  bool has_win_scale;
+  unsigned char win_scale;
+  // Whether the flow has an entry in flow_to_credit, and its value.
+  bool has_credit;
+  struct rm_credit credit;
+  // Whether the flow has an entry in flow_to_rate, and its value.
+  bool has_rate;
+  struct rm_rate rate;
+  // Advertised window that the program should leave in the packet.
+  uint16_t window_out;
+};
+
+static const struct tc_case tc_cases[] = {
+    // The flow is not managed, so the packet is untouched.
+    {.name = "miss", .kind = PKT_IPV4, .window_in = 1000, .window_out = 1000},
+    // The configured RWND is smaller than the window set by flow control.
+    {.name = "hit",
+     .kind = PKT_IPV4,
+     .window_in = 1000,
+     .has_rwnd = true,
+     .rwnd = 10000,
+     .has_win_scale = true,
+     .win_scale = 7,
+     .window_out = 10000 >> 7},
+    // Flow control's window is already smaller, so it is preserved.
+    {.name = "hit_flow_control",
+     .kind = PKT_IPV4,
+     .window_in = 50,
+     .has_rwnd = true,
+     .rwnd = 10000,
+     .has_win_scale = true,
+     .win_scale = 7,
+     .window_out = 50},
+    // The scaled RWND does not fit in 16 bits, so it must saturate instead of
+    // wrapping around to a tiny window.
+    {.name = "hit_saturate",
+     .kind = PKT_IPV4,
+     .window_in = 40000,
+     .has_rwnd = true,
+     .rwnd = 1 << 20,
+     .has_win_scale = true,
+     .win_scale = 0,
+     .window_out = 40000},
+    // A paused flow. This path skips the window scale lookup.
+    {.name = "zero_window",
+     .kind = PKT_IPV4,
+     .window_in = 1000,
+     .has_rwnd = true,
+     .rwnd = 0,
+     .window_out = 0},
+    // The flow has 5120 B of byte credit left past the packet's ACK number.
+    {.name = "credit",
+     .kind = PKT_IPV4,
+     .window_in = 1000,
+     .has_win_scale = true,
+     .win_scale = 7,
+     .has_credit = true,
+     .credit = {.credit_B = 6400,
+                .start_seq = PKT_ACK_SEQ - 1280,
+                .started = 1},
+     .window_out = 5120 >> 7},
+    // The flow has used all of its byte credit, so it pauses itself.
+    {.name = "credit_exhausted",
+     .kind = PKT_IPV4,
+     .window_in = 1000,
+     .has_win_scale = true,
+     .win_scale = 7,
+     .has_credit = true,
+     .credit = {.credit_B = 6400,
+                .start_seq = PKT_ACK_SEQ - 6400,
+                .started = 1},
+     .window_out = 0},
+    // The flow has a target rate. Test packets have no socket, and therefore
+    // no RTT, so the program falls back to the minimum RWND.
+    {.name = "rate",
+     .kind = PKT_IPV4,
+     .window_in = 1000,
+     .has_win_scale = true,
+     .win_scale = 7,
+     .has_rate = true,
+     .rate = {.rate_Bps = 125000000, .min_rwnd_B = 12800},
+     .window_out = 12800 >> 7},
+    // IPv6 is not supported, so the packet is untouched even though the
+    // (IPv4) flow is managed.
+    {.name = "ipv6",
+     .kind = PKT_IPV6,
+     .window_in = 1000,
+     .has_rwnd = true,
+     .rwnd = 0,
+     .window_out = 1000},
+    // Frames with an in-band 802.1Q tag are not parsed, so the packet is
+    // untouched even though the flow is managed.
+    {.name = "vlan",
+     .kind = PKT_IPV4_VLAN,
+     .window_in = 1000,
+     .has_rwnd = true,
+     .rwnd = 0,
+     .window_out = 1000},
+};
+
+// BPF objects that the runtime deploys, relative to --obj-dir.
+static const char *const objs[] = {"ratemon_tc.bpf.o", "ratemon_kprobe.bpf.o",
+                                   "ratemon_sockops.bpf.o",
+                                   "ratemon_structops.bpf.o"};
+
+struct run_args {
+  const char *obj_dir;
+  unsigned int repeat;
+  unsigned int batches;
+  const char *out;
+};
+
+struct pkt {
+  unsigned char data[PKT_MAX_B];
+  size_t len;
+};
+
+static int libbpf_print_fn(enum libbpf_print_level level, const char *format,
+                           va_list args) {
+  // Only print warnings and errors, which include the verifier log if a
+  // program fails to load.
+  if (level == LIBBPF_DEBUG)
+    return 0;
+  return vfprintf(stdout, format, args);
+}
+
+static uint32_t csum_add(uint32_t sum, const void *buf, size_t len) {
+  const unsigned char *bytes = buf;
+  for (size_t i = 0; i + 1 < len; i += 2)
+    sum += (uint32_t)(bytes[i] << 8 | bytes[i + 1]);
+  if (len & 1)
+    sum += (uint32_t)(bytes[len - 1] << 8);
+  return sum;
+}
+
+static uint16_t csum_fold(uint32_t sum) {
+  while (sum >> 16)
+    sum = (sum & 0xFFFF) + (sum >> 16);
+  return (uint16_t)~sum;
+}
+
+// Compute the TCP checksum, including the IPv4 pseudo-header, of a segment
+// whose checksum field is zero.
+static uint16_t tcp_csum_ipv4(const struct iphdr *ip, const struct tcphdr *tcp,
+                              size_t tcp_len) {
+  uint32_t sum = 0;
+  sum = csum_add(sum, &ip->saddr, sizeof(ip->saddr));
+  sum = csum_add(sum, &ip->daddr, sizeof(ip->daddr));
+  sum += IPPROTO_TCP;
+  sum += (uint32_t)tcp_len;
+  sum = csum_add(sum, tcp, tcp_len);
+  return csum_fold(sum);
+}
+
+// Compute the TCP checksum, including the IPv6 pseudo-header, of a segment
+// whose checksum field is zero.
+static uint16_t tcp_csum_ipv6(const struct ip6_hdr *ip6,
+                              const struct tcphdr *tcp, size_t tcp_len) {
+  uint32_t sum = 0;
+  sum = csum_add(sum, &ip6->ip6_src, sizeof(ip6->ip6_src));
+  sum = csum_add(sum, &ip6->ip6_dst, sizeof(ip6->ip6_dst));
+  sum += (uint32_t)tcp_len;
+  sum += IPPROTO_TCP;
+  sum = csum_add(sum, tcp, tcp_len);
+  return csum_fold(sum);
+}
+
+// Build an ACK from the receiver for the test flow, with a valid TCP checksum
+// and the given advertised window.
+static void build_pkt(struct pkt *pkt, enum pkt_kind kind, uint16_t window) {
+  memset(pkt, 0, sizeof(*pkt));
+  unsigned char *cur = pkt->data;
+
+  struct ether_header *eth = (struct ether_header *)cur;
+  memset(eth->ether_dhost, 0x02, ETH_ALEN);
+  memset(eth->ether_shost, 0x04, ETH_ALEN);
+  cur += sizeof(*eth);
+  if (kind == PKT_IPV4_VLAN) {
+    eth->ether_type = htons(ETHERTYPE_VLAN);
+    // VLAN ID 100, followed by the encapsulated EtherType.
+    uint16_t tci = htons(100);
+    uint16_t proto = htons(ETHERTYPE_IP);
+    memcpy(cur, &tci, sizeof(tci));
+    memcpy(cur + sizeof(tci), &proto, sizeof(proto));
+    cur += VLAN_HDR_B;
+  } else {
+    eth->ether_type = htons(kind == PKT_IPV6 ? ETHERTYPE_IPV6 : ETHERTYPE_IP);
+  }
+
+  size_t tcp_len = sizeof(struct tcphdr) + PKT_PAYLOAD_B;
+  struct iphdr *ip = NULL;
+  struct ip6_hdr *ip6 = NULL;
+  if (kind == PKT_IPV6) {
+    ip6 = (struct ip6_hdr *)cur;
+    ip6->ip6_flow = htonl(6 << 28);
+    ip6->ip6_plen = htons((uint16_t)tcp_len);
+    ip6->ip6_nxt = IPPROTO_TCP;
+    ip6->ip6_hlim = 64;
+    inet_pton(AF_INET6, "fd00::1", &ip6->ip6_src);
+    inet_pton(AF_INET6, "fd00::2", &ip6->ip6_dst);
+    cur += sizeof(*ip6);
+  } else {
+    ip = (struct iphdr *)cur;
+    ip->version = 4;
+    ip->ihl = sizeof(*ip) / 4;
+    ip->tot_len = htons((uint16_t)(sizeof(*ip) + tcp_len));
+    ip->ttl = 64;
+    ip->protocol = IPPROTO_TCP;
+    inet_pton(AF_INET, LOCAL_ADDR, &ip->saddr);
+    inet_pton(AF_INET, REMOTE_ADDR, &ip->daddr);
+    cur += sizeof(*ip);
+  }
+
+  struct tcphdr *tcp = (struct tcphdr *)cur;
+  tcp->source = htons(LOCAL_PORT);
+  tcp->dest = htons(REMOTE_PORT);
+  tcp->seq = htonl(1000);
+  tcp->ack_seq = htonl(PKT_ACK_SEQ);
+  tcp->doff = sizeof(*tcp) / 4;
+  tcp->ack = 1;
+  tcp->psh = 1;
+  tcp->window = htons(window);
+  memset(cur + sizeof(*tcp), 0xAB, PKT_PAYLOAD_B);
+  tcp->check = htons(ip6 == NULL ? tcp_csum_ipv4(ip, tcp, tcp_len)
+                                 : tcp_csum_ipv6(ip6, tcp, tcp_len));
+  cur += tcp_len;
+
+  pkt->len = (size_t)(cur - pkt->data);
+}
+
+static int cmp_u32(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a;
+  uint32_t y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
+
+// Disable pinning for every map in an object, so that loading it neither
+// reuses nor replaces the maps of a running instance.
+static void unpin_maps(struct bpf_object *obj) {
+  struct bpf_map *map;
+  bpf_object__for_each_map(map, obj) { bpf_map__set_pin_path(map, NULL); }
+}
+
+// Print the verifier's statistics for every program in a loaded object.
+static void print_prog_stats(struct bpf_object *obj, const char *obj_name) {
+  struct bpf_program *prog;
+  bpf_object__for_each_program(prog, obj) {
+    struct bpf_prog_info info = {0};
+    __u32 info_len = sizeof(info);
+    if (bpf_prog_get_info_by_fd(bpf_program__fd(prog), &info, &info_len)) {
+      printf("WARNING: failed to query info for '%s': %s\n",
+             bpf_program__name(prog), strerror(errno));
+      continue;
+    }
+    printf("  %-24s %-32s verified_insns=%u xlated_b=%u jited_b=%u\n",
+           obj_name, bpf_program__name(prog), info.verified_insns,
+           info.xlated_prog_len, info.jited_prog_len);
+  }
+}
+
+static int set_flow_state(struct bpf_object *obj, const struct tc_case *c) {
+  struct bpf_map *rwnd_map =
+      bpf_object__find_map_by_name(obj, "flow_to_rwnd");
+  struct bpf_map *win_scale_map =
+      bpf_object__find_map_by_name(obj, "flow_to_win_scale");
+  struct bpf_map *credit_map =
+      bpf_object__find_map_by_name(obj, "flow_to_credit");
+  struct bpf_map *rate_map = bpf_object__find_map_by_name(obj, "flow_to_rate");
+  if (rwnd_map == NULL || win_scale_map == NULL || credit_map == NULL ||
+      rate_map == NULL) {
+    printf("ERROR: failed to find RWND maps\n");
+    return 1;
+  }
+  struct in_addr local_addr, remote_addr;
+  inet_pton(AF_INET, LOCAL_ADDR, &local_addr);
+  inet_pton(AF_INET, REMOTE_ADDR, &remote_addr);
+  struct rm_flow flow = {.local_addr = ntohl(local_addr.s_addr),
+                         .remote_addr = ntohl(remote_addr.s_addr),
+                         .local_port = LOCAL_PORT,
+                         .remote_port = REMOTE_PORT};
+  // Start from a clean slate. Deleting a missing key is not an error here.
+  bpf_map__delete_elem(rwnd_map, &flow, sizeof(flow), 0);
+  bpf_map__delete_elem(win_scale_map, &flow, sizeof(flow), 0);
+  bpf_map__delete_elem(credit_map, &flow, sizeof(flow), 0);
+  bpf_map__delete_elem(rate_map, &flow, sizeof(flow), 0);
+  if (c->has_rwnd &&
+      bpf_map__update_elem(rwnd_map, &flow, sizeof(flow), &c->rwnd,
+                           sizeof(c->rwnd), BPF_ANY)) {
+    printf("ERROR: failed to update flow_to_rwnd: %s\n", strerror(errno));
+    return 1;
+  }
+  if (c->has_win_scale &&
+      bpf_map__update_elem(win_scale_map, &flow, sizeof(flow), &c->win_scale,
+                           sizeof(c->win_scale), BPF_ANY)) {
+    printf("ERROR: failed to update flow_to_win_scale: %s\n", strerror(errno));
+    return 1;
+  }
+  if (c->has_credit &&
+      bpf_map__update_elem(credit_map, &flow, sizeof(flow), &c->credit,
+                           sizeof(c->credit), BPF_ANY)) {
+    printf("ERROR: failed to update flow_to_credit: %s\n", strerror(errno));
+    return 1;
+  }
+  if (c->has_rate &&
+      bpf_map__update_elem(rate_map, &flow, sizeof(flow), &c->rate,
+                           sizeof(c->rate), BPF_ANY)) {
+    printf("ERROR: failed to update flow_to_rate: %s\n", strerror(errno));
+    return 1;
+  }
+  return 0;
+}
+
+// Run one case. Returns 0 if the output matches and timing succeeded.
+static int run_tc_case(struct bpf_object *obj, int prog_fd,
+                       const struct tc_case *c, const struct run_args *args,
+                       FILE *out) {
+  if (set_flow_state(obj, c))
+    return 1;
+
+  struct pkt in, expected, actual;
+  build_pkt(&in, c->kind, c->window_in);
+  build_pkt(&expected, c->kind, c->window_out);
+
+  // Verify a single run.
+  LIBBPF_OPTS(bpf_test_run_opts, opts, .data_in = in.data,
+              .data_size_in = (__u32)in.len, .data_out = actual.data,
+              .data_size_out = sizeof(actual.data), .repeat = 1);
+  if (bpf_prog_test_run_opts(prog_fd, &opts)) {
+    printf("ERROR: test run failed for case '%s': %s\n", c->name,
+           strerror(errno));
+    return 1;
+  }
+  bool verified = true;
+  if (opts.retval != 0) {
+    printf("ERROR: case '%s' returned %u, expected TC_ACT_OK\n", c->name,
+           opts.retval);
+    verified = false;
+  }
+  if (opts.data_size_out != expected.len ||
+      memcmp(actual.data, expected.data, expected.len) != 0) {
+    // Point out the likely culprit.
+    size_t tcp_off = expected.len - PKT_PAYLOAD_B - sizeof(struct tcphdr);
+    const struct tcphdr *tcp_a = (const struct tcphdr *)(actual.data + tcp_off);
+    const struct tcphdr *tcp_e =
+        (const struct tcphdr *)(expected.data + tcp_off);
+    printf("ERROR: case '%s' output mismatch: len %u (expected %zu), "
+           "window %u (expected %u), checksum 0x%04x (expected 0x%04x)\n",
+           c->name, opts.data_size_out, expected.len, ntohs(tcp_a->window),
+           ntohs(tcp_e->window), ntohs(tcp_a->check), ntohs(tcp_e->check));
+    verified = false;
+  }
+
+  // Time the program.
+  uint32_t *durations = calloc(args->batches, sizeof(*durations));
+  if (durations == NULL) {
+    printf("ERROR: failed to allocate %u batches\n", args->batches);
+    return 1;
+  }
+  for (unsigned int i = 0; i < args->batches; ++i) {
+    LIBBPF_OPTS(bpf_test_run_opts, timed_opts, .data_in = in.data,
+                .data_size_in = (__u32)in.len, .repeat = args->repeat);
+    if (bpf_prog_test_run_opts(prog_fd, &timed_opts)) {
+      printf("ERROR: timed test run failed for case '%s': %s\n", c->name,
+             strerror(errno));
+      free(durations);
+      return 1;
+    }
+    durations[i] = timed_opts.duration;
+  }
+  qsort(durations, args->batches, sizeof(*durations), cmp_u32);
+  uint32_t median_ns = durations[args->batches / 2];
+  free(durations);
+
+  printf("  %-24s %6u ns/packet  %s\n", c->name, median_ns,
+         verified ? "OK" : "FAILED");
+  if (out != NULL)
+    fprintf(out, "%s,%u,%d\n", c->name, median_ns, verified);
+  return verified ? 0 : 1;
+}
+
+static int run_tc(struct bpf_object *obj, const struct run_args *args,
+                  FILE *out) {
+  struct bpf_program *prog =
+      bpf_object__find_program_by_name(obj, "do_rwnd_at_egress");
+  if (prog == NULL) {
+    printf("ERROR: failed to find 'do_rwnd_at_egress'\n");
+    return 1;
+  }
+  int prog_fd = bpf_program__fd(prog);
+  printf("INFO: running %zu tc/egress cases, %u batches x %u repetitions\n",
+         sizeof(tc_cases) / sizeof(tc_cases[0]), args->batches, args->repeat);
+  int ret = 0;
+  for (size_t i = 0; i < sizeof(tc_cases) / sizeof(tc_cases[0]); ++i)
+    ret |= run_tc_case(obj, prog_fd, &tc_cases[i], args, out);
+  return ret;
+}
+
+static void usage(const char *prog) {
+  printf("Usage: %s [--obj-dir D] [--repeat R] [--batches B] [--out FILE]\n",
+         prog);
+}
+
+int main(int argc, char **argv) {
+  struct run_args args = {
+      .obj_dir = "../.output", .repeat = 1000000, .batches = 5};
+  static const struct option opts[] = {
+      {"obj-dir", required_argument, NULL, 'd'},
+      {"repeat", required_argument, NULL, 'r'},
+      {"batches", required_argument, NULL, 'b'},
+      {"out", required_argument, NULL, 'w'},
+      {NULL, 0, NULL, 0}};
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+    switch (opt) {
+    case 'd':
+      args.obj_dir = optarg;
+      break;
+    case 'r':
+      args.repeat = (unsigned int)atoi(optarg);
+      break;
+    case 'b':
+      args.batches = (unsigned int)atoi(optarg);
+      break;
+    case 'w':
+      args.out = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (!args.repeat || !args.batches) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  FILE *out = NULL;
+  if (args.out != NULL && (out = fopen(args.out, "w")) == NULL) {
+    printf("ERROR: failed to open output file: %s\n", args.out);
+    return 1;
+  }
+
+  libbpf_set_print(libbpf_print_fn);
+
+  int ret = 0;
+  printf("INFO: verifier statistics\n");
+  for (size_t i = 0; i < sizeof(objs) / sizeof(objs[0]); ++i) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s", args.obj_dir, objs[i]);
+    struct bpf_object *obj = bpf_object__open_file(path, NULL);
+    if (obj == NULL) {
+      printf("ERROR: failed to open BPF object: %s\n", path);
+      ret = 1;
+      continue;
+    }
+    unpin_maps(obj);
+    if (bpf_object__load(obj)) {
+      printf("ERROR: failed to load BPF object: %s\n", path);
+      bpf_object__close(obj);
+      ret = 1;
+      continue;
+    }
+    print_prog_stats(obj, objs[i]);
+    if (strcmp(objs[i], "ratemon_tc.bpf.o") == 0)
+      ret |= run_tc(obj, &args, out);
+    bpf_object__close(obj);
+  }
+
+  if (out != NULL)
+    fclose(out);
+  if (ret)
+    printf("ERROR: one or more checks failed\n");
+  return ret;
+}
@@ -0,0 +1,488 @@
+// Measures the latency of accept(), connect(), and close() on loopback, so that
+// running it with and without LD_PRELOAD=libratemon_interp.so isolates the cost
+// that interposition adds to each new connection (see interp_bench.py).
+//
+// --threads client threads each connect to a listener in this process from a
+// fixed local port (--local-port-start + thread index), wait for the server to
+// close the connection, and then close their end with an RST so that the port
+// can be reused immediately without TIME_WAIT. The same number of server
+// threads accept and close these connections. Each client thread opens
+// --warmup + --conns connections at --rate connections/s (0 means as fast as
+// possible). Only the time spent inside each call is measured; for accept(),
+// the server waits with poll() until a connection is pending first.
+//
+// Before the threads start, the main thread opens one connection by itself.
+// With libratemon_interp, its accept() and connect() perform one-time setup, so
+// they are reported separately as the "setup" phase. Warmup connections are
+// discarded, and the rest are reported as the "steady" phase.
+//
+// Writes one CSV line per call and phase to --out:
+//     call, phase, count, mean (ns), p50 (ns), p90 (ns), p99 (ns), p99.9 (ns),
+//     max (ns)
+// followed by a line with the achieved connection rate:
+//     rate, steady, connections, connections/s
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "bench_common.h"
+
+// How often server threads check whether the run is over.
+#define POLL_TIMEOUT_MS 100
+
+enum call { CALL_CONNECT, CALL_ACCEPT, CALL_CLOSE_CLIENT, CALL_CLOSE_SERVER };
+#define NUM_CALLS 4
+static const char *const call_names[NUM_CALLS] = {"connect", "accept",
+                                                  "close_client",
+                                                  "close_server"};
+
+struct bench_args {
+  unsigned short port;
+  unsigned short local_port_start;
+  unsigned int threads;
+  unsigned int conns;
+  unsigned int warmup;
+  unsigned int rate;
+  const char *out;
+};
+
+// Latency samples for one call.
+struct samples {
+  uint64_t *ns;
+  size_t num;
+};
+
+struct client_ctx {
+  const struct bench_args *args;
+  unsigned int idx;
+  struct samples connect;
+  struct samples close;
+  bool failed;
+};
+
+struct server_ctx {
+  const struct bench_args *args;
+  int listen_fd;
+  bool failed;
+};
+
+// Number of connections that server threads have accepted, across threads.
+// Accepted connections are not attributed to particular clients, so the first
+// threads x warmup connections are the warmup connections.
+static unsigned long num_accepted = 0;
+// Latency samples for the server side, shared by all server threads and indexed
+// by the order in which connections were accepted, minus the warmup.
+static struct samples server_accept;
+static struct samples server_close;
+// Set once all clients are done.
+static volatile bool clients_done = false;
+
+static bool samples_init(struct samples *s, size_t cap) {
+  s->ns = calloc(cap ? cap : 1, sizeof(*s->ns));
+  s->num = 0;
+  return s->ns != NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static void sleep_until_ns(uint64_t when_ns) {
+  struct timespec ts = {.tv_sec = (time_t)(when_ns / 1000000000ull),
+                        .tv_nsec = (long)(when_ns % 1000000000ull)};
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    ;
+}
+
+// Open one connection from local_port, wait for the server to close it, and
+// close it with an RST. Records the latency of connect() and close() if the
+// samples are not NULL.
+static bool do_client_conn(const struct bench_args *args,
+                           unsigned short local_port,
+                           struct samples *connect_samples,
+                           struct samples *close_samples) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd == -1) {
+    printf("ERROR: failed to create socket: %s\n", strerror(errno));
+    return false;
+  }
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  struct sockaddr_in local = {.sin_family = AF_INET,
+                              .sin_port = htons(local_port),
+                              .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+  if (bind(fd, (struct sockaddr *)&local, sizeof(local)) == -1) {
+    printf("ERROR: failed to bind to local port %u: %s\n", local_port,
+           strerror(errno));
+    close(fd);
+    return false;
+  }
+  struct sockaddr_in server = {.sin_family = AF_INET,
+                               .sin_port = htons(args->port),
+                               .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+  uint64_t start_ns = rm_bench_now_ns();
+  int ret = connect(fd, (struct sockaddr *)&server, sizeof(server));
+  uint64_t end_ns = rm_bench_now_ns();
+  if (ret == -1) {
+    printf("ERROR: failed to connect from local port %u: %s\n", local_port,
+           strerror(errno));
+    close(fd);
+    return false;
+  }
+  if (connect_samples != NULL)
+    connect_samples->ns[connect_samples->num++] = end_ns - start_ns;
+
+  // Wait for the server to close its end.
+  char buf[16];
+  while (recv(fd, buf, sizeof(buf), 0) > 0)
+    ;
+  struct linger linger = {.l_onoff = 1, .l_linger = 0};
+  setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+  start_ns = rm_bench_now_ns();
+  close(fd);
+  end_ns = rm_bench_now_ns();
+  if (close_samples != NULL)
+    close_samples->ns[close_samples->num++] = end_ns - start_ns;
+  return true;
+}
+
+// Accept one pending connection and close it. Returns 1 if a connection was
+// handled, 0 if none was pending before the timeout, and -1 on error. Stores
+// the latency of accept() and close() in accept_ns and close_ns.
+static int do_server_conn(int listen_fd, uint64_t *accept_ns,
+                          uint64_t *close_ns) {
+  struct pollfd pfd = {.fd = listen_fd, .events = POLLIN};
+  int ret = poll(&pfd, 1, POLL_TIMEOUT_MS);
+  if (ret == 0 || (ret == -1 && errno == EINTR))
+    return 0;
+  if (ret == -1) {
+    printf("ERROR: failed to poll listening socket: %s\n", strerror(errno));
+    return -1;
+  }
+  struct sockaddr_in addr;
+  socklen_t addr_len = sizeof(addr);
+  uint64_t start_ns = rm_bench_now_ns();
+  int fd = accept(listen_fd, (struct sockaddr *)&addr, &addr_len);
+  uint64_t end_ns = rm_bench_now_ns();
+  if (fd == -1) {
+    // Another server thread took the connection.
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return 0;
+    printf("ERROR: failed to accept: %s\n", strerror(errno));
+    return -1;
+  }
+  *accept_ns = end_ns - start_ns;
+  start_ns = rm_bench_now_ns();
+  close(fd);
+  *close_ns = rm_bench_now_ns() - start_ns;
+  return 1;
+}
+
+static void *client_func(void *arg) {
+  struct client_ctx *ctx = arg;
+  const struct bench_args *args = ctx->args;
+  unsigned short local_port =
+      (unsigned short)(args->local_port_start + ctx->idx);
+  uint64_t interval_ns = args->rate ? 1000000000ull / args->rate : 0;
+  uint64_t next_ns = rm_bench_now_ns();
+  for (unsigned int i = 0; i < args->warmup + args->conns; ++i) {
+    if (interval_ns) {
+      sleep_until_ns(next_ns);
+      next_ns += interval_ns;
+    }
+    bool record = i >= args->warmup;
+    if (!do_client_conn(args, local_port, record ? &ctx->connect : NULL,
+                        record ? &ctx->close : NULL)) {
+      ctx->failed = true;
+      break;
+    }
+  }
+  return NULL;
+}
+
+static void *server_func(void *arg) {
+  struct server_ctx *ctx = arg;
+  const struct bench_args *args = ctx->args;
+  unsigned long num_warmup = (unsigned long)args->threads * args->warmup;
+  unsigned long num_total =
+      num_warmup + (unsigned long)args->threads * args->conns;
+  while (!clients_done) {
+    uint64_t accept_ns, close_ns;
+    int ret = do_server_conn(ctx->listen_fd, &accept_ns, &close_ns);
+    if (ret == -1) {
+      ctx->failed = true;
+      break;
+    }
+    if (ret == 0)
+      continue;
+    unsigned long idx = __atomic_fetch_add(&num_accepted, 1, __ATOMIC_RELAXED);
+    if (idx >= num_warmup && idx < num_total) {
+      server_accept.ns[idx - num_warmup] = accept_ns;
+      server_close.ns[idx - num_warmup] = close_ns;
+    }
+  }
+  return NULL;
+}
+
+// Sort the samples and write their summary.
+static void write_summary(FILE *out, const char *call, const char *phase,
+                          struct samples *s) {
+  if (s->num == 0) {
+    fprintf(out, "%s,%s,0,,,,,,\n", call, phase);
+    return;
+  }
+  qsort(s->ns, s->num, sizeof(*s->ns), cmp_u64);
+  uint64_t sum = 0;
+  for (size_t i = 0; i < s->num; ++i)
+    sum += s->ns[i];
+#define PCT(p) s->ns[(size_t)((double)(s->num - 1) * (p) / 100.0)]
+  fprintf(out, "%s,%s,%zu,%lu,%lu,%lu,%lu,%lu,%lu\n", call, phase, s->num,
+          sum / s->num, PCT(50), PCT(90), PCT(99), PCT(99.9),
+          s->ns[s->num - 1]);
+#undef PCT
+}
+
+// Concatenate the samples of one call from every thread.
+static bool merge(struct samples *dst, struct samples **srcs, size_t num_srcs) {
+  size_t total = 0;
+  for (size_t i = 0; i < num_srcs; ++i)
+    total += srcs[i]->num;
+  if (!samples_init(dst, total))
+    return false;
+  for (size_t i = 0; i < num_srcs; ++i) {
+    memcpy(dst->ns + dst->num, srcs[i]->ns, srcs[i]->num * sizeof(*dst->ns));
+    dst->num += srcs[i]->num;
+  }
+  return true;
+}
+
+static void usage(const char *prog) {
+  printf("Usage: %s [--port P] [--local-port-start L] [--threads T]\n"
+         "          [--conns N] [--warmup W] [--rate R] [--out FILE]\n",
+         prog);
+}
+
+int main(int argc, char **argv) {
+  struct bench_args args = {.port = RM_BENCH_PORT,
+                            .local_port_start = RM_BENCH_PORT + 1,
+                            .threads = 1,
+                            .conns = 10000,
+                            .warmup = 100};
+  static const struct option opts[] = {
+      {"port", required_argument, NULL, 'p'},
+      {"local-port-start", required_argument, NULL, 'l'},
+      {"threads", required_argument, NULL, 't'},
+      {"conns", required_argument, NULL, 'n'},
+      {"warmup", required_argument, NULL, 'u'},
+      {"rate", required_argument, NULL, 'r'},
+      {"out", required_argument, NULL, 'w'},
+      {NULL, 0, NULL, 0}};
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+    switch (opt) {
+    case 'p':
+      args.port = (unsigned short)atoi(optarg);
+      break;
+    case 'l':
+      args.local_port_start = (unsigned short)atoi(optarg);
+      break;
+    case 't':
+      args.threads = (unsigned int)atoi(optarg);
+      break;
+    case 'n':
+      args.conns = (unsigned int)atoi(optarg);
+      break;
+    case 'u':
+      args.warmup = (unsigned int)atoi(optarg);
+      break;
+    case 'r':
+      args.rate = (unsigned int)atoi(optarg);
+      break;
+    case 'w':
+      args.out = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (!args.threads || !args.conns ||
+      args.local_port_start + args.threads > 65536) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  FILE *out = args.out == NULL ? stdout : fopen(args.out, "w");
+  if (out == NULL) {
+    printf("ERROR: failed to open output file: %s\n", args.out);
+    return 1;
+  }
+
+  int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (listen_fd == -1) {
+    printf("ERROR: failed to create socket: %s\n", strerror(errno));
+    return 1;
+  }
+  int one = 1;
+  setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  struct sockaddr_in addr = {.sin_family = AF_INET,
+                             .sin_port = htons(args.port),
+                             .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+  if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(listen_fd, 4096) == -1) {
+    printf("ERROR: failed to listen on port %u: %s\n", args.port,
+           strerror(errno));
+    return 1;
+  }
+
+  // Setup phase: a single connection, before any other thread exists. The
+  // server does not accept until connect() has returned, so the two calls
+  // never contend for the setup lock.
+  struct samples setup[NUM_CALLS];
+  for (int i = 0; i < NUM_CALLS; ++i) {
+    if (!samples_init(&setup[i], 1)) {
+      printf("ERROR: failed to allocate samples\n");
+      return 1;
+    }
+  }
+  {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in local = {.sin_family = AF_INET,
+                                .sin_port = htons(args.local_port_start),
+                                .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    if (fd == -1 || bind(fd, (struct sockaddr *)&local, sizeof(local)) == -1) {
+      printf("ERROR: failed to create setup socket: %s\n", strerror(errno));
+      return 1;
+    }
+    uint64_t start_ns = rm_bench_now_ns();
+    int ret = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+    setup[CALL_CONNECT].ns[setup[CALL_CONNECT].num++] =
+        rm_bench_now_ns() - start_ns;
+    if (ret == -1) {
+      printf("ERROR: failed to connect for setup: %s\n", strerror(errno));
+      return 1;
+    }
+    if (do_server_conn(listen_fd, &setup[CALL_ACCEPT].ns[0],
+                       &setup[CALL_CLOSE_SERVER].ns[0]) != 1) {
+      printf("ERROR: failed to accept for setup\n");
+      return 1;
+    }
+    setup[CALL_ACCEPT].num = setup[CALL_CLOSE_SERVER].num = 1;
+    char buf[16];
+    while (recv(fd, buf, sizeof(buf), 0) > 0)
+      ;
+    struct linger linger = {.l_onoff = 1, .l_linger = 0};
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    start_ns = rm_bench_now_ns();
+    close(fd);
+    setup[CALL_CLOSE_CLIENT].ns[setup[CALL_CLOSE_CLIENT].num++] =
+        rm_bench_now_ns() - start_ns;
+  }
+
+  // Steady phase.
+  struct client_ctx *clients = calloc(args.threads, sizeof(*clients));
+  struct server_ctx *servers = calloc(args.threads, sizeof(*servers));
+  pthread_t *client_threads = calloc(args.threads, sizeof(*client_threads));
+  pthread_t *server_threads = calloc(args.threads, sizeof(*server_threads));
+  if (clients == NULL || servers == NULL || client_threads == NULL ||
+      server_threads == NULL) {
+    printf("ERROR: failed to allocate %u threads\n", args.threads);
+    return 1;
+  }
+  size_t total_conns = (size_t)args.threads * args.conns;
+  if (!samples_init(&server_accept, total_conns) ||
+      !samples_init(&server_close, total_conns)) {
+    printf("ERROR: failed to allocate samples\n");
+    return 1;
+  }
+  for (unsigned int i = 0; i < args.threads; ++i) {
+    clients[i] = (struct client_ctx){.args = &args, .idx = i};
+    servers[i] = (struct server_ctx){.args = &args, .listen_fd = listen_fd};
+    if (!samples_init(&clients[i].connect, args.conns) ||
+        !samples_init(&clients[i].close, args.conns)) {
+      printf("ERROR: failed to allocate samples\n");
+      return 1;
+    }
+  }
+  uint64_t start_ns = rm_bench_now_ns();
+  for (unsigned int i = 0; i < args.threads; ++i) {
+    if (pthread_create(&server_threads[i], NULL, server_func, &servers[i]) ||
+        pthread_create(&client_threads[i], NULL, client_func, &clients[i])) {
+      printf("ERROR: failed to create threads\n");
+      return 1;
+    }
+  }
+  int ret = 0;
+  for (unsigned int i = 0; i < args.threads; ++i) {
+    pthread_join(client_threads[i], NULL);
+    if (clients[i].failed)
+      ret = 1;
+  }
+  uint64_t elapsed_ns = rm_bench_now_ns() - start_ns;
+  clients_done = true;
+  for (unsigned int i = 0; i < args.threads; ++i) {
+    pthread_join(server_threads[i], NULL);
+    if (servers[i].failed)
+      ret = 1;
+  }
+  close(listen_fd);
+  // Every steady-phase connection that a client opened was accepted before the
+  // client's recv() returned.
+  server_accept.num = server_close.num = total_conns;
+
+  struct samples **srcs = calloc(args.threads, sizeof(*srcs));
+  struct samples steady[NUM_CALLS];
+  if (srcs == NULL) {
+    printf("ERROR: failed to allocate samples\n");
+    return 1;
+  }
+  for (int call = 0; call < NUM_CALLS; ++call) {
+    if (call == CALL_ACCEPT || call == CALL_CLOSE_SERVER) {
+      steady[call] = call == CALL_ACCEPT ? server_accept : server_close;
+    } else {
+      for (unsigned int i = 0; i < args.threads; ++i)
+        srcs[i] =
+            call == CALL_CONNECT ? &clients[i].connect : &clients[i].close;
+      if (!merge(&steady[call], srcs, args.threads)) {
+        printf("ERROR: failed to allocate samples\n");
+        return 1;
+      }
+    }
+    write_summary(out, call_names[call], "setup", &setup[call]);
+    write_summary(out, call_names[call], "steady", &steady[call]);
+  }
+  size_t num_steady = steady[CALL_CONNECT].num;
+  fprintf(out, "rate,steady,%zu,%.1f\n", num_steady,
+          elapsed_ns ? (double)num_steady * 1e9 / (double)elapsed_ns : 0.0);
+  if (out != stdout)
+    fclose(out);
+
+  for (int call = 0; call < NUM_CALLS; ++call) {
+    free(setup[call].ns);
+    free(steady[call].ns);
+  }
+  for (unsigned int i = 0; i < args.threads; ++i) {
+    free(clients[i].connect.ns);
+    free(clients[i].close.ns);
+  }
+  free(srcs);
+  free(clients);
+  free(servers);
+  free(client_threads);
+  free(server_threads);
+  return ret;
+}
@@ -0,0 +1,222 @@
+#!/usr/bin/env python
+"""Benchmark of the latency that libratemon_interp adds to accept(), connect(),
+and close().
+
+Runs interp_bench on loopback for every combination of --threads and --rates, in
+each of these modes:
+
+    baseline:    without libratemon_interp
+    unmonitored: with libratemon_interp, but no port is in the monitor range, so
+                 only the four-tuple lookup is performed for each connection
+    monitored:   with libratemon_interp, and every connection is monitored, so
+                 each connection also pays for changing its CCA, for the BPF map
+                 updates, and for initial scheduling
+
+In the interposed modes, the tc/egress program is attached to lo and
+ratemon_main is running, as in a real deployment. For each call, reports the
+latency of the first call in the process, which performs libratemon_interp's
+one-time setup, separately from steady-state percentiles, along with the
+steady-state overhead relative to the baseline. Writes everything to
+results.json in --out-dir.
+
+Requires root. Build the runtime (`make` in the parent directory) and
+interp_bench (`make` in this directory) first.
+"""
+
+import argparse
+import json
+import logging
+import os
+import subprocess
+import sys
+from os import path
+
+import netns_bench
+from netns_bench import BENCH_DIR, CGROUP, RUNTIME_DIR, RUNTIME_OUTPUT
+
+IFACE = "lo"
+SERVER_PORT = 9000
+# Client thread i uses local port LOCAL_PORT_START + i.
+LOCAL_PORT_START = SERVER_PORT + 1
+MODES = ["baseline", "unmonitored", "monitored"]
+CALLS = ["connect", "accept", "close_client", "close_server"]
+STATS = ["count", "mean_ns", "p50_ns", "p90_ns", "p99_ns", "p999_ns", "max_ns"]
+
+
+def load_results(flp):
+    """Parse interp_bench's output into {call: {phase: {stat: value}}}."""
+    out = {}
+    with open(flp, "r", encoding="utf-8") as fil:
+        for line in fil:
+            call, phase, *vals = line.strip().split(",")
+            if call == "rate":
+                out["rate"] = {"count": int(vals[0]), "conns_per_s": float(vals[1])}
+                continue
+            out.setdefault(call, {})[phase] = {
+                stat: (int(val) if val else None) for stat, val in zip(STATS, vals)
+            }
+    return out
+
+
+def run_config(args, mode, threads, rate):
+    """Run interp_bench once and return its parsed results."""
+    out_flp = path.join(args.out_dir, f"{mode}_t{threads}_r{rate}.csv")
+    if path.exists(out_flp):
+        os.remove(out_flp)
+    env = dict(os.environ)
+    if mode != "baseline":
+        env.update(netns_bench.get_interp_env())
+        # Connections are monitored based on their remote port: the server port
+        # for connect() and the client's local port for accept().
+        monitor_range = (
+            (SERVER_PORT, LOCAL_PORT_START + threads - 1)
+            if mode == "monitored"
+            else (1, 1)
+        )
+        env.update(
+            {
+                "RM_MAX_ACTIVE_FLOWS": str(args.max_active_flows),
+                "RM_EPOCH_US": str(args.epoch_us),
+                "RM_IDLE_TIMEOUT_US": str(args.idle_timeout_us),
+                "RM_MONITOR_PORT_START": str(monitor_range[0]),
+                "RM_MONITOR_PORT_END": str(monitor_range[1]),
+            }
+        )
+    proc = subprocess.run(
+        [path.join(BENCH_DIR, "interp_bench")]
+        + ["--port", str(SERVER_PORT)]
+        + ["--local-port-start", str(LOCAL_PORT_START)]
+        + ["--threads", str(threads)]
+        + ["--conns", str(args.conns)]
+        + ["--warmup", str(args.warmup)]
+        + ["--rate", str(rate)]
+        + ["--out", out_flp],
+        env=env,
+        stdout=subprocess.PIPE,
+        stderr=subprocess.STDOUT,
+        text=True,
+        preexec_fn=netns_bench.join_cgroup,
+        check=False,
+    )
+    # libratemon_interp's scheduler thread is only joined on SIGINT, so the
+    # process may abort when it exits. That is fine as long as the results were
+    # written in full.
+    if not path.exists(out_flp) or "rate" not in load_results(out_flp):
+        raise RuntimeError(
+            f"interp_bench failed in mode {mode} with {threads} threads at rate "
+            f"{rate} (exit code {proc.returncode}):\n{proc.stdout[-2000:]}"
+        )
+    if proc.returncode != 0:
+        logging.debug("interp_bench exited with code %d", proc.returncode)
+    return load_results(out_flp)
+
+
+def add_overheads(results):
+    """Add the difference from the baseline of each steady-state statistic."""
+    for config, base in results.get("baseline", {}).items():
+        for mode in MODES[1:]:
+            res = results.get(mode, {}).get(config)
+            if res is None:
+                continue
+            res["overhead"] = {
+                call: {
+                    stat: res[call]["steady"][stat] - base[call]["steady"][stat]
+                    for stat in ["mean_ns", "p50_ns", "p99_ns"]
+                    if res[call]["steady"][stat] is not None
+                    and base[call]["steady"][stat] is not None
+                }
+                for call in CALLS
+            }
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(
+        description="accept()/connect()/close() interposition benchmark."
+    )
+    parser.add_argument(
+        "--threads", default=[1, 4, 16], help="Thread counts.", nargs="+", type=int
+    )
+    parser.add_argument(
+        "--rates",
+        default=[1000, 0],
+        help="Connections/s per thread. 0 means as fast as possible.",
+        nargs="+",
+        type=int,
+    )
+    parser.add_argument(
+        "--conns", default=5000, help="Connections per thread.", type=int
+    )
+    parser.add_argument(
+        "--warmup", default=100, help="Warmup connections per thread.", type=int
+    )
+    parser.add_argument("--max-active-flows", default=5, type=int)
+    parser.add_argument("--epoch-us", default=10000, type=int)
+    parser.add_argument("--idle-timeout-us", default=0, type=int)
+    parser.add_argument("--modes", choices=MODES, default=MODES, nargs="+")
+    parser.add_argument("--out-dir", required=True, type=str)
+    parser.add_argument("--verbose", action="store_true")
+    args = parser.parse_args()
+    assert min(args.threads) > 0 and args.conns > 0
+    assert LOCAL_PORT_START + max(args.threads) <= 65536, "Too many threads."
+    return args
+
+
+def main(args):
+    logging.basicConfig(
+        format="%(asctime)s %(levelname)s %(message)s",
+        level=logging.DEBUG if args.verbose else logging.INFO,
+    )
+    assert os.geteuid() == 0, "Must be run as root."
+    interposed = any(mode != "baseline" for mode in args.modes)
+    for flp in [path.join(BENCH_DIR, "interp_bench")] + (
+        [
+            path.join(RUNTIME_DIR, "ratemon_main"),
+            path.join(RUNTIME_OUTPUT, "ratemon_tc.bpf.o"),
+            path.join(RUNTIME_OUTPUT, "libratemon_interp.so"),
+        ]
+        if interposed
+        else []
+    ):
+        assert path.exists(flp), f"Missing {flp}. Run make first."
+    os.makedirs(args.out_dir, exist_ok=True)
+    os.makedirs(CGROUP, exist_ok=True)
+
+    results = {}
+    ratemon_proc = None
+    try:
+        if interposed:
+            ratemon_proc = netns_bench.start_ratemon(IFACE)
+        for mode in args.modes:
+            for threads in args.threads:
+                for rate in args.rates:
+                    config = f"t{threads}_r{rate}"
+                    logging.info("Running mode: %s, config: %s", mode, config)
+                    results.setdefault(mode, {})[config] = run_config(
+                        args, mode, threads, rate
+                    )
+    finally:
+        if interposed:
+            netns_bench.stop_ratemon(ratemon_proc, IFACE)
+    add_overheads(results)
+
+    out_flp = path.join(args.out_dir, "results.json")
+    with open(out_flp, "w", encoding="utf-8") as fil:
+        json.dump({"args": vars(args), "results": results}, fil, indent=2)
+    print(f"Results: {out_flp}")
+    for mode, configs in results.items():
+        for config, res in configs.items():
+            print(
+                f"{mode:>11} {config:>10}: "
+                + ", ".join(
+                    f"{call} setup={res[call]['setup']['mean_ns']} ns "
+                    f"p50={res[call]['steady']['p50_ns']} ns "
+                    f"p99={res[call]['steady']['p99_ns']} ns"
+                    for call in CALLS
+                )
+                + f", rate={res['rate']['conns_per_s']:.0f} conn/s"
+            )
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(parse_args()))
@@ -0,0 +1,633 @@
+#!/usr/bin/env python
+"""End-to-end benchmark of scheduled RWND tuning on a single machine.
+
+Builds a dumbbell topology out of network namespaces and veth pairs:
+
+    rmb-snd0 --\\
+    rmb-snd1 ---+-- br0 (rmb-sw) --[tbf bottleneck]-- rmb-rcv (root namespace)
+    ...      --/
+
+Each sender namespace runs bench_sender with M flows. The bottleneck is a tbf
+qdisc on the switch's port toward the receiver, and each sender's RTT is set by a
+netem qdisc on the switch's port toward that sender. The receiver (bench_receiver)
+runs in the root namespace so that it shares the BPF filesystem and cgroup with
+ratemon_main, exactly as in a real deployment.
+
+Each run is repeated without RateMon ("baseline") and with RateMon ("ratemon"),
+where the tc/egress program is attached to rmb-rcv, ratemon_main is running, and
+bench_receiver is run with LD_PRELOAD=libratemon_interp.so. The "discover" mode
+is like "ratemon", except that bench_receiver runs without libratemon_interp and
+ratemon_main discovers and schedules its flows instead. For each mode, reports
+flow completion times, JFI, link utilization, bottleneck queue occupancy, and the
+CPU time of the scheduler threads, and writes them to results.json in --out-dir.
+
+Requires root, iproute2, and ethtool. Build the runtime (`make` in the parent
+directory) and the traffic generators (`make` in this directory) first.
+"""
+
+import argparse
+import json
+import logging
+import os
+import select
+import shlex
+import signal
+import subprocess
+import sys
+import threading
+import time
+from os import path
+
+import numpy as np
+
+BENCH_DIR = path.dirname(path.abspath(__file__))
+RUNTIME_DIR = path.dirname(BENCH_DIR)
+RUNTIME_OUTPUT = path.join(RUNTIME_DIR, ".output")
+
+SWITCH_NS = "rmb-sw"
+SENDER_NS_PREFIX = "rmb-snd"
+BRIDGE = "br0"
+RECEIVER_IFACE = "rmb-rcv"
+# Name of the receiver's veth peer, inside SWITCH_NS. The bottleneck is here.
+BOTTLENECK_IFACE = "rmb-rcv-sw"
+SUBNET = "10.77.0"
+RECEIVER_IP = f"{SUBNET}.1"
+CGROUP = "/sys/fs/cgroup/ratemon_bench"
+# Sender i's flows use local ports starting at LOCAL_PORT_START + i * flows.
+LOCAL_PORT_START = 50000
+# Maps that ratemon_tc.bpf.o creates, and that ratemon_main and libratemon_interp
+# expect to find pinned. Map names are truncated to 15 characters. See the
+# attach_tc_and_run target in the runtime Makefile.
+PINNED_MAPS = [
+    ("flow_to_rwnd", "/sys/fs/bpf/flow_to_rwnd"),
+    ("flow_to_win_sca", "/sys/fs/bpf/flow_to_win_scale"),
+    ("flow_to_slot", "/sys/fs/bpf/flow_to_slot"),
+    ("flow_telemetry", "/sys/fs/bpf/flow_telemetry"),
+    ("flow_to_keepali", "/sys/fs/bpf/flow_to_keepalive"),
+    ("flow_to_credit", "/sys/fs/bpf/flow_to_credit"),
+    ("credit_events", "/sys/fs/bpf/credit_events"),
+    ("flow_to_rate", "/sys/fs/bpf/flow_to_rate"),
+    ("flow_events", "/sys/fs/bpf/flow_events"),
+]
+TC_GLOBALS_DIR = "/sys/fs/bpf/tc/globals"
+# Traffic pattern presets: (transfer size (B), off time between transfers (ms)).
+PATTERNS = {
+    "bulk": (64 * 2**20, 0),
+    "rpc": (32 * 2**10, 0),
+    "onoff": (4 * 2**20, 500),
+}
+MODES = ["baseline", "ratemon", "discover"]
+# How often to sample the bottleneck queue.
+QUEUE_SAMPLE_INTERVAL_S = 0.05
+
+
+def run(cmd, nsn=None, check=True):
+    """Run a command, optionally in a network namespace."""
+    if nsn is not None:
+        cmd = ["ip", "netns", "exec", nsn] + cmd
+    logging.debug("Running: %s", " ".join(cmd))
+    return subprocess.run(cmd, check=check, capture_output=True, text=True)
+
+
+def get_bpftool():
+    bpftool = path.join(RUNTIME_OUTPUT, "bpftool", "bootstrap", "bpftool")
+    return bpftool if path.exists(bpftool) else "bpftool"
+
+
+def setup_topology(args):
+    teardown_topology(args)
+    run(["ip", "netns", "add", SWITCH_NS])
+    run(["ip", "link", "add", BRIDGE, "type", "bridge"], SWITCH_NS)
+    run(["ip", "link", "set", BRIDGE, "up"], SWITCH_NS)
+
+    def add_port(iface, peer, peer_ns, addr):
+        run(["ip", "link", "add", iface, "type", "veth", "peer", "name", peer])
+        run(["ip", "link", "set", peer, "netns", SWITCH_NS])
+        run(["ip", "link", "set", peer, "master", BRIDGE], SWITCH_NS)
+        run(["ip", "link", "set", peer, "up"], SWITCH_NS)
+        if peer_ns is not None:
+            run(["ip", "link", "set", iface, "netns", peer_ns])
+        run(["ip", "addr", "add", f"{addr}/24", "dev", iface], peer_ns)
+        run(["ip", "link", "set", iface, "up"], peer_ns)
+        if args.no_offloads:
+            # Segmentation offloads create multi-packet bursts that tbf and the
+            # RWND accounting see as one packet.
+            for nsn, dev in [(peer_ns, iface), (SWITCH_NS, peer)]:
+                run(
+                    ["ethtool", "-K", dev, "tso", "off", "gso", "off", "gro", "off"],
+                    nsn,
+                    check=False,
+                )
+
+    add_port(RECEIVER_IFACE, BOTTLENECK_IFACE, None, RECEIVER_IP)
+    for snd in range(args.senders):
+        nsn = f"{SENDER_NS_PREFIX}{snd}"
+        run(["ip", "netns", "add", nsn])
+        run(["ip", "link", "set", "lo", "up"], nsn)
+        add_port("eth0", f"{nsn}-sw", nsn, f"{SUBNET}.{10 + snd}")
+        # The sender's RTT, applied on the ACK path.
+        rtt_us = args.rtt_us[snd % len(args.rtt_us)]
+        run(
+            ["tc", "qdisc", "add", "dev", f"{nsn}-sw", "root", "netem"]
+            + ["delay", f"{rtt_us}us", "limit", "100000"],
+            SWITCH_NS,
+        )
+
+    # The bottleneck, toward the receiver.
+    bw_Bps = args.bw_mbps * 1e6 / 8
+    limit_B = max(int(args.queue_bdp * bw_Bps * max(args.rtt_us) / 1e6), 15000)
+    run(
+        ["tc", "qdisc", "add", "dev", BOTTLENECK_IFACE, "root", "tbf"]
+        + ["rate", f"{args.bw_mbps}mbit"]
+        + ["burst", str(max(15000, int(bw_Bps / 250)))]
+        + ["limit", str(limit_B)],
+        SWITCH_NS,
+    )
+    logging.info(
+        "Created topology: %d senders, %s Mbps bottleneck, %d B queue",
+        args.senders,
+        args.bw_mbps,
+        limit_B,
+    )
+
+
+def teardown_topology(args):
+    # Deleting a namespace deletes the veth pairs that have an end in it.
+    for snd in range(args.senders):
+        run(["ip", "netns", "del", f"{SENDER_NS_PREFIX}{snd}"], check=False)
+    run(["ip", "netns", "del", SWITCH_NS], check=False)
+    run(["ip", "link", "del", RECEIVER_IFACE], check=False)
+
+
+def wait_for_line(proc, text, timeout_s):
+    """Read a process's stdout until a line contains text."""
+    deadline = time.time() + timeout_s
+    while time.time() < deadline:
+        if proc.poll() is not None:
+            return False
+        ready, _, _ = select.select([proc.stdout], [], [], 0.1)
+        if ready:
+            line = proc.stdout.readline()
+            logging.debug("[%d] %s", proc.pid, line.rstrip())
+            if text in line:
+                return True
+    return False
+
+
+def drain(proc):
+    """Discard a process's output in the background so that it never blocks."""
+
+    def func():
+        for _ in proc.stdout:
+            pass
+
+    threading.Thread(target=func, daemon=True).start()
+
+
+def unregister_struct_ops():
+    bpftool = get_bpftool()
+    out = run([bpftool, "struct_ops", "list"], check=False).stdout
+    for line in out.splitlines():
+        if ":" in line:
+            run(
+                [bpftool, "struct_ops", "unregister", "id", line.split(":")[0]],
+                check=False,
+            )
+
+
+def start_ratemon(iface=RECEIVER_IFACE, env=None):
+    """Attach the tc/egress program, pin its maps, and start ratemon_main.
+
+    env holds additional environment variables for ratemon_main.
+    """
+    unregister_struct_ops()
+    run(["tc", "qdisc", "del", "dev", iface, "clsact"], check=False)
+    run(["tc", "qdisc", "add", "dev", iface, "clsact"])
+    run(
+        ["tc", "filter", "add", "dev", iface, "egress", "bpf"]
+        + ["direct-action", "obj", path.join(RUNTIME_OUTPUT, "ratemon_tc.bpf.o")]
+        + ["sec", "tc/egress"]
+    )
+    for name, pin_path in PINNED_MAPS:
+        run([get_bpftool(), "map", "pin", "name", name, pin_path])
+    proc = subprocess.Popen(
+        [path.join(RUNTIME_DIR, "ratemon_main")],
+        env={**os.environ, "RM_CGROUP": CGROUP, **(env or {})},
+        stdout=subprocess.PIPE,
+        stderr=subprocess.STDOUT,
+        text=True,
+    )
+    if not wait_for_line(proc, "BPF programs running", timeout_s=30):
+        stop(proc)
+        raise RuntimeError("ratemon_main failed to start")
+    drain(proc)
+    return proc
+
+
+def stop_ratemon(proc, iface=RECEIVER_IFACE):
+    if proc is not None:
+        stop(proc)
+    unregister_struct_ops()
+    run(["tc", "filter", "del", "dev", iface, "egress"], check=False)
+    run(["tc", "qdisc", "del", "dev", iface, "clsact"], check=False)
+    for _, pin_path in PINNED_MAPS:
+        for flp in [pin_path, path.join(TC_GLOBALS_DIR, path.basename(pin_path))]:
+            if path.exists(flp):
+                os.remove(flp)
+
+
+def stop(proc, timeout_s=10):
+    """Stop a process with SIGINT, which lets libratemon_interp clean up."""
+    if proc.poll() is None:
+        proc.send_signal(signal.SIGINT)
+        try:
+            proc.wait(timeout=timeout_s)
+        except subprocess.TimeoutExpired:
+            proc.kill()
+            proc.wait()
+
+
+def get_interp_env():
+    """Return the environment variables that load libratemon_interp."""
+    out = run(["make", "-s", "-C", RUNTIME_DIR, "get_ld_vars"]).stdout
+    return dict(var.split("=", 1) for var in shlex.split(out.strip()))
+
+
+def join_cgroup():
+    with open(path.join(CGROUP, "cgroup.procs"), "w", encoding="utf-8") as fil:
+        fil.write(str(os.getpid()))
+
+
+def get_cpu_s(pid):
+    """Return a map from thread ID to the CPU time (s) used by that thread."""
+    ticks = os.sysconf("SC_CLK_TCK")
+    out = {}
+    task_dir = f"/proc/{pid}/task"
+    for tid in os.listdir(task_dir):
+        try:
+            with open(path.join(task_dir, tid, "stat"), "r", encoding="utf-8") as fil:
+                # The command name can contain spaces, so split after it.
+                fields = fil.read().rsplit(")", 1)[1].split()
+        except FileNotFoundError:
+            continue
+        # utime and stime are fields 14 and 15, so 12 and 13 after the name.
+        out[int(tid)] = (int(fields[11]) + int(fields[12])) / ticks
+    return out
+
+
+class QueueSampler(threading.Thread):
+    """Periodically samples the bottleneck queue's backlog and drops."""
+
+    def __init__(self):
+        super().__init__(daemon=True)
+        self.samples = []
+        self.done = threading.Event()
+
+    def run(self):
+        while not self.done.wait(QUEUE_SAMPLE_INTERVAL_S):
+            out = run(
+                ["tc", "-s", "-j", "qdisc", "show", "dev", BOTTLENECK_IFACE],
+                SWITCH_NS,
+                check=False,
+            ).stdout
+            try:
+                qdisc = json.loads(out)[0]
+            except (json.JSONDecodeError, IndexError):
+                continue
+            self.samples.append(
+                (qdisc.get("backlog", 0), qdisc.get("qlen", 0), qdisc.get("drops", 0))
+            )
+
+
+def run_mode(args, mode, out_dir):
+    """Run one experiment in the given mode and return its summary."""
+    size_b, off_ms = PATTERNS[args.pattern]
+    size_b = args.size_b if args.size_b is not None else size_b
+    off_ms = args.off_ms if args.off_ms is not None else off_ms
+    num_flws = args.senders * args.flows
+    rcv_flp = path.join(out_dir, f"{mode}_receiver.csv")
+
+    env = dict(os.environ)
+    ratemon_proc = None
+    if mode == "ratemon":
+        ratemon_proc = start_ratemon()
+        env.update(get_interp_env())
+        env.update(
+            {
+                "RM_MAX_ACTIVE_FLOWS": str(args.max_active_flows),
+                "RM_EPOCH_US": str(args.epoch_us),
+                "RM_EPOCH_JITTER_PERMILLE": str(args.jitter_permille),
+                "RM_IDLE_TIMEOUT_US": str(args.idle_timeout_us),
+                "RM_CREDIT_B": str(args.credit_b),
+                "RM_EPOCH_RTTS": str(args.epoch_rtts),
+                "RM_EARLY_WAKE_RTTS": str(args.early_wake_rtts),
+                "RM_BUSY_POLL": str(int(args.busy_poll)),
+                "RM_SCHED_SHARDS": str(args.shards),
+                "RM_MAX_PAUSED": str(args.max_paused),
+                "RM_POLICY": args.policy,
+                "RM_MAX_WAIT_US": str(args.max_wait_us),
+                "RM_MONITOR_PORT_START": str(LOCAL_PORT_START),
+                "RM_MONITOR_PORT_END": str(LOCAL_PORT_START + num_flws - 1),
+            }
+        )
+        if args.sched_cpu is not None:
+            env["RM_SCHED_CPU"] = str(args.sched_cpu)
+        if args.policy_args is not None:
+            env["RM_POLICY_ARGS"] = args.policy_args
+    elif mode == "discover":
+        ratemon_proc = start_ratemon(
+            env={
+                "RM_MAX_ACTIVE_FLOWS": str(args.max_active_flows),
+                "RM_EPOCH_US": str(args.epoch_us),
+                "RM_DISCOVER_PORT_START": str(LOCAL_PORT_START),
+                "RM_DISCOVER_PORT_END": str(LOCAL_PORT_START + num_flws - 1),
+            }
+        )
+    receiver = None
+    senders = []
+    queue = QueueSampler()
+    try:
+        receiver = subprocess.Popen(
+            [path.join(BENCH_DIR, "bench_receiver"), "--out", rcv_flp],
+            env=env,
+            stdout=subprocess.PIPE,
+            stderr=subprocess.STDOUT,
+            text=True,
+            preexec_fn=join_cgroup,
+        )
+        if not wait_for_line(receiver, "listening", timeout_s=10):
+            raise RuntimeError("bench_receiver failed to start")
+        drain(receiver)
+
+        cpu_before = get_cpu_s(receiver.pid)
+        main_before = sum(get_cpu_s(ratemon_proc.pid).values()) if ratemon_proc else 0
+        queue.start()
+        start_time_s = time.time()
+        for snd in range(args.senders):
+            nsn = f"{SENDER_NS_PREFIX}{snd}"
+            senders.append(
+                subprocess.Popen(
+                    ["ip", "netns", "exec", nsn, path.join(BENCH_DIR, "bench_sender")]
+                    + ["--addr", RECEIVER_IP]
+                    + ["--local-port-start", str(LOCAL_PORT_START + snd * args.flows)]
+                    + ["--flows", str(args.flows)]
+                    + ["--size-b", str(size_b)]
+                    + ["--off-ms", str(off_ms)]
+                    + ["--duration-s", str(args.duration_s)]
+                    + ["--out", path.join(out_dir, f"{mode}_sender{snd}.csv")],
+                    stdout=subprocess.DEVNULL,
+                )
+            )
+        for sender in senders:
+            sender.wait(timeout=args.duration_s + 60)
+        wall_s = time.time() - start_time_s
+        queue.done.set()
+        cpu_after = get_cpu_s(receiver.pid)
+        main_after = sum(get_cpu_s(ratemon_proc.pid).values()) if ratemon_proc else 0
+    finally:
+        queue.done.set()
+        for sender in senders:
+            if sender.poll() is None:
+                sender.kill()
+        if receiver is not None:
+            stop(receiver)
+        if mode != "baseline":
+            stop_ratemon(ratemon_proc)
+
+    # Every thread other than the main thread belongs to libratemon_interp.
+    sched_s = sum(
+        cpu_s - cpu_before.get(tid, 0)
+        for tid, cpu_s in cpu_after.items()
+        if tid != receiver.pid
+    )
+    return summarize(
+        args,
+        rcv_flp,
+        [path.join(out_dir, f"{mode}_sender{snd}.csv") for snd in range(args.senders)],
+        queue.samples,
+        {
+            "scheduler_s": sched_s,
+            "scheduler_pct": sched_s / wall_s * 100,
+            "receiver_s": cpu_after.get(receiver.pid, 0)
+            - cpu_before.get(receiver.pid, 0),
+            "ratemon_main_s": main_after - main_before,
+        },
+    )
+
+
+def load_csv(flp, cols):
+    if not path.exists(flp) or path.getsize(flp) == 0:
+        return np.zeros((0, cols), dtype=np.int64)
+    return np.loadtxt(flp, delimiter=",", dtype=np.int64, ndmin=2)
+
+
+def summarize(args, rcv_flp, snd_flps, queue_samples, cpu):
+    # Sender rows: flow, local port, start (ns), end (ns), bytes
+    transfers = np.concatenate([load_csv(flp, 5) for flp in snd_flps])
+    fcts_ms = (transfers[:, 3] - transfers[:, 2]) / 1e6
+    # Receiver rows: remote port, bytes, first data time (ns), last data time (ns)
+    flws = load_csv(rcv_flp, 4)
+    flws = flws[(flws[:, 1] > 0) & (flws[:, 3] > flws[:, 2])]
+    tputs_bps = flws[:, 1] * 8 / ((flws[:, 3] - flws[:, 2]) / 1e9)
+    span_s = (flws[:, 3].max() - flws[:, 2].min()) / 1e9 if len(flws) else 0
+    backlogs = np.array([sample[0] for sample in queue_samples], dtype=np.float64)
+
+    def pct(vals, pctl):
+        return float(np.percentile(vals, pctl)) if len(vals) else None
+
+    return {
+        "fct": {
+            "count": len(fcts_ms),
+            "mean_ms": float(fcts_ms.mean()) if len(fcts_ms) else None,
+            "p50_ms": pct(fcts_ms, 50),
+            "p99_ms": pct(fcts_ms, 99),
+            "max_ms": float(fcts_ms.max()) if len(fcts_ms) else None,
+        },
+        "jfi": (
+            float(tputs_bps.sum() ** 2 / (len(tputs_bps) * (tputs_bps**2).sum()))
+            if len(tputs_bps)
+            else None
+        ),
+        "util": (
+            float(flws[:, 1].sum() * 8 / span_s / (args.bw_mbps * 1e6))
+            if span_s
+            else None
+        ),
+        "flows": len(flws),
+        "queue": {
+            "mean_B": float(backlogs.mean()) if len(backlogs) else None,
+            "p50_B": pct(backlogs, 50),
+            "p99_B": pct(backlogs, 99),
+            "max_B": float(backlogs.max()) if len(backlogs) else None,
+            "drops": int(queue_samples[-1][2]) if queue_samples else None,
+        },
+        "cpu": cpu,
+    }
+
+
+def build_parser(description="netns/veth RateMon benchmark."):
+    parser = argparse.ArgumentParser(description=description)
+    parser.add_argument("--senders", default=2, help="Number of senders.", type=int)
+    parser.add_argument("--flows", default=5, help="Flows per sender.", type=int)
+    parser.add_argument(
+        "--pattern", choices=list(PATTERNS.keys()), default="bulk", type=str
+    )
+    parser.add_argument(
+        "--size-b", help="Override the pattern's transfer size (B).", type=int
+    )
+    parser.add_argument(
+        "--off-ms", help="Override the pattern's off time (ms).", type=int
+    )
+    parser.add_argument("--duration-s", default=30, type=int)
+    parser.add_argument("--bw-mbps", default=100, type=float)
+    parser.add_argument(
+        "--rtt-us",
+        default=[10000],
+        help="RTT of each sender (us). Cycled if there are fewer than senders.",
+        nargs="+",
+        type=int,
+    )
+    parser.add_argument(
+        "--queue-bdp",
+        default=1.0,
+        help="Bottleneck queue size, as a multiple of the largest BDP.",
+        type=float,
+    )
+    parser.add_argument("--max-active-flows", default=5, type=int)
+    parser.add_argument("--epoch-us", default=10000, type=int)
+    parser.add_argument("--idle-timeout-us", default=1000, type=int)
+    parser.add_argument(
+        "--jitter-permille",
+        default=125,
+        help="Random jitter applied to each epoch, in thousandths of the epoch.",
+        type=int,
+    )
+    parser.add_argument(
+        "--credit-b",
+        default=0,
+        help="Byte credit per activation. 0 uses time epochs only.",
+        type=int,
+    )
+    parser.add_argument(
+        "--epoch-rtts",
+        default=0,
+        help="Epoch length as a multiple of each flow's RTT. 0 uses --epoch-us.",
+        type=int,
+    )
+    parser.add_argument(
+        "--early-wake-rtts",
+        default=0,
+        help="Activate each flow's successor this many RTTs before its epoch ends.",
+        type=int,
+    )
+    parser.add_argument(
+        "--max-paused",
+        default=0,
+        help="Max paused flows. Flows beyond this wait, paused, outside the backlog.",
+        type=int,
+    )
+    parser.add_argument(
+        "--policy",
+        default="round_robin",
+        help=(
+            "Scheduling policy: round_robin, lifo, odf, or the path of a policy "
+            "shared object, such as random_policy.so."
+        ),
+    )
+    parser.add_argument("--policy-args", help="RM_POLICY_ARGS for --policy.")
+    parser.add_argument(
+        "--max-wait-us",
+        default=0,
+        help="Activate flows that have been paused this long. 0 disables aging.",
+        type=int,
+    )
+    parser.add_argument(
+        "--busy-poll",
+        action="store_true",
+        help="Busy-poll in the scheduler thread instead of sleeping.",
+    )
+    parser.add_argument(
+        "--sched-cpu", help="CPU to pin the scheduler thread to.", type=int
+    )
+    parser.add_argument(
+        "--shards",
+        default=1,
+        help="Scheduler shards (threads) to hash flows across.",
+        type=int,
+    )
+    parser.add_argument("--modes", choices=MODES, default=MODES, nargs="+")
+    parser.add_argument(
+        "--no-offloads",
+        action="store_true",
+        help="Disable TSO, GSO, and GRO on all veth interfaces.",
+    )
+    parser.add_argument("--out-dir", required=True, type=str)
+    parser.add_argument("--verbose", action="store_true")
+    return parser
+
+
+def check_args(args):
+    assert args.senders > 0 and args.flows > 0
+    assert 0 < args.shards <= 64
+    assert LOCAL_PORT_START + args.senders * args.flows <= 65536, "Too many flows."
+    # libratemon_interp loads policies from paths that contain a '/'.
+    if args.policy.endswith(".so"):
+        args.policy = path.abspath(args.policy)
+    return args
+
+
+def parse_args():
+    return check_args(build_parser().parse_args())
+
+
+def main(args):
+    logging.basicConfig(
+        format="%(asctime)s %(levelname)s %(message)s",
+        level=logging.DEBUG if args.verbose else logging.INFO,
+    )
+    assert os.geteuid() == 0, "Must be run as root."
+    for flp in [
+        path.join(BENCH_DIR, "bench_sender"),
+        path.join(BENCH_DIR, "bench_receiver"),
+    ] + (
+        [
+            path.join(RUNTIME_DIR, "ratemon_main"),
+            path.join(RUNTIME_OUTPUT, "ratemon_tc.bpf.o"),
+        ]
+        if any(mode != "baseline" for mode in args.modes)
+        else []
+    ) + (
+        [path.join(RUNTIME_OUTPUT, "libratemon_interp.so")]
+        if "ratemon" in args.modes
+        else []
+    ):
+        assert path.exists(flp), f"Missing {flp}. Run make first."
+    os.makedirs(args.out_dir, exist_ok=True)
+    os.makedirs(CGROUP, exist_ok=True)
+
+    results = {}
+    setup_topology(args)
+    try:
+        for mode in args.modes:
+            logging.info("Running mode: %s", mode)
+            results[mode] = run_mode(args, mode, args.out_dir)
+            logging.info("%s: %s", mode, json.dumps(results[mode]))
+    finally:
+        teardown_topology(args)
+
+    out_flp = path.join(args.out_dir, "results.json")
+    with open(out_flp, "w", encoding="utf-8") as fil:
+        json.dump({"args": vars(args), "results": results}, fil, indent=2)
+    print(f"Results: {out_flp}")
+    for mode, res in results.items():
+        print(
+            f"{mode:>8}: FCT p50={res['fct']['p50_ms']} ms "
+            f"p99={res['fct']['p99_ms']} ms, JFI={res['jfi']}, "
+            f"util={res['util']}, queue p99={res['queue']['p99_B']} B, "
+            f"scheduler CPU={res['cpu']['scheduler_pct']:.2f}%"
+        )
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(parse_args()))
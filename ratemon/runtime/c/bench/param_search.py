@@ -0,0 +1,298 @@
+#!/usr/bin/env python
+"""Search for the scheduled RWND tuning parameters that suit a workload.
+
+Each trial runs netns_bench's "ratemon" mode on its dumbbell topology (see
+netns_bench.py) with one combination of max_active_flows, epoch_us,
+idle_timeout_us, and jitter_permille, taken from the grid given by the --*-grid
+arguments. The search either runs every point in the grid ("grid"), or runs
+--trials points chosen by Bayesian optimization ("bayes"): after --init-trials
+random points, it fits a Gaussian process to the trials so far and runs the
+point with the highest expected improvement in --objective. The baseline,
+without RateMon, is run once for reference.
+
+The objectives are p99 flow completion time (lower is better), and JFI and
+link utilization (higher is better). Each trial is repeated --repeats times and
+its objectives are averaged. Writes every trial, the best trial for
+--objective, and the Pareto front across all objectives to search.json in
+--out-dir, after every trial.
+
+Accepts all of netns_bench.py's arguments, which describe the scenario.
+Requires root. Build the runtime (`make` in the parent directory) and the
+traffic generators (`make` in this directory) first.
+"""
+
+import copy
+import itertools
+import json
+import logging
+import os
+import sys
+from os import path
+
+import numpy as np
+from scipy.stats import norm
+from sklearn.gaussian_process import GaussianProcessRegressor
+from sklearn.gaussian_process.kernels import ConstantKernel, Matern, WhiteKernel
+
+import netns_bench
+from netns_bench import BENCH_DIR, CGROUP, RUNTIME_DIR, RUNTIME_OUTPUT
+
+# Searched parameters, which are also netns_bench arguments, and whether to
+# search them on a log scale.
+PARAMS = {
+    "max_active_flows": True,
+    "epoch_us": True,
+    "idle_timeout_us": True,
+    "jitter_permille": False,
+}
+# Maps objective name to a function that extracts it from a netns_bench
+# summary, and whether higher is better.
+OBJECTIVES = {
+    "fct_p99": (lambda res: res["fct"]["p99_ms"], False),
+    "jfi": (lambda res: res["jfi"], True),
+    "util": (lambda res: res["util"], True),
+}
+# Minimum expected improvement, relative to the standard deviation of the
+# observed scores, for exploration.
+EI_XI = 0.01
+
+
+def get_grid(args):
+    """Return every combination of parameter values, as a list of dicts."""
+    values = [sorted(set(getattr(args, f"{param}_grid"))) for param in PARAMS]
+    return [dict(zip(PARAMS, combo)) for combo in itertools.product(*values)]
+
+
+def get_features(grid):
+    """Scale each parameter to [0, 1], on a log scale if it is searched on one."""
+    feats = np.array(
+        [
+            [
+                np.log1p(point[param]) if log else point[param]
+                for param, log in PARAMS.items()
+            ]
+            for point in grid
+        ],
+        dtype=np.float64,
+    )
+    span = feats.max(axis=0) - feats.min(axis=0)
+    span[span == 0] = 1
+    return (feats - feats.min(axis=0)) / span
+
+
+def score(summaries, objective):
+    """Average an objective across repeats, or None if it was never measured."""
+    vals = [OBJECTIVES[objective][0](res) for res in summaries]
+    vals = [val for val in vals if val is not None]
+    return float(np.mean(vals)) if vals else None
+
+
+def run_trial(args, params, out_dir):
+    """Run one point in the grid --repeats times and return its summaries."""
+    trial_args = copy.copy(args)
+    for param, val in params.items():
+        setattr(trial_args, param, val)
+    summaries = []
+    for rep in range(args.repeats):
+        rep_dir = path.join(out_dir, f"rep{rep}")
+        os.makedirs(rep_dir, exist_ok=True)
+        try:
+            summaries.append(netns_bench.run_mode(trial_args, "ratemon", rep_dir))
+        except (RuntimeError, OSError) as exc:
+            logging.warning("Trial %s failed: %s", params, exc)
+    return summaries
+
+
+def propose(feats, trials, objective, rng):
+    """Return the index of the untried point with the highest expected
+    improvement in the objective, according to a Gaussian process fit to the
+    trials so far."""
+    tried = [trial["idx"] for trial in trials]
+    untried = np.setdiff1d(np.arange(len(feats)), tried)
+    sign = 1 if OBJECTIVES[objective][1] else -1
+    scores = [trial["scores"][objective] for trial in trials]
+    measured = [sign * val for val in scores if val is not None]
+    if not measured:
+        return int(rng.choice(untried))
+    # Treat failed trials as no better than the worst successful one.
+    y = np.array([sign * val if val is not None else min(measured) for val in scores])
+    gpr = GaussianProcessRegressor(
+        kernel=ConstantKernel() * Matern(nu=2.5) + WhiteKernel(),
+        normalize_y=True,
+        n_restarts_optimizer=2,
+        random_state=int(rng.integers(2**31)),
+    )
+    gpr.fit(feats[tried], y)
+    mean, std = gpr.predict(feats[untried], return_std=True)
+    imp = mean - y.max() - EI_XI * (y.std() or 1)
+    with np.errstate(divide="ignore", invalid="ignore"):
+        zsc = np.where(std > 0, imp / std, 0)
+    expected = np.where(std > 0, imp * norm.cdf(zsc) + std * norm.pdf(zsc), 0)
+    return int(untried[np.argmax(expected)])
+
+
+def get_pareto(trials):
+    """Return the indices (into trials) of the trials that are not dominated,
+    i.e., no other trial is at least as good in every objective and better in
+    one."""
+    points = [
+        (
+            i,
+            [
+                val if OBJECTIVES[obj][1] else -val
+                for obj, val in trial["scores"].items()
+            ],
+        )
+        for i, trial in enumerate(trials)
+        if None not in trial["scores"].values()
+    ]
+    return [
+        i
+        for i, vals in points
+        if not any(
+            all(o >= v for o, v in zip(other, vals))
+            and any(o > v for o, v in zip(other, vals))
+            for _, other in points
+        )
+    ]
+
+
+def write_results(args, baseline, trials):
+    best = None
+    measured = [
+        trial for trial in trials if trial["scores"][args.objective] is not None
+    ]
+    if measured:
+        best = (max if OBJECTIVES[args.objective][1] else min)(
+            measured, key=lambda trial: trial["scores"][args.objective]
+        )
+    out = {
+        "args": vars(args),
+        "baseline": baseline,
+        "trials": trials,
+        "best": best,
+        "pareto": [trials[i] for i in get_pareto(trials)],
+    }
+    out_flp = path.join(args.out_dir, "search.json")
+    with open(out_flp, "w", encoding="utf-8") as fil:
+        json.dump(out, fil, indent=2)
+    return out, out_flp
+
+
+def parse_args():
+    parser = netns_bench.build_parser(
+        description="Scheduled RWND tuning parameter search."
+    )
+    parser.add_argument("--search", choices=["grid", "bayes"], default="bayes")
+    parser.add_argument(
+        "--objective", choices=list(OBJECTIVES.keys()), default="fct_p99"
+    )
+    parser.add_argument(
+        "--trials", default=20, help="Trials for --search=bayes.", type=int
+    )
+    parser.add_argument(
+        "--init-trials",
+        default=5,
+        help="Random trials before --search=bayes starts fitting.",
+        type=int,
+    )
+    parser.add_argument("--repeats", default=1, help="Runs per trial.", type=int)
+    parser.add_argument("--seed", default=0, type=int)
+    parser.add_argument(
+        "--max-active-flows-grid", default=[1, 2, 5, 10, 20], nargs="+", type=int
+    )
+    parser.add_argument(
+        "--epoch-us-grid",
+        default=[1000, 2000, 5000, 10000, 20000, 50000, 100000],
+        nargs="+",
+        type=int,
+    )
+    parser.add_argument(
+        "--idle-timeout-us-grid", default=[0, 500, 1000, 5000], nargs="+", type=int
+    )
+    parser.add_argument(
+        "--jitter-permille-grid", default=[0, 125, 250], nargs="+", type=int
+    )
+    args = netns_bench.check_args(parser.parse_args())
+    assert args.trials > 0 and args.init_trials > 0 and args.repeats > 0
+    assert min(args.max_active_flows_grid) > 0 and min(args.epoch_us_grid) > 0
+    assert min(args.jitter_permille_grid) >= 0
+    assert max(args.jitter_permille_grid) <= 1000
+    return args
+
+
+def main(args):
+    logging.basicConfig(
+        format="%(asctime)s %(levelname)s %(message)s",
+        level=logging.DEBUG if args.verbose else logging.INFO,
+    )
+    assert os.geteuid() == 0, "Must be run as root."
+    for flp in [
+        path.join(BENCH_DIR, "bench_sender"),
+        path.join(BENCH_DIR, "bench_receiver"),
+        path.join(RUNTIME_DIR, "ratemon_main"),
+        path.join(RUNTIME_OUTPUT, "ratemon_tc.bpf.o"),
+        path.join(RUNTIME_OUTPUT, "libratemon_interp.so"),
+    ]:
+        assert path.exists(flp), f"Missing {flp}. Run make first."
+    os.makedirs(args.out_dir, exist_ok=True)
+    os.makedirs(CGROUP, exist_ok=True)
+
+    grid = get_grid(args)
+    feats = get_features(grid)
+    num_trials = len(grid) if args.search == "grid" else min(args.trials, len(grid))
+    logging.info("Searching %d of %d points", num_trials, len(grid))
+    rng = np.random.default_rng(args.seed)
+    init_idxs = rng.permutation(len(grid))[: args.init_trials].tolist()
+
+    trials = []
+    netns_bench.setup_topology(args)
+    try:
+        logging.info("Running baseline")
+        base_dir = path.join(args.out_dir, "baseline")
+        os.makedirs(base_dir, exist_ok=True)
+        baseline = netns_bench.run_mode(args, "baseline", base_dir)
+        for num in range(num_trials):
+            if args.search == "grid":
+                idx = num
+            elif num < len(init_idxs):
+                idx = init_idxs[num]
+            else:
+                idx = propose(feats, trials, args.objective, rng)
+            logging.info("Trial %d/%d: %s", num + 1, num_trials, grid[idx])
+            summaries = run_trial(
+                args, grid[idx], path.join(args.out_dir, f"trial{num}")
+            )
+            trials.append(
+                {
+                    "idx": idx,
+                    "params": grid[idx],
+                    "scores": {obj: score(summaries, obj) for obj in OBJECTIVES},
+                    "results": summaries,
+                }
+            )
+            logging.info("Trial %d scores: %s", num + 1, trials[-1]["scores"])
+            out, out_flp = write_results(args, baseline, trials)
+    finally:
+        netns_bench.teardown_topology(args)
+
+    print(f"Results: {out_flp}")
+    print(
+        "Baseline: "
+        + ", ".join(f"{obj}={score([baseline], obj)}" for obj in OBJECTIVES)
+    )
+    if out["best"] is not None:
+        print(f"Best {args.objective}: {out['best']['params']} {out['best']['scores']}")
+    print("Pareto front:")
+    for trial in out["pareto"]:
+        print(
+            "  "
+            + ", ".join(f"{param}={val}" for param, val in trial["params"].items())
+            + ": "
+            + ", ".join(f"{obj}={val:.4g}" for obj, val in trial["scores"].items())
+        )
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(parse_args()))
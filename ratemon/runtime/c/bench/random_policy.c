@@ -0,0 +1,118 @@
+// Example scheduling policy for libratemon_interp, for comparison against the
+// built-in policies. Activates paused flows with pending data in a random
+// order. Load it with RM_POLICY=<path to random_policy.so>. RM_POLICY_ARGS, if
+// set, is the seed.
+//
+// See ../ratemon_policy.h for the interface.
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "../ratemon.h"
+#include "../ratemon_policy.h"
+
+struct entry {
+  int fd;
+  unsigned long paused_at_ns;
+};
+
+// The paused flows in one class, in no particular order.
+struct backlog {
+  struct entry *entries;
+  unsigned long len;
+  unsigned long cap;
+  // The scheduling round that left applies to, and the number of entries at
+  // the front of entries that pick_next() has not looked at yet in that round.
+  unsigned long round_ns;
+  unsigned long left;
+};
+
+struct random_policy {
+  const struct rm_policy_env *env;
+  unsigned int seed;
+  struct backlog backlogs[RM_MAX_CLASSES];
+};
+
+static int init(const struct rm_policy_env *env, const char *args,
+                void **ctx) {
+  struct random_policy *pol = calloc(1, sizeof(*pol));
+  if (pol == NULL)
+    return -1;
+  pol->env = env;
+  pol->seed = args != NULL ? (unsigned int)strtoul(args, NULL, 10)
+                           : (unsigned int)time(NULL);
+  *ctx = pol;
+  return 0;
+}
+
+static void fini(void *ctx) {
+  struct random_policy *pol = ctx;
+  for (unsigned int c = 0; c < RM_MAX_CLASSES; ++c)
+    free(pol->backlogs[c].entries);
+  free(pol);
+}
+
+static void push(void *ctx, int fd, unsigned int cls,
+                 unsigned long paused_at_ns) {
+  struct backlog *b = &((struct random_policy *)ctx)->backlogs[cls];
+  if (b->len == b->cap) {
+    unsigned long cap = b->cap ? b->cap * 2 : 64;
+    struct entry *entries = realloc(b->entries, cap * sizeof(*entries));
+    // There is no way to report an error, so drop the flow. It can still be
+    // activated by aging.
+    if (entries == NULL)
+      return;
+    b->entries = entries;
+    b->cap = cap;
+  }
+  b->entries[b->len++] = (struct entry){fd, paused_at_ns};
+}
+
+// Swap entries i and j.
+static void swap(struct backlog *b, unsigned long i, unsigned long j) {
+  struct entry tmp = b->entries[i];
+  b->entries[i] = b->entries[j];
+  b->entries[j] = tmp;
+}
+
+// Look at the unvisited entries in a random order. Entries without pending
+// data are moved past the unvisited ones, so that each entry is looked at most
+// once per round.
+static int pick_next(void *ctx, unsigned int cls, unsigned long now_ns) {
+  struct random_policy *pol = ctx;
+  struct backlog *b = &pol->backlogs[cls];
+  if (b->round_ns != now_ns) {
+    b->round_ns = now_ns;
+    b->left = b->len;
+  }
+  while (b->left > 0) {
+    unsigned long i = (unsigned long)rand_r(&pol->seed) % b->left;
+    struct entry e = b->entries[i];
+    --b->left;
+    if (pol->env->is_paused(e.fd, e.paused_at_ns) &&
+        !pol->env->has_demand(e.fd)) {
+      swap(b, i, b->left);
+      continue;
+    }
+    // Remove this entry: fill its place with the last unvisited entry, and
+    // that entry's place with the last entry.
+    b->entries[i] = b->entries[b->left];
+    b->entries[b->left] = b->entries[--b->len];
+    // Drop flows that have been closed or activated.
+    if (pol->env->is_paused(e.fd, e.paused_at_ns))
+      return e.fd;
+  }
+  return -1;
+}
+
+const struct rm_policy_ops rm_policy_ops = {
+    .init = init,
+    .on_register = push,
+    .on_demand = push,
+    .on_idle = push,
+    .on_deadline = NULL,
+    .pick_next = pick_next,
+    .fini = fini,
+};
@@ -6,81 +6,300 @@
 #include <bpf/bpf.h>
 #include <bpf/libbpf.h>
 #include <dlfcn.h>
+#include <errno.h>
 #include <linux/inet_diag.h>
 #include <netinet/in.h> // structure for storing address information
 #include <netinet/tcp.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/socket.h> // for socket APIs
 #include <time.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
 #include <boost/asio.hpp>
-#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <cassert>
+#include <chrono>
 #include <cmath>
+#include <deque>
 #include <experimental/random>
+#include <istream>
+#include <memory>
 #include <mutex>
+#include <optional>
 #include <queue>
+#include <string>
 #include <unordered_map>
 #include <unordered_set>
 #include <utility>
+#include <vector>
 
 #include "ratemon.h"
+#include "ratemon_policy.h"
+#include "ratemon_slots.h"
 
-// Protects writes only to max_active_flows, epoch_us, idle_timeout_ns,
-// monitor_port_start, monitor_port_end, flow_to_rwnd_fd, flow_to_win_scale_fd,
-// flow_to_last_data_time_fd, flow_to_keepalive_fd, oldact, and setup. Reads are
-// unprotected.
+// Protects writes only to max_active_flows, epoch_us, epoch_rtts,
+// epoch_min_us, epoch_max_us, early_wake_rtts, busy_poll, sched_cpu,
+// sched_fifo_prio, idle_timeout_ns,
+// monitor_port_range, credit_B, num_classes,
+// class_min_slots, the class rules, flow_to_rwnd_fd,
+// flow_to_win_scale_fd, flow_to_slot_fd, telemetry, flow_to_keepalive_fd,
+// flow_to_credit_fd, credit_rb, control_path, oldact, shards, num_shards, and
+// setup. Reads are unprotected. After setup, the tuning parameters are only
+// written by the control channel, which holds every shard's lock while doing
+// so, so each shard always sees a consistent set of them.
 std::mutex lock_setup;
-// Whether setup has been performed.
-bool setup_done = false;
-// Used to signal the scheduler thread to end.
-bool run = true;
+// Whether setup has been performed. Set with release ordering after setup, so
+// that a thread that reads true with acquire ordering sees the shards and
+// everything else that setup() initialized.
+std::atomic<bool> setup_done = false;
+// Used to signal the scheduler threads to end. Written by the SIGINT handler
+// and read by the scheduler threads and the interposed functions, so it must be
+// atomic (and lock-free, to be safe to write from a signal handler).
+std::atomic<bool> run = true;
+static_assert(std::atomic<bool>::is_always_lock_free);
 // Existing signal handler for SIGINT.
 struct sigaction oldact;
 // FD for the BPF map "flow_to_rwnd".
 int flow_to_rwnd_fd = 0;
 // FD for the BPF map "flow_to_win_sca" (short for "flow_to_win_scale").
 int flow_to_win_scale_fd = 0;
-// FD for the BPF map "flow_to_last_da" (short for "flow_to_last_data_time_ns").
-int flow_to_last_data_time_fd = 0;
+// FD for the BPF map "flow_to_slot".
+int flow_to_slot_fd = 0;
+// The BPF map "flow_telemetry", mapped into memory. Indexed by slot.
+struct rm_telemetry *telemetry = NULL;
 // FD for the BPF map "flow_to_keepali" (short for "flow_to_keepalive").
 int flow_to_keepalive_fd = 0;
-// Runs async timers for scheduling
-boost::asio::io_context io;
-// Periodically performs scheduling using timer_callback().
-boost::asio::deadline_timer timer(io);
-// Manages the io_context.
-std::thread scheduler_thread;
-// Protects writes and reads to active_fds_queue, paused_fds_queue, and
-// fd_to_flow.
-std::mutex lock_scheduler;
-// FDs for flows thare are currently active.
-std::queue<std::pair<int, boost::posix_time::ptime>> active_fds_queue;
-// FDs for flows that are currently paused (RWND = 0 B);
-std::queue<int> paused_fds_queue;
-// Maps file descriptor to rm_flow struct.
-std::unordered_map<int, struct rm_flow> fd_to_flow;
+// FD for the BPF map "flow_to_credit". Only used in byte-credit mode.
+int flow_to_credit_fd = 0;
+// Reads the BPF ring buffer "credit_events". Only used in byte-credit mode.
+struct ring_buffer *credit_rb = NULL;
+// The scheduler's clock. On Linux, this is CLOCK_MONOTONIC, which is also the
+// clock that the BPF programs use (bpf_ktime_get_ns()), so deadlines and kernel
+// timestamps are directly comparable. Reading it involves no time zone
+// conversion.
+typedef std::chrono::steady_clock rm_clock;
+// An active flow, or a draining flow (see draining_fds): its FD, when its epoch
+// ends, and its RTT (us) when the epoch started, or 0 if there was no RTT
+// sample or neither adaptive epochs nor early wake need it. The RTT is read
+// once per epoch, since each read is a syscall (see get_rtt_us()).
+struct active_flow {
+  int fd;
+  rm_clock::time_point epoch_end;
+  unsigned long rtt_us;
+};
+// The scheduler is split into shards, so that a process with very many flows
+// can schedule them on more than one thread. Each flow belongs to the shard
+// that its FD hashes to (see shard_for()), which schedules it on its own
+// thread, with its own io_context, timer, lock, and policy state. The shards
+// share one budget of max_active_flows active slots (see slots_used). With one
+// shard, which is the default, this is a single scheduler thread.
+struct scheduler_shard {
+  // This shard's index in shards.
+  unsigned int idx;
+  // Runs async timers for scheduling
+  boost::asio::io_context io;
+  // Periodically performs scheduling using timer_callback(). asio implements
+  // this with a timerfd on CLOCK_MONOTONIC. Not used in busy-poll mode.
+  boost::asio::steady_timer timer;
+  // In busy-poll mode, when timer_callback() should run next, or
+  // rm_clock::time_point::max() if it should not. Only accessed on this shard's
+  // thread.
+  rm_clock::time_point busy_poll_deadline = rm_clock::time_point::max();
+  // When timer_callback() is supposed to run next, for measuring lateness.
+  rm_clock::time_point timer_deadline;
+  // Manages the io_context.
+  std::thread thread;
+  // Protects writes and reads to active_fds_queue, fd_to_paused_since,
+  // draining_fds, fd_to_flow, fd_to_class, fd_to_slot, pending_fds_queue,
+  // pending_fd_to_flow, register_posted, exhausted_flows, fd_to_rejected_since,
+  // rejected_fds_queue, paused_order, num_rejected, num_aged, and this shard's
+  // scheduling policy state.
+  std::mutex lock;
+  // FDs for flows thare are currently active. Each holds one slot of the
+  // active budget.
+  std::queue<active_flow> active_fds_queue;
+  // Flows that have handed their slot to a successor that was woken early.
+  // They will be paused at the end of their epoch. They do not count toward
+  // max_active_flows.
+  std::vector<active_flow> draining_fds;
+  // Maps the FD of each flow that is currently paused (RWND = 0 B) to when it
+  // was paused (ns). The scheduling policy keeps the paused flows in order.
+  std::unordered_map<int, unsigned long> fd_to_paused_since;
+  // Maps the FD of each flow that was rejected because the paused backlog was
+  // full to when it was rejected (ns). A rejected flow is held at RWND = 0 B
+  // like a paused flow, but it is not in the backlog, so the scheduling policy
+  // does not see it. It joins the backlog once there is room.
+  std::unordered_map<int, unsigned long> fd_to_rejected_since;
+  // The rejected flows, in the order that they were rejected, and when. An
+  // entry is stale if its FD's time in fd_to_rejected_since does not match.
+  std::queue<std::pair<int, unsigned long>> rejected_fds_queue;
+  // When max_wait_us is set, each class's paused flows (paused_at_ns, FD), in
+  // the order that they were paused, so that aging only looks at the flows that
+  // have waited the longest. An entry is stale if its FD's time in
+  // fd_to_paused_since does not match. Flows paused while max_wait_us was 0
+  // are not in it.
+  std::deque<std::pair<unsigned long, int>> paused_order[RM_MAX_CLASSES];
+  // Maps file descriptor to rm_flow struct.
+  std::unordered_map<int, struct rm_flow> fd_to_flow;
+  // Maps file descriptor to priority class.
+  std::unordered_map<int, unsigned int> fd_to_class;
+  // Maps file descriptor to its slot in telemetry.
+  std::unordered_map<int, unsigned int> fd_to_slot;
+  // FDs that have been accepted or connected but not yet registered, in order.
+  // An FD may appear more than once if it was closed and reused before it was
+  // registered. Only entries that are in pending_fd_to_flow are valid.
+  std::queue<int> pending_fds_queue;
+  // Maps a pending FD to its partially-filled rm_flow and whether it was
+  // accepted (as opposed to connected). The remote address and port are filled
+  // in if accept()/connect() provided them (otherwise the remote port is 0),
+  // but the local address and port are not.
+  std::unordered_map<int, std::pair<struct rm_flow, bool>> pending_fd_to_flow;
+  // Whether register_pending_fds() has been posted to this shard's thread and
+  // has not run yet.
+  bool register_posted = false;
+  // Flows that credit_events reported as having exhausted their byte credit
+  // since this shard's last scheduling round. The events do not say which
+  // shard a flow belongs to, so every shard gets every event and ignores the
+  // ones for flows that it does not have active.
+  std::vector<struct rm_flow> exhausted_flows;
+  // The number of new flows rejected because the paused backlog was full, and
+  // the number of flows activated because they reached max_wait_us.
+  unsigned long num_rejected = 0;
+  unsigned long num_aged = 0;
+  // Whether this shard's last scheduling round ended with paused flows that it
+  // could not activate because the active budget was used up. Only written with
+  // lock held, but read by other shards.
+  std::atomic<bool> waiting = false;
+
+  explicit scheduler_shard(unsigned int idx_) : idx(idx_), timer(io) {}
+};
+// The shards, which are created during setup. Never resized afterward.
+std::vector<std::unique_ptr<scheduler_shard>> shards;
+unsigned int num_shards = 1;
+// The number of slots of the active budget (max_active_flows) that the shards
+// hold, i.e., the total size of their active_fds_queues. See ratemon_slots.h.
+std::atomic<unsigned long> slots_used = 0;
+// The total number of paused flows across all shards, for admission control.
+std::atomic<unsigned long> total_paused = 0;
+// The number of shards whose waiting flag is set.
+std::atomic<unsigned int> num_waiting_shards = 0;
+// A bitmap of the FDs that may be registered, i.e., that are pending or in
+// their shard's fd_to_flow. Bits are only written with the FD's shard's lock
+// held: set when the FD is queued for registration and cleared once the FD is
+// neither. This lets close() skip the lock for every other FD, such as files
+// and pipes. FDs at or above RM_MAX_TRACKED_FDS are always considered possibly
+// registered.
+std::atomic<unsigned long> fd_maybe_registered[RM_MAX_TRACKED_FDS / 64];
+// Waits for credit_rb to become readable, on shard 0. Only used in byte-credit
+// mode.
+std::optional<boost::asio::posix::stream_descriptor> credit_events_desc;
+// Listens on the control socket, at control_path, on shard 0. Only used if
+// RM_CONTROL_DIR is set.
+std::optional<boost::asio::local::stream_protocol::acceptor> control_acceptor;
+std::string control_path;
+// An open connection to the control socket.
+struct control_session {
+  boost::asio::local::stream_protocol::socket sock;
+  // Commands are at most 1 KB.
+  boost::asio::streambuf buf;
+  std::string reply;
+  control_session() : sock(shards[0]->io), buf(1024) {}
+};
+// Open connections to the control socket. Only accessed on shard 0's thread.
+std::unordered_set<std::shared_ptr<control_session>> control_sessions;
 // The next four are scheduled RWND tuning parameters. See ratemon.h for
 // parameter documentation.
 unsigned int max_active_flows = 5;
 unsigned int epoch_us = 10000;
 long idle_timeout_us = 0;
 unsigned long idle_timeout_ns = 0;
-unsigned short monitor_port_start = 9000;
-unsigned short monitor_port_end = 9999;
+// The range of REMOTE ports to manage, packed as (start << 16) | end so that
+// accept() and connect() always see a consistent range, even while the control
+// channel is changing it.
+std::atomic<unsigned int> monitor_port_range = (9000U << 16) | 9999U;
+// Adaptive epoch parameters. 0 disables adaptive epochs.
+unsigned int epoch_rtts = 0;
+unsigned int epoch_min_us = 0;
+unsigned int epoch_max_us = 0;
+// Random jitter applied to each epoch, in thousandths of the epoch.
+unsigned int jitter_permille = 125;
+// Early-wake lead time, in RTTs. 0 disables early wake.
+unsigned int early_wake_rtts = 0;
+// Scheduler thread options. Whether to busy-poll instead of sleeping until the
+// next event, the CPU to pin the thread to (or -1; shard i's thread is pinned
+// to sched_cpu + i), and its SCHED_FIFO priority (or 0 to keep the default
+// policy).
+unsigned int busy_poll = 0;
+int sched_cpu = -1;
+unsigned int sched_fifo_prio = 0;
+// Byte credit granted to each activated flow. 0 disables byte-credit mode.
+unsigned int credit_B = 0;
+// Number of priority classes, and the minimum number of active slots for each.
+unsigned int num_classes = 1;
+unsigned int class_min_slots[RM_MAX_CLASSES] = {0};
+// Places flows whose SO_PRIORITY, DSCP, or remote port (depending on the list
+// that the rule is in) is in [lo, hi] in class cls.
+struct class_rule {
+  unsigned int lo;
+  unsigned int hi;
+  unsigned int cls;
+};
+std::vector<class_rule> class_priority_rules;
+std::vector<class_rule> class_dscp_rules;
+std::vector<class_rule> class_port_rules;
+// Paused backlog options. The maximum number of paused flows (0 means
+// unbounded) and the maximum time that a flow can be paused (0 disables aging).
+unsigned int max_paused = 0;
+unsigned int max_wait_us = 0;
+// The scheduling policy, which decides which paused flows to activate.
+enum policy_kind_type {
+  POLICY_ROUND_ROBIN,
+  POLICY_LIFO,
+  POLICY_ODF,
+  POLICY_SHARED_OBJECT
+};
+policy_kind_type policy_kind = POLICY_ROUND_ROBIN;
+std::string policy_name = "round_robin";
 
 // Used to set entries in flow_to_rwnd.
 int zero = 0;
-boost::posix_time::seconds one_sec = boost::posix_time::seconds(1);
+std::chrono::seconds one_sec = std::chrono::seconds(1);
 // As an optimization, reuse the same tcp_cc_info struct and size.
 union tcp_cc_info placeholder_cc_info;
 socklen_t placeholder_cc_info_length = (socklen_t)sizeof(placeholder_cc_info);
 
+inline bool maybe_registered(int fd) {
+  if (fd < 0 || fd >= RM_MAX_TRACKED_FDS)
+    return true;
+  return fd_maybe_registered[fd / 64].load(std::memory_order_acquire) &
+         (1UL << (fd % 64));
+}
+
+inline void set_maybe_registered(int fd, bool val) {
+  if (fd < 0 || fd >= RM_MAX_TRACKED_FDS)
+    return;
+  if (val)
+    fd_maybe_registered[fd / 64].fetch_or(1UL << (fd % 64),
+                                          std::memory_order_release);
+  else
+    fd_maybe_registered[fd / 64].fetch_and(~(1UL << (fd % 64)),
+                                           std::memory_order_release);
+}
+
+// The shard that schedules this FD. The kernel allocates the lowest free FD, so
+// a process's flows spread evenly across the shards.
+inline scheduler_shard &shard_for(int fd) {
+  return *shards[(unsigned int)fd % num_shards];
+}
+
 // Trigger a pure ACK packet to be send on this FD by calling getsockopt() with
 // TCP_CC_INFO. This only works if the flow is using the CCA BPF_CUBIC.
 inline void trigger_ack(int fd) {
@@ -90,124 +309,587 @@ inline void trigger_ack(int fd) {
              &placeholder_cc_info_length);
 }
 
-// Jitter the provided value by +/- 12.5%. Returns just the jitter.
+// Jitter the provided value by +/- jitter_permille. Returns just the jitter.
 inline int jitter(int v) {
-  return std::experimental::randint(0, (int)std::roundl(v * 0.25)) -
-         (int)std::roundl(v * 0.125);
+  int j = (int)std::roundl(v * (jitter_permille / 1000.0L));
+  return std::experimental::randint(0, 2 * j) - j;
+}
+
+// Look up this FD's flow, or return NULL if the FD is not registered. Use this
+// instead of fd_to_flow[fd], which would register a zeroed flow for the FD.
+inline struct rm_flow *find_flow(int fd) {
+  scheduler_shard &sh = shard_for(fd);
+  auto it = sh.fd_to_flow.find(fd);
+  return it == sh.fd_to_flow.end() ? NULL : &it->second;
 }
 
 inline void activate_flow(int fd) {
-  bpf_map_delete_elem(flow_to_rwnd_fd, &fd_to_flow[fd]);
+  struct rm_flow *flow = find_flow(fd);
+  if (flow == NULL)
+    return;
+  if (credit_B) {
+    // Grant the credit before removing the RWND limit so that the flow is
+    // never unlimited. The tc/egress program starts the credit from the flow's
+    // next ACK.
+    struct rm_credit credit = {
+        .credit_B = credit_B, .start_seq = 0, .started = 0, .exhausted = 0};
+    bpf_map_update_elem(flow_to_credit_fd, flow, &credit, BPF_ANY);
+  }
+  bpf_map_delete_elem(flow_to_rwnd_fd, flow);
   trigger_ack(fd);
   RM_PRINTF("INFO: activated FD=%d\n", fd);
 }
 
 inline void pause_flow(int fd) {
+  struct rm_flow *flow = find_flow(fd);
+  if (flow == NULL)
+    return;
   // Pausing a flow means retting its RWND to 0 B.
-  bpf_map_update_elem(flow_to_rwnd_fd, &fd_to_flow[fd], &zero, BPF_ANY);
+  bpf_map_update_elem(flow_to_rwnd_fd, flow, &zero, BPF_ANY);
   trigger_ack(fd);
   RM_PRINTF("INFO: paused flow FD=%d\n", fd);
 }
 
-// Call this to check if scheduling should take place, and if so, perform it. If
-// there are waiting flows and available capacity, then one will be activated.
-// Flows are paused and activated in round-robin order. Each flow is allowed to
-// be active for at most epoch_us microseconds. Flows that have been idle for
-// longer than idle_timeout_ns will be paused.
-//
-// There must always be a pending timer event, otherwise the timer thread will
-// expire. So this function must always set a new timer event, unless it is
-// called because the timer was cancelled or the program is supposed to end.
-void timer_callback(const boost::system::error_code &error) {
-  RM_PRINTF("INFO: in timer_callback\n");
+// Look up this flow's RTT (us): the receiver's estimate if there is one, or
+// else the smoothed RTT. Returns 0 if there is no RTT sample.
+unsigned long get_rtt_us(int fd) {
+  struct tcp_info info;
+  socklen_t info_len = sizeof(info);
+  if (getsockopt(fd, SOL_TCP, TCP_INFO, &info, &info_len) == -1)
+    return 0;
+  return info.tcpi_rcv_rtt ? info.tcpi_rcv_rtt : info.tcpi_rtt;
+}
 
-  // 0. Perform validity checks.
-  // If an error (such as a cancellation) triggered this callback, then abort
-  // immediately. Do not set another timer.
-  if (error) {
-    RM_PRINTF("ERROR: timer_callback error: %s\n", error.message().c_str());
-    return;
+// Calculate the epoch for a flow with this RTT. With adaptive epochs, this is a
+// multiple of the RTT, so that long-RTT flows get enough time to ramp up and
+// short-RTT flows do not hold a slot for many RTTs. Otherwise, or if there is
+// no RTT sample, it is epoch_us.
+unsigned int epoch_for_rtt_us(unsigned long rtt_us) {
+  if (!epoch_rtts || !rtt_us)
+    return epoch_us;
+  unsigned long flow_epoch_us_ = rtt_us * epoch_rtts;
+  if (epoch_min_us && flow_epoch_us_ < epoch_min_us)
+    flow_epoch_us_ = epoch_min_us;
+  if (epoch_max_us && flow_epoch_us_ > epoch_max_us)
+    flow_epoch_us_ = epoch_max_us;
+  return (unsigned int)std::min(flow_epoch_us_, (unsigned long)UINT32_MAX);
+}
+
+// Calculate when the scheduler should look for this flow's successor. With
+// early wake, this is early_wake_rtts RTTs (of this flow, as a proxy for its
+// successor's) before the end of its epoch, but no earlier than halfway through
+// its epoch, so that the successor has filled the pipe by the time this flow is
+// paused.
+rm_clock::time_point get_wake_time(const active_flow &a) {
+  if (!early_wake_rtts)
+    return a.epoch_end;
+  unsigned long lead_us =
+      std::min(a.rtt_us * early_wake_rtts,
+               (unsigned long)epoch_for_rtt_us(a.rtt_us) / 2);
+  return a.epoch_end - std::chrono::microseconds(lead_us);
+}
+
+// Start a new epoch for this flow at start, reading its RTT if the epoch
+// length or the early-wake lead time depend on it. Randomly jitter the epoch
+// time by +/- jitter_permille.
+inline active_flow start_epoch(int fd, rm_clock::time_point start) {
+  unsigned long rtt_us = (epoch_rtts || early_wake_rtts) ? get_rtt_us(fd) : 0;
+  unsigned int e = epoch_for_rtt_us(rtt_us);
+  return {fd,
+          start + std::chrono::microseconds(e) +
+              std::chrono::microseconds(jitter(e)),
+          rtt_us};
+}
+
+// Whether this flow has exhausted its byte credit, in which case the tc/egress
+// program has already paused it. Only flows that credit_events reported since
+// the last scheduling round are looked up in flow_to_credit, which filters out
+// events for a credit that has since been replaced.
+inline bool credit_exhausted(const scheduler_shard &sh, int fd) {
+  if (sh.exhausted_flows.empty())
+    return false;
+  const struct rm_flow &flow = sh.fd_to_flow.at(fd);
+  struct rm_credit credit;
+  return std::any_of(sh.exhausted_flows.begin(), sh.exhausted_flows.end(),
+                     [&](const struct rm_flow &f) {
+                       return f.local_addr == flow.local_addr &&
+                              f.remote_addr == flow.remote_addr &&
+                              f.local_port == flow.local_port &&
+                              f.remote_port == flow.remote_port;
+                     }) &&
+         !bpf_map_lookup_elem(flow_to_credit_fd, &flow, &credit) &&
+         credit.exhausted;
+}
+
+// Total number of paused flows in this shard, across all classes.
+inline unsigned long num_paused(const scheduler_shard &sh) {
+  return sh.fd_to_paused_since.size();
+}
+
+// Pause this flow, which the caller must then hand to the scheduling policy
+// with now_ns.
+inline void mark_paused(int fd, unsigned long now_ns) {
+  scheduler_shard &sh = shard_for(fd);
+  if (sh.fd_to_paused_since.insert_or_assign(fd, now_ns).second)
+    ++total_paused;
+  if (max_wait_us)
+    sh.paused_order[sh.fd_to_class[fd]].push_back({now_ns, fd});
+  pause_flow(fd);
+}
+
+// Forget that this flow is paused, because it was activated or closed.
+inline void unmark_paused(int fd) {
+  if (shard_for(fd).fd_to_paused_since.erase(fd))
+    --total_paused;
+}
+
+// Hold this flow at RWND = 0 B without adding it to the paused backlog, which
+// is full. schedule() admits it to the backlog, in order, once there is room.
+inline void mark_rejected(scheduler_shard &sh, int fd, unsigned long now_ns) {
+  sh.fd_to_rejected_since[fd] = now_ns;
+  sh.rejected_fds_queue.push({fd, now_ns});
+  ++sh.num_rejected;
+  pause_flow(fd);
+}
+
+// Whether this paused flow has sent a keepalive, i.e., it has pending data. If
+// it is not in the flow_to_keepalive map, then bpf_map_lookup_elem() returns a
+// negative error code. A policy may pass an FD that has been closed, which has
+// no demand.
+bool policy_has_demand(int fd) {
+  struct rm_flow *flow = find_flow(fd);
+  int dummy;
+  return flow != NULL &&
+         !bpf_map_lookup_elem(flow_to_keepalive_fd, flow, &dummy);
+}
+
+// Whether this flow is still paused since it was handed to the scheduling
+// policy with paused_at_ns. Otherwise, it was activated or closed since.
+bool policy_is_paused(int fd, unsigned long paused_at_ns) {
+  const scheduler_shard &sh = shard_for(fd);
+  auto it = sh.fd_to_paused_since.find(fd);
+  return it != sh.fd_to_paused_since.end() && it->second == paused_at_ns;
+}
+
+struct rm_policy_env policy_env = {policy_has_demand, policy_is_paused};
+
+// A paused flow, as the built-in policies record it.
+struct paused_entry {
+  int fd;
+  unsigned long paused_at_ns;
+  // When the flow was first known to have pending data, or 0 if it is not known
+  // to. Only used by oldest_demand_first_policy.
+  unsigned long demand_since_ns;
+};
+
+// The built-in policies implement the hooks in ratemon_policy.h as member
+// functions, without ctx, and are specialized into the scheduler at compile
+// time. rotating_policy<false> is round-robin, which is the default: it
+// activates paused flows with pending data in the order that they were paused,
+// and rotates flows without pending data to the back, looking at as few paused
+// flows as possible. rotating_policy<true> is the opposite, LIFO.
+template <bool lifo> struct rotating_policy {
+  std::deque<paused_entry> queues[RM_MAX_CLASSES];
+  // The scheduling round that left applies to, and the number of flows in each
+  // class that pick_next() has not looked at yet in that round.
+  unsigned long round_ns[RM_MAX_CLASSES] = {0};
+  unsigned long left[RM_MAX_CLASSES] = {0};
+
+  void on_register(int fd, unsigned int cls, unsigned long now_ns) {
+    queues[cls].push_back({fd, now_ns, 0});
   }
-  // If the program has been signalled to stop, then exit. Do not set another
-  // timer.
-  if (!run) {
-    RM_PRINTF("INFO: program signalled to exit\n");
-    return;
+  void on_demand(int fd, unsigned int cls, unsigned long now_ns) {
+    queues[cls].push_back({fd, now_ns, 0});
   }
-  // If setup has not been performed yet, then we cannot perform scheduling.
-  // Otherwise, revert to slow check mode.
-  if (!setup_done) {
-    RM_PRINTF("INFO: not set up\n");
-    if (timer.expires_from_now(one_sec)) {
-      RM_PRINTF("ERROR: timer unexpectedly cancelled\n");
+  void on_idle(int fd, unsigned int cls, unsigned long now_ns) {
+    queues[cls].push_back({fd, now_ns, 0});
+  }
+  bool on_deadline(int, unsigned int, unsigned long) { return true; }
+  int pick_next(unsigned int cls, unsigned long now_ns) {
+    std::deque<paused_entry> &q = queues[cls];
+    if (round_ns[cls] != now_ns) {
+      round_ns[cls] = now_ns;
+      left[cls] = q.size();
     }
-    timer.async_wait(&timer_callback);
-    return;
+    while (left[cls] > 0) {
+      --left[cls];
+      paused_entry e = lifo ? q.back() : q.front();
+      if (lifo)
+        q.pop_back();
+      else
+        q.pop_front();
+      // If this flow has been closed or activated, then drop it.
+      if (!policy_is_paused(e.fd, e.paused_at_ns))
+        continue;
+      if (policy_has_demand(e.fd))
+        return e.fd;
+      // This flow has no pending data, so skip it.
+      if (lifo)
+        q.push_front(e);
+      else
+        q.push_back(e);
+    }
+    return -1;
   }
-  // Check that relevant parameters have been set. Otherwise, revert to slow
-  // check mode.
-  if (!max_active_flows || !epoch_us || !flow_to_rwnd_fd ||
-      !flow_to_last_data_time_fd || !flow_to_keepalive_fd) {
-    RM_PRINTF(
-        "ERROR: cannot continue, invalid max_active_flows=%u, epoch_us=%u, "
-        "flow_to_rwnd_fd=%d, flow_to_last_data_time_fd=%d, or "
-        "flow_to_keepalive_fd=%d\n",
-        max_active_flows, epoch_us, flow_to_rwnd_fd, flow_to_last_data_time_fd,
-        flow_to_keepalive_fd);
-    if (timer.expires_from_now(one_sec)) {
-      RM_PRINTF("ERROR: timer unexpectedly cancelled\n");
+};
+
+// Activates the paused flow that has been waiting with pending data for the
+// longest. Unlike the rotating policies, this checks every paused flow in the
+// class once per scheduling round.
+struct oldest_demand_first_policy {
+  std::deque<paused_entry> queues[RM_MAX_CLASSES];
+  // The scheduling round that candidates applies to, and the flows in each
+  // class with pending data in that round, sorted newest demand first.
+  unsigned long round_ns[RM_MAX_CLASSES] = {0};
+  std::vector<paused_entry> candidates[RM_MAX_CLASSES];
+
+  void on_register(int fd, unsigned int cls, unsigned long now_ns) {
+    queues[cls].push_back({fd, now_ns, 0});
+  }
+  void on_demand(int fd, unsigned int cls, unsigned long now_ns) {
+    queues[cls].push_back({fd, now_ns, now_ns});
+  }
+  void on_idle(int fd, unsigned int cls, unsigned long now_ns) {
+    queues[cls].push_back({fd, now_ns, 0});
+  }
+  bool on_deadline(int, unsigned int, unsigned long) { return true; }
+  int pick_next(unsigned int cls, unsigned long now_ns) {
+    std::deque<paused_entry> &q = queues[cls];
+    std::vector<paused_entry> &cands = candidates[cls];
+    if (round_ns[cls] != now_ns) {
+      round_ns[cls] = now_ns;
+      cands.clear();
+      for (size_t i = 0; i < q.size();) {
+        paused_entry &e = q[i];
+        if (!policy_is_paused(e.fd, e.paused_at_ns)) {
+          q.erase(q.begin() + i);
+          continue;
+        }
+        ++i;
+        if (!policy_has_demand(e.fd))
+          continue;
+        // The first time that we see this flow's demand is when it started.
+        if (!e.demand_since_ns)
+          e.demand_since_ns = now_ns;
+        cands.push_back(e);
+      }
+      std::sort(cands.begin(), cands.end(),
+                [](const paused_entry &x, const paused_entry &y) {
+                  return x.demand_since_ns > y.demand_since_ns;
+                });
+    }
+    while (!cands.empty()) {
+      paused_entry e = cands.back();
+      cands.pop_back();
+      if (!policy_is_paused(e.fd, e.paused_at_ns))
+        continue;
+      q.erase(std::find_if(q.begin(), q.end(), [&](const paused_entry &x) {
+        return x.fd == e.fd && x.paused_at_ns == e.paused_at_ns;
+      }));
+      return e.fd;
     }
-    timer.async_wait(&timer_callback);
+    return -1;
+  }
+};
+
+// Adapts a policy loaded from a shared object. Its hooks are called through
+// function pointers.
+struct shared_object_policy {
+  const struct rm_policy_ops *ops = NULL;
+  void *ctx = NULL;
+
+  void on_register(int fd, unsigned int cls, unsigned long now_ns) {
+    ops->on_register(ctx, fd, cls, now_ns);
+  }
+  void on_demand(int fd, unsigned int cls, unsigned long now_ns) {
+    ops->on_demand(ctx, fd, cls, now_ns);
+  }
+  void on_idle(int fd, unsigned int cls, unsigned long now_ns) {
+    ops->on_idle(ctx, fd, cls, now_ns);
+  }
+  bool on_deadline(int fd, unsigned int cls, unsigned long now_ns) {
+    return ops->on_deadline == NULL || ops->on_deadline(ctx, fd, cls, now_ns);
+  }
+  int pick_next(unsigned int cls, unsigned long now_ns) {
+    return ops->pick_next(ctx, cls, now_ns);
+  }
+  void fini() {
+    if (ops->fini != NULL)
+      ops->fini(ctx);
+    ctx = NULL;
+  }
+};
+
+// Each shard's instance of each policy, indexed by shard. Only the selected
+// policy's instances are used.
+std::vector<rotating_policy<false>> round_robin_policies;
+std::vector<rotating_policy<true>> lifo_policies;
+std::vector<oldest_demand_first_policy> odf_policies;
+std::vector<shared_object_policy> so_policies;
+// The shared object that so_policies come from, or NULL.
+void *policy_handle = NULL;
+
+// Call f with this shard's instance of the selected scheduling policy. f is
+// instantiated for each policy, so the built-in policies' hooks are inlined
+// into it, and the only dispatch is this switch.
+template <class F> inline auto with_policy(scheduler_shard &sh, F &&f) {
+  switch (policy_kind) {
+  case POLICY_LIFO:
+    return f(lifo_policies[sh.idx]);
+  case POLICY_ODF:
+    return f(odf_policies[sh.idx]);
+  case POLICY_SHARED_OBJECT:
+    return f(so_policies[sh.idx]);
+  default:
+    return f(round_robin_policies[sh.idx]);
+  }
+}
+
+// Select the scheduling policy by name, or load it from the shared object at
+// this path, if name contains a '/'. args is passed to a shared object's init
+// hook, which is called once per shard. Must be called after the shards are
+// created, and before their threads are started.
+bool load_policy(const char *name, const char *args) {
+  // setup() may be retried, so release a shared object that an earlier
+  // attempt loaded.
+  for (auto &pol : so_policies)
+    pol.fini();
+  so_policies.clear();
+  if (policy_handle != NULL) {
+    dlclose(policy_handle);
+    policy_handle = NULL;
+  }
+  policy_kind = POLICY_ROUND_ROBIN;
+  policy_name = name;
+  if (strcmp(name, "round_robin") == 0) {
+    policy_kind = POLICY_ROUND_ROBIN;
+    return true;
+  }
+  if (strcmp(name, "lifo") == 0) {
+    policy_kind = POLICY_LIFO;
+    return true;
+  }
+  if (strcmp(name, "odf") == 0) {
+    policy_kind = POLICY_ODF;
+    return true;
+  }
+  if (strchr(name, '/') == NULL) {
+    RM_PRINTF("ERROR: unknown policy '%s'\n", name);
+    return false;
+  }
+  void *handle = dlopen(name, RTLD_NOW | RTLD_LOCAL);
+  if (handle == NULL) {
+    RM_PRINTF("ERROR: failed to load policy '%s': %s\n", name, dlerror());
+    return false;
+  }
+  const struct rm_policy_ops *ops =
+      (const struct rm_policy_ops *)dlsym(handle, RM_POLICY_OPS_SYMBOL);
+  if (ops == NULL || ops->on_register == NULL || ops->on_demand == NULL ||
+      ops->on_idle == NULL || ops->pick_next == NULL) {
+    RM_PRINTF("ERROR: policy '%s' does not define '%s' with all required "
+              "hooks\n",
+              name, RM_POLICY_OPS_SYMBOL);
+    dlclose(handle);
+    return false;
+  }
+  so_policies.assign(num_shards, shared_object_policy());
+  for (unsigned int i = 0; i < num_shards; ++i) {
+    shared_object_policy &pol = so_policies[i];
+    pol.ops = ops;
+    if (ops->init != NULL && ops->init(&policy_env, args, &pol.ctx)) {
+      RM_PRINTF("ERROR: policy '%s' failed to initialize\n", name);
+      // Free the ctxs of the shards that were initialized before unloading
+      // the code that owns them.
+      for (unsigned int j = 0; j < i; ++j)
+        so_policies[j].fini();
+      so_policies.clear();
+      dlclose(handle);
+      return false;
+    }
+  }
+  policy_handle = handle;
+  policy_kind = POLICY_SHARED_OBJECT;
+  return true;
+}
+
+inline unsigned int monitor_port_start() {
+  return monitor_port_range.load(std::memory_order_relaxed) >> 16;
+}
+
+inline unsigned int monitor_port_end() {
+  return monitor_port_range.load(std::memory_order_relaxed) & 0xFFFF;
+}
+
+// Claim a free slot in telemetry, which is shared by every process using the
+// pinned map, and start tracking this flow there. Slots are claimed by an
+// atomic compare-and-swap on their in_use field. Returns false if all slots are
+// in use, in which case the flow is scheduled without idle detection.
+bool claim_telemetry_slot(int fd) {
+  scheduler_shard &sh = shard_for(fd);
+  // Where this shard's thread should start looking next.
+  static thread_local unsigned int next = 0;
+  unsigned int expected;
+  for (unsigned int i = 0; i < RM_MAX_FLOWS; ++i) {
+    unsigned int slot = (next + i) % RM_MAX_FLOWS;
+    expected = 0;
+    if (!__atomic_compare_exchange_n(&telemetry[slot].in_use, &expected, 1,
+                                     false, __ATOMIC_ACQUIRE,
+                                     __ATOMIC_RELAXED))
+      continue;
+    next = (slot + 1) % RM_MAX_FLOWS;
+    __atomic_store_n(&telemetry[slot].last_data_time_ns, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&telemetry[slot].bytes, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&telemetry[slot].packets, 0, __ATOMIC_RELAXED);
+    // Creating an entry in flow_to_slot tells the kprobe program to start
+    // tracking this flow.
+    if (bpf_map_update_elem(flow_to_slot_fd, &sh.fd_to_flow[fd], &slot,
+                            BPF_ANY)) {
+      __atomic_store_n(&telemetry[slot].in_use, 0, __ATOMIC_RELEASE);
+      return false;
+    }
+    sh.fd_to_slot[fd] = slot;
+    return true;
+  }
+  return false;
+}
+
+// Stop tracking this flow and return its slot. Slots held by a process that
+// exits without closing its flows are leaked until the map is unpinned.
+void release_telemetry_slot(int fd) {
+  scheduler_shard &sh = shard_for(fd);
+  std::unordered_map<int, unsigned int>::iterator it = sh.fd_to_slot.find(fd);
+  if (it == sh.fd_to_slot.end())
     return;
+  bpf_map_delete_elem(flow_to_slot_fd, &sh.fd_to_flow[fd]);
+  __atomic_store_n(&telemetry[it->second].in_use, 0, __ATOMIC_RELEASE);
+  sh.fd_to_slot.erase(it);
+}
+
+void timer_callback(scheduler_shard &sh,
+                    const boost::system::error_code &error);
+void stop_control();
+
+// Arrange for timer_callback() to run on this shard after the given duration,
+// replacing any pending timer event. Returns the number of pending events that
+// were cancelled. Must be called on the shard's thread.
+size_t set_timer(scheduler_shard &sh, rm_clock::duration when) {
+  sh.timer_deadline = rm_clock::now() + when;
+  if (busy_poll) {
+    size_t cancelled = sh.busy_poll_deadline != rm_clock::time_point::max();
+    sh.busy_poll_deadline = sh.timer_deadline;
+    return cancelled;
   }
+  size_t cancelled = sh.timer.expires_after(when);
+  sh.timer.async_wait([&sh](const boost::system::error_code &error) {
+    timer_callback(sh, error);
+  });
+  return cancelled;
+}
 
-  // It is now safe to perform scheduling.
-  lock_scheduler.lock();
-  RM_PRINTF("INFO: performing scheduling. active=%lu, paused=%lu\n",
-            active_fds_queue.size(), paused_fds_queue.size());
+// Perform scheduling on this shard right away, on its own thread.
+void post_scheduling(scheduler_shard &sh) {
+  boost::asio::post(
+      sh.io, [&sh]() { timer_callback(sh, boost::system::error_code()); });
+}
 
+// Perform steps 1-6 of timer_callback() on this shard with this scheduling
+// policy, and return when the next timer should expire. Must be called with the
+// shard's lock held.
+template <class Policy>
+rm_clock::duration schedule(scheduler_shard &sh, Policy &policy) {
   // Temporary variable for storing the front of active_fds_queue.
-  std::pair<int, boost::posix_time::ptime> a;
-  // Temporary variable for storing the front of paused_fds_queue.
+  active_flow a;
+  // Temporary variable for storing a paused flow.
   int p;
   // Size of active_fds_queue.
   unsigned long s;
-  // Vector of active flows that we plan to pause.
-  std::vector<int> to_pause;
-  // Current kernel time (since boot).
-  struct timespec ts;
-  clock_gettime(CLOCK_MONOTONIC, &ts);
-  unsigned long ktime_now_ns = ts.tv_sec * 1000000000ull + ts.tv_nsec;
+  // Active flows that are in the middle of their epoch, and active flows that
+  // have reached the end of their epoch, by class, in active_fds_queue order.
+  // These are thread_local so that their storage is reused across calls, which
+  // only happen on the shards' threads.
+  static thread_local std::vector<active_flow> unexpired[RM_MAX_CLASSES];
+  static thread_local std::vector<active_flow> expired[RM_MAX_CLASSES];
+  // Expired flows that the policy does not allow to keep their slots. They are
+  // appended to expired after the ones that it does.
+  static thread_local std::vector<active_flow> yielding[RM_MAX_CLASSES];
+  unsigned long num_continuing[RM_MAX_CLASSES];
+  // Current time. This is also the kernel time (since boot).
+  rm_clock::time_point now = rm_clock::now();
+  unsigned long ktime_now_ns =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          now.time_since_epoch())
+          .count();
   // For measuring idle time.
   unsigned long last_data_time_ns, idle_ns;
-  // Current time (absolute).
-  boost::posix_time::ptime now =
-      boost::posix_time::microsec_clock::local_time();
-  // New epoch time.
-  boost::posix_time::ptime now_plus_epoch =
-      now + boost::posix_time::microseconds(epoch_us);
-
-  // Typically, active_fds_queue will be small and paused_fds_queue will be
+  std::unordered_map<int, unsigned int>::iterator slot;
+  // Earliest time at which an active flow needs a successor, or at which a
+  // draining flow must be paused.
+  rm_clock::time_point next_event = rm_clock::time_point::max();
+
+  // Typically, active_fds_queue will be small and the paused backlog will be
   // large. Therefore, it is alright for us to iterate through the entire
-  // active_fds_queue (multiple times), but we must iterate through as few
-  // elements of paused_fds_queue as possible.
+  // active_fds_queue (multiple times), but the policy must look at as few
+  // paused flows as possible.
 
-  // 1) Perform a status check on all active flows. It is alright to iterate
-  // through all of active_fds_queue.
-  s = active_fds_queue.size();
+  // 1) Pause draining flows whose epoch has ended. There are at most as many as
+  // there are active flows. Then, admit rejected flows.
+  s = 0;
+  for (const auto &d : sh.draining_fds) {
+    if (!sh.fd_to_flow.contains(d.fd))
+      continue;
+    if (now >= d.epoch_end) {
+      mark_paused(d.fd, ktime_now_ns);
+      policy.on_demand(d.fd, sh.fd_to_class[d.fd], ktime_now_ns);
+    } else {
+      sh.draining_fds[s++] = d;
+      next_event = std::min(next_event, d.epoch_end);
+    }
+  }
+  sh.draining_fds.resize(s);
+  // Then, move flows that were rejected into the paused backlog, in the order
+  // that they were rejected, while it has room. They are already paused.
+  while (!sh.rejected_fds_queue.empty() &&
+         (!max_paused ||
+          total_paused.load(std::memory_order_relaxed) < max_paused)) {
+    auto [fd, rejected_at_ns] = sh.rejected_fds_queue.front();
+    sh.rejected_fds_queue.pop();
+    auto it = sh.fd_to_rejected_since.find(fd);
+    if (it == sh.fd_to_rejected_since.end() || it->second != rejected_at_ns)
+      continue;
+    sh.fd_to_rejected_since.erase(it);
+    RM_PRINTF("INFO: admitting rejected FD=%d to the paused backlog\n", fd);
+    sh.fd_to_paused_since[fd] = ktime_now_ns;
+    ++total_paused;
+    if (max_wait_us)
+      sh.paused_order[sh.fd_to_class[fd]].push_back({ktime_now_ns, fd});
+    policy.on_register(fd, sh.fd_to_class[fd], ktime_now_ns);
+  }
+
+  // 2) Perform a status check on all active flows and sort them by class. It is
+  // alright to iterate through all of active_fds_queue.
+  for (unsigned int c = 0; c < num_classes; ++c) {
+    unexpired[c].clear();
+    expired[c].clear();
+    yielding[c].clear();
+  }
+  bool any_paused = num_paused(sh) > 0;
+  s = sh.active_fds_queue.size();
   for (unsigned long i = 0; i < s; ++i) {
-    a = active_fds_queue.front();
-    active_fds_queue.pop();
-    // 1.1) If this flow has been closed, remove it.
-    if (!fd_to_flow.contains(a.first))
+    a = sh.active_fds_queue.front();
+    sh.active_fds_queue.pop();
+    // 2.1) If this flow has been closed, remove it.
+    if (!sh.fd_to_flow.contains(a.fd))
       continue;
-    // 1.2) If idle timeout mode is enabled, then check if this flow is
+    unsigned int cls = sh.fd_to_class[a.fd];
+    // 2.2) If idle timeout mode is enabled, then check if this flow is
     // past its idle timeout. Skip this check if there are no paused
     // flows.
-    if (idle_timeout_ns > 0 && !paused_fds_queue.empty()) {
-      // Look up this flow's last active time.
-      if (!bpf_map_lookup_elem(flow_to_last_data_time_fd, &fd_to_flow[a.first],
-                               &last_data_time_ns)) {
+    if (idle_timeout_ns > 0 && any_paused) {
+      // Look up this flow's last active time. This is a plain memory load.
+      slot = sh.fd_to_slot.find(a.fd);
+      if (slot != sh.fd_to_slot.end()) {
+        last_data_time_ns = __atomic_load_n(
+            &telemetry[slot->second].last_data_time_ns, __ATOMIC_RELAXED);
         // If last_data_time_ns is 0, then this flow has not yet been tracked.
         if (last_data_time_ns) {
           if (last_data_time_ns > ktime_now_ns) {
@@ -216,187 +898,734 @@ void timer_callback(const boost::system::error_code &error) {
             RM_PRINTF(
                 "WARNING: FD=%d last data time (%lu ns) is more recent that "
                 "current time (%lu ns) by %lu ns\n",
-                a.first, last_data_time_ns, ktime_now_ns,
+                a.fd, last_data_time_ns, ktime_now_ns,
                 last_data_time_ns - ktime_now_ns);
           } else {
             idle_ns = ktime_now_ns - last_data_time_ns;
             RM_PRINTF("INFO: FD=%d now: %lu ns, last data time: %lu ns\n",
-                      a.first, ktime_now_ns, last_data_time_ns);
+                      a.fd, ktime_now_ns, last_data_time_ns);
             RM_PRINTF(
                 "INFO: FD=%d idle has been idle for %lu ns. timeout is %lu "
                 "ns\n",
-                a.first, idle_ns, idle_timeout_ns);
+                a.fd, idle_ns, idle_timeout_ns);
             // If the flow has been idle for longer than the idle timeout, then
             // pause it. We pause the flow *before* activating a replacement
             // flow because it is by definition not sending data, so we do not
             // risk causing a drop in utilization by pausing it immediately.
             if (idle_ns >= idle_timeout_ns) {
-              RM_PRINTF("INFO: Pausing FD=%d due to idle timeout\n", a.first);
+              RM_PRINTF("INFO: Pausing FD=%d due to idle timeout\n", a.fd);
               // Remove the flow from flow_to_keepalive, signalling that it no
               // longer has pending demand.
-              bpf_map_delete_elem(flow_to_keepalive_fd, &a.first);
-              paused_fds_queue.push(a.first);
-              pause_flow(a.first);
+              bpf_map_delete_elem(flow_to_keepalive_fd,
+                                  &sh.fd_to_flow[a.fd]);
+              mark_paused(a.fd, ktime_now_ns);
+              policy.on_idle(a.fd, cls, ktime_now_ns);
               continue;
             }
           }
         }
       }
     }
-    // 1.3) If the flow has been active for longer than its epoch, then plan to
-    // pause it.
-    if (now > a.second) {
-      if (paused_fds_queue.empty()) {
-        // If there are no paused flows, then immediately reactivate this flow.
-        // Randomly jitter the epoch time by +/- 12.5%.
-        active_fds_queue.push(
-            {a.first, now_plus_epoch +
-                          boost::posix_time::microseconds(jitter(epoch_us))});
-        RM_PRINTF("INFO: reactivated FD=%d\n", a.first);
-        continue;
-      } else {
-        // Plan to pause this flow.
-        to_pause.push_back(a.first);
-      }
+    // 2.3) If the flow has been active for longer than its epoch (less the
+    // early-wake lead time), or has exhausted its byte credit, then it must
+    // compete for its slot again, if the policy allows it to. A flow that has
+    // exhausted its credit is already paused, so it cannot overlap with its
+    // successor.
+    if (credit_exhausted(sh, a.fd)) {
+      a.epoch_end = now;
+    } else if (now < get_wake_time(a)) {
+      unexpired[cls].push_back(a);
+      continue;
     }
-    // Put the flow back in the active queue. For this to occur, we know the
-    // flow is not idle, and it is either not yet at its epoch time or it has
-    // passed its epoch time and it will be extracted and paused later.
-    active_fds_queue.push(a);
+    if (policy.on_deadline(a.fd, cls, ktime_now_ns))
+      expired[cls].push_back(a);
+    else
+      yielding[cls].push_back(a);
+  }
+  sh.exhausted_flows.clear();
+  // The number of flows that are still active, and how many of them are in the
+  // middle of their epoch.
+  unsigned long num_kept = 0, num_unexpired = 0;
+  for (unsigned int c = 0; c < num_classes; ++c) {
+    num_continuing[c] = expired[c].size();
+    expired[c].insert(expired[c].end(), yielding[c].begin(), yielding[c].end());
+    num_unexpired += unexpired[c].size();
+    num_kept += unexpired[c].size() + expired[c].size();
   }
 
-  // 2) Activate flows. Now we can calculate how many flows to activate to reach
-  // full capacity. This value is the existing free capacity plus the number of
-  // flows we intend to pause. The important part here is that we only look at
-  // as many entries in paused_fds_queue as needed.
-  unsigned long num_to_activate =
-      max_active_flows - active_fds_queue.size() + to_pause.size();
-  int dummy;
-  for (unsigned long i = 0; i < num_to_activate; ++i) {
-    // Loop until we find a paused flow that is valid (not closed).
-    unsigned long num_paused = paused_fds_queue.size();
-    for (unsigned long j = 0; j < num_paused; ++j) {
-      p = paused_fds_queue.front();
-      paused_fds_queue.pop();
-      // If this flow has been closed, then skip it.
-      if (!fd_to_flow.contains(p))
+  // 3) Pick the flows that will be active. Within a class, flows that are in
+  // the middle of their epoch keep their slots, then paused flows with pending
+  // data take turns, then flows whose epoch ended continue if slots remain.
+  // First, every class claims up to its minimum number of slots. Then, classes
+  // claim the remaining slots in priority order. This activates flows before
+  // the ones that lost their slots are paused in step 4. The policy picks which
+  // paused flows take turns, except that a paused flow that has waited for
+  // max_wait_us takes precedence over every other flow in its class.
+  unsigned long unexpired_idx[RM_MAX_CLASSES] = {0};
+  unsigned long expired_idx[RM_MAX_CLASSES] = {0};
+  // Flows that were paused at or before this time have reached the max wait.
+  // Without aging, nothing has, and paused_order is not kept.
+  unsigned long cutoff_ns = 0;
+  if (max_wait_us && ktime_now_ns > max_wait_us * 1000UL)
+    cutoff_ns = ktime_now_ns - max_wait_us * 1000UL;
+  for (unsigned int c = 0; c < num_classes; ++c) {
+    std::deque<std::pair<unsigned long, int>> &order = sh.paused_order[c];
+    if (!max_wait_us) {
+      order.clear();
+      continue;
+    }
+    // Drop the stale entries at the front, for flows that the policy
+    // activated, so that they do not pile up while this class has no slots.
+    while (!order.empty() &&
+           !policy_is_paused(order.front().second, order.front().first))
+      order.pop_front();
+  }
+  // Activate this paused flow.
+  auto activate_paused = [&](int fd) {
+    unmark_paused(fd);
+    sh.active_fds_queue.push(start_epoch(fd, now));
+    next_event =
+        std::min(next_event, get_wake_time(sh.active_fds_queue.back()));
+    activate_flow(fd);
+  };
+  // Claim up to want slots for class c. Returns the number claimed.
+  auto claim_slots = [&](unsigned int c, unsigned long want) {
+    unsigned long got = 0;
+    // Flows that have waited for max_wait_us come first, oldest first, so that
+    // no flow is paused for much longer than that, even if it is always skipped
+    // below. Only the front of paused_order, which is in pause order, needs to
+    // be looked at.
+    std::deque<std::pair<unsigned long, int>> &order = sh.paused_order[c];
+    while (got < want && !order.empty() && order.front().first <= cutoff_ns) {
+      auto [paused_at_ns, fd] = order.front();
+      order.pop_front();
+      p = fd;
+      // Skip this flow if it has been activated or closed since it was paused.
+      if (!policy_is_paused(p, paused_at_ns))
         continue;
-      // If this flow is not in the flow_to_keepalive map (bpf_map_lookup_elem()
-      // returns negative error code when the flow is not found), then it has no
-      // pending data and should be skipped.
-      if (bpf_map_lookup_elem(flow_to_keepalive_fd, &p, &dummy)) {
-        // RM_PRINTF("INFO: skipping activating FD=%d, no pending data\n", p);
-        paused_fds_queue.push(p);
+      RM_PRINTF("INFO: activating FD=%d, which reached the max wait\n", p);
+      activate_paused(p);
+      ++sh.num_aged;
+      ++got;
+    }
+    for (; got < want && unexpired_idx[c] < unexpired[c].size(); ++got) {
+      a = unexpired[c][unexpired_idx[c]++];
+      sh.active_fds_queue.push(a);
+      next_event = std::min(next_event, get_wake_time(a));
+    }
+    // A policy from a shared object may return an FD that is not paused in
+    // this shard and class, e.g., one that it failed to drop. Ignore such
+    // picks, but not forever, in case the policy keeps returning the same one.
+    unsigned long bad_picks = 0;
+    while (got < want) {
+      p = policy.pick_next(c, ktime_now_ns);
+      if (p == -1)
+        break;
+      if (p < 0 || &shard_for(p) != &sh || !sh.fd_to_paused_since.contains(p) ||
+          sh.fd_to_class[p] != c) {
+        RM_PRINTF("WARNING: policy picked FD=%d, which is not paused in shard "
+                  "%u class %u\n",
+                  p, sh.idx, c);
+        if (++bad_picks > num_paused(sh))
+          break;
         continue;
       }
-      // Randomly jitter the epoch time by +/- 12.5%.
-      active_fds_queue.push(
-          {p,
-           now_plus_epoch + boost::posix_time::microseconds(jitter(epoch_us))});
-      activate_flow(p);
-      break;
+      activate_paused(p);
+      ++got;
     }
+    for (; got < want && expired_idx[c] < num_continuing[c]; ++got) {
+      a = expired[c][expired_idx[c]++];
+      p = a.fd;
+      // With early wake, the new epoch starts when the current one ends.
+      sh.active_fds_queue.push(start_epoch(p, std::max(now, a.epoch_end)));
+      next_event =
+        std::min(next_event, get_wake_time(sh.active_fds_queue.back()));
+      // In byte-credit mode, grant a new credit (and undo the pause, if the
+      // credit was exhausted).
+      if (credit_B)
+        activate_flow(p);
+      RM_PRINTF("INFO: reactivated FD=%d\n", p);
+    }
+    return got;
+  };
+  // Take this round's slots from the active budget, starting from the s slots
+  // that this shard has held since its last round. It needs at most one for
+  // each of its active and paused flows. If another shard is waiting for slots,
+  // then this one keeps no more than its fair share, except for flows in the
+  // middle of their epoch, so that slots rotate between shards as epochs end.
+  unsigned long want = num_kept + num_paused(sh);
+  bool others_waiting = num_waiting_shards.load(std::memory_order_relaxed) >
+                        (sh.waiting ? 1U : 0U);
+  if (others_waiting) {
+    unsigned long fair_share = (max_active_flows + num_shards - 1) / num_shards;
+    want = std::min(want, std::max(num_unexpired, fair_share));
   }
+  unsigned long held = resize_slots(slots_used, max_active_flows, s, want);
+  unsigned long free_slots = held;
+  for (unsigned int c = 0; c < num_classes && free_slots > 0; ++c)
+    free_slots -= claim_slots(c, std::min<unsigned long>(class_min_slots[c],
+                                                         free_slots));
+  for (unsigned int c = 0; c < num_classes && free_slots > 0; ++c)
+    free_slots -= claim_slots(c, free_slots);
 
-  // 3) Pause flows. We need to recalculate the number of flows to pause because
-  // we may not have been able to activate as many flows as planned. Recall that
-  // it is alright to iterate through all of active_fds_queue.
-  unsigned long num_to_pause = (unsigned long)std::max(
-      0L, (long)active_fds_queue.size() - (long)max_active_flows);
-#ifdef RM_VERBOSE
-  assert(num_to_pause <= to_pause.size());
-#endif
-  // For each flow that we are supposed to pause, advance through
-  // active_fds_queue until we find it.
-  s = active_fds_queue.size();
-  unsigned long j = 0;
-  for (unsigned long i = 0; i < num_to_pause; ++i) {
-    while (j < s) {
-      a = active_fds_queue.front();
-      active_fds_queue.pop();
-      ++j;
-      if (a.first == to_pause[i]) {
-        // Pause this flow.
-        paused_fds_queue.push(a.first);
-        pause_flow(a.first);
-        break;
+  // 4) Pause the flows that did not get a slot, and hand them to the policy.
+  // With early wake, flows whose epoch has not ended yet keep running alongside
+  // their successor until it does.
+  for (unsigned int c = 0; c < num_classes; ++c) {
+    for (; unexpired_idx[c] < unexpired[c].size(); ++unexpired_idx[c]) {
+      p = unexpired[c][unexpired_idx[c]].fd;
+      RM_PRINTF("INFO: preempting FD=%d in class %u\n", p, c);
+      mark_paused(p, ktime_now_ns);
+      policy.on_demand(p, c, ktime_now_ns);
+    }
+    for (; expired_idx[c] < expired[c].size(); ++expired_idx[c]) {
+      a = expired[c][expired_idx[c]];
+      if (a.epoch_end > now) {
+        RM_PRINTF("INFO: draining FD=%d\n", a.fd);
+        sh.draining_fds.push_back(a);
+        next_event = std::min(next_event, a.epoch_end);
+        continue;
       }
-      // Examine the next flow in active_fds_queue.
-      active_fds_queue.push(a);
+      mark_paused(a.fd, ktime_now_ns);
+      policy.on_demand(a.fd, c, ktime_now_ns);
     }
   }
 
-  // 4) Check invariants.
+  // Return the slots that this shard did not use to the active budget, and
+  // record whether it ran out of them. If it returned slots that another shard
+  // is waiting for, then let that shard take them right away, instead of at
+  // its next event.
+  slots_used.fetch_sub(held - sh.active_fds_queue.size(),
+                       std::memory_order_relaxed);
+  bool waiting = held < want && free_slots == 0;
+  if (waiting != sh.waiting) {
+    sh.waiting = waiting;
+    if (waiting)
+      ++num_waiting_shards;
+    else
+      --num_waiting_shards;
+  }
+  if (sh.active_fds_queue.size() < s &&
+      num_waiting_shards.load(std::memory_order_relaxed) > (waiting ? 1U : 0U))
+    for (const auto &other : shards)
+      if (other.get() != &sh && other->waiting)
+        post_scheduling(*other);
+
+  // 5) Check invariants.
 #ifdef RM_VERBOSE
   // Cannot have more than the max number of active flows.
-  assert(active_fds_queue.size() <= max_active_flows);
+  assert(sh.active_fds_queue.size() <= max_active_flows);
   // If there are no active flows, then there should also be no paused flows.
   // No, this is not strictly true anymore. If none of the flows have pending
   // data (i.e., none are in flow_to_keepalive), then they will all be paused.
   // assert(!active_fds_queue.empty() || paused_fds_queue.empty());
 #endif
 
-  // 5) Calculate when the next timer should expire.
-  boost::posix_time::time_duration when;
-  long next_epoch_us =
-      (active_fds_queue.front().second - now).total_microseconds();
-  if (active_fds_queue.empty()) {
+  // 6) Calculate when the next timer should expire.
+  rm_clock::duration when;
+  if (sh.active_fds_queue.empty() && sh.draining_fds.empty()) {
     // If there are no flows, revert to slow check mode.
     RM_PRINTF("INFO: no flows remaining, reverting to slow check mode\n");
     when = one_sec;
   } else if (!idle_timeout_ns) {
     // If we are not using idle timeout mode...
     RM_PRINTF("INFO: no idle timeout, scheduling timer for next epoch end\n");
-    when = boost::posix_time::microsec(next_epoch_us);
-  } else if (idle_timeout_us < next_epoch_us) {
+    when = next_event - now;
+  } else if (std::chrono::microseconds(idle_timeout_us) < next_event - now) {
     // If we are using idle timeout mode...
     RM_PRINTF("INFO: scheduling timer for next idle timeout\n");
-    when = boost::posix_time::microsec(idle_timeout_us);
+    when = std::chrono::microseconds(idle_timeout_us);
   } else {
     RM_PRINTF("INFO: scheduling timer for next epoch end, sooner than idle "
               "timeout\n");
-    when = boost::posix_time::microsec(next_epoch_us);
+    when = next_event - now;
+  }
+  // With aging, check paused flows again by the time they reach the max wait.
+  if (max_wait_us && num_paused(sh) > 0 &&
+      std::chrono::microseconds(max_wait_us) < when) {
+    RM_PRINTF("INFO: scheduling timer for max wait\n");
+    when = std::chrono::microseconds(max_wait_us);
+  }
+  return when;
+}
+
+// Call this to check if scheduling should take place, and if so, perform it. If
+// there are waiting flows and available capacity, then one will be activated.
+// The scheduling policy decides the order in which paused flows are activated,
+// which by default is round-robin. Each flow is allowed to be active for at
+// most its epoch (see start_epoch()), or in byte-credit mode, until it
+// exhausts its credit, whichever comes first. Flows that have been idle for
+// longer than idle_timeout_ns will be paused.
+//
+// With early wake, the successor of a flow is activated shortly before the end
+// of that flow's epoch, and the two overlap until the flow is paused at the end
+// of its epoch. This way, the successor has ramped up by the time the flow
+// stops, and the bottleneck does not idle during the handoff.
+//
+// With multiple priority classes, higher classes get active slots first, and
+// round-robin happens only within a class. Waiting flows in a higher class
+// preempt active flows in a lower class at the next scheduling event, without
+// waiting for the end of their epochs, except for the minimum number of slots
+// that each class is guaranteed.
+//
+// With more than one shard, each shard does this for its own flows, using slots
+// from the shared active budget. Priority classes and minimum slots apply
+// within a shard. A shard that runs out of slots while it has paused flows is
+// "waiting", and while any shard is waiting, the others give up the slots of
+// flows whose epoch ends beyond their fair share of the budget.
+//
+// There must always be a pending timer event, otherwise the timer thread will
+// expire. So this function must always set a new timer event, unless it is
+// called because the timer was cancelled or the program is supposed to end.
+void timer_callback(scheduler_shard &sh,
+                    const boost::system::error_code &error) {
+  RM_PRINTF("INFO: in timer_callback on shard %u, %ld us late\n", sh.idx,
+            (long)std::chrono::duration_cast<std::chrono::microseconds>(
+                rm_clock::now() - sh.timer_deadline)
+                .count());
+
+  // 0. Perform validity checks.
+  // If an error (such as a cancellation) triggered this callback, then abort
+  // immediately. Do not set another timer.
+  if (error) {
+    RM_PRINTF("ERROR: timer_callback error: %s\n", error.message().c_str());
+    return;
+  }
+  // If the program has been signalled to stop, then exit. Do not set another
+  // timer.
+  if (!run) {
+    RM_PRINTF("INFO: program signalled to exit\n");
+    // Stop waiting for credit events and control commands so that shard 0's
+    // io_context can end.
+    if (sh.idx == 0) {
+      if (credit_events_desc->is_open())
+        credit_events_desc->cancel();
+      stop_control();
+    }
+    return;
+  }
+  // If setup has not been performed yet, then we cannot perform scheduling.
+  // Otherwise, revert to slow check mode.
+  if (!setup_done.load(std::memory_order_acquire)) {
+    RM_PRINTF("INFO: not set up\n");
+    if (set_timer(sh, one_sec)) {
+      RM_PRINTF("ERROR: timer unexpectedly cancelled\n");
+    }
+    return;
+  }
+  // Check that relevant parameters have been set. Otherwise, revert to slow
+  // check mode.
+  if (!max_active_flows || !epoch_us || !flow_to_rwnd_fd ||
+      !flow_to_slot_fd || telemetry == NULL || !flow_to_keepalive_fd) {
+    RM_PRINTF(
+        "ERROR: cannot continue, invalid max_active_flows=%u, epoch_us=%u, "
+        "flow_to_rwnd_fd=%d, flow_to_slot_fd=%d, telemetry=%p, or "
+        "flow_to_keepalive_fd=%d\n",
+        max_active_flows, epoch_us, flow_to_rwnd_fd, flow_to_slot_fd,
+        (void *)telemetry, flow_to_keepalive_fd);
+    if (set_timer(sh, one_sec)) {
+      RM_PRINTF("ERROR: timer unexpectedly cancelled\n");
+    }
+    return;
   }
 
-  // 6) Start the next timer.
-  if (timer.expires_from_now(when)) {
+  // It is now safe to perform scheduling.
+  sh.lock.lock();
+  RM_PRINTF("INFO: performing scheduling. active=%lu, paused=%lu\n",
+            sh.active_fds_queue.size(), num_paused(sh));
+
+  rm_clock::duration when =
+      with_policy(sh, [&sh](auto &policy) { return schedule(sh, policy); });
+
+  // 7) Start the next timer.
+  if (set_timer(sh, when)) {
     RM_PRINTF("ERROR: timer unexpectedly cancelled\n");
   }
-  timer.async_wait(&timer_callback);
-  lock_scheduler.unlock();
+  sh.lock.unlock();
   RM_PRINTF("INFO: sleeping until next event in %ld us\n",
-            when.total_microseconds());
+            (long)std::chrono::duration_cast<std::chrono::microseconds>(when)
+                .count());
   return;
 }
 
-// This function is designed to be run in a thread. It is responsible for
-// managing the async timers that perform scheduling. The timer events are
-// executed by this thread, but they can be scheduled by other threads.
-void thread_func() {
-  RM_PRINTF("INFO: scheduler thread started\n");
-  if (timer.expires_from_now(one_sec)) {
-    RM_PRINTF("ERROR: timer unexpectedly cancelled\n");
+// The flows that the current ring_buffer__consume() call has reported. Only
+// accessed on shard 0's thread.
+std::vector<struct rm_flow> credit_events_flows;
+
+// Called by ring_buffer__consume() for each flow that has exhausted its byte
+// credit. The flow has already paused itself. Record it so that the scheduling
+// pass that follows hands its slot to another flow.
+int handle_credit_event(void * /* ctx */, void *data, size_t size) {
+  if (size >= sizeof(struct rm_flow))
+    credit_events_flows.push_back(*(const struct rm_flow *)data);
+  return 0;
+}
+
+// Perform scheduling on every shard right away. Must be called on shard 0's
+// thread.
+void schedule_all_shards() {
+  for (unsigned int i = 1; i < num_shards; ++i)
+    post_scheduling(*shards[i]);
+  // This also reschedules the timer.
+  timer_callback(*shards[0], boost::system::error_code());
+}
+
+// Runs on shard 0 when credit_rb is readable, i.e., when at least one flow has
+// exhausted its byte credit. Performs scheduling right away instead of at the
+// end of the current epoch, so the handoff does not wait for the timer. The
+// events do not say which shards' flows they are for, so every shard checks.
+void credit_events_callback(const boost::system::error_code &error) {
+  if (error || !run)
+    return;
+  ring_buffer__consume(credit_rb);
+  for (const auto &sh : shards) {
+    sh->lock.lock();
+    sh->exhausted_flows.insert(sh->exhausted_flows.end(),
+                               credit_events_flows.begin(),
+                               credit_events_flows.end());
+    sh->lock.unlock();
+  }
+  credit_events_flows.clear();
+  schedule_all_shards();
+  credit_events_desc->async_wait(
+      boost::asio::posix::stream_descriptor::wait_read,
+      &credit_events_callback);
+}
+
+// Describe the current parameters and scheduler state, summed across shards,
+// for the control channel's "get" command.
+std::string control_get() {
+  char out[512];
+  unsigned long flows = 0, active = 0, paused = 0, draining = 0, pending = 0,
+                rejected = 0, aged = 0;
+  for (const auto &sh : shards) {
+    sh->lock.lock();
+    flows += sh->fd_to_flow.size();
+    active += sh->active_fds_queue.size();
+    paused += num_paused(*sh);
+    draining += sh->draining_fds.size();
+    pending += sh->pending_fd_to_flow.size();
+    rejected += sh->num_rejected;
+    aged += sh->num_aged;
+    sh->lock.unlock();
   }
+  snprintf(out, sizeof(out),
+           "OK max_active_flows=%u epoch_us=%u idle_timeout_us=%ld "
+           "epoch_rtts=%u epoch_min_us=%u epoch_max_us=%u early_wake_rtts=%u "
+           "monitor_port_start=%u monitor_port_end=%u credit_B=%u "
+           "num_classes=%u max_paused=%u max_wait_us=%u jitter_permille=%u "
+           "policy=%s shards=%u flows=%lu active=%lu paused=%lu draining=%lu "
+           "pending=%lu rejected=%lu aged=%lu\n",
+           max_active_flows, epoch_us, idle_timeout_us, epoch_rtts,
+           epoch_min_us, epoch_max_us, early_wake_rtts, monitor_port_start(),
+           monitor_port_end(), credit_B, num_classes, max_paused, max_wait_us,
+           jitter_permille, policy_name.c_str(), num_shards, flows, active,
+           paused, draining, pending, rejected, aged);
+  return out;
+}
 
-  timer.async_wait(&timer_callback);
+// Apply the control channel's "set <key>=<value> ..." command. Either all of
+// the assignments are applied, or, if any is invalid, none are. Flows that are
+// already registered are not affected by a change to the port range.
+std::string control_set(const std::string &args) {
+  unsigned int max_active_flows_ = max_active_flows;
+  unsigned int epoch_us_ = epoch_us;
+  unsigned int idle_timeout_us_ = (unsigned int)idle_timeout_us;
+  unsigned int epoch_rtts_ = epoch_rtts;
+  unsigned int epoch_min_us_ = epoch_min_us;
+  unsigned int epoch_max_us_ = epoch_max_us;
+  unsigned int early_wake_rtts_ = early_wake_rtts;
+  unsigned int monitor_port_start_ = monitor_port_start();
+  unsigned int monitor_port_end_ = monitor_port_end();
+  unsigned int max_paused_ = max_paused;
+  unsigned int max_wait_us_ = max_wait_us;
+  unsigned int jitter_permille_ = jitter_permille;
+  size_t pos = 0;
+  unsigned int num_set = 0;
+  while (pos < args.size()) {
+    size_t end = args.find(' ', pos);
+    if (end == std::string::npos)
+      end = args.size();
+    if (end == pos) {
+      ++pos;
+      continue;
+    }
+    std::string arg = args.substr(pos, end - pos);
+    pos = end;
+    size_t eq = arg.find('=');
+    if (eq == std::string::npos)
+      return "ERROR expected <key>=<value>: " + arg + "\n";
+    std::string key = arg.substr(0, eq);
+    const char *val_str = arg.c_str() + eq + 1;
+    char *val_end;
+    errno = 0;
+    unsigned long val = strtoul(val_str, &val_end, 10);
+    if (*val_str == '\0' || *val_str == '-' || *val_end != '\0' || errno ||
+        val > UINT32_MAX)
+      return "ERROR invalid value: " + arg + "\n";
+    unsigned int *dest;
+    bool allow_zero = true;
+    unsigned long max = UINT32_MAX;
+    if (key == "max_active_flows") {
+      dest = &max_active_flows_;
+      allow_zero = false;
+    } else if (key == "epoch_us") {
+      dest = &epoch_us_;
+      allow_zero = false;
+    } else if (key == "idle_timeout_us") {
+      dest = &idle_timeout_us_;
+      max = INT32_MAX;
+    } else if (key == "epoch_rtts") {
+      dest = &epoch_rtts_;
+    } else if (key == "epoch_min_us") {
+      dest = &epoch_min_us_;
+    } else if (key == "epoch_max_us") {
+      dest = &epoch_max_us_;
+    } else if (key == "early_wake_rtts") {
+      dest = &early_wake_rtts_;
+    } else if (key == "monitor_port_start") {
+      dest = &monitor_port_start_;
+      allow_zero = false;
+      max = 65535;
+    } else if (key == "monitor_port_end") {
+      dest = &monitor_port_end_;
+      allow_zero = false;
+      max = 65535;
+    } else if (key == "max_paused") {
+      dest = &max_paused_;
+    } else if (key == "max_wait_us") {
+      dest = &max_wait_us_;
+    } else if (key == "jitter_permille") {
+      dest = &jitter_permille_;
+      max = 1000;
+    } else {
+      return "ERROR unknown parameter: " + key + "\n";
+    }
+    if ((!allow_zero && val == 0) || val > max)
+      return "ERROR invalid value: " + arg + "\n";
+    *dest = (unsigned int)val;
+    ++num_set;
+  }
+  if (!num_set)
+    return "ERROR expected set <key>=<value> ...\n";
+  if (monitor_port_start_ > monitor_port_end_)
+    return "ERROR monitor_port_start must be <= monitor_port_end\n";
+  unsigned long min_slots = 0;
+  for (unsigned int c = 0; c < num_classes; ++c)
+    min_slots += class_min_slots[c];
+  if (min_slots > max_active_flows_)
+    return "ERROR class minimum slots exceed max_active_flows\n";
+
+  lock_setup.lock();
+  for (const auto &sh : shards)
+    sh->lock.lock();
+  max_active_flows = max_active_flows_;
+  epoch_us = epoch_us_;
+  idle_timeout_us = (long)idle_timeout_us_;
+  idle_timeout_ns = (unsigned long)idle_timeout_us * 1000UL;
+  epoch_rtts = epoch_rtts_;
+  epoch_min_us = epoch_min_us_;
+  epoch_max_us = epoch_max_us_;
+  early_wake_rtts = early_wake_rtts_;
+  monitor_port_range = (monitor_port_start_ << 16) | monitor_port_end_;
+  max_paused = max_paused_;
+  max_wait_us = max_wait_us_;
+  jitter_permille = jitter_permille_;
+  for (const auto &sh : shards)
+    sh->lock.unlock();
+  lock_setup.unlock();
+  RM_PRINTF("INFO: control channel set parameters: %s\n", args.c_str());
+  // Perform scheduling right away, so that, e.g., a higher max_active_flows
+  // takes effect without waiting for the current epoch to end.
+  schedule_all_shards();
+  return "OK\n";
+}
+
+// Run one control command and return the reply.
+std::string handle_control_command(const std::string &line) {
+  if (line == "get")
+    return control_get();
+  if (line.rfind("set ", 0) == 0)
+    return control_set(line.substr(4));
+  return "ERROR unknown command: " + line + "\n";
+}
+
+// Read the next command from a control connection, then reply to it. Commands
+// are newline-terminated. The connection stays open until the client closes it.
+void control_read(std::shared_ptr<control_session> sess) {
+  boost::asio::async_read_until(
+      sess->sock, sess->buf, '\n',
+      [sess](const boost::system::error_code &error, size_t /* n */) {
+        if (error) {
+          // The client closed the connection, the command was too long, or
+          // the program is ending.
+          sess->sock.close();
+          control_sessions.erase(sess);
+          return;
+        }
+        std::istream in(&sess->buf);
+        std::string line;
+        std::getline(in, line);
+        if (!line.empty() && line.back() == '\r')
+          line.pop_back();
+        sess->reply = handle_control_command(line);
+        boost::asio::async_write(
+            sess->sock, boost::asio::buffer(sess->reply),
+            [sess](const boost::system::error_code &error, size_t /* n */) {
+              if (error) {
+                sess->sock.close();
+                control_sessions.erase(sess);
+                return;
+              }
+              control_read(sess);
+            });
+      });
+}
+
+// Accept the next connection to the control socket.
+void control_accept() {
+  auto sess = std::make_shared<control_session>();
+  control_acceptor->async_accept(
+      sess->sock, [sess](const boost::system::error_code &error) {
+        if (error)
+          return;
+        control_sessions.insert(sess);
+        control_read(sess);
+        control_accept();
+      });
+}
+
+// Open the control socket, if RM_CONTROL_DIR is set. Shard 0's thread starts
+// accepting connections once it is running.
+bool setup_control() {
+  char *dir = getenv(RM_CONTROL_DIR_KEY);
+  if (dir == NULL)
+    return true;
+  control_path = std::string(dir) + "/ratemon_" + std::to_string(getpid()) +
+                 ".sock";
+  // Remove a stale socket left behind by an earlier process with this PID.
+  unlink(control_path.c_str());
+  boost::system::error_code error;
+  boost::asio::local::stream_protocol::endpoint endpoint(control_path);
+  control_acceptor->open(endpoint.protocol(), error);
+  if (!error)
+    control_acceptor->bind(endpoint, error);
+  if (!error)
+    control_acceptor->listen(boost::asio::socket_base::max_listen_connections,
+                            error);
+  if (error) {
+    RM_PRINTF("ERROR: failed to open control socket '%s': %s\n",
+              control_path.c_str(), error.message().c_str());
+    control_path.clear();
+    return false;
+  }
+  RM_PRINTF("INFO: listening for control commands on '%s'\n",
+            control_path.c_str());
+  return true;
+}
+
+// Close the control socket and all open control connections. Must be called
+// on shard 0's thread.
+void stop_control() {
+  if (!control_acceptor->is_open())
+    return;
+  control_acceptor->close();
+  for (const auto &sess : control_sessions)
+    sess->sock.close();
+  control_sessions.clear();
+  unlink(control_path.c_str());
+}
+
+// This function is designed to be run in a thread, one for each shard. It is
+// responsible for managing the async timers that perform scheduling for the
+// shard. The timer events are executed by this thread, but they can be
+// scheduled by other threads. Shard 0's thread also runs the control channel
+// and waits for credit events.
+void thread_func(scheduler_shard &sh) {
+  RM_PRINTF("INFO: scheduler thread for shard %u started\n", sh.idx);
+  if (sched_cpu >= 0) {
+    int cpu = sched_cpu + (int)sh.idx;
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    if (cpu < CPU_SETSIZE)
+      CPU_SET(cpu, &cpus);
+    if (cpu >= CPU_SETSIZE ||
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus)) {
+      RM_PRINTF("ERROR: failed to pin scheduler thread to CPU %d\n", cpu);
+    }
+  }
+  if (sched_fifo_prio) {
+    struct sched_param param = {.sched_priority = (int)sched_fifo_prio};
+    if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param)) {
+      RM_PRINTF("ERROR: failed to set SCHED_FIFO priority %u for scheduler "
+                "thread\n",
+                sched_fifo_prio);
+    }
+  }
+  if (set_timer(sh, one_sec)) {
+    RM_PRINTF("ERROR: timer unexpectedly cancelled\n");
+  }
+  if (sh.idx == 0 && credit_rb != NULL) {
+    credit_events_desc->assign(ring_buffer__epoll_fd(credit_rb));
+    credit_events_desc->async_wait(
+        boost::asio::posix::stream_descriptor::wait_read,
+        &credit_events_callback);
+  }
+  if (sh.idx == 0 && control_acceptor->is_open())
+    control_accept();
   RM_PRINTF("INFO: scheduler thread initial sleep\n");
+  if (busy_poll) {
+    // Spin instead of sleeping, so that events run within a few microseconds
+    // of their deadline. Run other handlers (flow registration and credit
+    // events) as they become ready. The work guard keeps the io_context from
+    // stopping while it has nothing to do.
+    auto work = boost::asio::make_work_guard(sh.io);
+    while (run) {
+      sh.io.poll();
+      if (rm_clock::now() >= sh.busy_poll_deadline) {
+        sh.busy_poll_deadline = rm_clock::time_point::max();
+        timer_callback(sh, boost::system::error_code());
+      }
+    }
+    // Let timer_callback() observe that the program is ending, then finish
+    // any cancelled handlers.
+    timer_callback(sh, boost::system::error_code());
+    work.reset();
+  }
   // Execute the configured events, until there are no more events to execute.
-  io.run();
+  sh.io.run();
 
-  // Delete all flows from flow_to_rwnd and flow_to_win_scale.
-  lock_scheduler.lock();
-  for (const auto &p : fd_to_flow) {
+  // Delete this shard's flows from flow_to_rwnd and flow_to_win_scale.
+  sh.lock.lock();
+  for (const auto &p : sh.fd_to_flow) {
     if (flow_to_rwnd_fd)
       bpf_map_delete_elem(flow_to_rwnd_fd, &p.second);
     if (flow_to_win_scale_fd)
       bpf_map_delete_elem(flow_to_win_scale_fd, &p.second);
-    if (flow_to_last_data_time_fd)
-      bpf_map_delete_elem(flow_to_last_data_time_fd, &p.second);
+    if (flow_to_slot_fd)
+      bpf_map_delete_elem(flow_to_slot_fd, &p.second);
     if (flow_to_keepalive_fd)
       bpf_map_delete_elem(flow_to_keepalive_fd, &p.second);
+    if (flow_to_credit_fd)
+      bpf_map_delete_elem(flow_to_credit_fd, &p.second);
+  }
+  if (telemetry != NULL) {
+    for (const auto &p : sh.fd_to_slot)
+      __atomic_store_n(&telemetry[p.second].in_use, 0, __ATOMIC_RELEASE);
+    sh.fd_to_slot.clear();
   }
-  lock_scheduler.unlock();
-  RM_PRINTF("INFO: scheduler thread ended\n");
+  // Free this shard's policy state. No hooks are called after this.
+  if (policy_kind == POLICY_SHARED_OBJECT)
+    so_policies[sh.idx].fini();
+  sh.lock.unlock();
+  if (sh.idx == 0 && credit_rb != NULL) {
+    // The ring buffer owns its epoll FD.
+    if (credit_events_desc->is_open())
+      credit_events_desc->release();
+    ring_buffer__free(credit_rb);
+    credit_rb = NULL;
+  }
+  RM_PRINTF("INFO: scheduler thread for shard %u ended\n", sh.idx);
 
   if (run) {
     RM_PRINTF("ERROR: scheduled thread ended before program was signalled to "
@@ -404,13 +1633,14 @@ void thread_func() {
   }
 }
 
-// Catch SIGINT and trigger the scheduler thread and timer to end.
+// Catch SIGINT and trigger the scheduler threads and timers to end.
 void sigint_handler(int signum) {
   switch (signum) {
   case SIGINT:
     RM_PRINTF("INFO: caught SIGINT\n");
     run = false;
-    scheduler_thread.join();
+    for (const auto &sh : shards)
+      sh->thread.join();
     RM_PRINTF("INFO: resetting old SIGINT handler\n");
     sigaction(SIGINT, &oldact, NULL);
     break;
@@ -443,6 +1673,73 @@ bool read_env_uint(const char *key, volatile unsigned int *dest,
   return true;
 }
 
+// Read an environment variable as a list of class rules. See ratemon.h for the
+// format. The variable is optional. Values must be at most max_val.
+bool read_env_class_rules(const char *key, std::vector<class_rule> *rules,
+                          unsigned int max_val) {
+  // setup() may be retried, so replace any rules from an earlier attempt.
+  rules->clear();
+  char *val_str = getenv(key);
+  if (val_str == NULL)
+    return true;
+  char *pos = val_str;
+  char *end;
+  while (*pos != '\0') {
+    struct class_rule rule;
+    rule.lo = (unsigned int)strtoul(pos, &end, 10);
+    rule.hi = rule.lo;
+    bool valid = end != pos;
+    if (valid && *end == '-') {
+      pos = end + 1;
+      rule.hi = (unsigned int)strtoul(pos, &end, 10);
+      valid = end != pos;
+    }
+    valid = valid && *end == ':';
+    if (valid) {
+      pos = end + 1;
+      rule.cls = (unsigned int)strtoul(pos, &end, 10);
+      valid = end != pos && (*end == ',' || *end == '\0') &&
+              rule.lo <= rule.hi && rule.hi <= max_val &&
+              rule.cls < num_classes;
+    }
+    if (!valid) {
+      RM_PRINTF("ERROR: invalid value for '%s'='%s'\n", key, val_str);
+      return false;
+    }
+    rules->push_back(rule);
+    pos = *end == ',' ? end + 1 : end;
+  }
+  return true;
+}
+
+// Read the optional minimum number of active slots for each class.
+bool read_env_class_min_slots() {
+  char *val_str = getenv(RM_CLASS_MIN_SLOTS_KEY);
+  if (val_str == NULL)
+    return true;
+  char *pos = val_str;
+  char *end;
+  unsigned long total = 0;
+  for (unsigned int c = 0; *pos != '\0'; ++c) {
+    unsigned long val = strtoul(pos, &end, 10);
+    if (end == pos || (*end != ',' && *end != '\0') || c >= num_classes) {
+      RM_PRINTF("ERROR: invalid value for '%s'='%s'\n", RM_CLASS_MIN_SLOTS_KEY,
+                val_str);
+      return false;
+    }
+    class_min_slots[c] = (unsigned int)val;
+    total += val;
+    pos = *end == ',' ? end + 1 : end;
+  }
+  if (total > max_active_flows) {
+    RM_PRINTF("ERROR: '%s' reserves %lu slots, but only %u flows can be "
+              "active\n",
+              RM_CLASS_MIN_SLOTS_KEY, total, max_active_flows);
+    return false;
+  }
+  return true;
+}
+
 // Perform setup (only once for all flows in this process), such as reading
 // parameters from environment variables and looking up the BPF map
 // flow_to_rwnd.
@@ -452,6 +1749,53 @@ bool setup() {
     return false;
   if (!read_env_uint(RM_EPOCH_US_KEY, &epoch_us))
     return false;
+  // Scheduler thread options are optional.
+  unsigned int sched_cpu_;
+  if ((getenv(RM_BUSY_POLL_KEY) != NULL &&
+       !read_env_uint(RM_BUSY_POLL_KEY, &busy_poll, true /* allow_zero */)) ||
+      (getenv(RM_SCHED_FIFO_PRIO_KEY) != NULL &&
+       !read_env_uint(RM_SCHED_FIFO_PRIO_KEY, &sched_fifo_prio,
+                      true /* allow_zero */)))
+    return false;
+  if (getenv(RM_SCHED_CPU_KEY) != NULL) {
+    if (!read_env_uint(RM_SCHED_CPU_KEY, &sched_cpu_, true /* allow_zero */) ||
+        sched_cpu_ >= CPU_SETSIZE)
+      return false;
+    sched_cpu = (int)sched_cpu_;
+  }
+  if (getenv(RM_SCHED_SHARDS_KEY) != NULL &&
+      (!read_env_uint(RM_SCHED_SHARDS_KEY, &num_shards) ||
+       num_shards > RM_MAX_SHARDS))
+    return false;
+  // Create the shards, and each shard's instance of the built-in policies.
+  // Setup is retried if it fails, but no shard's thread has been started yet.
+  credit_events_desc.reset();
+  control_acceptor.reset();
+  shards.clear();
+  for (unsigned int i = 0; i < num_shards; ++i)
+    shards.push_back(std::make_unique<scheduler_shard>(i));
+  round_robin_policies.assign(num_shards, rotating_policy<false>());
+  lifo_policies.assign(num_shards, rotating_policy<true>());
+  odf_policies.assign(num_shards, oldest_demand_first_policy());
+  credit_events_desc.emplace(shards[0]->io);
+  control_acceptor.emplace(shards[0]->io);
+  // Adaptive epochs and early wake are optional.
+  if ((getenv(RM_EARLY_WAKE_RTTS_KEY) != NULL &&
+       !read_env_uint(RM_EARLY_WAKE_RTTS_KEY, &early_wake_rtts,
+                      true /* allow_zero */)) ||
+      (getenv(RM_EPOCH_RTTS_KEY) != NULL &&
+       !read_env_uint(RM_EPOCH_RTTS_KEY, &epoch_rtts, true /* allow_zero */)) ||
+      (getenv(RM_EPOCH_MIN_US_KEY) != NULL &&
+       !read_env_uint(RM_EPOCH_MIN_US_KEY, &epoch_min_us,
+                      true /* allow_zero */)) ||
+      (getenv(RM_EPOCH_MAX_US_KEY) != NULL &&
+       !read_env_uint(RM_EPOCH_MAX_US_KEY, &epoch_max_us,
+                      true /* allow_zero */)) ||
+      (getenv(RM_EPOCH_JITTER_PERMILLE_KEY) != NULL &&
+       (!read_env_uint(RM_EPOCH_JITTER_PERMILLE_KEY, &jitter_permille,
+                       true /* allow_zero */) ||
+        jitter_permille > 1000)))
+    return false;
   unsigned int idle_timeout_us_;
   if (!read_env_uint(RM_IDLE_TIMEOUT_US_KEY, &idle_timeout_us_,
                      true /* allow_zero */))
@@ -462,12 +1806,32 @@ bool setup() {
   if (!read_env_uint(RM_MONITOR_PORT_START_KEY, &monitor_port_start_) ||
       monitor_port_start_ >= 65536)
     return false;
-  monitor_port_start = (unsigned short)monitor_port_start_;
   unsigned int monitor_port_end_;
   if (!read_env_uint(RM_MONITOR_PORT_END_KEY, &monitor_port_end_) ||
       monitor_port_end_ >= 65536)
     return false;
-  monitor_port_end = (unsigned short)monitor_port_end_;
+  monitor_port_range = (monitor_port_start_ << 16) | monitor_port_end_;
+  // Byte-credit mode is optional.
+  if (getenv(RM_CREDIT_B_KEY) != NULL &&
+      !read_env_uint(RM_CREDIT_B_KEY, &credit_B, true /* allow_zero */))
+    return false;
+  // Priority classes are optional.
+  if (getenv(RM_NUM_CLASSES_KEY) != NULL &&
+      (!read_env_uint(RM_NUM_CLASSES_KEY, &num_classes) ||
+       num_classes > RM_MAX_CLASSES))
+    return false;
+  if (!read_env_class_rules(RM_CLASS_PRIORITIES_KEY, &class_priority_rules,
+                            0xFFFFFFFF) ||
+      !read_env_class_rules(RM_CLASS_DSCPS_KEY, &class_dscp_rules, 63) ||
+      !read_env_class_rules(RM_CLASS_PORTS_KEY, &class_port_rules, 65535) ||
+      !read_env_class_min_slots())
+    return false;
+  // Paused backlog options are optional.
+  if ((getenv(RM_MAX_PAUSED_KEY) != NULL &&
+       !read_env_uint(RM_MAX_PAUSED_KEY, &max_paused, true /* allow_zero */)) ||
+      (getenv(RM_MAX_WAIT_US_KEY) != NULL &&
+       !read_env_uint(RM_MAX_WAIT_US_KEY, &max_wait_us, true /* allow_zero */)))
+    return false;
 
   // Look up the FD for the flow_to_rwnd map. We do not need the BPF skeleton
   // for this.
@@ -490,17 +1854,31 @@ bool setup() {
   }
   flow_to_win_scale_fd = err;
 
-  // Look up the FD for the flow_to_last_data_time_ns map. We do not need the
-  // BPF skeleton for this.
-  err = bpf_obj_get(RM_FLOW_TO_LAST_DATA_TIME_PIN_PATH);
+  // Look up the FD for the flow_to_slot map. We do not need the BPF skeleton
+  // for this.
+  err = bpf_obj_get(RM_FLOW_TO_SLOT_PIN_PATH);
   if (err == -1) {
-    RM_PRINTF(
-        "ERROR: failed to get FD for 'flow_to_last_data_time_ns' from path "
-        "'%s'\n",
-        RM_FLOW_TO_LAST_DATA_TIME_PIN_PATH);
+    RM_PRINTF("ERROR: failed to get FD for 'flow_to_slot' from path '%s'\n",
+              RM_FLOW_TO_SLOT_PIN_PATH);
+    return false;
+  }
+  flow_to_slot_fd = err;
+
+  // Map the flow_telemetry array into memory, so that the scheduler can read
+  // each flow's last data time without a syscall.
+  err = bpf_obj_get(RM_FLOW_TELEMETRY_PIN_PATH);
+  if (err == -1) {
+    RM_PRINTF("ERROR: failed to get FD for 'flow_telemetry' from path '%s'\n",
+              RM_FLOW_TELEMETRY_PIN_PATH);
+    return false;
+  }
+  void *mem = mmap(NULL, RM_MAX_FLOWS * sizeof(struct rm_telemetry),
+                   PROT_READ | PROT_WRITE, MAP_SHARED, err, 0);
+  if (mem == MAP_FAILED) {
+    RM_PRINTF("ERROR: failed to mmap 'flow_telemetry': %s\n", strerror(errno));
     return false;
   }
-  flow_to_last_data_time_fd = err;
+  telemetry = (struct rm_telemetry *)mem;
 
   // Look up the FD for the flow_to_keepalive map. We do not need the
   // BPF skeleton for this.
@@ -513,6 +1891,41 @@ bool setup() {
   }
   flow_to_keepalive_fd = err;
 
+  if (credit_B) {
+    // Look up the FD for the flow_to_credit map, and open the credit_events
+    // ring buffer. We do not need the BPF skeleton for these.
+    err = bpf_obj_get(RM_FLOW_TO_CREDIT_PIN_PATH);
+    if (err == -1) {
+      RM_PRINTF("ERROR: failed to get FD for 'flow_to_credit' from path "
+                "'%s'\n",
+                RM_FLOW_TO_CREDIT_PIN_PATH);
+      return false;
+    }
+    flow_to_credit_fd = err;
+    err = bpf_obj_get(RM_CREDIT_EVENTS_PIN_PATH);
+    if (err == -1) {
+      RM_PRINTF("ERROR: failed to get FD for 'credit_events' from path "
+                "'%s'\n",
+                RM_CREDIT_EVENTS_PIN_PATH);
+      return false;
+    }
+    credit_rb = ring_buffer__new(err, handle_credit_event, NULL, NULL);
+    if (credit_rb == NULL) {
+      RM_PRINTF("ERROR: failed to create ring buffer for 'credit_events'\n");
+      return false;
+    }
+  }
+
+  if (!setup_control())
+    return false;
+
+  // The scheduling policy is optional. Load it after everything else that can
+  // fail, so that a failed setup() does not leave a policy initialized.
+  char *policy_str = getenv(RM_POLICY_KEY);
+  if (policy_str != NULL &&
+      !load_policy(policy_str, getenv(RM_POLICY_ARGS_KEY)))
+    return false;
+
   // Catch SIGINT to end the program.
   struct sigaction action;
   action.sa_handler = sigint_handler;
@@ -520,20 +1933,24 @@ bool setup() {
   action.sa_flags = SA_RESETHAND;
   sigaction(SIGINT, &action, &oldact);
 
-  // Launch the scheduler thread.
-  scheduler_thread = std::thread(thread_func);
+  // Launch the scheduler threads.
+  for (const auto &sh : shards)
+    sh->thread = std::thread(thread_func, std::ref(*sh));
 
   RM_PRINTF("INFO: setup complete! max_active_flows=%u, epoch_us=%u, "
-            "idle_timeout_ns=%lu, monitor_port_start=%u, monitor_port_end=%u\n",
-            max_active_flows, epoch_us, idle_timeout_ns, monitor_port_start,
-            monitor_port_end);
+            "idle_timeout_ns=%lu, monitor_port_start=%u, monitor_port_end=%u, "
+            "credit_B=%u, num_classes=%u, epoch_rtts=%u, early_wake_rtts=%u, "
+            "busy_poll=%u, sched_cpu=%d, sched_fifo_prio=%u, max_paused=%u, "
+            "max_wait_us=%u, policy=%s, num_shards=%u\n",
+            max_active_flows, epoch_us, idle_timeout_ns, monitor_port_start(),
+            monitor_port_end(), credit_B, num_classes, epoch_rtts,
+            early_wake_rtts, busy_poll, sched_cpu, sched_fifo_prio, max_paused,
+            max_wait_us, policy_name.c_str(), num_shards);
   return true;
 }
 
-// Fill in the four-tuple for this socket.
-bool get_flow(int fd, struct rm_flow *flow) {
-  // Determine the four-tuple, which we need to track because RWND tuning is
-  // applied based on four-tuple.
+// Fill in the local half of the four-tuple for this socket.
+bool get_local_addr(int fd, struct rm_flow *flow) {
   struct sockaddr_in local_addr;
   socklen_t local_addr_len = sizeof(local_addr);
   // Get the local IP and port.
@@ -541,6 +1958,13 @@ bool get_flow(int fd, struct rm_flow *flow) {
     RM_PRINTF("ERROR: failed to call 'getsockname'\n");
     return false;
   }
+  flow->local_addr = ntohl(local_addr.sin_addr.s_addr);
+  flow->local_port = ntohs(local_addr.sin_port);
+  return true;
+}
+
+// Fill in the remote half of the four-tuple for this socket.
+bool get_remote_addr(int fd, struct rm_flow *flow) {
   struct sockaddr_in remote_addr;
   socklen_t remote_addr_len = sizeof(remote_addr);
   // Get the peer's (i.e., the remote) IP and port.
@@ -549,14 +1973,91 @@ bool get_flow(int fd, struct rm_flow *flow) {
     RM_PRINTF("ERROR: failed to call 'getpeername'\n");
     return false;
   }
-  // Fill in the four-tuple.
-  flow->local_addr = ntohl(local_addr.sin_addr.s_addr);
   flow->remote_addr = ntohl(remote_addr.sin_addr.s_addr);
-  flow->local_port = ntohs(local_addr.sin_port);
   flow->remote_port = ntohs(remote_addr.sin_port);
   return true;
 }
 
+// Whether flows on this remote port should be managed.
+inline bool in_monitor_range(unsigned short remote_port) {
+  unsigned int range = monitor_port_range.load(std::memory_order_relaxed);
+  return remote_port >= (range >> 16) && remote_port <= (range & 0xFFFF);
+}
+
+// Look up the class of the first rule in rules that matches val. Returns false
+// if no rule matches.
+inline bool match_class_rules(const std::vector<class_rule> &rules,
+                              unsigned int val, unsigned int *cls) {
+  for (const auto &rule : rules) {
+    if (val >= rule.lo && val <= rule.hi) {
+      *cls = rule.cls;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Look up the DSCP that classifies a flow. For an accepted flow, this is the
+// DSCP of the peer's SYN, which the kernel keeps for the socket and reports
+// through IP_PKTOPTIONS while IP_RECVTOS is enabled. For a connected flow, we
+// sent the SYN, so this is the local marking in the socket's IP_TOS. Returns
+// false if the DSCP is not available.
+bool get_class_dscp(int fd, bool accepted, unsigned int *dscp) {
+  int val = 0;
+  socklen_t val_len = sizeof(val);
+  if (!accepted) {
+    if (getsockopt(fd, IPPROTO_IP, IP_TOS, &val, &val_len) != 0)
+      return false;
+    *dscp = ((unsigned int)val & 0xFF) >> 2;
+    return true;
+  }
+  // Room for every control message that IP_PKTOPTIONS might return.
+  char control[CMSG_SPACE(sizeof(struct in_pktinfo)) +
+               2 * CMSG_SPACE(sizeof(int))];
+  socklen_t control_len = sizeof(control);
+  int one = 1;
+  if (setsockopt(fd, IPPROTO_IP, IP_RECVTOS, &one, sizeof(one)) != 0)
+    return false;
+  int ret = getsockopt(fd, IPPROTO_IP, IP_PKTOPTIONS, control, &control_len);
+  // TCP does not deliver control messages to recvmsg(), so this only restores
+  // what later IP_PKTOPTIONS calls return.
+  setsockopt(fd, IPPROTO_IP, IP_RECVTOS, &zero, sizeof(zero));
+  if (ret != 0)
+    return false;
+  struct msghdr msg = {};
+  msg.msg_control = control;
+  msg.msg_controllen = control_len;
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_TOS) {
+      memcpy(&val, CMSG_DATA(cmsg), sizeof(val));
+      *dscp = ((unsigned int)val & 0xFF) >> 2;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Determine the priority class of this socket. See ratemon.h for the rules.
+unsigned int classify(int fd, const struct rm_flow *flow, bool accepted) {
+  if (num_classes == 1)
+    return 0;
+  unsigned int cls;
+  int val;
+  socklen_t val_len = sizeof(val);
+  if (!class_priority_rules.empty() &&
+      getsockopt(fd, SOL_SOCKET, SO_PRIORITY, &val, &val_len) == 0 &&
+      match_class_rules(class_priority_rules, (unsigned int)val, &cls))
+    return cls;
+  unsigned int dscp;
+  if (!class_dscp_rules.empty() && get_class_dscp(fd, accepted, &dscp) &&
+      match_class_rules(class_dscp_rules, dscp, &cls))
+    return cls;
+  if (match_class_rules(class_port_rules, flow->remote_port, &cls))
+    return cls;
+  return num_classes - 1;
+}
+
 // Set the CCA for this socket and make sure it was set correctly.
 bool set_cca(int fd, const char *cca) {
   if (setsockopt(fd, SOL_TCP, TCP_CONGESTION, cca, strlen(cca)) == -1) {
@@ -578,32 +2079,45 @@ bool set_cca(int fd, const char *cca) {
   return true;
 }
 
-// Perform initial scheduling for this flow.
-void initial_scheduling(int fd) {
-  // Create an entry in flow_to_last_data_time_ns for this flow so that the
-  // kprobe program knows to start tracking this flow.
-  bpf_map_update_elem(flow_to_last_data_time_fd, &fd_to_flow[fd], &zero,
-                      BPF_ANY);
-  // Should this flow be active or paused?
-  if (active_fds_queue.size() < max_active_flows) {
+// Perform initial scheduling for this flow, on its shard's thread.
+void initial_scheduling(scheduler_shard &sh, int fd) {
+  if (!claim_telemetry_slot(fd))
+    RM_PRINTF("WARNING: no telemetry slot for FD=%d, cannot detect idle\n", fd);
+  // Should this flow be active or paused? Take a free slot if there is one,
+  // without giving up any that this shard holds, which its active flows are
+  // using even if max_active_flows was lowered.
+  if (try_acquire_slot(slots_used, max_active_flows)) {
     // Less than the max number of flows are active, so make this one active.
-    boost::posix_time::ptime now =
-        boost::posix_time::microsec_clock::local_time();
-    active_fds_queue.push(
-        {fd, now + boost::posix_time::microseconds(epoch_us) +
-                 boost::posix_time::microseconds(jitter(epoch_us))});
+    rm_clock::time_point now = rm_clock::now();
+    sh.active_fds_queue.push(start_epoch(fd, now));
     RM_PRINTF("INFO: allowing new flow FD=%d\n", fd);
-    if (active_fds_queue.size() == 1) {
-      if (timer.expires_from_now(active_fds_queue.front().second - now) != 1) {
+    if (sh.active_fds_queue.size() == 1) {
+      if (set_timer(sh, get_wake_time(sh.active_fds_queue.front()) - now) !=
+          1) {
         RM_PRINTF("ERROR: should have cancelled 1 timer\n");
       }
-      timer.async_wait(&timer_callback);
       RM_PRINTF("INFO: first scheduling event\n");
     }
+    return;
+  }
+  unsigned long now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                             rm_clock::now().time_since_epoch())
+                             .count();
+  if (max_paused &&
+      total_paused.load(std::memory_order_relaxed) >= max_paused) {
+    // This flow would have to wait, but the paused backlog (across all shards)
+    // is full, so reject it. It stays paused, outside of the backlog, until
+    // there is room.
+    RM_PRINTF("INFO: rejecting FD=%d, paused backlog is full\n", fd);
+    mark_rejected(sh, fd, now_ns);
   } else {
-    // The max number of flows are active already, so pause this one.
-    paused_fds_queue.push(fd);
-    pause_flow(fd);
+    // The max number of flows are active already, so pause this one. If it
+    // outranks an active flow, then it preempts that flow at the next
+    // scheduling event once it has pending data.
+    mark_paused(fd, now_ns);
+    with_policy(sh, [&](auto &policy) {
+      policy.on_register(fd, sh.fd_to_class[fd], now_ns);
+    });
   }
 }
 
@@ -619,40 +2133,107 @@ int check_family(const struct sockaddr *addr) {
   return 0;
 }
 
-void register_fd_for_monitoring(int fd) {
-  // One-time setup.
-  lock_setup.lock();
-  if (!setup_done) {
-    if (!setup()) {
-      lock_setup.unlock();
-      return;
+// Complete the registration of one pending FD, whose rm_flow has the remote
+// address and port if they are known. Returns whether the FD is now managed.
+// Called with the shard's lock held.
+bool register_pending_fd(scheduler_shard &sh, int fd, struct rm_flow flow,
+                         bool accepted) {
+  // Look up whichever half of the four-tuple we do not know yet.
+  if (!get_local_addr(fd, &flow))
+    return false;
+  if (flow.remote_port == 0) {
+    if (!get_remote_addr(fd, &flow))
+      return false;
+    // Ignore flows that are not in the monitor port range.
+    if (!in_monitor_range(flow.remote_port)) {
+      RM_PRINTF(
+          "INFO: ignoring flow on remote port %u, not in monitor port range: "
+          "[%u, %u]\n",
+          flow.remote_port, monitor_port_start(), monitor_port_end());
+      return false;
     }
-    setup_done = true;
   }
-  lock_setup.unlock();
-  // Look up the four-tuple.
-  struct rm_flow flow;
-  if (!get_flow(fd, &flow))
-    return;
   RM_PRINTF("flow: %u:%u->%u:%u\n", flow.remote_addr, flow.remote_port,
             flow.local_addr, flow.local_port);
-  // Ignore flows that are not in the monitor port range.
-  if (!(flow.remote_port >= monitor_port_start &&
-        flow.remote_port <= monitor_port_end)) {
-    RM_PRINTF(
-        "INFO: ignoring flow on remote port %u, not in monitor port range: "
-        "[%u, %u]\n",
-        flow.remote_port, monitor_port_start, monitor_port_end);
-    return;
-  }
-  fd_to_flow[fd] = flow;
   // Change the CCA to BPF_CUBIC.
   if (!set_cca(fd, RM_BPF_CUBIC))
-    return;
+    return false;
+  sh.fd_to_flow[fd] = flow;
+  sh.fd_to_class[fd] = classify(fd, &flow, accepted);
   // Initial scheduling for this flow.
-  lock_scheduler.lock();
-  initial_scheduling(fd);
-  lock_scheduler.unlock();
+  initial_scheduling(sh, fd);
+  return true;
+}
+
+// Complete the registration of all of this shard's pending FDs. This runs on
+// the shard's thread so that the syscalls and initial scheduling for new flows
+// stay off of the application's accept()/connect() path, and so that a burst of
+// new flows is registered in one batch. Holding the shard's lock throughout
+// guarantees that close() cannot release an FD number while it is being
+// registered.
+void register_pending_fds(scheduler_shard &sh) {
+  sh.lock.lock();
+  sh.register_posted = false;
+  while (!sh.pending_fds_queue.empty()) {
+    int fd = sh.pending_fds_queue.front();
+    sh.pending_fds_queue.pop();
+    auto it = sh.pending_fd_to_flow.find(fd);
+    if (it == sh.pending_fd_to_flow.end()) {
+      // This FD was closed before it could be registered.
+      continue;
+    }
+    auto [flow, accepted] = it->second;
+    sh.pending_fd_to_flow.erase(it);
+    // close() does not need to look for FDs that are not managed.
+    if (!register_pending_fd(sh, fd, flow, accepted) &&
+        !sh.fd_to_flow.contains(fd))
+      set_maybe_registered(fd, false);
+  }
+  sh.lock.unlock();
+}
+
+// Queue an FD to be registered by register_pending_fds() on its shard's
+// thread. remote is the peer's address, if the caller already knows it, or
+// NULL. accepted is whether the FD came from accept() rather than connect().
+// Flows whose remote port is known to be outside of the monitor port range are
+// ignored immediately.
+void register_fd_for_monitoring(int fd, const struct sockaddr_in *remote,
+                                bool accepted) {
+  // One-time setup.
+  if (!setup_done.load(std::memory_order_acquire)) {
+    lock_setup.lock();
+    if (!setup_done.load(std::memory_order_relaxed)) {
+      if (!setup()) {
+        lock_setup.unlock();
+        return;
+      }
+      setup_done.store(true, std::memory_order_release);
+    }
+    lock_setup.unlock();
+  }
+  struct rm_flow flow = {};
+  if (remote != NULL) {
+    flow.remote_addr = ntohl(remote->sin_addr.s_addr);
+    flow.remote_port = ntohs(remote->sin_port);
+    // Ignore flows that are not in the monitor port range.
+    if (!in_monitor_range(flow.remote_port)) {
+      RM_PRINTF(
+          "INFO: ignoring flow on remote port %u, not in monitor port range: "
+          "[%u, %u]\n",
+          flow.remote_port, monitor_port_start(), monitor_port_end());
+      return;
+    }
+  }
+  scheduler_shard &sh = shard_for(fd);
+  sh.lock.lock();
+  set_maybe_registered(fd, true);
+  sh.pending_fd_to_flow[fd] = {flow, accepted};
+  sh.pending_fds_queue.push(fd);
+  if (!sh.register_posted) {
+    sh.register_posted = true;
+    boost::asio::post(sh.io, [&sh]() { register_pending_fds(sh); });
+  }
+  sh.lock.unlock();
 }
 
 // accept() and connect() are the two entrance points for libratemon_interp. accept() handles the responder side and connect() handles the initiator side.
@@ -679,7 +2260,14 @@ int accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen) {
   if (!run)
     return fd;
 
-  register_fd_for_monitoring(fd);
+  // Reuse the peer address that accept() already looked up, if the caller
+  // asked for it.
+  register_fd_for_monitoring(
+      fd, (addr != NULL && addrlen != NULL &&
+           *addrlen >= (socklen_t)sizeof(struct sockaddr_in))
+              ? (const struct sockaddr_in *)addr
+              : NULL,
+      true);
   RM_PRINTF("INFO: successful 'accept' for FD=%d, got FD=%d\n", sockfd, fd);
   return fd;
 }
@@ -691,21 +2279,26 @@ int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
     RM_PRINTF("ERROR: failed to query dlsym for 'connect': %s\n", dlerror());
     return -1;
   }
-  int fd = real_connect(sockfd, addr, addrlen);
-  if (fd == -1) {
+  int ret = real_connect(sockfd, addr, addrlen);
+  // A non-blocking connect() that is in progress already has its four-tuple,
+  // so it can be registered too.
+  if (ret == -1 && errno != EINPROGRESS) {
     RM_PRINTF("ERROR: real 'connect' failed\n");
-    return fd;
+    return ret;
   }
-  if (check_family(addr) != 0)
-    return fd;
+  if (addr == NULL || check_family(addr) != 0)
+    return ret;
 
   // If we have been signalled to quit, then do nothing more.
   if (!run)
-    return fd;
+    return ret;
 
-  register_fd_for_monitoring(fd);
-  RM_PRINTF("INFO: successful 'close' for FD=%d, got FD=%d\n", sockfd, fd);
-  return fd;
+  // Preserve errno (i.e., EINPROGRESS) for the caller.
+  int saved_errno = errno;
+  register_fd_for_monitoring(sockfd, (const struct sockaddr_in *)addr, false);
+  RM_PRINTF("INFO: successful 'connect' for FD=%d\n", sockfd);
+  errno = saved_errno;
+  return ret;
 }
 
 // Get around C++ function name mangling.
@@ -716,33 +2309,55 @@ int close(int sockfd) {
     RM_PRINTF("ERROR: failed to query dlsym for 'close': %s\n", dlerror());
     return -1;
   }
-  int ret = real_close(sockfd);
-  if (ret == -1) {
-    RM_PRINTF("ERROR: real 'close' failed\n");
-  } else {
-    RM_PRINTF("INFO: successful 'close' for FD=%d\n", sockfd);
+  // Before setup, no FD has been registered, and there are no shards. After
+  // setup, most closed FDs (files, pipes, unmanaged sockets) were never
+  // registered, so skip the lock for them.
+  if (!setup_done.load(std::memory_order_acquire) || !maybe_registered(sockfd))
+    return real_close(sockfd);
+  // Cancel this FD's registration, if it is pending, and remove it from all
+  // data structures. Once that is done, no shard acts on this FD number, so it
+  // is safe to release it (and for the kernel to reuse it) without the lock.
+  scheduler_shard &sh = shard_for(sockfd);
+  sh.lock.lock();
+  sh.pending_fd_to_flow.erase(sockfd);
+  auto it = sh.fd_to_flow.find(sockfd);
+  bool registered = it != sh.fd_to_flow.end();
+  struct rm_flow flow = {};
+  if (registered) {
+    flow = it->second;
+    if (flow_to_slot_fd)
+      release_telemetry_slot(sockfd);
+    // Removing the FD from fd_to_flow triggers it to be (eventually) removed
+    // from scheduling.
+    sh.fd_to_flow.erase(it);
+    sh.fd_to_class.erase(sockfd);
+    unmark_paused(sockfd);
+    sh.fd_to_rejected_since.erase(sockfd);
   }
+  set_maybe_registered(sockfd, false);
+  sh.lock.unlock();
 
-  // Remove this FD from all data structures.
-  lock_scheduler.lock();
-  if (fd_to_flow.contains(sockfd)) {
-    // Obviously, do this before removing the FD from fd_to_flow.
+  // The flow's four-tuple is in use until real_close(), so it cannot be
+  // registered again before its BPF map entries are removed.
+  if (registered) {
     if (flow_to_rwnd_fd)
-      bpf_map_delete_elem(flow_to_rwnd_fd, &fd_to_flow[sockfd]);
+      bpf_map_delete_elem(flow_to_rwnd_fd, &flow);
     if (flow_to_win_scale_fd)
-      bpf_map_delete_elem(flow_to_win_scale_fd, &fd_to_flow[sockfd]);
-    if (flow_to_last_data_time_fd)
-      bpf_map_delete_elem(flow_to_last_data_time_fd, &fd_to_flow[sockfd]);
+      bpf_map_delete_elem(flow_to_win_scale_fd, &flow);
     if (flow_to_keepalive_fd)
-      bpf_map_delete_elem(flow_to_keepalive_fd, &fd_to_flow[sockfd]);
-    // Removing the FD from fd_to_flow triggers it to be (eventually) removed
-    // from scheduling.
-    unsigned long d = fd_to_flow.erase(sockfd);
-    RM_PRINTF("INFO: removed FD=%d (%ld elements removed)\n", sockfd, d);
+      bpf_map_delete_elem(flow_to_keepalive_fd, &flow);
+    if (flow_to_credit_fd)
+      bpf_map_delete_elem(flow_to_credit_fd, &flow);
+    RM_PRINTF("INFO: removed FD=%d\n", sockfd);
   } else {
     RM_PRINTF("INFO: ignoring 'close' for FD=%d, not in fd_to_flow\n", sockfd);
   }
-  lock_scheduler.unlock();
+  int ret = real_close(sockfd);
+  if (ret == -1) {
+    RM_PRINTF("ERROR: real 'close' failed\n");
+  } else {
+    RM_PRINTF("INFO: successful 'close' for FD=%d\n", sockfd);
+  }
   return ret;
 }
 }
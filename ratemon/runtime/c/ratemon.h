@@ -18,12 +18,18 @@
 
 // Max number of flows that BPF can track.
 #define RM_MAX_FLOWS 8192
+// Number of FDs for which libratemon_interp keeps a lock-free "may be
+// registered" flag. close() on a higher FD always takes its shard's lock.
+#define RM_MAX_TRACKED_FDS 65536
 // Map pin paths.
 #define RM_FLOW_TO_RWND_PIN_PATH "/sys/fs/bpf/flow_to_rwnd"
 #define RM_FLOW_TO_WIN_SCALE_PIN_PATH "/sys/fs/bpf/flow_to_win_scale"
-#define RM_FLOW_TO_LAST_DATA_TIME_PIN_PATH                                     \
-  "/sys/fs/bpf/flow_to_last_data_time_ns"
+#define RM_FLOW_TO_SLOT_PIN_PATH "/sys/fs/bpf/flow_to_slot"
+#define RM_FLOW_TELEMETRY_PIN_PATH "/sys/fs/bpf/flow_telemetry"
 #define RM_FLOW_TO_KEEPALIVE_PIN_PATH "/sys/fs/bpf/flow_to_keepalive"
+#define RM_FLOW_TO_CREDIT_PIN_PATH "/sys/fs/bpf/flow_to_credit"
+#define RM_CREDIT_EVENTS_PIN_PATH "/sys/fs/bpf/credit_events"
+#define RM_FLOW_TO_RATE_PIN_PATH "/sys/fs/bpf/flow_to_rate"
 // Name of struct_ops CCA that flows must use to be woken up.
 #define RM_BPF_CUBIC "bpf_cubic"
 
@@ -31,15 +37,120 @@
 #define RM_MAX_ACTIVE_FLOWS_KEY "RM_MAX_ACTIVE_FLOWS"
 // Environment variable that specifies how often to perform flow scheduling.
 #define RM_EPOCH_US_KEY "RM_EPOCH_US"
+// Environment variable that specifies each flow's epoch as a multiple of its
+// measured RTT (equivalently, the time to receive that many BDPs at its current
+// rate). The RTT is the receiver's estimate from TCP_INFO (tcpi_rcv_rtt), or
+// the smoothed RTT if there is none yet. Flows without an RTT sample use
+// RM_EPOCH_US. 0 or unset disables adaptive epochs.
+#define RM_EPOCH_RTTS_KEY "RM_EPOCH_RTTS"
+// Environment variables that bound adaptive epochs. 0 or unset means no bound.
+#define RM_EPOCH_MIN_US_KEY "RM_EPOCH_MIN_US"
+#define RM_EPOCH_MAX_US_KEY "RM_EPOCH_MAX_US"
+// Environment variable that specifies the random jitter applied to each epoch,
+// in thousandths of the epoch (up to 1000), so that flows that start together
+// do not stay in lockstep. Unset means 125, i.e., +/- 12.5%.
+#define RM_EPOCH_JITTER_PERMILLE_KEY "RM_EPOCH_JITTER_PERMILLE"
+// Environment variable that specifies how many RTTs before the end of a flow's
+// epoch to activate its successor. The two flows overlap until the epoch ends,
+// which hides the successor's ramp-up. The lead time is capped at half of the
+// epoch. 0 or unset disables early wake.
+#define RM_EARLY_WAKE_RTTS_KEY "RM_EARLY_WAKE_RTTS"
 // Duration after which an idle flow will be forcibly paused. 0 disables this
 // feature.
 #define RM_IDLE_TIMEOUT_US_KEY "RM_IDLE_TIMEOUT_US"
+// Environment variable that, when 1, makes the scheduler thread busy-poll
+// instead of sleeping until the next event, for sub-100 us epochs. This
+// dedicates a CPU to the scheduler thread. 0 or unset disables busy-polling.
+#define RM_BUSY_POLL_KEY "RM_BUSY_POLL"
+// Environment variable that specifies a CPU to pin the scheduler thread to.
+// With more than one shard, shard i's thread is pinned to this CPU + i. Unset
+// disables pinning.
+#define RM_SCHED_CPU_KEY "RM_SCHED_CPU"
+// Environment variable that specifies the number of scheduler shards, up to
+// RM_MAX_SHARDS, for processes with more flows than one scheduler thread can
+// keep up with. Flows are hashed across the shards by FD, and each shard
+// schedules its flows on its own thread. The shards share RM_MAX_ACTIVE_FLOWS.
+// Priority classes and RM_CLASS_MIN_SLOTS apply within each shard. 1 or unset
+// uses one scheduler thread.
+#define RM_SCHED_SHARDS_KEY "RM_SCHED_SHARDS"
+#define RM_MAX_SHARDS 64
+// Environment variable that specifies a SCHED_FIFO priority (1-99) for the
+// scheduler thread. Requires CAP_SYS_NICE. 0 or unset keeps the default policy.
+#define RM_SCHED_FIFO_PRIO_KEY "RM_SCHED_FIFO_PRIO"
 // Environment variable that specifies the start range of REMOTE ports to manage
 // using scheduled RWND tuning.
 #define RM_MONITOR_PORT_START_KEY "RM_MONITOR_PORT_START"
 #define RM_MONITOR_PORT_END_KEY "RM_MONITOR_PORT_END"
+// Environment variable that specifies the byte credit that an activated flow
+// is granted. When set, an active flow is paused (in the kernel) as soon as it
+// has received this many bytes, in addition to at the end of its epoch. 0 or
+// unset disables byte-credit scheduling.
+#define RM_CREDIT_B_KEY "RM_CREDIT_B"
+// Environment variable that specifies the number of strict-priority classes,
+// up to RM_MAX_CLASSES. Class 0 has the highest priority. Flows that do not
+// match any class rule are placed in the lowest-priority class. 1 or unset
+// disables priorities.
+#define RM_NUM_CLASSES_KEY "RM_NUM_CLASSES"
+#define RM_MAX_CLASSES 8
+// Environment variables that specify class rules. Each is a comma-separated
+// list of "<value>:<class>" or "<start>-<end>:<class>" entries. A flow's class
+// is set by the first matching rule, checking, in order, the socket's
+// SO_PRIORITY (an application hint), the flow's DSCP, and the flow's remote
+// port. The DSCP of an accepted flow is the one in the peer's SYN. The DSCP of
+// a connected flow is the local marking in the socket's IP_TOS. Applications
+// must set SO_PRIORITY or IP_TOS before connect(), or set SO_PRIORITY on the
+// listening socket, from which accepted sockets inherit.
+#define RM_CLASS_PRIORITIES_KEY "RM_CLASS_PRIORITIES"
+#define RM_CLASS_DSCPS_KEY "RM_CLASS_DSCPS"
+#define RM_CLASS_PORTS_KEY "RM_CLASS_PORTS"
+// Environment variable that specifies the minimum number of active slots for
+// each class, as a comma-separated list in class order, so that lower classes
+// are not starved. Missing entries are 0. The sum must not exceed
+// RM_MAX_ACTIVE_FLOWS.
+#define RM_CLASS_MIN_SLOTS_KEY "RM_CLASS_MIN_SLOTS"
+// Environment variable that specifies the maximum number of paused flows,
+// across all classes. A new flow that would have to wait while the backlog is
+// full is rejected: it is held at RWND = 0 B outside of the backlog, and joins
+// the backlog, in the order of rejection, once there is room. 0 or unset means
+// unbounded.
+#define RM_MAX_PAUSED_KEY "RM_MAX_PAUSED"
+// Environment variable that specifies the scheduling policy, which decides the
+// order in which paused flows with pending data are activated, within a class.
+// Either the name of a built-in policy, "round_robin" (the default), "lifo", or
+// "odf" (oldest demand first, i.e., the flow that has been waiting with pending
+// data for the longest), or the path of a shared object that implements the
+// interface in ratemon_policy.h. RM_POLICY_ARGS is passed to the shared
+// object's init hook.
+#define RM_POLICY_KEY "RM_POLICY"
+#define RM_POLICY_ARGS_KEY "RM_POLICY_ARGS"
+// Environment variable that specifies the maximum time (us) that a flow can be
+// paused. A flow that has waited this long is activated before any other flow
+// in its class, whether or not it has sent a keepalive. 0 or unset disables
+// aging.
+#define RM_MAX_WAIT_US_KEY "RM_MAX_WAIT_US"
+// Environment variable that specifies a directory in which each process opens a
+// control socket, named "ratemon_<pid>.sock". Unset disables the control
+// channel. The control socket accepts newline-terminated commands and replies
+// with one line that starts with "OK" or "ERROR":
+//   get: report the current parameters and the number of flows in each state
+//   set <key>=<value> ...: atomically change max_active_flows, epoch_us,
+//     idle_timeout_us, epoch_rtts, epoch_min_us, epoch_max_us,
+//     early_wake_rtts, monitor_port_start, monitor_port_end, max_paused,
+//     max_wait_us, or jitter_permille
+// For example, with socat:
+//   echo "set max_active_flows=10" | socat - UNIX-CONNECT:<socket path>
+#define RM_CONTROL_DIR_KEY "RM_CONTROL_DIR"
 // Path to cgroup for attaching sockops programs.
 #define RM_CGROUP_KEY "RM_CGROUP"
+// Environment variables for ratemon_main that specify the range of REMOTE ports
+// whose flows the sockops program discovers and ratemon_main schedules, for
+// every process in RM_CGROUP, without libratemon_interp. ratemon_main reads
+// RM_MAX_ACTIVE_FLOWS, RM_EPOCH_US, and optionally RM_IDLE_TIMEOUT_US for its
+// scheduler, which follows libratemon_interp's default round-robin policy (see
+// ratemon_main.c for the differences). Unset disables discovery. Do not also
+// use libratemon_interp for flows in this range.
+#define RM_DISCOVER_PORT_START_KEY "RM_DISCOVER_PORT_START"
+#define RM_DISCOVER_PORT_END_KEY "RM_DISCOVER_PORT_END"
 
 // Key for use in flow-based maps.
 struct rm_flow {
@@ -49,4 +160,61 @@ struct rm_flow {
   unsigned short remote_port;
 };
 
+// Value in flow_to_credit. Userspace grants a flow credit_B bytes by inserting
+// an entry with started = 0. The first ACK that the flow sends afterward records
+// its ACK number (i.e., rcv_nxt) as start_seq. Once the flow has received
+// credit_B bytes past start_seq, the tc/egress program sets exhausted, pauses
+// the flow, and notifies userspace through credit_events.
+struct rm_credit {
+  unsigned int credit_B;
+  unsigned int start_seq;
+  unsigned char started;
+  unsigned char exhausted;
+};
+
+// Value in flow_to_rate. Instead of a fixed RWND, userspace can give a flow a
+// target rate. The tc/egress program then translates it into an RWND using the
+// socket's current smoothed RTT on every outgoing packet, so the cap tracks
+// RTT changes between policy decisions. The RWND never drops below min_rwnd_B,
+// which is also used when the socket has no RTT estimate.
+struct rm_rate {
+  unsigned long long rate_Bps;
+  unsigned int min_rwnd_B;
+};
+
+// Value in flow_telemetry, which is indexed by a slot that userspace assigns to
+// each flow (see flow_to_slot). Userspace maps flow_telemetry into memory and
+// reads these fields directly, without syscalls.
+struct rm_telemetry {
+  // Nonzero while a flow owns this slot. The slots are shared by all processes
+  // that use the pinned map, so userspace claims and releases them with atomic
+  // operations on the mapped memory.
+  unsigned int in_use;
+  unsigned int pad;
+  // The last time (bpf_ktime_get_ns()) that the flow received new data, or 0.
+  unsigned long long last_data_time_ns;
+  // Payload bytes and packets of new data that the flow has received.
+  unsigned long long bytes;
+  unsigned long long packets;
+};
+
+// Types of rm_flow_event.
+#define RM_FLOW_EVENT_ESTABLISHED 0
+#define RM_FLOW_EVENT_CLOSED 1
+#define RM_FLOW_EVENT_OWNER 2
+
+// Carried by flow_events when the sockops program discovers a flow (after
+// setting its CCA to RM_BPF_CUBIC) or sees a discovered flow close, and when
+// the kprobe programs see a process accept() or connect() a socket for a flow
+// in the discovery range.
+struct rm_flow_event {
+  struct rm_flow flow;
+  unsigned int type;
+  // Only for RM_FLOW_EVENT_OWNER: the process (TGID) that owns the flow's
+  // socket, the socket's FD in that process, and the socket's inode.
+  int pid;
+  int fd;
+  unsigned long long ino;
+};
+
 #endif /* __RATEMON_H */
@@ -14,6 +14,34 @@
 
 char LICENSE[] SEC("license") = "Dual BSD/GPL";
 
+#define AF_INET 2
+
+#define EINPROGRESS 115
+
+// The range of REMOTE ports whose flows discover_flows manages (see
+// ratemon_sockops.bpf.c). Set by ratemon_main, which only loads the programs
+// that record flow owners if flow discovery is enabled.
+const volatile unsigned short discover_port_start = 0;
+const volatile unsigned short discover_port_end = 0;
+
+// A socket that a thread is in the middle of accept()ing or connect()ing. For
+// accept(), this is the new socket, and the FD is not known until the syscall
+// returns. For connect(), the FD is known from the start, and the sock is
+// recorded once tcp_v4_connect() is called.
+struct owner_call {
+  struct socket *sock;
+  struct sock *sk;
+  int fd;
+};
+
+// Maps thread (pid_tgid) to its in-progress accept() or connect().
+struct {
+  __uint(type, BPF_MAP_TYPE_HASH);
+  __uint(max_entries, RM_MAX_FLOWS);
+  __type(key, u64);
+  __type(value, struct owner_call);
+} owner_calls SEC(".maps");
+
 // 'tcp_rcv_established' will be used to track the last time that a flow
 // received data so that we can determine when to classify a flow as idle.
 SEC("kprobe/tcp_rcv_established")
@@ -92,18 +120,126 @@ int BPF_KPROBE(tcp_rcv_established, struct sock *sk, struct sk_buff *skb) {
     return 0;
   }
 
-  // Check if we should record the last data time for this flow.
-  if (bpf_map_lookup_elem(&flow_to_last_data_time_ns, &flow) == NULL) {
-    // This flow is not in the map, so we are not supposed to track its last
-    // data time.
+  // Check if we should record telemetry for this flow.
+  unsigned int *slot = bpf_map_lookup_elem(&flow_to_slot, &flow);
+  if (slot == NULL) {
+    // This flow is not in the map, so we are not supposed to track it.
+    return 0;
+  }
+  struct rm_telemetry *telemetry = bpf_map_lookup_elem(&flow_telemetry, slot);
+  if (telemetry == NULL) {
+    bpf_printk("ERROR: 'tcp_rcv_established' invalid telemetry slot %u",
+               *slot);
+    return 0;
+  }
+  // Record the current time and count the new data. Userspace reads these
+  // fields concurrently through mmap().
+  telemetry->last_data_time_ns = bpf_ktime_get_ns();
+  __sync_fetch_and_add(&telemetry->bytes, len - doff * 4);
+  __sync_fetch_and_add(&telemetry->packets, 1);
+  return 0;
+}
+
+// The next several programs tell ratemon_main which process and FD own each
+// discovered flow's socket, so that it can wake the flow without searching
+// /proc. The owner is only known in the context of the accept() or connect()
+// syscall, so these track each call from entry to exit.
+
+// Send an RM_FLOW_EVENT_OWNER for this socket, if it is for a flow in the
+// discovery range.
+__always_inline void send_owner_event(struct sock *sk, struct socket *sock,
+                                      int fd) {
+  if (sk == NULL || sock == NULL ||
+      BPF_CORE_READ(sk, __sk_common.skc_family) != AF_INET) {
+    return;
+  }
+  struct rm_flow flow = {
+      .local_addr = bpf_ntohl(BPF_CORE_READ(sk, __sk_common.skc_rcv_saddr)),
+      .remote_addr = bpf_ntohl(BPF_CORE_READ(sk, __sk_common.skc_daddr)),
+      .local_port = BPF_CORE_READ(sk, __sk_common.skc_num),
+      .remote_port = bpf_ntohs(BPF_CORE_READ(sk, __sk_common.skc_dport))};
+  if (flow.remote_port < discover_port_start ||
+      flow.remote_port > discover_port_end) {
+    return;
+  }
+  struct rm_flow_event *event =
+      bpf_ringbuf_reserve(&flow_events, sizeof(*event), 0);
+  if (event == NULL) {
+    bpf_printk("ERROR: failed to reserve space in flow_events");
+    return;
+  }
+  event->flow = flow;
+  event->type = RM_FLOW_EVENT_OWNER;
+  event->pid = (int)(bpf_get_current_pid_tgid() >> 32);
+  event->fd = fd;
+  event->ino = BPF_CORE_READ(sock, file, f_inode, i_ino);
+  bpf_ringbuf_submit(event, 0);
+}
+
+// inet_accept() hands the accepted sock to the new socket, which already has
+// a file, but not an FD yet.
+SEC("kprobe/inet_accept")
+int BPF_KPROBE(record_accept, struct socket *sock, struct socket *newsock) {
+  u64 id = bpf_get_current_pid_tgid();
+  struct owner_call call = {.sock = newsock, .sk = NULL, .fd = -1};
+  bpf_map_update_elem(&owner_calls, &id, &call, BPF_ANY);
+  return 0;
+}
+
+__always_inline int handle_accept_exit(long ret) {
+  u64 id = bpf_get_current_pid_tgid();
+  struct owner_call *call = bpf_map_lookup_elem(&owner_calls, &id);
+  if (call == NULL) {
+    return 0;
+  }
+  if (ret >= 0 && call->sock != NULL) {
+    send_owner_event(BPF_CORE_READ(call->sock, sk), call->sock, (int)ret);
+  }
+  bpf_map_delete_elem(&owner_calls, &id);
+  return 0;
+}
+
+SEC("tracepoint/syscalls/sys_exit_accept")
+int record_accept_exit(struct trace_event_raw_sys_exit *ctx) {
+  return handle_accept_exit(ctx->ret);
+}
+
+SEC("tracepoint/syscalls/sys_exit_accept4")
+int record_accept4_exit(struct trace_event_raw_sys_exit *ctx) {
+  return handle_accept_exit(ctx->ret);
+}
+
+SEC("tracepoint/syscalls/sys_enter_connect")
+int record_connect(struct trace_event_raw_sys_enter *ctx) {
+  u64 id = bpf_get_current_pid_tgid();
+  struct owner_call call = {.sock = NULL, .sk = NULL, .fd = (int)ctx->args[0]};
+  bpf_map_update_elem(&owner_calls, &id, &call, BPF_ANY);
+  return 0;
+}
+
+// The four-tuple is not complete until tcp_v4_connect() picks a local port, so
+// only record the sock here, and read the four-tuple when connect() returns.
+SEC("kprobe/tcp_v4_connect")
+int BPF_KPROBE(record_tcp_v4_connect, struct sock *sk) {
+  u64 id = bpf_get_current_pid_tgid();
+  struct owner_call *call = bpf_map_lookup_elem(&owner_calls, &id);
+  if (call != NULL) {
+    call->sk = sk;
+  }
+  return 0;
+}
+
+SEC("tracepoint/syscalls/sys_exit_connect")
+int record_connect_exit(struct trace_event_raw_sys_exit *ctx) {
+  u64 id = bpf_get_current_pid_tgid();
+  struct owner_call *call = bpf_map_lookup_elem(&owner_calls, &id);
+  if (call == NULL) {
     return 0;
   }
-  // Get the current time and store it for this flow.
-  unsigned long now_ns = bpf_ktime_get_ns();
-  if (bpf_map_update_elem(&flow_to_last_data_time_ns, &flow, &now_ns,
-                          BPF_ANY)) {
-    bpf_printk("ERROR: 'tcp_rcv_established' error updating "
-               "flow_to_last_data_time_ns");
+  // A non-blocking connect() returns -EINPROGRESS, but has its four-tuple.
+  if ((ctx->ret == 0 || ctx->ret == -EINPROGRESS) && call->sk != NULL) {
+    send_owner_event(call->sk, BPF_CORE_READ(call->sk, sk_socket), call->fd);
   }
+  bpf_map_delete_elem(&owner_calls, &id);
   return 0;
 }
@@ -4,13 +4,22 @@
 #include <argp.h>
 #include <bpf/bpf.h>
 #include <bpf/libbpf.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <linux/limits.h>
 #include <linux/types.h>
 #include <net/if.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "ratemon.h"
@@ -29,6 +38,80 @@ struct ratemon_kprobe_bpf *kprobe_skel;
 // Existing signal handler for SIGINT.
 struct sigaction oldact;
 
+// The rest of the globals are for the scheduler that manages flows that
+// discover_flows finds. See RM_DISCOVER_PORT_START_KEY in ratemon.h. It
+// follows libratemon_interp's default round-robin policy: paused flows with
+// pending data (i.e., that have sent a keepalive) take turns in the order that
+// they were paused, and if other flows are waiting, then an active flow that
+// has been idle for idle_timeout_us is paused before its epoch ends. Unlike
+// libratemon_interp, it has one class and fixed epochs. It does not support
+// priority classes, byte credit, adaptive or jittered epochs, early wake, a
+// bounded backlog, aging, other policies, or shards. It runs on the thread that
+// polls flow_events, so its timing has millisecond resolution.
+
+// A flow that discover_flows found, or whose owner the kprobe programs
+// reported before discover_flows found it.
+struct discovered_flow {
+  struct rm_flow flow;
+  bool in_use;
+  // Whether discover_flows has reported this flow. If not, then only its owner
+  // is known, and it is not scheduled yet.
+  bool established;
+  bool active;
+  // If active, when this flow's epoch ends. If paused, when it was paused. If
+  // not established, when its owner was reported.
+  unsigned long long time_ns;
+  // If active, this flow's index in active_idxs. If paused, the sequence number
+  // of its entry in paused_queue.
+  unsigned int active_pos;
+  unsigned long long pause_seq;
+  // A pidfd for the process that owns this flow's socket, or -1 if unknown,
+  // and the socket's FD number in that process and inode, as reported by the
+  // kprobe programs when the process accepted or connected the socket. Used to
+  // wake the flow.
+  int pidfd;
+  int fd;
+  unsigned long long ino;
+  // This flow's slot in flow_telemetry, or -1 if it has none.
+  int slot;
+};
+static struct discovered_flow flows[RM_MAX_FLOWS];
+// Indexes in flows of the entries that are not in use.
+static unsigned int free_idxs[RM_MAX_FLOWS];
+static unsigned int num_free = 0;
+// Indexes in flows of the active flows, in no particular order.
+static unsigned int active_idxs[RM_MAX_FLOWS];
+static unsigned int num_active = 0;
+// The paused flows, in the order that they were paused, as a ring buffer. An
+// entry is stale if its flow has since been activated, paused again, or
+// removed. Each flow has at most one entry that is not stale, so with twice as
+// many entries as flows, dropping the stale entries always makes room.
+#define PAUSED_QUEUE_LEN (2 * RM_MAX_FLOWS)
+struct paused_entry {
+  unsigned int idx;
+  unsigned long long seq;
+};
+static struct paused_entry paused_queue[PAUSED_QUEUE_LEN];
+static unsigned int paused_head = 0;
+static unsigned int paused_len = 0;
+// The number of paused flows, i.e., of entries in paused_queue that are not
+// stale, and the sequence number of the last pause.
+static unsigned int num_paused = 0;
+static unsigned long long pause_seq = 0;
+static unsigned int max_active_flows = 5;
+static unsigned int epoch_us = 10000;
+static unsigned int idle_timeout_us = 0;
+static int flow_to_rwnd_fd = -1;
+static int flow_to_win_scale_fd = -1;
+static int flow_to_keepalive_fd = -1;
+static int flow_to_slot_fd = -1;
+// The BPF map "flow_telemetry", mapped into memory. Indexed by slot. Only used
+// if idle_timeout_us is set.
+static struct rm_telemetry *telemetry = NULL;
+static struct ring_buffer *flow_events_rb = NULL;
+// Used to set entries in flow_to_rwnd.
+static int zero = 0;
+
 static int libbpf_print_fn(enum libbpf_print_level level, const char *format,
                            va_list args) {
   return vfprintf(stdout, format, args);
@@ -76,11 +159,19 @@ static int join_cgroup(const char *cgroup_path) {
   return rc;
 }
 
-int prepare_sockops(char *cg_path) {
-  // Open skeleton and load programs and maps.
-  sockops_skel = ratemon_sockops_bpf__open_and_load();
+int prepare_sockops(char *cg_path, unsigned int discover_port_start,
+                    unsigned int discover_port_end) {
+  // Open skeleton, configure flow discovery, and load programs and maps.
+  sockops_skel = ratemon_sockops_bpf__open();
   if (!sockops_skel) {
-    printf("ERROR: failed to open/load 'ratemon_sockops' BPF skeleton\n");
+    printf("ERROR: failed to open 'ratemon_sockops' BPF skeleton\n");
+    return 1;
+  }
+  sockops_skel->rodata->discover_port_start =
+      (unsigned short)discover_port_start;
+  sockops_skel->rodata->discover_port_end = (unsigned short)discover_port_end;
+  if (ratemon_sockops_bpf__load(sockops_skel)) {
+    printf("ERROR: failed to load 'ratemon_sockops' BPF skeleton\n");
     return 1;
   }
   // Join cgroup for sock_ops.
@@ -104,6 +195,15 @@ int prepare_sockops(char *cg_path) {
     return 1;
   }
   sockops_skel->links.read_win_scale = skops_link_win_scale;
+  if (discover_port_end) {
+    struct bpf_link *skops_link_discover =
+        bpf_program__attach_cgroup(sockops_skel->progs.discover_flows, cg_fd);
+    if (skops_link_discover == NULL) {
+      printf("ERROR: failed to attach 'discover_flows'\n");
+      return 1;
+    }
+    sockops_skel->links.discover_flows = skops_link_discover;
+  }
   return 0;
 }
 
@@ -123,11 +223,28 @@ int prepare_structops() {
   return 0;
 }
 
-int prepare_kprobe() {
-  // Open skeleton and load programs and maps.
-  kprobe_skel = ratemon_kprobe_bpf__open_and_load();
+int prepare_kprobe(unsigned int discover_port_start,
+                   unsigned int discover_port_end) {
+  // Open skeleton, configure flow discovery, and load programs and maps.
+  kprobe_skel = ratemon_kprobe_bpf__open();
   if (!kprobe_skel) {
-    printf("ERROR: failed to open/load 'ratemon_kprobe' BPF skeleton\n");
+    printf("ERROR: failed to open 'ratemon_kprobe' BPF skeleton\n");
+    return 1;
+  }
+  kprobe_skel->rodata->discover_port_start =
+      (unsigned short)discover_port_start;
+  kprobe_skel->rodata->discover_port_end = (unsigned short)discover_port_end;
+  // The programs that record flow owners are only needed for flow discovery.
+  if (!discover_port_end) {
+    bpf_program__set_autoload(kprobe_skel->progs.record_accept, false);
+    bpf_program__set_autoload(kprobe_skel->progs.record_accept_exit, false);
+    bpf_program__set_autoload(kprobe_skel->progs.record_accept4_exit, false);
+    bpf_program__set_autoload(kprobe_skel->progs.record_connect, false);
+    bpf_program__set_autoload(kprobe_skel->progs.record_tcp_v4_connect, false);
+    bpf_program__set_autoload(kprobe_skel->progs.record_connect_exit, false);
+  }
+  if (ratemon_kprobe_bpf__load(kprobe_skel)) {
+    printf("ERROR: failed to load 'ratemon_kprobe' BPF skeleton\n");
     return 1;
   }
   // Attach kprobe.
@@ -138,6 +255,401 @@ int prepare_kprobe() {
   return 0;
 }
 
+static unsigned long long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Record the process and FD that own this flow's socket, from an
+// RM_FLOW_EVENT_OWNER.
+static void set_socket_owner(struct discovered_flow *f,
+                             const struct rm_flow_event *event) {
+  if (f->pidfd != -1) {
+    close(f->pidfd);
+  }
+  f->pidfd = (int)syscall(SYS_pidfd_open, event->pid, 0);
+  f->fd = event->fd;
+  f->ino = event->ino;
+}
+
+// Forget the owner of this flow's socket.
+static void forget_socket_owner(struct discovered_flow *f) {
+  if (f->pidfd != -1) {
+    close(f->pidfd);
+  }
+  f->pidfd = -1;
+}
+
+// Trigger a pure ACK on this flow, so that the sender learns that its window
+// has reopened. We do not own the socket, so borrow it from its owner with
+// pidfd_getfd() and call getsockopt() with TCP_CC_INFO, which bpf_cubic
+// answers by sending an ACK. If the owner is unknown (e.g., the socket has not
+// been accepted yet), then the flow resumes at the sender's next zero window
+// probe instead.
+static void wake_flow(struct discovered_flow *f) {
+  if (f->pidfd == -1) {
+    printf("INFO: owner of flow with remote port %u is unknown, waiting for "
+           "zero window probe\n",
+           f->flow.remote_port);
+    return;
+  }
+  int sfd = (int)syscall(SYS_pidfd_getfd, f->pidfd, f->fd, 0);
+  if (sfd == -1) {
+    forget_socket_owner(f);
+    return;
+  }
+  // Make sure that the owner has not closed the socket and reused its FD.
+  struct stat st;
+  if (fstat(sfd, &st) == 0 && st.st_ino == f->ino) {
+    char placeholder_cc_info[64];
+    socklen_t len = sizeof(placeholder_cc_info);
+    getsockopt(sfd, SOL_TCP, TCP_CC_INFO, placeholder_cc_info, &len);
+  } else {
+    forget_socket_owner(f);
+  }
+  close(sfd);
+}
+
+// Claim a slot in flow_telemetry for this flow, so that the kprobe program
+// records when it last received data. The slots are shared with
+// libratemon_interp.
+static void claim_telemetry_slot(struct discovered_flow *f) {
+  static unsigned int next = 0;
+  for (unsigned int i = 0; i < RM_MAX_FLOWS; ++i) {
+    unsigned int slot = (next + i) % RM_MAX_FLOWS;
+    unsigned int expected = 0;
+    if (!__atomic_compare_exchange_n(&telemetry[slot].in_use, &expected, 1,
+                                     false, __ATOMIC_ACQUIRE,
+                                     __ATOMIC_RELAXED)) {
+      continue;
+    }
+    next = (slot + 1) % RM_MAX_FLOWS;
+    __atomic_store_n(&telemetry[slot].last_data_time_ns, 0, __ATOMIC_RELAXED);
+    if (bpf_map_update_elem(flow_to_slot_fd, &f->flow, &slot, BPF_ANY)) {
+      __atomic_store_n(&telemetry[slot].in_use, 0, __ATOMIC_RELEASE);
+      break;
+    }
+    f->slot = (int)slot;
+    return;
+  }
+  printf("WARNING: no telemetry slot for flow with remote port %u, cannot "
+         "detect idle\n",
+         f->flow.remote_port);
+}
+
+static void release_telemetry_slot(struct discovered_flow *f) {
+  if (f->slot == -1) {
+    return;
+  }
+  bpf_map_delete_elem(flow_to_slot_fd, &f->flow);
+  __atomic_store_n(&telemetry[f->slot].in_use, 0, __ATOMIC_RELEASE);
+  f->slot = -1;
+}
+
+// Whether this active flow has not received data for idle_timeout_us.
+static bool is_idle(const struct discovered_flow *f, unsigned long long now) {
+  if (!idle_timeout_us || f->slot == -1) {
+    return false;
+  }
+  unsigned long long last_data_time_ns = __atomic_load_n(
+      &telemetry[f->slot].last_data_time_ns, __ATOMIC_RELAXED);
+  // If last_data_time_ns is 0, then this flow has not yet been tracked.
+  return last_data_time_ns && now > last_data_time_ns &&
+         now - last_data_time_ns >= (unsigned long long)idle_timeout_us * 1000;
+}
+
+// Whether this paused flow has sent a keepalive, i.e., it has pending data.
+static bool has_demand(const struct discovered_flow *f) {
+  int dummy;
+  return !bpf_map_lookup_elem(flow_to_keepalive_fd, &f->flow, &dummy);
+}
+
+static bool paused_entry_is_stale(struct paused_entry e) {
+  const struct discovered_flow *f = &flows[e.idx];
+  return !f->in_use || !f->established || f->active || f->pause_seq != e.seq;
+}
+
+static void push_paused(struct paused_entry e) {
+  if (paused_len == PAUSED_QUEUE_LEN) {
+    // Drop the stale entries, keeping the rest in order.
+    unsigned int len = 0;
+    for (unsigned int i = 0; i < paused_len; ++i) {
+      struct paused_entry x =
+          paused_queue[(paused_head + i) % PAUSED_QUEUE_LEN];
+      if (!paused_entry_is_stale(x)) {
+        paused_queue[(paused_head + len++) % PAUSED_QUEUE_LEN] = x;
+      }
+    }
+    paused_len = len;
+  }
+  paused_queue[(paused_head + paused_len++) % PAUSED_QUEUE_LEN] = e;
+}
+
+static struct paused_entry pop_paused() {
+  struct paused_entry e = paused_queue[paused_head];
+  paused_head = (paused_head + 1) % PAUSED_QUEUE_LEN;
+  --paused_len;
+  return e;
+}
+
+static void activate_flow(struct discovered_flow *f, unsigned long long now,
+                          bool wake) {
+  bpf_map_delete_elem(flow_to_rwnd_fd, &f->flow);
+  if (wake) {
+    wake_flow(f);
+  }
+  f->active = true;
+  f->time_ns = now + (unsigned long long)epoch_us * 1000ULL;
+  f->active_pos = num_active;
+  active_idxs[num_active++] = (unsigned int)(f - flows);
+}
+
+// Stop counting this flow as active.
+static void deactivate_flow(struct discovered_flow *f) {
+  unsigned int last = active_idxs[--num_active];
+  active_idxs[f->active_pos] = last;
+  flows[last].active_pos = f->active_pos;
+  f->active = false;
+}
+
+// Pausing a flow means setting its RWND to 0 B. The flow is still receiving
+// data, so its next ACK carries the new window without needing to be woken.
+static void pause_flow(struct discovered_flow *f, unsigned long long now) {
+  bpf_map_update_elem(flow_to_rwnd_fd, &f->flow, &zero, BPF_ANY);
+  if (f->active) {
+    deactivate_flow(f);
+  }
+  f->time_ns = now;
+  f->pause_seq = ++pause_seq;
+  push_paused((struct paused_entry){(unsigned int)(f - flows), f->pause_seq});
+  ++num_paused;
+}
+
+// Look up a flow by its four-tuple. This only happens once per flow event.
+static struct discovered_flow *find_flow(const struct rm_flow *flow) {
+  for (unsigned int i = 0; i < RM_MAX_FLOWS; ++i) {
+    if (flows[i].in_use && !memcmp(&flows[i].flow, flow, sizeof(*flow))) {
+      return &flows[i];
+    }
+  }
+  return NULL;
+}
+
+static void remove_flow(struct discovered_flow *f) {
+  if (f->established) {
+    bpf_map_delete_elem(flow_to_rwnd_fd, &f->flow);
+    bpf_map_delete_elem(flow_to_win_scale_fd, &f->flow);
+    bpf_map_delete_elem(flow_to_keepalive_fd, &f->flow);
+    if (f->active) {
+      deactivate_flow(f);
+    } else {
+      --num_paused;
+    }
+  }
+  release_telemetry_slot(f);
+  forget_socket_owner(f);
+  f->in_use = false;
+  free_idxs[num_free++] = (unsigned int)(f - flows);
+}
+
+// Take an unused entry in flows and initialize it for this flow. If there are
+// none, then reclaim the entries of outgoing connections whose owner was
+// reported more than one second ago but that never became established (e.g.,
+// because the connection failed). Returns NULL if there is no room.
+static struct discovered_flow *add_flow(const struct rm_flow *flow,
+                                        unsigned long long now) {
+  if (num_free == 0) {
+    for (unsigned int i = 0; i < RM_MAX_FLOWS; ++i) {
+      if (flows[i].in_use && !flows[i].established &&
+          flows[i].time_ns + 1000000000ULL < now) {
+        remove_flow(&flows[i]);
+      }
+    }
+    if (num_free == 0) {
+      return NULL;
+    }
+  }
+  struct discovered_flow *f = &flows[free_idxs[--num_free]];
+  *f = (struct discovered_flow){.flow = *flow,
+                                .in_use = true,
+                                .established = false,
+                                .active = false,
+                                .time_ns = now,
+                                .pidfd = -1,
+                                .slot = -1};
+  return f;
+}
+
+// Called by ring_buffer__poll() for each event from discover_flows and the
+// kprobe programs.
+static int handle_flow_event(void * /* ctx */, void *data, size_t size) {
+  const struct rm_flow_event *event = data;
+  if (size < sizeof(*event)) {
+    return 0;
+  }
+  unsigned long long now = now_ns();
+  struct discovered_flow *f = find_flow(&event->flow);
+  switch (event->type) {
+  case RM_FLOW_EVENT_CLOSED:
+    if (f != NULL) {
+      remove_flow(f);
+      printf("INFO: removed flow with remote port %u\n",
+             event->flow.remote_port);
+    }
+    return 0;
+  case RM_FLOW_EVENT_OWNER:
+    // A non-blocking connect() can return before discover_flows reports the
+    // flow, so remember the owner until it does.
+    if (f == NULL) {
+      f = add_flow(&event->flow, now);
+    }
+    if (f != NULL) {
+      set_socket_owner(f, event);
+    }
+    return 0;
+  }
+  // This four-tuple may be reused before we see the old flow close.
+  if (f != NULL && f->established) {
+    remove_flow(f);
+    f = NULL;
+  }
+  if (f == NULL) {
+    f = add_flow(&event->flow, now);
+  }
+  if (f == NULL) {
+    printf("ERROR: too many flows, ignoring flow with remote port %u\n",
+           event->flow.remote_port);
+    return 0;
+  }
+  f->established = true;
+  if (idle_timeout_us) {
+    claim_telemetry_slot(f);
+  }
+  // A new flow is not limited yet, so it does not need to be woken.
+  if (num_active < max_active_flows) {
+    activate_flow(f, now, false);
+  } else {
+    pause_flow(f, now);
+  }
+  printf("INFO: discovered flow with remote port %u, %s\n",
+         event->flow.remote_port, f->active ? "active" : "paused");
+  return 0;
+}
+
+// Perform round-robin scheduling of the discovered flows. Returns when the
+// next epoch ends, or when idle flows must be checked next.
+static unsigned long long schedule_flows() {
+  unsigned long long now = now_ns();
+  // 1) If other flows are waiting, then pause the active flows that have been
+  // idle for idle_timeout_us. Collect the active flows whose epoch has ended,
+  // which must compete for their slots again.
+  static unsigned int expired[RM_MAX_FLOWS];
+  unsigned int num_expired = 0;
+  for (unsigned int i = 0; i < num_active;) {
+    struct discovered_flow *f = &flows[active_idxs[i]];
+    if (num_paused && is_idle(f, now)) {
+      printf("INFO: pausing flow with remote port %u due to idle timeout\n",
+             f->flow.remote_port);
+      // Signal that this flow no longer has pending data.
+      bpf_map_delete_elem(flow_to_keepalive_fd, &f->flow);
+      // This moves the last active flow to position i.
+      pause_flow(f, now);
+      continue;
+    }
+    if (f->time_ns <= now) {
+      expired[num_expired++] = active_idxs[i];
+    }
+    ++i;
+  }
+  // 2) Give the free slots, and then the slots of the flows whose epoch has
+  // ended, to paused flows with pending data, in the order that they were
+  // paused. Paused flows without pending data go to the back. Look at each
+  // paused flow at most once.
+  unsigned int free_slots =
+      num_active < max_active_flows ? max_active_flows - num_active : 0;
+  unsigned int activated = 0;
+  for (unsigned int left = paused_len;
+       left > 0 && activated < free_slots + num_expired; --left) {
+    struct paused_entry e = pop_paused();
+    if (paused_entry_is_stale(e)) {
+      continue;
+    }
+    struct discovered_flow *f = &flows[e.idx];
+    if (!has_demand(f)) {
+      push_paused(e);
+      continue;
+    }
+    --num_paused;
+    activate_flow(f, now, true);
+    ++activated;
+  }
+  // 3) Pause the flows whose slots were given away. The rest start a new
+  // epoch.
+  unsigned int replaced = activated > free_slots ? activated - free_slots : 0;
+  for (unsigned int i = 0; i < num_expired; ++i) {
+    if (i < replaced) {
+      pause_flow(&flows[expired[i]], now);
+    } else {
+      flows[expired[i]].time_ns = now + (unsigned long long)epoch_us * 1000ULL;
+    }
+  }
+  // 4) Calculate when to run next.
+  unsigned long long next_event = now + 1000000000ULL;
+  for (unsigned int i = 0; i < num_active; ++i) {
+    if (flows[active_idxs[i]].time_ns < next_event) {
+      next_event = flows[active_idxs[i]].time_ns;
+    }
+  }
+  if (idle_timeout_us && num_active && num_paused &&
+      now + (unsigned long long)idle_timeout_us * 1000ULL < next_event) {
+    next_event = now + (unsigned long long)idle_timeout_us * 1000ULL;
+  }
+  return next_event;
+}
+
+// Run the scheduler for discovered flows until the program is signalled to
+// stop. ring_buffer__poll() has millisecond resolution, so epochs are rounded
+// up to the next millisecond.
+static void run_discovery_scheduler() {
+  for (unsigned int i = 0; i < RM_MAX_FLOWS; ++i) {
+    free_idxs[num_free++] = RM_MAX_FLOWS - 1 - i;
+  }
+  while (run) {
+    unsigned long long next_event = schedule_flows();
+    unsigned long long now = now_ns();
+    int timeout_ms =
+        next_event > now ? (int)((next_event - now + 999999) / 1000000) : 0;
+    int err = ring_buffer__poll(flow_events_rb, timeout_ms);
+    if (err < 0 && err != -EINTR) {
+      printf("ERROR: failed to poll flow_events: %d\n", err);
+      break;
+    }
+  }
+  // Do not leave any flows paused.
+  for (unsigned int i = 0; i < RM_MAX_FLOWS; ++i) {
+    if (flows[i].in_use) {
+      remove_flow(&flows[i]);
+    }
+  }
+}
+
+static bool read_env_uint(const char *key, unsigned int *dest) {
+  // Read an environment variable as a positive integer.
+  char *val_str = getenv(key);
+  if (val_str == NULL) {
+    printf("ERROR: failed to query environment variable '%s'\n", key);
+    return false;
+  }
+  int val_int = atoi(val_str);
+  if (val_int <= 0) {
+    printf("ERROR: invalid value for '%s'=%d (must be > 0)\n", key, val_int);
+    return false;
+  }
+  *dest = (unsigned int)val_int;
+  return true;
+}
+
 bool read_env_str(const char *key, char *dest) {
   // Read an environment variable a char *.
   char *val_str = getenv(key);
@@ -166,15 +678,38 @@ int main(int argc, char **argv) {
     goto cleanup;
   }
 
-  if (prepare_sockops(cg_path)) {
-    printf("ERROR: failed to set up sockops\n");
-    goto cleanup;
+  // Flow discovery is optional.
+  unsigned int discover_port_start = 0;
+  unsigned int discover_port_end = 0;
+  if (getenv(RM_DISCOVER_PORT_START_KEY) != NULL ||
+      getenv(RM_DISCOVER_PORT_END_KEY) != NULL) {
+    if (!read_env_uint(RM_DISCOVER_PORT_START_KEY, &discover_port_start) ||
+        !read_env_uint(RM_DISCOVER_PORT_END_KEY, &discover_port_end) ||
+        discover_port_end >= 65536 ||
+        discover_port_start > discover_port_end ||
+        !read_env_uint(RM_MAX_ACTIVE_FLOWS_KEY, &max_active_flows) ||
+        !read_env_uint(RM_EPOCH_US_KEY, &epoch_us)) {
+      printf("ERROR: invalid flow discovery parameters\n");
+      goto cleanup;
+    }
+    // The idle timeout is optional.
+    if (getenv(RM_IDLE_TIMEOUT_US_KEY) != NULL &&
+        !read_env_uint(RM_IDLE_TIMEOUT_US_KEY, &idle_timeout_us)) {
+      printf("ERROR: invalid flow discovery parameters\n");
+      goto cleanup;
+    }
   }
+
+  // Register bpf_cubic before discover_flows starts assigning it to flows.
   if (prepare_structops()) {
     printf("ERROR: failed to set up structops\n");
     goto cleanup;
   }
-  if (prepare_kprobe()) {
+  if (prepare_sockops(cg_path, discover_port_start, discover_port_end)) {
+    printf("ERROR: failed to set up sockops\n");
+    goto cleanup;
+  }
+  if (prepare_kprobe(discover_port_start, discover_port_end)) {
     printf("ERROR: failed to set up kprobe\n");
     goto cleanup;
   }
@@ -183,9 +718,43 @@ int main(int argc, char **argv) {
          "Progress: `sudo cat /sys/kernel/debug/tracing/trace_pipe`. "
          "Ctrl-C to end.\n");
 
+  if (discover_port_end) {
+    flow_to_rwnd_fd = bpf_map__fd(sockops_skel->maps.flow_to_rwnd);
+    flow_to_win_scale_fd = bpf_map__fd(sockops_skel->maps.flow_to_win_scale);
+    flow_to_keepalive_fd = bpf_map__fd(kprobe_skel->maps.flow_to_keepalive);
+    flow_to_slot_fd = bpf_map__fd(kprobe_skel->maps.flow_to_slot);
+    if (idle_timeout_us) {
+      // Map flow_telemetry into memory, so that the scheduler can read each
+      // flow's last data time without a syscall.
+      void *mem = mmap(NULL, RM_MAX_FLOWS * sizeof(struct rm_telemetry),
+                       PROT_READ | PROT_WRITE, MAP_SHARED,
+                       bpf_map__fd(kprobe_skel->maps.flow_telemetry), 0);
+      if (mem == MAP_FAILED) {
+        printf("ERROR: failed to mmap 'flow_telemetry': %s\n",
+               strerror(errno));
+        goto cleanup;
+      }
+      telemetry = (struct rm_telemetry *)mem;
+    }
+    flow_events_rb =
+        ring_buffer__new(bpf_map__fd(sockops_skel->maps.flow_events),
+                         handle_flow_event, NULL, NULL);
+    if (flow_events_rb == NULL) {
+      printf("ERROR: failed to create ring buffer for 'flow_events'\n");
+      goto cleanup;
+    }
+    printf("INFO: discovering flows on remote ports [%u, %u], "
+           "max_active_flows=%u, epoch_us=%u, idle_timeout_us=%u\n",
+           discover_port_start, discover_port_end, max_active_flows, epoch_us,
+           idle_timeout_us);
+    // Runs until Ctrl-C.
+    run_discovery_scheduler();
+  }
+
   // Wait for Ctrl-C.
-  while (run)
+  while (run) {
     sleep(1);
+  }
 
 cleanup:
   printf("Destroying BPF programs\n");
@@ -193,6 +762,10 @@ cleanup:
   // bpf_tc_hook_destroy(&hook);
   // bpf_map__unpin(skel->maps.flow_to_rwnd, NULL);
   // bpf_map__unpin(skel->maps.flow_to_win_scale, NULL);
+  ring_buffer__free(flow_events_rb);
+  if (telemetry != NULL) {
+    munmap(telemetry, RM_MAX_FLOWS * sizeof(struct rm_telemetry));
+  }
   bpf_link__destroy(structops_link);
   ratemon_sockops_bpf__destroy(sockops_skel);
   ratemon_structops_bpf__destroy(structops_skel);
@@ -23,6 +23,16 @@ struct {
   __uint(pinning, LIBBPF_PIN_BY_NAME);
 } flow_to_rwnd SEC(".maps");
 
+// Read target rate for flow, as set by userspace. Used only for flows that do
+// not have an entry in flow_to_rwnd.
+struct {
+  __uint(type, BPF_MAP_TYPE_HASH);
+  __uint(max_entries, RM_MAX_FLOWS);
+  __type(key, struct rm_flow);
+  __type(value, struct rm_rate);
+  __uint(pinning, LIBBPF_PIN_BY_NAME);
+} flow_to_rate SEC(".maps");
+
 // Learn window scaling factor for each flow.
 struct {
   __uint(type, BPF_MAP_TYPE_HASH);
@@ -32,15 +42,26 @@ struct {
   __uint(pinning, LIBBPF_PIN_BY_NAME);
 } flow_to_win_scale SEC(".maps");
 
-// Maps flow to the last time that flow received data. This is used to decide
-// whether a flow is idle.
+// Maps flow to its slot in flow_telemetry. Only flows in this map are tracked.
 struct {
   __uint(type, BPF_MAP_TYPE_HASH);
   __uint(max_entries, RM_MAX_FLOWS);
   __type(key, struct rm_flow);
-  __type(value, unsigned long);
+  __type(value, unsigned int);
+  __uint(pinning, LIBBPF_PIN_BY_NAME);
+} flow_to_slot SEC(".maps");
+
+// Per-flow telemetry, such as the last time that a flow received data, which
+// is used to decide whether a flow is idle. Userspace reads this through
+// mmap().
+struct {
+  __uint(type, BPF_MAP_TYPE_ARRAY);
+  __uint(max_entries, RM_MAX_FLOWS);
+  __uint(map_flags, BPF_F_MMAPABLE);
+  __type(key, unsigned int);
+  __type(value, struct rm_telemetry);
   __uint(pinning, LIBBPF_PIN_BY_NAME);
-} flow_to_last_data_time_ns SEC(".maps");
+} flow_telemetry SEC(".maps");
 
 // Flows in this map have received a recent keepalive and have not gone idle
 // since, so they are considered to be active.
@@ -52,4 +73,29 @@ struct {
   __uint(pinning, LIBBPF_PIN_BY_NAME);
 } flow_to_keepalive SEC(".maps");
 
+// Byte credit granted to each active flow, in byte-credit scheduling mode.
+struct {
+  __uint(type, BPF_MAP_TYPE_HASH);
+  __uint(max_entries, RM_MAX_FLOWS);
+  __type(key, struct rm_flow);
+  __type(value, struct rm_credit);
+  __uint(pinning, LIBBPF_PIN_BY_NAME);
+} flow_to_credit SEC(".maps");
+
+// Carries an rm_flow to userspace each time a flow exhausts its byte credit.
+struct {
+  __uint(type, BPF_MAP_TYPE_RINGBUF);
+  __uint(max_entries, 1 << 16);
+  __uint(pinning, LIBBPF_PIN_BY_NAME);
+} credit_events SEC(".maps");
+
+// Carries an rm_flow_event to ratemon_main each time the sockops program
+// discovers a flow or sees a discovered flow close, and each time the kprobe
+// programs learn which process owns a discovered flow's socket.
+struct {
+  __uint(type, BPF_MAP_TYPE_RINGBUF);
+  __uint(max_entries, 1 << 16);
+  __uint(pinning, LIBBPF_PIN_BY_NAME);
+} flow_events SEC(".maps");
+
 #endif /* __RATEMON_MAPS_H */
@@ -0,0 +1,74 @@
+#pragma once
+// SPDX-License-Identifier: GPL-2.0 OR BSD-3-Clause
+
+#ifndef __RATEMON_POLICY_H
+#define __RATEMON_POLICY_H
+
+#include <stdbool.h>
+
+// Interface for scheduling policies that libratemon_interp loads from a shared
+// object, selected with RM_POLICY=<path>. The shared object must export a
+// "struct rm_policy_ops" named RM_POLICY_OPS_SYMBOL, with C linkage.
+//
+// libratemon_interp owns the mechanism: active slots, epochs, priority classes,
+// early wake, byte credit, idle detection, aging, and admission control. The
+// policy owns the backlog of paused flows in each class, and decides which of
+// them to activate when a slot is free. With RM_SCHED_SHARDS, each shard has
+// its own ctx, and the hooks for a ctx are only called on its shard's thread,
+// with the flows of that shard, so a policy needs no locking unless its ctxs
+// share state. Times are CLOCK_MONOTONIC in ns, which is also the kernel time
+// (bpf_ktime_get_ns()).
+//
+// libratemon_interp does not tell the policy when a paused flow is closed, or
+// when it is activated by aging. Instead, a policy records the paused_at_ns
+// that it was given along with each flow, and drops any flow for which
+// is_paused() returns false. If pick_next returns a flow that is not paused in
+// that shard and class, then libratemon_interp ignores it and calls pick_next
+// again.
+
+#define RM_POLICY_OPS_SYMBOL "rm_policy_ops"
+
+// Functions that libratemon_interp provides to the policy.
+struct rm_policy_env {
+  // Whether this paused flow has pending data, i.e., it has sent a keepalive
+  // since it was paused. This is a syscall, so call it sparingly.
+  bool (*has_demand)(int fd);
+  // Whether this flow is still paused since the hook call that passed
+  // paused_at_ns.
+  bool (*is_paused)(int fd, unsigned long paused_at_ns);
+};
+
+struct rm_policy_ops {
+  // Optional. Called once per shard, during setup, with the value of
+  // RM_POLICY_ARGS (or NULL if unset). Sets *ctx, which is passed to every
+  // other hook for that shard. Returns 0 on success, or nonzero to fail setup.
+  int (*init)(const struct rm_policy_env *env, const char *args, void **ctx);
+  // A new flow in class cls was paused because no slot was free. It may or may
+  // not have pending data.
+  void (*on_register)(void *ctx, int fd, unsigned int cls,
+                      unsigned long paused_at_ns);
+  // A flow that has pending data was paused, because its epoch ended and it
+  // lost its slot, or because a flow in a higher class preempted it.
+  void (*on_demand)(void *ctx, int fd, unsigned int cls,
+                    unsigned long paused_at_ns);
+  // A flow was paused because it has been idle for longer than the idle
+  // timeout. It has no pending data.
+  void (*on_idle)(void *ctx, int fd, unsigned int cls,
+                  unsigned long paused_at_ns);
+  // Optional. An active flow reached the end of its epoch or exhausted its
+  // byte credit. Returns whether it may keep its slot if no paused flow in its
+  // class needs it. If NULL, it may.
+  bool (*on_deadline)(void *ctx, int fd, unsigned int cls,
+                      unsigned long now_ns);
+  // Remove from the backlog, and return, the next paused flow in class cls
+  // that has pending data, or return -1 if there is none. Called repeatedly
+  // while slots are free. All calls in one scheduling round have the same
+  // now_ns. A flow that is returned is activated.
+  int (*pick_next)(void *ctx, unsigned int cls, unsigned long now_ns);
+  // Optional. Called once for each ctx that init set, when that shard's
+  // scheduler thread ends, or during setup if init failed for a later shard.
+  // Frees ctx. No other hook is called for ctx afterward.
+  void (*fini)(void *ctx);
+};
+
+#endif /* __RATEMON_POLICY_H */
@@ -0,0 +1,49 @@
+#pragma once
+// SPDX-License-Identifier: GPL-2.0 OR BSD-3-Clause
+
+#ifndef __RATEMON_SLOTS_H
+#define __RATEMON_SLOTS_H
+
+#include <algorithm>
+#include <atomic>
+
+// The active budget that libratemon_interp's scheduler shards share. used is
+// the number of slots that the shards hold, i.e., the total number of active
+// flows. Each shard takes slots from the budget and returns them with
+// compare-and-swap. used may exceed max_slots for a while after max_slots is
+// lowered, until the shards release the excess at the end of their flows'
+// epochs.
+
+// Change the number of slots that a shard holds from held to as close to want
+// as the budget allows, and return the new number. This is want, unless the
+// other shards hold so many slots that fewer than want are left, in which case
+// it is all of the ones that are left. This may be less than held, so the
+// caller must pause the flows that no longer have a slot.
+inline unsigned long resize_slots(std::atomic<unsigned long> &used,
+                                  unsigned long max_slots, unsigned long held,
+                                  unsigned long want) {
+  unsigned long cur = used.load(std::memory_order_relaxed);
+  unsigned long others, granted;
+  do {
+    others = cur - held;
+    granted = std::min<unsigned long>(
+        want, max_slots > others ? max_slots - others : 0);
+  } while (!used.compare_exchange_weak(cur, others + granted,
+                                       std::memory_order_relaxed));
+  return granted;
+}
+
+// Take one more slot from the budget, if one is free, without giving up any
+// that the caller holds. Returns whether it did.
+inline bool try_acquire_slot(std::atomic<unsigned long> &used,
+                             unsigned long max_slots) {
+  unsigned long cur = used.load(std::memory_order_relaxed);
+  do {
+    if (cur >= max_slots)
+      return false;
+  } while (!used.compare_exchange_weak(cur, cur + 1,
+                                       std::memory_order_relaxed));
+  return true;
+}
+
+#endif /* __RATEMON_SLOTS_H */
@@ -22,6 +22,9 @@ char LICENSE[] SEC("license") = "Dual BSD/GPL";
 
 #define EINVAL 22
 
+#define SOL_TCP 6
+#define TCP_CONGESTION 13
+
 #define TCPOPT_WINDOW 3 /* Window scaling */
 
 // TCP header flags.
@@ -29,6 +32,11 @@ char LICENSE[] SEC("license") = "Dual BSD/GPL";
 #define TCPHDR_ACK 0x10
 #define TCPHDR_SYNACK (TCPHDR_SYN | TCPHDR_ACK)
 
+// The range of REMOTE ports whose flows discover_flows manages. Set by
+// ratemon_main before loading. Discovery is disabled if the range is empty.
+const volatile unsigned short discover_port_start = 0;
+const volatile unsigned short discover_port_end = 0;
+
 struct tcp_opt {
   __u8 kind;
   __u8 len;
@@ -148,6 +156,74 @@ __always_inline int handle_write_hdr_opt(struct bpf_sock_ops *skops) {
   return SOCKOPS_OK;
 }
 
+// The next several functions are helpers for the sockops program that discovers
+// flows for ratemon_main.
+
+__always_inline bool should_discover(struct bpf_sock_ops *skops) {
+  unsigned short remote_port = (u16)bpf_ntohl(skops->remote_port);
+  return skops->family == AF_INET && remote_port >= discover_port_start &&
+         remote_port <= discover_port_end;
+}
+
+__always_inline void send_flow_event(struct bpf_sock_ops *skops,
+                                     unsigned int type) {
+  struct rm_flow_event *event =
+      bpf_ringbuf_reserve(&flow_events, sizeof(*event), 0);
+  if (event == NULL) {
+    bpf_printk("ERROR: failed to reserve space in flow_events");
+    return;
+  }
+  event->flow.local_addr = bpf_ntohl(skops->local_ip4);
+  event->flow.remote_addr = bpf_ntohl(skops->remote_ip4);
+  event->flow.local_port = (u16)skops->local_port;
+  event->flow.remote_port = (u16)bpf_ntohl(skops->remote_port);
+  event->type = type;
+  bpf_ringbuf_submit(event, 0);
+}
+
+__always_inline int handle_established(struct bpf_sock_ops *skops) {
+  if (!should_discover(skops)) {
+    return SOCKOPS_OK;
+  }
+  // Flows must use RM_BPF_CUBIC so that ratemon_main can wake them.
+  char cca[] = RM_BPF_CUBIC;
+  if (bpf_setsockopt(skops, SOL_TCP, TCP_CONGESTION, cca, sizeof(cca))) {
+    bpf_printk("ERROR: failed to set CCA for flow with remote port %u",
+               (u16)bpf_ntohl(skops->remote_port));
+    return SOCKOPS_ERR;
+  }
+  // Enable BPF_SOCK_OPS_STATE_CB so that we learn when this flow closes.
+  if (set_hdr_cb_flags(skops, skops->bpf_sock_ops_cb_flags |
+                                  BPF_SOCK_OPS_STATE_CB_FLAG) == SOCKOPS_ERR) {
+    return SOCKOPS_ERR;
+  }
+  send_flow_event(skops, RM_FLOW_EVENT_ESTABLISHED);
+  return SOCKOPS_OK;
+}
+
+// This sockops program discovers flows in the monitored port range, so that
+// ratemon_main can schedule them without libratemon_interp. It also enables
+// read_win_scale for outgoing connections, which do not pass through
+// BPF_SOCK_OPS_TCP_LISTEN_CB.
+SEC("sockops")
+int discover_flows(struct bpf_sock_ops *skops) {
+  switch (skops->op) {
+  case BPF_SOCK_OPS_TCP_CONNECT_CB:
+    return should_discover(skops) ? enable_hdr_cbs(skops) : SOCKOPS_OK;
+  case BPF_SOCK_OPS_ACTIVE_ESTABLISHED_CB:
+  case BPF_SOCK_OPS_PASSIVE_ESTABLISHED_CB:
+    return handle_established(skops);
+  case BPF_SOCK_OPS_STATE_CB:
+    // args[1] is the new state. Only flows that handle_established() accepted
+    // have this callback enabled.
+    if (skops->args[1] == BPF_TCP_CLOSE) {
+      send_flow_event(skops, RM_FLOW_EVENT_CLOSED);
+    }
+    return SOCKOPS_OK;
+  }
+  return SOCKOPS_OK;
+}
+
 // This sockops program records a flow's TCP window scale, which is set in
 // receiver's outgoing SYNACK packet.
 SEC("sockops")
@@ -20,8 +20,131 @@ char LICENSE[] SEC("license") = "Dual BSD/GPL";
 
 #define min(x, y) ((x) < (y) ? (x) : (y))
 
+// Offset of the TCP checksum from the start of the packet. The parsing below
+// assumes fixed-size Ethernet and IP headers.
+#define TCP_CSUM_OFF                                                           \
+  (sizeof(struct ethhdr) + sizeof(struct iphdr) + offsetof(struct tcphdr, check))
+
+// Install an advertised window (in network byte order) in a TCP header and
+// incrementally update the TCP checksum. If the checksum is offloaded (i.e.,
+// CHECKSUM_PARTIAL), then bpf_l4_csum_replace() leaves it for the NIC.
+// Invalidates all packet pointers.
+__always_inline void set_window(struct __sk_buff *skb, struct tcphdr *tcp,
+                                __be16 window) {
+  __be16 old_window = tcp->window;
+  if (old_window == window) {
+    return;
+  }
+  tcp->window = window;
+  bpf_l4_csum_replace(skb, TCP_CSUM_OFF, old_window, window, sizeof(window));
+}
+
+// Apply the window scale to an RWND value and install it in the advertised
+// window field, unless the window set by flow control is already smaller, so
+// that we preserve flow control. Saturate instead of truncating if the scaled
+// value does not fit in the window field.
+__always_inline void cap_window(struct __sk_buff *skb, struct tcphdr *tcp,
+                                u32 rwnd_B, u8 win_scale) {
+  u16 rwnd_with_win_scale = (u16)min(rwnd_B >> win_scale, 0xFFFF);
+  // The window field is in network byte order.
+  set_window(skb, tcp,
+             bpf_htons(min(bpf_ntohs(tcp->window), rwnd_with_win_scale)));
+}
+
+// Look up the smoothed RTT (us) of the socket that sent this packet. Falls back
+// to the minimum RTT if there is no smoothed RTT yet. Returns 0 if the packet
+// has no TCP socket or the socket has no RTT estimate. Note that a receiver
+// only updates its RTT estimate when it receives ACKs for data that it sent, so
+// for a pure receiver this mostly reflects the handshake RTT.
+__always_inline u32 get_rtt_us(struct __sk_buff *skb) {
+  struct bpf_sock *sk = skb->sk;
+  if (sk == NULL) {
+    return 0;
+  }
+  sk = bpf_sk_fullsock(sk);
+  if (sk == NULL) {
+    return 0;
+  }
+  struct bpf_tcp_sock *tp = bpf_tcp_sock(sk);
+  if (tp == NULL) {
+    return 0;
+  }
+  // srtt_us is stored left-shifted by 3.
+  u32 srtt_us = tp->srtt_us >> 3;
+  return srtt_us ? srtt_us : tp->rtt_min;
+}
+
+// Enforce a flow's target rate by advertising the window that achieves that
+// rate at the socket's current RTT (i.e., the BDP).
+__always_inline int apply_rate(struct __sk_buff *skb, struct tcphdr *tcp,
+                               struct rm_flow *flow, struct rm_rate *rate) {
+  u64 rate_Bps = rate->rate_Bps;
+  u64 min_rwnd_B = rate->min_rwnd_B;
+  u8 *win_scale = bpf_map_lookup_elem(&flow_to_win_scale, flow);
+  if (win_scale == NULL) {
+    bpf_printk("ERROR: flow with local port %u, remote port %u, no win scale",
+               flow->local_port, flow->remote_port);
+    return TC_ACT_OK;
+  }
+  u64 rwnd_B = rate_Bps * get_rtt_us(skb) / 1000000;
+  if (rwnd_B < min_rwnd_B) {
+    rwnd_B = min_rwnd_B;
+  }
+  cap_window(skb, tcp, (u32)min(rwnd_B, 0xFFFFFFFF), *win_scale);
+  return TC_ACT_OK;
+}
+
+// Enforce a flow's byte credit, if it has one. Advertise at most the credit that
+// remains past this packet's ACK number (i.e., the receiver's rcv_nxt). Once no
+// credit remains, pause the flow by setting its RWND to 0 B and notify
+// userspace so that it can hand the slot to another flow.
+__always_inline int apply_credit(struct __sk_buff *skb, struct tcphdr *tcp,
+                                 struct rm_flow *flow) {
+  struct rm_credit *credit = bpf_map_lookup_elem(&flow_to_credit, flow);
+  if (credit == NULL || !tcp->ack) {
+    return TC_ACT_OK;
+  }
+  u8 *win_scale = bpf_map_lookup_elem(&flow_to_win_scale, flow);
+  if (win_scale == NULL) {
+    bpf_printk("ERROR: flow with local port %u, remote port %u, no win scale",
+               flow->local_port, flow->remote_port);
+    return TC_ACT_OK;
+  }
+
+  u32 ack_seq = bpf_ntohl(tcp->ack_seq);
+  if (!credit->started) {
+    // This is the first ACK since the credit was granted.
+    credit->start_seq = ack_seq;
+    credit->started = 1;
+  }
+  // Sequence numbers wrap around, so use signed arithmetic.
+  s32 remaining_B = (s32)(credit->start_seq + credit->credit_B - ack_seq);
+  u32 credit_with_win_scale =
+      remaining_B > 0 ? (u32)remaining_B >> *win_scale : 0;
+  if (credit_with_win_scale == 0) {
+    // The credit is exhausted, or what remains is smaller than the window
+    // scale can express.
+    set_window(skb, tcp, 0);
+    if (!credit->exhausted) {
+      credit->exhausted = 1;
+      unsigned int zero = 0;
+      bpf_map_update_elem(&flow_to_rwnd, flow, &zero, BPF_ANY);
+      bpf_ringbuf_output(&credit_events, flow, sizeof(*flow), 0);
+    }
+    return TC_ACT_OK;
+  }
+  // Preserve flow control, as in do_rwnd_at_egress().
+  set_window(skb, tcp,
+             bpf_htons(min(bpf_ntohs(tcp->window),
+                           (u16)min(credit_with_win_scale, 0xFFFF))));
+  return TC_ACT_OK;
+}
+
 // Perform RWND tuning at TC egress. If a flow has an entry in flow_to_rwnd,
-// then install that value in the advertised window field. Inspired by:
+// then install that value in the advertised window field. Otherwise, if it has
+// an entry in flow_to_rate, then translate that rate into an RWND. Otherwise,
+// if it has an entry in flow_to_credit, then enforce that byte credit.
+// Inspired by:
 // https://stackoverflow.com/questions/65762365/ebpf-printing-udp-payload-and-source-ip-as-hex
 SEC("tc/egress")
 int do_rwnd_at_egress(struct __sk_buff *skb) {
@@ -69,11 +192,16 @@ int do_rwnd_at_egress(struct __sk_buff *skb) {
                          .remote_port = bpf_ntohs(tcp->dest)};
   u32 *rwnd = bpf_map_lookup_elem(&flow_to_rwnd, &flow);
   if (rwnd == NULL) {
-    // This flow does not have a custom RWND value.
+    // This flow does not have a custom RWND value. If it has a target rate or
+    // has been granted a byte credit, then enforce that instead.
     // bpf_printk(
     //     "WARNING: flow with local port %u and remote port %u has no RWND
     //     value", flow.local_port, flow.remote_port);
-    return TC_ACT_OK;
+    struct rm_rate *rate = bpf_map_lookup_elem(&flow_to_rate, &flow);
+    if (rate != NULL) {
+      return apply_rate(skb, tcp, &flow, rate);
+    }
+    return apply_credit(skb, tcp, &flow);
   }
   // For scheduled RWND tuning, it is fine for the RWND to be 0.
   // if (*rwnd == 0) {
@@ -86,7 +214,7 @@ int do_rwnd_at_egress(struct __sk_buff *skb) {
   if (*rwnd == 0) {
     // If the configured RWND value is 0 B, then we can take a shortcut and not
     // bother looking up the window scale.
-    tcp->window = 0;
+    set_window(skb, tcp, 0);
     // bpf_printk(
     //     "INFO: set RWND for flow with local port %u and remote port %u to 0
     //     B", flow.local_port, flow.remote_port);
@@ -102,12 +230,7 @@ int do_rwnd_at_egress(struct __sk_buff *skb) {
     return TC_ACT_OK;
   }
 
-  // Apply the window scale to the configured RWND value.
-  u16 rwnd_with_win_scale = (u16)(*rwnd >> *win_scale);
-  // Set the RWND value in the TCP header. If the existing advertised window
-  // set by flow control is smaller, then use that instead so that we
-  // preserve flow control.
-  tcp->window = min(tcp->window, rwnd_with_win_scale);
+  cap_window(skb, tcp, *rwnd, *win_scale);
   // bpf_printk(
   //     "INFO: set RWND for flow with remote port %u to %u (win scale: %u)",
   //     flow.remote_port, rwnd_with_win_scale, *win_scale);
@@ -0,0 +1,94 @@
+// SPDX-License-Identifier: GPL-2.0 OR BSD-3-Clause
+//
+// Tests for the active budget in ratemon_slots.h. Build and run with
+// `make test`. Needs only a C++ compiler.
+
+#include <stdio.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "ratemon_slots.h"
+
+static int failures = 0;
+
+#define CHECK(cond)                                                            \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      printf("FAIL: %s:%d: %s\n", __FILE__, __LINE__, #cond);                  \
+      ++failures;                                                              \
+    }                                                                          \
+  } while (0)
+
+// Slots are granted up to the max, and no further.
+static void test_acquire_up_to_max() {
+  std::atomic<unsigned long> used = 0;
+  for (int i = 0; i < 3; ++i)
+    CHECK(try_acquire_slot(used, 3));
+  CHECK(!try_acquire_slot(used, 3));
+  CHECK(used == 3);
+}
+
+// Lowering the max while a shard holds slots must not take away the slots of
+// flows that are already active. A new flow is paused instead, and the budget
+// still counts every active flow.
+static void test_lower_max_while_held() {
+  std::atomic<unsigned long> used = 0;
+  unsigned long held = resize_slots(used, 5, 0, 4);
+  CHECK(held == 4);
+  CHECK(used == 4);
+  // max_active_flows is lowered from 5 to 2 while the shard holds 4 slots, and
+  // then a new flow arrives on that shard.
+  CHECK(!try_acquire_slot(used, 2));
+  CHECK(used == 4);
+  // At its next scheduling round, the shard gives back the excess and pauses
+  // the flows that lost their slot.
+  held = resize_slots(used, 2, held, held);
+  CHECK(held == 2);
+  CHECK(used == 2);
+  CHECK(!try_acquire_slot(used, 2));
+}
+
+// Other shards' slots are never given away.
+static void test_resize_respects_others() {
+  std::atomic<unsigned long> used = 0;
+  CHECK(resize_slots(used, 4, 0, 3) == 3);
+  // A second shard wants 3, but only 1 is left.
+  CHECK(resize_slots(used, 4, 0, 3) == 1);
+  CHECK(used == 4);
+  // The first shard releases 2, and the second takes them.
+  CHECK(resize_slots(used, 4, 3, 1) == 1);
+  CHECK(resize_slots(used, 4, 1, 3) == 3);
+  CHECK(used == 4);
+}
+
+// Concurrent acquisitions never exceed the max.
+static void test_concurrent_acquire() {
+  std::atomic<unsigned long> used = 0;
+  std::atomic<unsigned long> acquired = 0;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 8; ++t)
+    threads.emplace_back([&]() {
+      for (int i = 0; i < 1000; ++i)
+        if (try_acquire_slot(used, 100))
+          ++acquired;
+    });
+  for (auto &t : threads)
+    t.join();
+  CHECK(acquired == 100);
+  CHECK(used == 100);
+}
+
+int main() {
+  test_acquire_up_to_max();
+  test_lower_max_while_held();
+  test_resize_respects_others();
+  test_concurrent_acquire();
+  if (failures) {
+    printf("%d check(s) failed\n", failures);
+    return 1;
+  }
+  printf("All tests passed\n");
+  return 0;
+}
@@ -1,3 +1,4 @@
+import ctypes
 import logging
 import os
 import time
@@ -8,6 +9,12 @@ from bcc import BPF, BPFAttachType, BPFProgType
 from pyroute2 import IPRoute, protocols
 from pyroute2.netlink.exceptions import NetlinkError
 
+from ratemon.model import defaults
+
+# Must match MAX_SCHEDULE_STEPS and MAX_RWND_SCHEDULES in ratemon_runtime.c.
+MAX_SCHEDULE_STEPS = 64
+MAX_RWND_SCHEDULES = 1
+
 
 def load_ebpf():
     """Load the corresponding eBPF program."""
@@ -26,8 +33,39 @@ def load_ebpf():
     return BPF(text=bpf_text)
 
 
+def load_rwnd_schedule(rwnd_schedules, idx, schedule):
+    """Load an RWND schedule into the kernel, where the egress program applies it.
+
+    The schedule is a list as described in parse_static_rwnd_schedule(). Its start
+    times are wall-clock times, so convert them to the clock that
+    bpf_ktime_get_ns() uses (CLOCK_MONOTONIC).
+    """
+    assert (
+        0 <= idx < MAX_RWND_SCHEDULES
+    ), f"Schedule index must be less than {MAX_RWND_SCHEDULES}."
+    assert (
+        0 < len(schedule) <= MAX_SCHEDULE_STEPS
+    ), f"Schedule must have between 1 and {MAX_SCHEDULE_STEPS} steps."
+    wall_now_s = time.time()
+    mono_now_ns = time.monotonic_ns()
+    first_s = schedule[0][0]
+    leaf = rwnd_schedules.Leaf()
+    leaf.start_ns = max(0, mono_now_ns + round((first_s - wall_now_s) * 1e9))
+    leaf.num_steps = len(schedule)
+    for step, (start_s, rwnd_B) in enumerate(schedule):
+        leaf.offset_ns[step] = round((start_s - first_s) * 1e9)
+        leaf.rwnd_B[step] = max(rwnd_B, defaults.MIN_RWND_B)
+    rwnd_schedules[ctypes.c_uint32(idx)] = leaf
+    logging.info("Loaded RWND schedule %d with %d steps", idx, len(schedule))
+
+
 def configure_ebpf(args):
-    """Set up eBPF hooks."""
+    """Set up eBPF hooks.
+
+    Returns the flow_to_rwnd, flow_to_rate, and flow_to_schedule maps and a cleanup
+    function. If args.kernel_schedule is set, then also loads args.schedule into
+    the kernel as schedule 0.
+    """
     if min(args.listen_ports) >= 50000:
         # Use the listen ports to determine the wait time, so that multiple
         # instances of this program do not try to configure themselves at the same
@@ -41,8 +79,12 @@ def configure_ebpf(args):
         bpf = load_ebpf()
     except:
         logging.exception("Error loading BPF program!")
-        return None, None
+        return None, None, None, None
     flow_to_rwnd = bpf["flow_to_rwnd"]
+    flow_to_rate = bpf["flow_to_rate"]
+    flow_to_schedule = bpf["flow_to_schedule"]
+    if args.kernel_schedule:
+        load_rwnd_schedule(bpf["rwnd_schedules"], 0, args.schedule)
 
     # Set up a TC egress qdisc, specify a filter the accepts all packets, and attach
     # our egress function as the action on that filter.
@@ -70,7 +112,7 @@ def configure_ebpf(args):
         # If someone else is responsible for the egress action, then we will just let
         # them do the work.
         logging.warning("Not configuring TC")
-        return flow_to_rwnd, None
+        return flow_to_rwnd, flow_to_rate, flow_to_schedule, None
 
     # Read the TCP window scale on outgoing SYN-ACK packets.
     func_sock_ops = bpf.load_func("read_win_scale", bpf.SOCK_OPS)  # sock_stuff
@@ -113,7 +155,7 @@ def configure_ebpf(args):
         )
     except:
         logging.exception("Error: Unable to configure TC.")
-        return None, None
+        return None, None, None, None
 
     def ebpf_cleanup():
         """Clean attached eBPF programs."""
@@ -123,4 +165,4 @@ def configure_ebpf(args):
         ipr.tc("del", "htb", ifindex, handle, default=default)
 
     logging.info("Configured TC and BPF!")
-    return flow_to_rwnd, ebpf_cleanup
+    return flow_to_rwnd, flow_to_rate, flow_to_schedule, ebpf_cleanup
@@ -30,10 +30,20 @@ def run(args, que, flags, done):
 
     cleanup = None
     try:
-        flow_to_rwnd, cleanup = ebpf.configure_ebpf(args)
+        flow_to_rwnd, flow_to_rate, flow_to_schedule, cleanup = ebpf.configure_ebpf(
+            args
+        )
         if flow_to_rwnd is None:
             return
-        main_loop(args, flow_to_rwnd, que, flags, done)
+        if not args.kernel_rate:
+            # Install fixed RWNDs instead of target rates.
+            flow_to_rate = None
+        if not args.kernel_schedule:
+            # Install each step of the schedule from userspace.
+            flow_to_schedule = None
+        main_loop(
+            args, flow_to_rwnd, flow_to_rate, flow_to_schedule, que, flags, done
+        )
     except KeyboardInterrupt:
         logging.info("Policy engine: You pressed Ctrl+C!")
         done.set()
@@ -45,7 +55,7 @@ def run(args, que, flags, done):
             cleanup()
 
 
-def main_loop(args, flow_to_rwnd, que, flags, done):
+def main_loop(args, flow_to_rwnd, flow_to_rate, flow_to_schedule, que, flags, done):
     """Receive packets and run evaluate the policy on them."""
     logging.info("Loading model: %s", args.model_file)
     net = policies.get_model_for_policy(args.policy, args.model_file)
@@ -107,6 +117,8 @@ def main_loop(args, flow_to_rwnd, que, flags, done):
                 flow_to_prev_features,
                 flow_to_decisions,
                 flow_to_rwnd,
+                flow_to_rate,
+                flow_to_schedule,
                 flags,
                 que,
                 packets_covered_by_batch,
@@ -127,6 +139,8 @@ def loop_iteration(
     flow_to_prev_features,
     flow_to_decisions,
     flow_to_rwnd,
+    flow_to_rate,
+    flow_to_schedule,
     flags,
     que,
     packets_covered_by_batch,
@@ -147,6 +161,8 @@ def loop_iteration(
         batch,
         flow_to_decisions,
         flow_to_rwnd,
+        flow_to_rate,
+        flow_to_schedule,
         flags,
         max_batch_time_s,
         batch_start_time_s,
@@ -188,6 +204,8 @@ def loop_iteration(
         args.policy,
         val,
         flow_to_rwnd,
+        flow_to_rate,
+        flow_to_schedule,
         flow_to_decisions,
         flow_to_prev_features,
     )
@@ -258,6 +276,8 @@ def maybe_run_batch(
     batch,
     flow_to_decisions,
     flow_to_rwnd,
+    flow_to_rate,
+    flow_to_schedule,
     flags,
     max_batch_time_s,
     batch_start_time_s,
@@ -289,6 +309,8 @@ def maybe_run_batch(
             batch,
             flow_to_decisions,
             flow_to_rwnd,
+            flow_to_rate,
+            flow_to_schedule,
         )
     except AssertionError:
         # Assertion errors mean this batch of packets violated some
@@ -325,6 +347,8 @@ def batch_eval(
     batch,
     flow_to_decisions,
     flow_to_rwnd,
+    flow_to_rate,
+    flow_to_schedule,
 ):
     """
     Run the policy engine on a batch of flows.
@@ -379,7 +403,14 @@ def batch_eval(
         )
         if new_decision is not None:
             for flowkey in flowkeys:
-                apply_decision(flowkey, new_decision, flow_to_decisions, flow_to_rwnd)
+                apply_decision(
+                    flowkey,
+                    new_decision,
+                    flow_to_decisions,
+                    flow_to_rwnd,
+                    flow_to_rate,
+                    flow_to_schedule,
+                )
 
 
 def merge_fourtuples(fourtuples):
@@ -437,8 +468,24 @@ def smooth(labels):
     return label
 
 
-def apply_decision(flowkey, new_decision, flow_to_decisions, flow_to_rwnd):
-    """Apply a decision to a flow."""
+def apply_decision(
+    flowkey,
+    new_decision,
+    flow_to_decisions,
+    flow_to_rwnd,
+    flow_to_rate,
+    flow_to_schedule,
+):
+    """Apply a decision to a flow.
+
+    If flow_to_rate is not None and the decision includes a target throughput, then
+    install the target rate instead of a fixed RWND. The kernel translates it into an
+    RWND using the flow's current RTT.
+
+    If flow_to_schedule is not None, then the decision comes from the RWND schedule
+    that was loaded into the kernel, so assign the flow to that schedule instead of
+    installing the current step. The kernel applies later steps on its own.
+    """
     logging.info(
         "Decision for flow %s: (%s, target tput: %s, rwnd: %s)",
         flowkey,
@@ -446,11 +493,25 @@ def apply_decision(flowkey, new_decision, flow_to_decisions, flow_to_rwnd):
         "-" if new_decision[1] is None else f"{new_decision[1] / 1e6:.2f} Mbps",
         "-" if new_decision[2] is None else f"{new_decision[2] / 1e3:.2f} KB",
     )
-    if flow_to_decisions[flowkey] != new_decision:
+    if flow_to_schedule is not None and new_decision[2] is not None:
+        if flowkey not in flow_to_schedule:
+            logging.info("Assigning flow %s to RWND schedule 0.", flowkey)
+            flow_to_schedule[flowkey] = ctypes.c_uint32(0)
+        flow_to_decisions[flowkey] = new_decision
+    elif flow_to_decisions[flowkey] != new_decision:
         logging.info("Flow %s changed decision.", flowkey)
         if new_decision[2] is None:
             if flowkey in flow_to_rwnd:
                 del flow_to_rwnd[flowkey]
+            if flow_to_rate is not None and flowkey in flow_to_rate:
+                del flow_to_rate[flowkey]
+        elif flow_to_rate is not None and new_decision[1] is not None:
+            # flow_to_rwnd takes precedence over flow_to_rate in the kernel.
+            if flowkey in flow_to_rwnd:
+                del flow_to_rwnd[flowkey]
+            flow_to_rate[flowkey] = flow_to_rate.Leaf(
+                round(new_decision[1] / 8), defaults.MIN_RWND_B
+            )
         else:
             new_decision = (new_decision[0], new_decision[1], round(new_decision[2]))
             if new_decision[2] < defaults.MIN_RWND_B:
@@ -472,7 +533,13 @@ def apply_decision(flowkey, new_decision, flow_to_decisions, flow_to_rwnd):
 
 
 def parse_from_queue(
-    policy, val, flow_to_rwnd, flow_to_decisions, flow_to_prev_features
+    policy,
+    val,
+    flow_to_rwnd,
+    flow_to_rate,
+    flow_to_schedule,
+    flow_to_decisions,
+    flow_to_prev_features,
 ):
     """Parse a message from the policy engine input queue."""
     epoch = num_flows_expected = None
@@ -495,6 +562,10 @@ def parse_from_queue(
         logging.info("Policy engine: Removing flow %s", flowkey)
         if flowkey in flow_to_rwnd:
             del flow_to_rwnd[flowkey]
+        if flow_to_rate is not None and flowkey in flow_to_rate:
+            del flow_to_rate[flowkey]
+        if flow_to_schedule is not None and flowkey in flow_to_schedule:
+            del flow_to_schedule[flowkey]
         if flowkey in flow_to_decisions:
             del flow_to_decisions[flowkey]
         if flowkey in flow_to_prev_features:
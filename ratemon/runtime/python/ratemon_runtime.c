@@ -50,6 +50,43 @@ struct tcp_opt {
 // flow_t, u32);
 BPF_TABLE_PINNED("hash", struct flow_t, u32, flow_to_rwnd, 1024,
                  "/sys/fs/bpf/flow_to_rwnd");
+// Target rate for a flow, as set by userspace. Used instead of flow_to_rwnd
+// when the runtime runs with --kernel-rate. The egress path translates the rate
+// into an RWND using the socket's current RTT, so the RWND stays accurate as
+// the RTT changes between policy decisions. The RWND never drops below
+// min_rwnd_B, which is also used when there is no RTT estimate.
+struct rate_t {
+  u64 rate_Bps;
+  u32 min_rwnd_B;
+};
+BPF_TABLE_PINNED("hash", struct flow_t, struct rate_t, flow_to_rate, 1024,
+                 "/sys/fs/bpf/flow_to_rate");
+// A time-varying RWND, loaded by userspace for --policy=staticrwnd with
+// --kernel-schedule. Step i applies from start_ns + offset_ns[i] (on the
+// bpf_ktime_get_ns() clock) until the next step begins. Before the first step,
+// the first step's RWND applies, and after the last step, the last step's RWND
+// applies. Offsets must be sorted. This must match get_static_rwnd() in
+// reaction_strategy.py, which applies the same schedule from userspace.
+#define MAX_SCHEDULE_STEPS 64
+struct rwnd_schedule_t {
+  u64 start_ns;
+  u32 num_steps;
+  u32 pad;
+  u64 offset_ns[MAX_SCHEDULE_STEPS];
+  u32 rwnd_B[MAX_SCHEDULE_STEPS];
+};
+// The runtime loads a single schedule file (--schedule) as schedule 0, and
+// every scheduled flow follows it, so there is only one group. Supporting more
+// groups requires raising MAX_RWND_SCHEDULES (and MAX_RWND_SCHEDULES in
+// ebpf.py) and a way to choose each flow's schedule.
+#define MAX_RWND_SCHEDULES 1
+BPF_TABLE_PINNED("array", u32, struct rwnd_schedule_t, rwnd_schedules,
+                 MAX_RWND_SCHEDULES, "/sys/fs/bpf/rwnd_schedules");
+// Schedule (i.e., index in rwnd_schedules) that a flow follows. Flows that
+// share a schedule form a group that changes steps at the same instant. Used
+// only for flows that do not have an entry in flow_to_rwnd.
+BPF_TABLE_PINNED("hash", struct flow_t, u32, flow_to_schedule, 1024,
+                 "/sys/fs/bpf/flow_to_schedule");
 // Read RWND limit for flow, as set by userspace.
 // BPF_HASH(flow_to_win_scale, struct flow_t, u8);
 BPF_TABLE_PINNED("hash", struct flow_t, u8, flow_to_win_scale, 1024,
@@ -63,6 +100,73 @@ BPF_TABLE_PINNED("hash", struct flow_t, u8, flow_to_win_scale, 1024,
 // BPF_TABLE_PINNED(_table_type, _key_type, _leaf_type, _name, _max_entries,
 // "/sys/fs/bpf/xyz");
 
+// Offset of the TCP checksum from the start of the packet. The parsing below
+// assumes fixed-size Ethernet and IP headers.
+#define TCP_CSUM_OFF                                                           \
+  (sizeof(struct ethhdr) + sizeof(struct iphdr) + offsetof(struct tcphdr, check))
+
+// Apply the window scale to an RWND value and install it in the advertised
+// window field, updating the TCP checksum. If the existing advertised window
+// set by flow control is smaller, then use that instead so that we preserve
+// flow control. Saturate instead of truncating if the scaled value does not fit
+// in the window field. Invalidates all packet pointers.
+static inline void cap_window(struct __sk_buff *skb, struct tcphdr *tcp,
+                              u32 rwnd, u8 win_scale) {
+  u16 to_set = (u16)min(rwnd >> win_scale, (u32)0xFFFF);
+  __be16 old_window = tcp->window;
+  __be16 new_window = bpf_htons(min(bpf_ntohs(old_window), to_set));
+  if (new_window == old_window) {
+    return;
+  }
+  tcp->window = new_window;
+  bpf_l4_csum_replace(skb, TCP_CSUM_OFF, old_window, new_window,
+                      sizeof(new_window));
+}
+
+// Translate a target rate into an RWND (i.e., the BDP) using the smoothed RTT
+// of the socket that sent this packet, falling back to its minimum RTT. Note
+// that a receiver only updates its RTT estimate when it receives ACKs for data
+// that it sent, so for a pure receiver this mostly reflects the handshake RTT.
+static inline u32 rate_to_rwnd(struct __sk_buff *skb, struct rate_t *rate) {
+  u64 rate_Bps = rate->rate_Bps;
+  u64 min_rwnd_B = rate->min_rwnd_B;
+  u64 rtt_us = 0;
+  struct bpf_sock *sk = skb->sk;
+  if (sk != NULL) {
+    sk = bpf_sk_fullsock(sk);
+  }
+  if (sk != NULL) {
+    struct bpf_tcp_sock *tp = bpf_tcp_sock(sk);
+    if (tp != NULL) {
+      // srtt_us is stored left-shifted by 3.
+      rtt_us = tp->srtt_us >> 3;
+      if (rtt_us == 0) {
+        rtt_us = tp->rtt_min;
+      }
+    }
+  }
+  u64 rwnd_B = rate_Bps * rtt_us / 1000000;
+  if (rwnd_B < min_rwnd_B) {
+    rwnd_B = min_rwnd_B;
+  }
+  return (u32)min(rwnd_B, (u64)0xFFFFFFFF);
+}
+
+// Look up the current step of an RWND schedule. This runs on every outgoing
+// packet, so step changes take effect immediately, without userspace.
+static inline u32 scheduled_rwnd(struct rwnd_schedule_t *sched) {
+  u64 now_ns = bpf_ktime_get_ns();
+  u32 step = 0;
+  for (u32 i = 1; i < MAX_SCHEDULE_STEPS; ++i) {
+    if (i >= sched->num_steps ||
+        sched->start_ns + sched->offset_ns[i] > now_ns) {
+      break;
+    }
+    step = i;
+  }
+  return sched->rwnd_B[step];
+}
+
 // Inspired by:
 // https://stackoverflow.com/questions/65762365/ebpf-printing-udp-payload-and-source-ip-as-hex
 int do_rwnd_at_egress(struct __sk_buff *skb) {
@@ -109,11 +213,26 @@ int do_rwnd_at_egress(struct __sk_buff *skb) {
   flow.local_port = bpf_ntohs(tcp->source);
   flow.remote_port = bpf_ntohs(tcp->dest);
 
-  // Look up the RWND value for this flow.
+  // Look up the RWND value for this flow. If it does not have one, then
+  // take the RWND from its schedule or derive it from its target rate, if it
+  // has one.
+  u32 rwnd_derived;
   u32 *rwnd = flow_to_rwnd.lookup(&flow);
   if (rwnd == NULL) {
-    // We do not know the RWND value to use for this flow.
-    return TC_ACT_OK;
+    u32 *sched_idx = flow_to_schedule.lookup(&flow);
+    struct rwnd_schedule_t *sched =
+        sched_idx == NULL ? NULL : rwnd_schedules.lookup(sched_idx);
+    if (sched != NULL) {
+      rwnd_derived = scheduled_rwnd(sched);
+    } else {
+      struct rate_t *rate = flow_to_rate.lookup(&flow);
+      if (rate == NULL) {
+        // We do not know the RWND value to use for this flow.
+        return TC_ACT_OK;
+      }
+      rwnd_derived = rate_to_rwnd(skb, rate);
+    }
+    rwnd = &rwnd_derived;
   }
   if (*rwnd == 0) {
     // The RWND is configured to be 0. That does not make sense.
@@ -132,18 +251,9 @@ int do_rwnd_at_egress(struct __sk_buff *skb) {
     return TC_ACT_OK;
   }
 
-  // Apply the window scale to the configured RWND value.
-  u16 to_set = (u16)(*rwnd >> *win_scale);
-  // bpf_trace_printk("Setting RWND for flow with local port %u to %u (win
-  // scale: %u)\n", flow.local_port, to_set, *win_scale);
-  // bpf_trace_printk("Setting RWND to %u (win scale: %u, RWND with win scale:
-  // %u)\n", *rwnd, *win_scale, to_set);
-
-  // Set the RWND value in the TCP header. If the existing advertised window
-  // set by flow control is smaller, then use that instead so that we
-  // preserve flow control..
-  tcp->window = min(tcp->window, bpf_htons(to_set));
-  // tcp->window = bpf_htons((u16)(*rwnd >> *win_scale));
+  // Set the RWND value in the TCP header, taking the window scale into
+  // account. Compare in host byte order.
+  cap_window(skb, tcp, *rwnd, *win_scale);
 
   return TC_ACT_OK;
 }
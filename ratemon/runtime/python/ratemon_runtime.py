@@ -168,6 +168,24 @@ def parse_args():
         required=False,
         type=str,
     )
+    parser.add_argument(
+        "--kernel-rate",
+        action="store_true",
+        help=(
+            "Install each flow's target rate instead of a fixed RWND. The eBPF egress "
+            "program translates the rate into an RWND using the flow's current RTT "
+            "on every outgoing packet."
+        ),
+    )
+    parser.add_argument(
+        "--kernel-schedule",
+        action="store_true",
+        help=(
+            "(--policy==staticrwnd) Load the schedule into the kernel. The eBPF "
+            "egress program applies each step at its start time, instead of this "
+            "process installing each step."
+        ),
+    )
     args = parser.parse_args()
     args.policy = policies.to_policy(args.policy)
     args.reaction_strategy = reaction_strategy.to_strat(args.reaction_strategy)
@@ -176,6 +194,9 @@ def parse_args():
     assert (
         args.policy != Policy.STATIC_RWND or args.schedule is not None
     ), "Must specify schedule file."
+    assert (
+        not args.kernel_schedule or args.policy == Policy.STATIC_RWND
+    ), '"--kernel-schedule" requires "--policy=staticrwnd".'
     if args.schedule is not None:
         assert path.isfile(args.schedule), f"File does not exist: {args.schedule}"
         args.schedule = reaction_strategy.parse_static_rwnd_schedule(args.schedule)
@@ -95,10 +95,16 @@ def parse_static_rwnd_schedule(flp):
 def get_static_rwnd(schedule):
     """Extract the scheduled RWND value for the current time.
 
-    The schedule is a list as described in parse_pacing_schedule().
+    The schedule is a list as described in parse_pacing_schedule(). Each step
+    applies from its start time until the next step begins. Before the first step,
+    the first step's RWND applies. This must match scheduled_rwnd() in
+    ratemon_runtime.c, which applies the same schedule in the kernel.
     """
     assert len(schedule) > 0
     now = time.time()
-    while now > schedule[0][0] and len(schedule) > 1:
-        schedule = schedule[1:]
-    return schedule[0][1]
+    rwnd_B = schedule[0][1]
+    for start_s, step_rwnd_B in schedule[1:]:
+        if start_s > now:
+            break
+        rwnd_B = step_rwnd_B
+    return rwnd_B
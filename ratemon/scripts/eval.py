@@ -2,6 +2,7 @@
 
 import argparse
 import collections
+import functools
 import json
 import logging
 import math
@@ -16,7 +17,7 @@ from os import path
 import matplotlib.pyplot as plt
 import numpy as np
 
-from ratemon.model import defaults, features, gen_features, utils
+from ratemon.model import defaults, features, gen_features, pcap_parser, utils
 
 FIGSIZE = (5, 2.2)
 FIGSIZE_BOX = (5, 3.5)
@@ -429,21 +430,9 @@ def parse_opened_exp(
     logging.info("Parsing: %s", exp_flp)
 
     # Load results if they already exist.
-    if path.exists(out_flp):
-        logging.info("Found results: %s", out_flp)
-        try:
-            with open(out_flp, "rb") as fil:
-                out = pickle.load(fil)
-                assert len(out) == 5 and isinstance(
-                    out[0], utils.Exp
-                ), f"Improperly formatted results file: {out_flp}"
-                return out
-        except FileNotFoundError:
-            logging.exception("Cannot find results in: %s", out_flp)
-        except pickle.PickleError:
-            logging.exception("Pickle error when loads results from: %s", out_flp)
-        except AssertionError:
-            logging.exception("Improperly formatted results file: %s", out_flp)
+    out = load_results(out_flp)
+    if out is not None:
+        return out
     # Check for basic errors.
     if exp.name.startswith("FAILED"):
         logging.info("Error: Experimant failed: %s", exp_flp)
@@ -454,30 +443,9 @@ def parse_opened_exp(
 
     params = get_params(exp_dir)
     category = params["category"]
-
-    # Dictionary mapping a flow to its flow's CCA. Each flow is a tuple of the
-    # form: (sender port, receiver port)
-    #
-    # { (sender port, receiver port): CCA }
-    flw_to_cca = {
-        (sender_port, flw[6]): flw[2]
-        for flw in params["flowsets"]
-        for sender_port in flw[5]
-    }
-    flws = list(flw_to_cca.keys())
-    # Map flow to sender IP address (LAN). Each flow tuple will be unique because
-    # the receiver ports are unique across flows from different senders.
-    flw_to_sender = {
-        (sender_port, flw[6]): flw[0][0]
-        for flw in params["flowsets"]
-        for sender_port in flw[5]
-    }
-    sender_to_flws = collections.defaultdict(list)
-    for flw, sender in flw_to_sender.items():
-        sender_to_flws[sender].append(flw)
-
-    receiver_name_to_ip = {flw[1][0]: flw[1][7] for flw in params["flowsets"]}
-    assert receiver_name_to_ip, "Cannot determine receiver(s)."
+    flw_to_cca, flw_to_sender, sender_to_flws, receiver_name_to_ip = get_flw_maps(
+        params
+    )
 
     # Need to process all PCAPs to build a combined record of all flows.
     flw_to_pkts = dict()
@@ -550,20 +518,12 @@ def parse_opened_exp(
         overall_util = get_avg_util(exp.bw_bps, flw_to_pkts)
 
         # Calculate class-based utilization numbers.
-        # Determine a mapping from class to flows in that class.
-        class_to_flws = collections.defaultdict(list)
-        classifier = CLASSIFIERS[CATEGORIES[category][0]]
-        for flw in params["flowsets"]:
-            flow_class = classifier(flw)
-            for sender_port in flw[5]:
-                class_to_flws[flow_class].append((sender_port, flw[6]))
-        # Calculate the utilization of each class.
         class_to_util = {
             flow_class: get_avg_util(
                 exp.bw_bps,
                 {flw: flw_to_pkts[flw] for flw in flws},
             )
-            for flow_class, flws in class_to_flws.items()
+            for flow_class, flws in get_class_to_flws(params).items()
         }
 
         # Specific analysis for multibottleneck experiments.
@@ -581,12 +541,77 @@ def parse_opened_exp(
         bneck_to_maxmin_ratios,
     )
 
-    # Save the results.
+    save_results(out_flp, out)
+    return out
+
+
+def load_results(out_flp):
+    """Load the results of parse_opened_exp(), or return None if there are none."""
+    if not path.exists(out_flp):
+        return None
+    logging.info("Found results: %s", out_flp)
+    try:
+        with open(out_flp, "rb") as fil:
+            out = pickle.load(fil)
+            assert len(out) == 6 and isinstance(
+                out[0], utils.Exp
+            ), f"Improperly formatted results file: {out_flp}"
+            return out
+    except FileNotFoundError:
+        logging.exception("Cannot find results in: %s", out_flp)
+    except pickle.PickleError:
+        logging.exception("Pickle error when loads results from: %s", out_flp)
+    except AssertionError:
+        logging.exception("Improperly formatted results file: %s", out_flp)
+    return None
+
+
+def save_results(out_flp, out):
     logging.info("\tSaving: %s", out_flp)
     with open(out_flp, "wb") as fil:
         pickle.dump(out, fil)
 
-    return out
+
+def get_flw_maps(params):
+    """Determine the flows in an experiment from its params.
+
+    Returns a tuple of the form:
+        ( flow to CCA, flow to sender, sender to flows, receiver name to IP )
+    """
+    # Dictionary mapping a flow to its flow's CCA. Each flow is a tuple of the
+    # form: (sender port, receiver port)
+    #
+    # { (sender port, receiver port): CCA }
+    flw_to_cca = {
+        (sender_port, flw[6]): flw[2]
+        for flw in params["flowsets"]
+        for sender_port in flw[5]
+    }
+    # Map flow to sender IP address (LAN). Each flow tuple will be unique because
+    # the receiver ports are unique across flows from different senders.
+    flw_to_sender = {
+        (sender_port, flw[6]): flw[0][0]
+        for flw in params["flowsets"]
+        for sender_port in flw[5]
+    }
+    sender_to_flws = collections.defaultdict(list)
+    for flw, sender in flw_to_sender.items():
+        sender_to_flws[sender].append(flw)
+
+    receiver_name_to_ip = {flw[1][0]: flw[1][7] for flw in params["flowsets"]}
+    assert receiver_name_to_ip, "Cannot determine receiver(s)."
+    return flw_to_cca, flw_to_sender, sender_to_flws, receiver_name_to_ip
+
+
+def get_class_to_flws(params):
+    """Determine a mapping from flow class to the flows in that class."""
+    class_to_flws = collections.defaultdict(list)
+    classifier = CLASSIFIERS[CATEGORIES[params["category"]][0]]
+    for flw in params["flowsets"]:
+        flow_class = classifier(flw)
+        for sender_port in flw[5]:
+            class_to_flws[flow_class].append((sender_port, flw[6]))
+    return class_to_flws
 
 
 def calculate_maxmin_ratios(params, flw_to_pkts, flw_to_sender, sender_to_flws):
@@ -597,7 +622,45 @@ def calculate_maxmin_ratios(params, flw_to_pkts, flw_to_sender, sender_to_flws):
     #         Calculate ratio
     #     Average the ratios
     # Return array with one average ratio per bottleneck situation
+    bneck_situations, bneck_to_sender_to_maxminbps = get_maxmin_rates(
+        params, sender_to_flws
+    )
+
+    # For each bottleneck situation, compare each flow's actual throughput to its
+    # maxmin fair rate.
+    flw_to_last_cutoff_idx = collections.defaultdict(int)
+    bneck_to_maxmin_ratios = {}
+    for start_s, end_s, _ in bneck_situations:
+        bneck = (start_s, end_s)
+        flw_to_maxmin_ratio = {}
+        for flw, pkts in flw_to_pkts.items():
+            cutoff_idx = utils.find_bound(
+                pkts[features.ARRIVAL_TIME_FET],
+                end_s * 1e6,
+                flw_to_last_cutoff_idx[flw],
+                len(pkts) - 1,
+                "before",
+            )
+            tpus_bps = utils.safe_tput_bps(
+                pkts, flw_to_last_cutoff_idx[flw], cutoff_idx
+            )
+            maxmin_rate_bps = bneck_to_sender_to_maxminbps[bneck][flw_to_sender[flw]]
+            flw_to_maxmin_ratio[flw] = tpus_bps / maxmin_rate_bps
+            flw_to_last_cutoff_idx[flw] = cutoff_idx + 1
+        bneck_to_maxmin_ratios[bneck] = list(flw_to_maxmin_ratio.values())
+    return bneck_to_maxmin_ratios
+
 
+def get_maxmin_rates(params, sender_to_flws):
+    """Determine the bottleneck situations and each sender's per-flow maxmin fair
+    rate in each one.
+
+    A bottleneck situation is a tuple of the form:
+        ( start time (s), end time (s), sender to bottleneck rate (bps) )
+
+    Returns a tuple of the form:
+        ( bottleneck situations, (start, end) to sender to maxmin fair rate (bps) )
+    """
     # Add all bottleneck events to unified list. Replace rates of 0
     # (no bottleneck) with the BESS bandwidth.
     # Dict mapping time to a list of bottleneck events at that time.
@@ -722,30 +785,7 @@ def calculate_maxmin_ratios(params, flw_to_pkts, flw_to_sender, sender_to_flws):
                 "must be less than the shared bottleneck "
                 f"({params['bess_bw_Mbps'] * 1e6} bps)!"
             )
-
-    # For each bottleneck situation, compare each flow's actual throughput to its
-    # maxmin fair rate.
-    flw_to_last_cutoff_idx = collections.defaultdict(int)
-    bneck_to_maxmin_ratios = {}
-    for start_s, end_s, _ in bneck_situations:
-        bneck = (start_s, end_s)
-        flw_to_maxmin_ratio = {}
-        for flw, pkts in flw_to_pkts.items():
-            cutoff_idx = utils.find_bound(
-                pkts[features.ARRIVAL_TIME_FET],
-                end_s * 1e6,
-                flw_to_last_cutoff_idx[flw],
-                len(pkts) - 1,
-                "before",
-            )
-            tpus_bps = utils.safe_tput_bps(
-                pkts, flw_to_last_cutoff_idx[flw], cutoff_idx
-            )
-            maxmin_rate_bps = bneck_to_sender_to_maxminbps[bneck][flw_to_sender[flw]]
-            flw_to_maxmin_ratio[flw] = tpus_bps / maxmin_rate_bps
-            flw_to_last_cutoff_idx[flw] = cutoff_idx + 1
-        bneck_to_maxmin_ratios[bneck] = list(flw_to_maxmin_ratio.values())
-    return bneck_to_maxmin_ratios
+    return bneck_situations, bneck_to_sender_to_maxminbps
 
 
 def get_jfi(flw_to_pkts, servicepolicy=False, flw_to_sender=None):
@@ -785,6 +825,268 @@ def get_avg_util(bw_bps, flw_to_pkts):
     return avg_total_tput_bps / bw_bps
 
 
+class IntervalTputs:
+    """Bytes received by each flow in fixed-length intervals.
+
+    Packets are added one chunk at a time, so memory use depends on the number of
+    flows and the duration of the experiment instead of on the number of packets.
+    Intervals are aligned to multiples of interval_us in absolute time, so that
+    chunks from different PCAP files line up.
+    """
+
+    def __init__(self, num_flws, interval_us):
+        self.interval_us = int(interval_us)
+        # Absolute index of the first interval in byts.
+        self.first_bin = None
+        self.byts = np.zeros((num_flws, 0), dtype=np.int64)
+        self.first_us = np.full(num_flws, np.iinfo(np.int64).max, dtype=np.int64)
+        self.last_us = np.full(num_flws, -1, dtype=np.int64)
+
+    def _extend(self, lo_bin, hi_bin):
+        """Make room for the intervals in the range [lo_bin, hi_bin]."""
+        if self.first_bin is None:
+            self.first_bin = lo_bin
+        num_bins = self.byts.shape[1]
+        pad_lo = max(0, self.first_bin - lo_bin)
+        pad_hi = max(0, hi_bin - (self.first_bin + num_bins - 1))
+        if pad_lo or pad_hi:
+            # Grow geometrically at the end, since packets usually arrive in order.
+            if pad_hi:
+                pad_hi = max(pad_hi, num_bins)
+            self.byts = np.pad(self.byts, ((0, 0), (pad_lo, pad_hi)))
+            self.first_bin -= pad_lo
+
+    def add(self, flw_idxs, pkts):
+        """Add a chunk of data packets, where flw_idxs is the flow of each packet."""
+        if not len(pkts):
+            return
+        times_us = pkts[features.ARRIVAL_TIME_FET].astype(np.int64)
+        bins = times_us // self.interval_us
+        self._extend(int(bins.min()), int(bins.max()))
+        num_bins = self.byts.shape[1]
+        self.byts += (
+            np.bincount(
+                flw_idxs * num_bins + (bins - self.first_bin),
+                weights=pkts[features.WIRELEN_FET],
+                minlength=self.byts.size,
+            )
+            .astype(np.int64)
+            .reshape(self.byts.shape)
+        )
+        np.minimum.at(self.first_us, flw_idxs, times_us)
+        np.maximum.at(self.last_us, flw_idxs, times_us)
+
+    def get_bin(self, time_us):
+        """Return the index into byts of the interval that contains time_us."""
+        return int(time_us // self.interval_us) - self.first_bin
+
+
+def get_jfis(tputs_bps):
+    """Vectorized get_jfi() over the columns of tputs_bps (entities x intervals).
+
+    Intervals in which no entity received any data have a JFI of NaN.
+    """
+    sums = tputs_bps.sum(axis=0)
+    sum_sqs = (tputs_bps**2).sum(axis=0)
+    out = np.full(sums.shape, np.nan)
+    np.divide(sums**2, len(tputs_bps) * sum_sqs, out=out, where=sum_sqs > 0)
+    return out
+
+
+def parse_opened_exp_streaming(
+    exp,
+    exp_flp,
+    exp_dir,
+    out_flp,
+    skip_smoothed,
+    select_tail_percent,
+    servicepolicy,
+    interval_us=BUCKET_DUR_US,
+):
+    """Streaming alternative to parse_opened_exp().
+
+    Instead of loading every flow's packets, this walks the receiver PCAPs one chunk
+    at a time and accumulates the bytes received by each flow in intervals of
+    interval_us. Fairness, utilization, and maxmin ratios are computed from the
+    intervals that lie entirely within the period when all flows are active. This
+    differs from parse_opened_exp(), which uses the exact first and last packet, by
+    at most one interval at either end of each period.
+
+    Returns the same tuple as parse_opened_exp(). Also writes the per-interval
+    throughput of each flow, and the per-interval JFI and utilization, to a
+    compressed .npz file next to out_flp. Does not plot flows over time.
+    """
+    # skip_smoothed is not used but is kept to maintain API compatibility
+    # with gen_features.parse_opened_exp().
+
+    logging.info("Parsing (streaming): %s", exp_flp)
+
+    # Load results if they already exist.
+    out = load_results(out_flp)
+    if out is not None:
+        return out
+    # Check for basic errors.
+    if exp.name.startswith("FAILED"):
+        logging.info("Error: Experimant failed: %s", exp_flp)
+        return -1
+    if exp.tot_flws == 0:
+        logging.info("Error: No flows to analyze in: %s", exp_flp)
+        return -1
+
+    params = get_params(exp_dir)
+    flw_to_cca, flw_to_sender, sender_to_flws, receiver_name_to_ip = get_flw_maps(
+        params
+    )
+    flws = list(flw_to_cca.keys())
+    ccas = list(flw_to_cca.values())
+    flw_to_idx = {flw: idx for idx, flw in enumerate(flws)}
+
+    tputs = IntervalTputs(len(flws), interval_us)
+    for receiver_name, receiver_ip in receiver_name_to_ip.items():
+        receiver_pcap = path.join(exp_dir, f"{receiver_name}-tcpdump-{exp.name}.pcap")
+
+        if not path.exists(receiver_pcap):
+            logging.error(
+                "Error: Missing pcap file in: %s --- %s", exp_flp, receiver_pcap
+            )
+            return -1
+
+        for _, flw_idxs, dir_idxs, pkts in pcap_parser.iter_packets(
+            receiver_pcap, flws, receiver_ip, select_tail_percent, ccas=ccas
+        ):
+            # Discard the ACK packets.
+            data = dir_idxs == 0
+            tputs.add(flw_idxs[data], pkts[data])
+
+        logging.info("\tParsed packets: %s", receiver_pcap)
+
+    # Only consider flows with at least one packet. This is to support multiple
+    # receivers, where each receiver only has a subset of flows.
+    active = tputs.last_us != -1
+    if not active.any():
+        logging.error("Error: No packets found in: %s", exp_flp)
+        return -1
+    earliest_start_time_us = tputs.first_us[active].min()
+    latest_start_time_us = tputs.first_us[active].max()
+    earliest_end_time_us = tputs.last_us[active].min()
+    # Only consider intervals that lie entirely between when the last flow starts
+    # and when the first flow ends. If there are none, then fall back to the
+    # intervals that overlap that period.
+    start_bin = -(-latest_start_time_us // tputs.interval_us) - tputs.first_bin
+    end_bin = tputs.get_bin(earliest_end_time_us)
+    if end_bin <= start_bin:
+        start_bin = tputs.get_bin(latest_start_time_us)
+        end_bin += 1
+    # Trim the intervals to those in which any flow was active.
+    last_bin = tputs.get_bin(tputs.last_us[active].max()) + 1
+    byts = tputs.byts[:, :last_bin]
+
+    # Per-interval results. Each row is a flow and each column is an interval.
+    interval_s = tputs.interval_us / 1e6
+    tputs_bps = byts * 8 / interval_s
+    if servicepolicy:
+        # Combine the throughput of each sender's flows.
+        senders = list(sender_to_flws.keys())
+        sender_idxs = np.array([senders.index(flw_to_sender[flw]) for flw in flws])
+        sender_tputs_bps = np.zeros((len(senders), tputs_bps.shape[1]))
+        np.add.at(sender_tputs_bps, sender_idxs[active], tputs_bps[active])
+        jfis = get_jfis(sender_tputs_bps)
+    else:
+        jfis = get_jfis(tputs_bps[active])
+    intervals = {
+        "flws": np.array(flws, dtype=np.int64),
+        "interval_us": tputs.interval_us,
+        # Start of each interval relative to the start of the first flow.
+        "start_times_us": (
+            (np.arange(last_bin) + tputs.first_bin) * tputs.interval_us
+            - earliest_start_time_us
+        ),
+        # Range of intervals that are used for the summary results.
+        "window": np.array([start_bin, end_bin]),
+        "tputs_bps": tputs_bps.astype(np.float32),
+        "jfis": jfis.astype(np.float32),
+    }
+
+    # Summary results, over the intervals in which all flows are active.
+    def get_window_tputs_bps(flw_idxs, start_bin, end_bin):
+        if end_bin <= start_bin:
+            return np.zeros(len(flw_idxs))
+        return byts[flw_idxs, start_bin:end_bin].sum(axis=1) * 8 / (
+            (end_bin - start_bin) * interval_s
+        )
+
+    active_idxs = np.flatnonzero(active)
+    flw_tputs_bps = get_window_tputs_bps(active_idxs, start_bin, end_bin)
+    if servicepolicy:
+        sender_to_tput_bps = collections.defaultdict(float)
+        for flw_idx, tput_bps in zip(active_idxs, flw_tputs_bps):
+            sender_to_tput_bps[flw_to_sender[flws[flw_idx]]] += tput_bps
+        jfi_tputs_bps = np.array(list(sender_to_tput_bps.values()))
+    else:
+        jfi_tputs_bps = flw_tputs_bps
+    jfi = jfi_tputs_bps.sum() ** 2 / (len(jfi_tputs_bps) * (jfi_tputs_bps**2).sum())
+
+    overall_util = 0
+    # Flow class to overall utilization of that flow class.
+    class_to_util = {}
+    # Bottleneck time range to average ratio of flow throughput to maxmin fair rate.
+    bneck_to_maxmin_ratios = None
+    if exp.use_bess:
+        overall_util = flw_tputs_bps.sum() / exp.bw_bps
+        intervals["utils"] = (tputs_bps.sum(axis=0) / exp.bw_bps).astype(np.float32)
+
+        # Calculate the utilization of each class.
+        class_to_util = {
+            flow_class: get_window_tputs_bps(
+                [flw_to_idx[flw] for flw in class_flws if active[flw_to_idx[flw]]],
+                start_bin,
+                end_bin,
+            ).sum()
+            / exp.bw_bps
+            for flow_class, class_flws in get_class_to_flws(params).items()
+        }
+
+        # Specific analysis for multibottleneck experiments.
+        if params["category"] == "multibottleneck":
+            bneck_situations, bneck_to_sender_to_maxminbps = get_maxmin_rates(
+                params, sender_to_flws
+            )
+            bneck_to_maxmin_ratios = {}
+            for bneck_start_s, bneck_end_s, _ in bneck_situations:
+                bneck = (bneck_start_s, bneck_end_s)
+                bneck_tputs_bps = get_window_tputs_bps(
+                    active_idxs,
+                    max(
+                        start_bin,
+                        tputs.get_bin(earliest_start_time_us + bneck_start_s * 1e6),
+                    ),
+                    min(
+                        end_bin,
+                        tputs.get_bin(earliest_start_time_us + bneck_end_s * 1e6),
+                    ),
+                )
+                bneck_to_maxmin_ratios[bneck] = [
+                    tput_bps
+                    / bneck_to_sender_to_maxminbps[bneck][flw_to_sender[flws[flw_idx]]]
+                    for flw_idx, tput_bps in zip(active_idxs, bneck_tputs_bps)
+                ]
+
+    intervals_flp = out_flp[:-4] + "_intervals.npz"
+    logging.info("\tSaving: %s", intervals_flp)
+    np.savez_compressed(intervals_flp, **intervals)
+
+    out = (
+        exp,
+        params,
+        jfi,
+        overall_util,
+        class_to_util,
+        bneck_to_maxmin_ratios,
+    )
+    save_results(out_flp, out)
+    return out
+
+
 def group_and_box_plot(
     args,
     matched_results,
@@ -892,6 +1194,11 @@ def main(args):
     logging.info("Evaluating experiments in: %s", args.exp_dir)
 
     our_label = "ServicePolicy" if args.servicepolicy else "FlowPolicy"
+    parse_func = (
+        functools.partial(parse_opened_exp_streaming, interval_us=args.interval_us)
+        if args.streaming
+        else parse_opened_exp
+    )
 
     # Find all experiments.
     pcaps = [
@@ -903,7 +1210,8 @@ def main(args):
             args.select_tail_percent,
             args.servicepolicy,
             True,  # always_reparse
-            parse_opened_exp,
+            parse_func,
+            ".npz",  # out_ext
         )
         for exp in sorted(os.listdir(args.exp_dir))
         if exp.endswith(".tar.gz")
@@ -1668,9 +1976,25 @@ def parse_args():
         action="store_true",
         help="Evaluate fairness across senders instead of across flows.",
     )
+    parser.add_argument(
+        "--streaming",
+        action="store_true",
+        help=(
+            "Parse each experiment's PCAPs one chunk at a time and compute results "
+            "from per-interval throughputs, using bounded memory. Does not plot "
+            "flows over time."
+        ),
+    )
+    parser.add_argument(
+        "--interval-us",
+        default=BUCKET_DUR_US,
+        help="The interval length (us) to use with --streaming.",
+        type=int,
+    )
     args = parser.parse_args()
     assert path.isdir(args.exp_dir)
     assert path.isdir(args.out_dir)
+    assert args.interval_us > 0, "--interval-us must be positive."
     global PREFIX
     PREFIX = "" if args.prefix is None else f"{args.prefix}_"
     return args